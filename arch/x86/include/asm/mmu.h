@@ -3,12 +3,27 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/atomic.h>
 
 /*
  * The x86 doesn't have a mmu context, but
  * we put the segment information here.
  */
 typedef struct {
+	/*
+	 * ctx_id uniquely identifies this mm_struct.  A ctx_id will never
+	 * be reused, and zero is not a valid ctx_id.
+	 */
+	u64 ctx_id;
+
+	/*
+	 * Any code that needs to do any sort of TLB flushing for this
+	 * mm will first make its changes to the page tables, then
+	 * increment tlb_gen, then flush.  This lets the low-level
+	 * flushing code keep track of what needs flushing.
+	 */
+	atomic64_t tlb_gen;
+
 	void *ldt;
 	int size;
 
@@ -21,6 +36,12 @@ typedef struct {
 	void *vdso;
 } mm_context_t;
 
+#define INIT_MM_CONTEXT(mm)						\
+	.context = {							\
+		.ctx_id = 1,						\
+		.tlb_gen = ATOMIC64_INIT(0),				\
+	}
+
 #ifdef CONFIG_SMP
 void leave_mm(int cpu);
 #else
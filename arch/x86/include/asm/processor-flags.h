@@ -45,6 +45,11 @@
 #define X86_CR3_PWT	0x00000008 /* Page Write Through */
 #define X86_CR3_PCD	0x00000010 /* Page Cache Disable */
 #define X86_CR3_PCID_MASK 0x00000fff /* PCID Mask */
+#ifdef CONFIG_X86_64
+#define X86_CR3_PCID_NOFLUSH (1ULL << 63) /* Preserve PCID's TLB entries */
+#else
+#define X86_CR3_PCID_NOFLUSH 0		  /* No PCIDs outside long mode */
+#endif
 
 /*
  * Intel CPU features in CR4
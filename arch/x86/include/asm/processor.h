@@ -73,6 +73,7 @@ extern u16 __read_mostly tlb_lld_4k[NR_INFO];
 extern u16 __read_mostly tlb_lld_2m[NR_INFO];
 extern u16 __read_mostly tlb_lld_4m[NR_INFO];
 extern s8  __read_mostly tlb_flushall_shift;
+extern u32 __read_mostly tlb_single_page_flush_ceiling;
 
 /*
  *  CPU type and hardware bug flags. Kept separately for each CPU.
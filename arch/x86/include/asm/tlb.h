@@ -7,8 +7,9 @@
 
 #define tlb_flush(tlb)							\
 {									\
-	if (tlb->fullmm == 0)						\
-		flush_tlb_mm_range(tlb->mm, tlb->start, tlb->end, 0UL);	\
+	if (tlb->fullmm == 0 && tlb->start < tlb->end)			\
+		flush_tlb_unmap_range(tlb->mm, tlb->start, tlb->end,	\
+				      tlb->freed_tables);		\
 	else								\
 		flush_tlb_mm_range(tlb->mm, 0UL, TLB_FLUSH_ALL, 0UL);	\
 }
@@ -64,6 +64,19 @@ static inline void __flush_tlb_one(unsigned long addr)
 
 #define TLB_FLUSH_ALL	-1UL
 
+/*
+ * A flush of @flush_mm's user mappings from @flush_start to @flush_end,
+ * as passed to flush_tlb_others().  A @flush_end of 0 means the single
+ * page at @flush_start.  @new_tlb_gen is the mm's tlb_gen once this
+ * flush is done.
+ */
+struct flush_tlb_info {
+	struct mm_struct *flush_mm;
+	unsigned long flush_start;
+	unsigned long flush_end;
+	u64 new_tlb_gen;
+};
+
 /*
  * TLB flushing:
  *
@@ -72,8 +85,10 @@ static inline void __flush_tlb_one(unsigned long addr)
  *  - flush_tlb_mm(mm) flushes the specified mm context TLB's
  *  - flush_tlb_page(vma, vmaddr) flushes one page
  *  - flush_tlb_range(vma, start, end) flushes a range of pages
+ *  - flush_tlb_unmap_range(mm, start, end, freed_tables) flushes a range
+ *    of pages torn down by an mmu_gather
  *  - flush_tlb_kernel_range(start, end) flushes a range of kernel pages
- *  - flush_tlb_others(cpumask, mm, start, end) flushes TLBs on other cpus
+ *  - flush_tlb_others(cpumask, info) flushes TLBs on other cpus
  *
  * ..but the i386 has somewhat limited tlb flushing capabilities,
  * and page-granular flushes are available only on i486 and up.
@@ -112,10 +127,15 @@ static inline void flush_tlb_mm_range(struct mm_struct *mm,
 		__flush_tlb();
 }
 
+static inline void flush_tlb_unmap_range(struct mm_struct *mm,
+	   unsigned long start, unsigned long end, bool freed_tables)
+{
+	if (mm == current->active_mm)
+		__flush_tlb();
+}
+
 static inline void native_flush_tlb_others(const struct cpumask *cpumask,
-					   struct mm_struct *mm,
-					   unsigned long start,
-					   unsigned long end)
+					const struct flush_tlb_info *info)
 {
 }
 
@@ -145,34 +165,61 @@ extern void flush_tlb_current_task(void);
 extern void flush_tlb_page(struct vm_area_struct *, unsigned long);
 extern void flush_tlb_mm_range(struct mm_struct *mm, unsigned long start,
 				unsigned long end, unsigned long vmflag);
+extern void flush_tlb_unmap_range(struct mm_struct *mm, unsigned long start,
+				unsigned long end, bool freed_tables);
 extern void flush_tlb_kernel_range(unsigned long start, unsigned long end);
 
 #define flush_tlb()	flush_tlb_current_task()
 
 void native_flush_tlb_others(const struct cpumask *cpumask,
-				struct mm_struct *mm,
-				unsigned long start, unsigned long end);
+				const struct flush_tlb_info *info);
 
 #define TLBSTATE_OK	1
 #define TLBSTATE_LAZY	2
 
+/*
+ * Number of mm's that keep their TLB entries on a cpu at the same time,
+ * each tagged with its own PCID.  ASID n uses PCID n + 1: PCID 0 is left
+ * to the cr3 loads that do not go through switch_mm(), such as
+ * swapper_pg_dir in leave_mm().
+ */
+#define TLB_NR_DYN_ASIDS	6
+
+struct tlb_context {
+	u64 ctx_id;
+	u64 tlb_gen;
+};
+
 struct tlb_state {
 	struct mm_struct *active_mm;
 	int state;
+	u16 loaded_mm_asid;
+	u16 next_asid;
+	/*
+	 * The mm (by ctx_id) cached in each ASID, and the mm tlb_gen up to
+	 * which the cached entries have been flushed.
+	 */
+	struct tlb_context ctxs[TLB_NR_DYN_ASIDS];
 };
 DECLARE_PER_CPU_SHARED_ALIGNED(struct tlb_state, cpu_tlbstate);
 
 static inline void reset_lazy_tlbstate(void)
 {
+	int asid;
+
 	this_cpu_write(cpu_tlbstate.state, 0);
 	this_cpu_write(cpu_tlbstate.active_mm, &init_mm);
+	this_cpu_write(cpu_tlbstate.loaded_mm_asid, 0);
+	this_cpu_write(cpu_tlbstate.next_asid, 0);
+	for (asid = 0; asid < TLB_NR_DYN_ASIDS; asid++)
+		this_cpu_write(cpu_tlbstate.ctxs[asid].ctx_id, 0);
 }
 
 #endif	/* SMP */
 
 #ifndef CONFIG_PARAVIRT
-#define flush_tlb_others(mask, mm, start, end)	\
-	native_flush_tlb_others(mask, mm, start, end)
+#define flush_tlb_others(mask, info)	\
+	native_flush_tlb_others(mask, info)
 #endif
 
 #endif /* _ASM_X86_TLBFLUSH_H */
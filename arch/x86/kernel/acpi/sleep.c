@@ -52,7 +52,8 @@ int acpi_suspend_lowlevel(void)
 #endif /* !CONFIG_64BIT */
 
 	header->pmode_cr0 = read_cr0();
-	header->pmode_cr4 = read_cr4_safe();
+	/* The wakeup code loads this outside of long mode: no PCIDs */
+	header->pmode_cr4 = read_cr4_safe() & ~X86_CR4_PCIDE;
 	header->pmode_behavior = 0;
 	if (!rdmsr_safe(MSR_IA32_MISC_ENABLE,
 			&header->pmode_misc_en_low,
@@ -278,6 +278,37 @@ static __cpuinit void setup_smep(struct cpuinfo_x86 *c)
 	}
 }
 
+static int disable_pcid __cpuinitdata;
+static __init int setup_disable_pcid(char *arg)
+{
+	disable_pcid = 1;
+	return 1;
+}
+__setup("nopcid", setup_disable_pcid);
+
+static __cpuinit void setup_pcid(struct cpuinfo_x86 *c)
+{
+	if (!cpu_has(c, X86_FEATURE_PCID))
+		return;
+
+	/*
+	 * PCIDs only exist in long mode and are only handed out by the
+	 * SMP switch_mm().  flush_tlb_all() relies on toggling CR4.PGE to
+	 * flush all of them, so don't use them without global pages.
+	 */
+	if (!IS_ENABLED(CONFIG_X86_64) || !IS_ENABLED(CONFIG_SMP) ||
+	    !cpu_has(c, X86_FEATURE_PGE) || unlikely(disable_pcid)) {
+		setup_clear_cpu_cap(X86_FEATURE_PCID);
+		return;
+	}
+
+	/*
+	 * Not set_in_cr4(): the trampoline loads that CR4 value outside of
+	 * long mode, where PCIDE is not allowed.  Every cpu sets it here.
+	 */
+	write_cr4(read_cr4() | X86_CR4_PCIDE);
+}
+
 /*
  * Some CPU features depend on higher CPUID levels, which may not always
  * be available due to CPUID level capping or broken virtualization
@@ -469,6 +500,13 @@ u16 __read_mostly tlb_lld_4m[NR_INFO];
  */
 s8  __read_mostly tlb_flushall_shift = -1;
 
+/*
+ * Hard upper limit on the number of pages flushed one by one, whatever
+ * tlb_flushall_shift says: each 'invlpg' costs about as much as a
+ * refill, and a long run of them also holds off the flush IPI.
+ */
+u32 __read_mostly tlb_single_page_flush_ceiling = 33;
+
 void __cpuinit cpu_detect_tlb(struct cpuinfo_x86 *c)
 {
 	if (this_cpu->c_detect_tlb)
@@ -799,6 +837,7 @@ static void __cpuinit generic_identify(struct cpuinfo_x86 *c)
 	}
 
 	setup_smep(c);
+	setup_pcid(c);
 
 	get_model_name(c); /* Default name */
 
@@ -98,15 +98,22 @@ static inline int copy_ldt(mm_context_t *new, mm_context_t *old)
 	return 0;
 }
 
+/* init_mm uses ctx_id 1, see INIT_MM_CONTEXT */
+static atomic64_t last_mm_ctx_id = ATOMIC64_INIT(1);
+
 /*
  * we do not have to muck with descriptors here, that is
  * done in switch_mm() as needed.
  */
+
 int init_new_context(struct task_struct *tsk, struct mm_struct *mm)
 {
 	struct mm_struct *old_mm;
 	int retval = 0;
 
+	mm->context.ctx_id = atomic64_inc_return(&last_mm_ctx_id);
+	atomic64_set(&mm->context.tlb_gen, 0);
+
 	mutex_init(&mm->context.lock);
 	mm->context.size = 0;
 	old_mm = current->mm;
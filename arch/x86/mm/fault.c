@@ -1099,6 +1099,22 @@ do_page_fault(struct pt_regs *regs, unsigned long error_code)
 		return;
 	}
 
+	/*
+	 * Try to fill in user memory without mmap_sem first, so that we
+	 * don't wait behind a writer.  Everything else, including bad
+	 * accesses, is sorted out the regular way below.
+	 */
+	if (error_code & PF_USER) {
+		fault = handle_speculative_fault(mm, address, flags);
+		if (!fault) {
+			tsk->min_flt++;
+			perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS_MIN, 1,
+				      regs, address);
+			check_v8086_mode(regs, address, tsk);
+			return;
+		}
+	}
+
 	/*
 	 * When running in the kernel we expect faults to occur only to
 	 * addresses in user space.  All other faults represent errors in
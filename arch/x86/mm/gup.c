@@ -129,15 +129,18 @@ static noinline int gup_huge_pmd(pmd_t pmd, unsigned long addr,
 	head = pte_page(pte);
 	page = head + ((addr & ~PMD_MASK) >> PAGE_SHIFT);
 	do {
-		VM_BUG_ON(compound_head(page) != head);
+		VM_BUG_ON(PageHead(head) && compound_head(page) != head);
 		pages[*nr] = page;
 		if (PageTail(page))
 			get_huge_page_tail(page);
+		else if (!PageHead(head))
+			get_page(page);	/* team of shmem pages */
 		(*nr)++;
 		page++;
 		refs++;
 	} while (addr += PAGE_SIZE, addr != end);
-	get_head_page_multiple(head, refs);
+	if (PageHead(head))
+		get_head_page_multiple(head, refs);
 
 	return 1;
 }
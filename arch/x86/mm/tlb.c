@@ -31,12 +31,6 @@ DEFINE_PER_CPU_SHARED_ALIGNED(struct tlb_state, cpu_tlbstate)
  *	Implement flush IPI by CALL_FUNCTION_VECTOR, Alex Shi
  */
 
-struct flush_tlb_info {
-	struct mm_struct *flush_mm;
-	unsigned long flush_start;
-	unsigned long flush_end;
-};
-
 /*
  * We cannot call mmdrop() because we are in interrupt context,
  * instead update mm->cpu_vm_mask.
@@ -53,6 +47,119 @@ void leave_mm(int cpu)
 }
 EXPORT_SYMBOL_GPL(leave_mm);
 
+static inline unsigned long build_cr3(struct mm_struct *mm, u16 asid)
+{
+	if (static_cpu_has(X86_FEATURE_PCID))
+		return __pa(mm->pgd) | (asid + 1);
+	return __pa(mm->pgd);
+}
+
+/*
+ * Pick the ASID to run @next with: the one it still owns on this cpu if
+ * any, else the next slot round robin.  *need_flush is set if the TLB
+ * entries tagged with that ASID may be stale for @next.
+ */
+static void choose_new_asid(struct mm_struct *next, u64 next_tlb_gen,
+			    u16 *new_asid, bool *need_flush)
+{
+	u16 asid;
+
+	if (!static_cpu_has(X86_FEATURE_PCID)) {
+		*new_asid = 0;
+		*need_flush = true;
+		return;
+	}
+
+	for (asid = 0; asid < TLB_NR_DYN_ASIDS; asid++) {
+		if (this_cpu_read(cpu_tlbstate.ctxs[asid].ctx_id) !=
+		    next->context.ctx_id)
+			continue;
+
+		*new_asid = asid;
+		*need_flush = this_cpu_read(cpu_tlbstate.ctxs[asid].tlb_gen) <
+			      next_tlb_gen;
+		return;
+	}
+
+	*new_asid = this_cpu_add_return(cpu_tlbstate.next_asid, 1) - 1;
+	if (*new_asid >= TLB_NR_DYN_ASIDS) {
+		*new_asid = 0;
+		this_cpu_write(cpu_tlbstate.next_asid, 1);
+	}
+	*need_flush = true;
+}
+
+void switch_mm(struct mm_struct *prev, struct mm_struct *next,
+	       struct task_struct *tsk)
+{
+	unsigned cpu = smp_processor_id();
+	unsigned long flags;
+	bool need_flush;
+	u64 next_tlb_gen;
+	u16 asid;
+
+	/* cpu_tlbstate is also updated by the flush IPI */
+	local_irq_save(flags);
+	this_cpu_write(cpu_tlbstate.state, TLBSTATE_OK);
+
+	if (likely(prev != next)) {
+		this_cpu_write(cpu_tlbstate.active_mm, next);
+		cpumask_set_cpu(cpu, mm_cpumask(next));
+		next_tlb_gen = atomic64_read(&next->context.tlb_gen);
+
+		choose_new_asid(next, next_tlb_gen, &asid, &need_flush);
+		if (need_flush) {
+			this_cpu_write(cpu_tlbstate.ctxs[asid].ctx_id,
+				       next->context.ctx_id);
+			this_cpu_write(cpu_tlbstate.ctxs[asid].tlb_gen,
+				       next_tlb_gen);
+			write_cr3(build_cr3(next, asid));
+		} else {
+			write_cr3(build_cr3(next, asid) | X86_CR3_PCID_NOFLUSH);
+		}
+		this_cpu_write(cpu_tlbstate.loaded_mm_asid, asid);
+
+		/* stop flush ipis for the previous mm */
+		cpumask_clear_cpu(cpu, mm_cpumask(prev));
+
+		/*
+		 * load the LDT, if the LDT is different:
+		 */
+		if (unlikely(prev->context.ldt != next->context.ldt))
+			load_LDT_nolock(&next->context);
+	} else {
+		BUG_ON(this_cpu_read(cpu_tlbstate.active_mm) != next);
+
+		asid = this_cpu_read(cpu_tlbstate.loaded_mm_asid);
+		need_flush = !cpumask_test_and_set_cpu(cpu, mm_cpumask(next));
+		next_tlb_gen = atomic64_read(&next->context.tlb_gen);
+
+		if (need_flush) {
+			/*
+			 * We were in lazy tlb mode and leave_mm disabled
+			 * tlb flush IPI delivery. We must reload CR3
+			 * to make sure to use no freed page tables.
+			 */
+			this_cpu_write(cpu_tlbstate.ctxs[asid].tlb_gen,
+				       next_tlb_gen);
+			write_cr3(build_cr3(next, asid));
+			load_LDT_nolock(&next->context);
+		} else if (this_cpu_read(cpu_tlbstate.ctxs[asid].tlb_gen) <
+			   next_tlb_gen) {
+			/*
+			 * A flush skipped this cpu while it was lazy, see
+			 * flush_tlb_skip_lazy().  The page tables are still
+			 * in place, so only the TLB needs flushing.
+			 */
+			this_cpu_write(cpu_tlbstate.ctxs[asid].tlb_gen,
+				       next_tlb_gen);
+			count_vm_tlb_event(NR_TLB_LOCAL_FLUSH_ALL);
+			local_flush_tlb();
+		}
+	}
+	local_irq_restore(flags);
+}
+
 /*
  * The flush IPI assumes that a thread switch happens in this order:
  * [cpu0: the cpu that switches]
@@ -65,7 +172,9 @@ EXPORT_SYMBOL_GPL(leave_mm);
  *	Now cpu0 accepts tlb flushes for the new mm.
  * 1a3) cpu_set(cpu, new_mm->cpu_vm_mask);
  *	Now the other cpus will send tlb flush ipis.
- * 1a4) change cr3.
+ * 1a4) read new_mm->context.tlb_gen and pick an ASID.  If the ASID
+ *	has not seen every flush up to that generation, change cr3
+ *	with a flush, otherwise keep the TLB entries tagged with it.
  * 1a5) cpu_clear(cpu, old_mm->cpu_vm_mask);
  *	Stop ipi delivery for the old mm. This is not synchronized with
  *	the other cpus, but flush_tlb_func ignore flush ipis for the wrong
@@ -77,8 +186,15 @@ EXPORT_SYMBOL_GPL(leave_mm);
  *	Atomically set the bit [other cpus will start sending flush ipis],
  *	and test the bit.
  * 1b3) if the bit was 0: leave_mm was called, flush the tlb.
+ * 1b4) else if the ASID is behind mm->context.tlb_gen, a flush skipped
+ *	cpu0 while it was lazy: flush the tlb.
  * 2) switch %%esp, ie current
  *
+ * A flusher bumps mm->context.tlb_gen before it looks at the cpumask and
+ * cpu_tlbstate of the other cpus, and the locked cpumask update in 1a3)
+ * and 1b2) orders cpu0's TLBSTATE_OK store before its tlb_gen read: a
+ * flush is either sent an IPI to cpu0 or seen by cpu0 in 1a4) or 1b4).
+ *
  * The interrupt must handle 2 special cases:
  * - cr3 is changed before %%esp, ie. it cannot use current->{active_,}mm.
  * - the cpu performs speculative tlb reads, i.e. even if the cpu only
@@ -90,69 +206,174 @@ EXPORT_SYMBOL_GPL(leave_mm);
  */
 
 /*
- * TLB flush funcation:
- * 1) Flush the tlb entries if the cpu uses the mm that's being flushed.
- * 2) Leave the mm if we are in the lazy tlb mode.
+ * Bring the TLB of the loaded mm up to date with its tlb_gen.  Only the
+ * flush that is exactly one generation ahead of this cpu may be done by
+ * page, anything else (several flushes in flight or already merged into
+ * a later one) takes a full flush.  Called with interrupts disabled.
  */
-static void flush_tlb_func(void *info)
+static void flush_tlb_func_common(const struct flush_tlb_info *f)
 {
-	struct flush_tlb_info *f = info;
+	struct mm_struct *mm = this_cpu_read(cpu_tlbstate.active_mm);
+	u16 asid = this_cpu_read(cpu_tlbstate.loaded_mm_asid);
+	u64 mm_tlb_gen = atomic64_read(&mm->context.tlb_gen);
+	u64 local_tlb_gen = this_cpu_read(cpu_tlbstate.ctxs[asid].tlb_gen);
 
-	if (f->flush_mm != this_cpu_read(cpu_tlbstate.active_mm))
+	if (unlikely(local_tlb_gen == mm_tlb_gen))
 		return;
 
-	if (this_cpu_read(cpu_tlbstate.state) == TLBSTATE_OK) {
-		if (f->flush_end == TLB_FLUSH_ALL || !cpu_has_invlpg)
-			local_flush_tlb();
-		else if (!f->flush_end)
+	if (f->flush_end != TLB_FLUSH_ALL && cpu_has_invlpg &&
+	    f->new_tlb_gen == local_tlb_gen + 1 &&
+	    f->new_tlb_gen == mm_tlb_gen) {
+		if (!f->flush_end) {
+			count_vm_tlb_event(NR_TLB_LOCAL_FLUSH_ONE);
 			__flush_tlb_single(f->flush_start);
-		else {
+		} else {
 			unsigned long addr;
 			addr = f->flush_start;
 			while (addr < f->flush_end) {
 				__flush_tlb_single(addr);
 				addr += PAGE_SIZE;
 			}
+			count_vm_tlb_events(NR_TLB_LOCAL_FLUSH_ONE,
+				(f->flush_end - f->flush_start) >> PAGE_SHIFT);
 		}
-	} else
-		leave_mm(smp_processor_id());
+	} else {
+		count_vm_tlb_event(NR_TLB_LOCAL_FLUSH_ALL);
+		local_flush_tlb();
+	}
 
+	this_cpu_write(cpu_tlbstate.ctxs[asid].tlb_gen, mm_tlb_gen);
 }
 
-void native_flush_tlb_others(const struct cpumask *cpumask,
-				 struct mm_struct *mm, unsigned long start,
-				 unsigned long end)
+/*
+ * TLB flush funcation:
+ * 1) Flush the tlb entries if the cpu uses the mm that's being flushed.
+ * 2) Leave the mm if we are in the lazy tlb mode.
+ */
+static void flush_tlb_func(void *info)
 {
-	struct flush_tlb_info info;
-	info.flush_mm = mm;
-	info.flush_start = start;
-	info.flush_end = end;
+	const struct flush_tlb_info *f = info;
+
+	count_vm_tlb_event(NR_TLB_REMOTE_FLUSH_RECEIVED);
+
+	if (f->flush_mm != this_cpu_read(cpu_tlbstate.active_mm))
+		return;
+
+	if (this_cpu_read(cpu_tlbstate.state) == TLBSTATE_OK)
+		flush_tlb_func_common(f);
+	else
+		leave_mm(smp_processor_id());
+}
 
+void native_flush_tlb_others(const struct cpumask *cpumask,
+				 const struct flush_tlb_info *info)
+{
+	count_vm_tlb_event(NR_TLB_REMOTE_FLUSH);
 	if (is_uv_system()) {
 		unsigned int cpu;
 
 		cpu = smp_processor_id();
-		cpumask = uv_flush_tlb_others(cpumask, mm, start, end, cpu);
+		cpumask = uv_flush_tlb_others(cpumask, info->flush_mm,
+					      info->flush_start,
+					      info->flush_end, cpu);
 		if (cpumask)
 			smp_call_function_many(cpumask, flush_tlb_func,
-								&info, 1);
+							(void *)info, 1);
 		return;
 	}
-	smp_call_function_many(cpumask, flush_tlb_func, &info, 1);
+	smp_call_function_many(cpumask, flush_tlb_func, (void *)info, 1);
 }
 
-void flush_tlb_current_task(void)
+static DEFINE_PER_CPU(cpumask_var_t, flush_tlb_lazy_mask);
+
+/*
+ * Filter the cpus that only hold @mm as their lazy tlb mm out of a
+ * flush of @mm.  Instead of an IPI, each of them finds its ASID behind
+ * mm->context.tlb_gen and flushes once it leaves lazy mode, see
+ * switch_mm().
+ *
+ * This is only safe if no page tables were freed: a lazy cpu still has
+ * @mm loaded in cr3 and may walk its page tables speculatively, so the
+ * caller must interrupt it (via leave_mm) before they are reused.
+ *
+ * Returns the cpus that still need the IPI, or NULL if there are none.
+ */
+static const struct cpumask *flush_tlb_skip_lazy(struct mm_struct *mm)
 {
-	struct mm_struct *mm = current->mm;
+	struct cpumask *mask = __get_cpu_var(flush_tlb_lazy_mask);
+	unsigned int cpu, self = smp_processor_id();
+
+	cpumask_clear(mask);
+	for_each_cpu(cpu, mm_cpumask(mm)) {
+		if (cpu == self)
+			continue;
+		/*
+		 * The caller's tlb_gen increment is a full barrier: either
+		 * this cpu is seen leaving lazy mode or it sees the new
+		 * generation in switch_mm().
+		 */
+		if (per_cpu(cpu_tlbstate.state, cpu) == TLBSTATE_LAZY) {
+			count_vm_tlb_event(NR_TLB_REMOTE_FLUSH_LAZY);
+			continue;
+		}
+		cpumask_set_cpu(cpu, mask);
+	}
+
+	return cpumask_empty(mask) ? NULL : mask;
+}
+
+static int __init flush_tlb_lazy_mask_init(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		zalloc_cpumask_var_node(&per_cpu(flush_tlb_lazy_mask, cpu),
+					GFP_KERNEL, cpu_to_node(cpu));
+	return 0;
+}
+early_initcall(flush_tlb_lazy_mask_init);
+
+/*
+ * Advance @info->flush_mm to a new tlb_gen, then flush this cpu and
+ * send the flush to the other cpus that may cache the mm.
+ */
+static void flush_tlb_mm_info(struct flush_tlb_info *info, bool skip_lazy)
+{
+	struct mm_struct *mm = info->flush_mm;
+	const struct cpumask *cpus;
+	unsigned long flags;
 
 	preempt_disable();
+	info->new_tlb_gen = atomic64_inc_return(&mm->context.tlb_gen);
+
+	if (current->active_mm == mm) {
+		if (current->mm) {
+			local_irq_save(flags);
+			flush_tlb_func_common(info);
+			local_irq_restore(flags);
+		} else
+			leave_mm(smp_processor_id());
+	}
 
-	local_flush_tlb();
-	if (cpumask_any_but(mm_cpumask(mm), smp_processor_id()) < nr_cpu_ids)
-		flush_tlb_others(mm_cpumask(mm), mm, 0UL, TLB_FLUSH_ALL);
+	if (cpumask_any_but(mm_cpumask(mm), smp_processor_id()) < nr_cpu_ids) {
+		cpus = skip_lazy ? flush_tlb_skip_lazy(mm) : mm_cpumask(mm);
+		if (cpus)
+			flush_tlb_others(cpus, info);
+	}
 	preempt_enable();
 }
 
+void flush_tlb_current_task(void)
+{
+	struct flush_tlb_info info = {
+		.flush_mm = current->mm,
+		.flush_start = 0UL,
+		.flush_end = TLB_FLUSH_ALL,
+	};
+
+	flush_tlb_mm_info(&info, false);
+}
+
 /*
  * It can find out the THP large page, or
  * HUGETLB page in tlb_flush when THP disabled
@@ -179,26 +400,26 @@ static inline unsigned long has_large_page(struct mm_struct *mm,
 	return 0;
 }
 
-void flush_tlb_mm_range(struct mm_struct *mm, unsigned long start,
-				unsigned long end, unsigned long vmflag)
+/*
+ * Flushing a range one page at a time with 'invlpg' beats a cr3 reload
+ * only while the range is small compared to the TLB: beyond
+ * act_entries >> tlb_flushall_shift pages (the CPU specific balance
+ * point), and never for more than tlb_single_page_flush_ceiling pages,
+ * the whole TLB is flushed instead.
+ */
+static bool flush_tlb_by_page(struct mm_struct *mm, unsigned long start,
+			unsigned long end, unsigned long vmflag)
 {
-	unsigned long addr;
+	unsigned long nr_pages;
 	unsigned act_entries, tlb_entries = 0;
 
-	preempt_disable();
-	if (current->active_mm != mm)
-		goto flush_all;
-
-	if (!current->mm) {
-		leave_mm(smp_processor_id());
-		goto flush_all;
-	}
-
 	if (end == TLB_FLUSH_ALL || tlb_flushall_shift == -1
-					|| vmflag == VM_HUGETLB) {
-		local_flush_tlb();
-		goto flush_all;
-	}
+					|| vmflag == VM_HUGETLB)
+		return false;
+
+	nr_pages = (end - start) >> PAGE_SHIFT;
+	if (nr_pages > tlb_single_page_flush_ceiling)
+		return false;
 
 	/* In modern CPU, last level tlb used for both data/ins */
 	if (vmflag & VM_EXEC)
@@ -209,47 +430,55 @@ void flush_tlb_mm_range(struct mm_struct *mm, unsigned long start,
 	act_entries = mm->total_vm > tlb_entries ? tlb_entries : mm->total_vm;
 
 	/* tlb_flushall_shift is on balance point, details in commit log */
-	if ((end - start) >> PAGE_SHIFT > act_entries >> tlb_flushall_shift)
-		local_flush_tlb();
-	else {
-		if (has_large_page(mm, start, end)) {
-			local_flush_tlb();
-			goto flush_all;
-		}
-		/* flush range by one by one 'invlpg' */
-		for (addr = start; addr < end;	addr += PAGE_SIZE)
-			__flush_tlb_single(addr);
-
-		if (cpumask_any_but(mm_cpumask(mm),
-				smp_processor_id()) < nr_cpu_ids)
-			flush_tlb_others(mm_cpumask(mm), mm, start, end);
-		preempt_enable();
-		return;
-	}
+	if (nr_pages > act_entries >> tlb_flushall_shift)
+		return false;
 
-flush_all:
-	if (cpumask_any_but(mm_cpumask(mm), smp_processor_id()) < nr_cpu_ids)
-		flush_tlb_others(mm_cpumask(mm), mm, 0UL, TLB_FLUSH_ALL);
-	preempt_enable();
+	return !has_large_page(mm, start, end);
 }
 
-void flush_tlb_page(struct vm_area_struct *vma, unsigned long start)
+static void __flush_tlb_mm_range(struct mm_struct *mm, unsigned long start,
+		unsigned long end, unsigned long vmflag, bool skip_lazy)
 {
-	struct mm_struct *mm = vma->vm_mm;
-
-	preempt_disable();
+	struct flush_tlb_info info = {
+		.flush_mm = mm,
+		.flush_start = 0UL,
+		.flush_end = TLB_FLUSH_ALL,
+	};
 
-	if (current->active_mm == mm) {
-		if (current->mm)
-			__flush_tlb_one(start);
-		else
-			leave_mm(smp_processor_id());
+	if (flush_tlb_by_page(mm, start, end, vmflag)) {
+		info.flush_start = start;
+		info.flush_end = end;
 	}
 
-	if (cpumask_any_but(mm_cpumask(mm), smp_processor_id()) < nr_cpu_ids)
-		flush_tlb_others(mm_cpumask(mm), mm, start, 0UL);
+	flush_tlb_mm_info(&info, skip_lazy);
+}
 
-	preempt_enable();
+void flush_tlb_mm_range(struct mm_struct *mm, unsigned long start,
+				unsigned long end, unsigned long vmflag)
+{
+	__flush_tlb_mm_range(mm, start, end, vmflag, false);
+}
+
+/*
+ * Flush the range gathered by an mmu_gather, which may span several
+ * VMAs.  Unless page tables were freed, cpus that merely have @mm as
+ * their lazy tlb mm are not interrupted.
+ */
+void flush_tlb_unmap_range(struct mm_struct *mm, unsigned long start,
+				unsigned long end, bool freed_tables)
+{
+	__flush_tlb_mm_range(mm, start, end, 0UL, !freed_tables);
+}
+
+void flush_tlb_page(struct vm_area_struct *vma, unsigned long start)
+{
+	struct flush_tlb_info info = {
+		.flush_mm = vma->vm_mm,
+		.flush_start = start,
+		.flush_end = 0UL,
+	};
+
+	flush_tlb_mm_info(&info, false);
 }
 
 static void do_flush_tlb_all(void *info)
@@ -284,6 +513,7 @@ void flush_tlb_kernel_range(unsigned long start, unsigned long end)
 
 	/* Balance as user space task's flush, a bit conservative */
 	if (end == TLB_FLUSH_ALL || tlb_flushall_shift == -1 ||
+		(end - start) >> PAGE_SHIFT > tlb_single_page_flush_ceiling ||
 		(end - start) >> PAGE_SHIFT > act_entries >> tlb_flushall_shift)
 
 		on_each_cpu(do_flush_tlb_all, NULL, 1);
@@ -338,6 +568,9 @@ static int __cpuinit create_tlb_flushall_shift(void)
 	if (cpu_has_invlpg) {
 		debugfs_create_file("tlb_flushall_shift", S_IRUSR | S_IWUSR,
 			arch_debugfs_dir, NULL, &fops_tlbflush);
+		debugfs_create_u32("tlb_single_page_flush_ceiling",
+			S_IRUSR | S_IWUSR, arch_debugfs_dir,
+			&tlb_single_page_flush_ceiling);
 	}
 	return 0;
 }
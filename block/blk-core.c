@@ -1823,6 +1823,7 @@ void submit_bio(int rw, struct bio *bio)
 	if (bio_has_data(bio) && !(rw & REQ_DISCARD)) {
 		if (rw & WRITE) {
 			count_vm_events(PGPGOUT, count);
+			bio_associate_page_blkcg(bio);
 		} else {
 			task_io_account_read(bio->bi_size);
 			count_vm_events(PGPGIN, count);
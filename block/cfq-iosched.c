@@ -256,6 +256,13 @@ struct cfq_group {
 	int dispatched;
 	struct cfq_ttime ttime;
 	struct cfqg_stats stats;
+
+	/*
+	 * async queue for each priority case, per group so that buffered
+	 * writeback is scheduled by the weight of the group it is issued for
+	 */
+	struct cfq_queue *async_cfqq[2][IOPRIO_BE_NR];
+	struct cfq_queue *async_idle_cfqq;
 };
 
 struct cfq_io_cq {
@@ -321,12 +328,6 @@ struct cfq_data {
 	struct cfq_queue *active_queue;
 	struct cfq_io_cq *active_cic;
 
-	/*
-	 * async queue for each priority case
-	 */
-	struct cfq_queue *async_cfqq[2][IOPRIO_BE_NR];
-	struct cfq_queue *async_idle_cfqq;
-
 	sector_t last_position;
 
 	/*
@@ -1346,6 +1347,17 @@ static void cfq_pd_init(struct blkcg_gq *blkg)
 	cfqg->weight = blkg->blkcg->cfq_weight;
 }
 
+static void cfq_put_async_queues(struct cfq_group *cfqg);
+
+/*
+ * The async queues of a group hold references on it: drop them when the
+ * group is destroyed, or it would never be released.
+ */
+static void cfq_pd_offline(struct blkcg_gq *blkg)
+{
+	cfq_put_async_queues(blkg_to_cfqg(blkg));
+}
+
 /*
  * Search for the cfq group current task belongs to. request_queue lock must
  * be held.
@@ -1372,10 +1384,6 @@ static struct cfq_group *cfq_lookup_create_cfqg(struct cfq_data *cfqd,
 
 static void cfq_link_cfqq_cfqg(struct cfq_queue *cfqq, struct cfq_group *cfqg)
 {
-	/* Currently, all async queues are mapped to root group */
-	if (!cfq_cfqq_sync(cfqq))
-		cfqg = cfqq->cfqd->root_group;
-
 	cfqq->cfqg = cfqg;
 	/* cfqq reference on cfqg */
 	cfqg_get(cfqg);
@@ -3141,7 +3149,7 @@ static void cfq_init_cfqq(struct cfq_data *cfqd, struct cfq_queue *cfqq,
 static void check_blkcg_changed(struct cfq_io_cq *cic, struct bio *bio)
 {
 	struct cfq_data *cfqd = cic_to_cfqd(cic);
-	struct cfq_queue *sync_cfqq;
+	struct cfq_queue *sync_cfqq, *async_cfqq;
 	uint64_t id;
 
 	rcu_read_lock();
@@ -3166,6 +3174,17 @@ static void check_blkcg_changed(struct cfq_io_cq *cic, struct bio *bio)
 		cfq_put_queue(sync_cfqq);
 	}
 
+	/*
+	 * Likewise for the async queue, which the new group has its own
+	 * of.  This happens all the time to the flusher threads, whose
+	 * writeback bios carry the blkcg of the pages they write.
+	 */
+	async_cfqq = cic_to_cfqq(cic, 0);
+	if (async_cfqq) {
+		cic_set_cfqq(cic, NULL, 0);
+		cfq_put_queue(async_cfqq);
+	}
+
 	cic->blkcg_id = id;
 }
 #else
@@ -3228,18 +3247,18 @@ retry:
 }
 
 static struct cfq_queue **
-cfq_async_queue_prio(struct cfq_data *cfqd, int ioprio_class, int ioprio)
+cfq_async_queue_prio(struct cfq_group *cfqg, int ioprio_class, int ioprio)
 {
 	switch (ioprio_class) {
 	case IOPRIO_CLASS_RT:
-		return &cfqd->async_cfqq[0][ioprio];
+		return &cfqg->async_cfqq[0][ioprio];
 	case IOPRIO_CLASS_NONE:
 		ioprio = IOPRIO_NORM;
 		/* fall through */
 	case IOPRIO_CLASS_BE:
-		return &cfqd->async_cfqq[1][ioprio];
+		return &cfqg->async_cfqq[1][ioprio];
 	case IOPRIO_CLASS_IDLE:
-		return &cfqd->async_idle_cfqq;
+		return &cfqg->async_idle_cfqq;
 	default:
 		BUG();
 	}
@@ -3253,19 +3272,31 @@ cfq_get_queue(struct cfq_data *cfqd, bool is_sync, struct cfq_io_cq *cic,
 	const int ioprio = IOPRIO_PRIO_DATA(cic->ioprio);
 	struct cfq_queue **async_cfqq = NULL;
 	struct cfq_queue *cfqq = NULL;
+	struct cfq_group *cfqg;
 
 	if (!is_sync) {
-		async_cfqq = cfq_async_queue_prio(cfqd, ioprio_class, ioprio);
+		rcu_read_lock();
+		cfqg = cfq_lookup_create_cfqg(cfqd, bio_blkcg(bio));
+		rcu_read_unlock();
+		if (!cfqg)
+			cfqg = cfqd->root_group;
+		async_cfqq = cfq_async_queue_prio(cfqg, ioprio_class, ioprio);
 		cfqq = *async_cfqq;
+		/*
+		 * Don't let cfq_find_alloc_queue() drop the queue lock: the
+		 * group, which the new queue is pinned in, could go away.
+		 */
+		gfp_mask &= ~__GFP_WAIT;
 	}
 
 	if (!cfqq)
 		cfqq = cfq_find_alloc_queue(cfqd, is_sync, cic, bio, gfp_mask);
 
 	/*
-	 * pin the queue now that it's allocated, scheduler exit will prune it
+	 * pin the queue now that it's allocated, group offline or scheduler exit
+	 * will prune it
 	 */
-	if (!is_sync && !(*async_cfqq)) {
+	if (!is_sync && !(*async_cfqq) && cfqq != &cfqd->oom_cfqq) {
 		cfqq->ref++;
 		*async_cfqq = cfqq;
 	}
@@ -3918,25 +3949,32 @@ static void cfq_shutdown_timer_wq(struct cfq_data *cfqd)
 	cancel_work_sync(&cfqd->unplug_work);
 }
 
-static void cfq_put_async_queues(struct cfq_data *cfqd)
+static void cfq_put_async_queues(struct cfq_group *cfqg)
 {
 	int i;
 
 	for (i = 0; i < IOPRIO_BE_NR; i++) {
-		if (cfqd->async_cfqq[0][i])
-			cfq_put_queue(cfqd->async_cfqq[0][i]);
-		if (cfqd->async_cfqq[1][i])
-			cfq_put_queue(cfqd->async_cfqq[1][i]);
+		if (cfqg->async_cfqq[0][i]) {
+			cfq_put_queue(cfqg->async_cfqq[0][i]);
+			cfqg->async_cfqq[0][i] = NULL;
+		}
+		if (cfqg->async_cfqq[1][i]) {
+			cfq_put_queue(cfqg->async_cfqq[1][i]);
+			cfqg->async_cfqq[1][i] = NULL;
+		}
 	}
 
-	if (cfqd->async_idle_cfqq)
-		cfq_put_queue(cfqd->async_idle_cfqq);
+	if (cfqg->async_idle_cfqq) {
+		cfq_put_queue(cfqg->async_idle_cfqq);
+		cfqg->async_idle_cfqq = NULL;
+	}
 }
 
 static void cfq_exit_queue(struct elevator_queue *e)
 {
 	struct cfq_data *cfqd = e->elevator_data;
 	struct request_queue *q = cfqd->queue;
+	struct blkcg_gq *blkg __maybe_unused;
 
 	cfq_shutdown_timer_wq(cfqd);
 
@@ -3945,7 +3983,12 @@ static void cfq_exit_queue(struct elevator_queue *e)
 	if (cfqd->active_queue)
 		__cfq_slice_expired(cfqd, cfqd->active_queue, 0);
 
-	cfq_put_async_queues(cfqd);
+#ifdef CONFIG_CFQ_GROUP_IOSCHED
+	list_for_each_entry(blkg, &q->blkg_list, q_node)
+		cfq_put_async_queues(blkg_to_cfqg(blkg));
+#else
+	cfq_put_async_queues(cfqd->root_group);
+#endif
 
 	spin_unlock_irq(q->queue_lock);
 
@@ -4176,6 +4219,7 @@ static struct blkcg_policy blkcg_policy_cfq = {
 	.cftypes		= cfq_blkcg_files,
 
 	.pd_init_fn		= cfq_pd_init,
+	.pd_offline_fn		= cfq_pd_offline,
 	.pd_reset_stats_fn	= cfq_pd_reset_stats,
 };
 #endif
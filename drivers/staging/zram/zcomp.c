@@ -0,0 +1,181 @@
+/*
+ * Compression streams for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/lzo.h>
+
+#include "zcomp.h"
+
+static void zcomp_strm_free(struct zcomp_strm *zstrm)
+{
+	kfree(zstrm->workmem);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+/*
+ * Allocate a new stream.  This is called from the I/O path, on behalf of
+ * swap out among others, so it must not recurse into the block layer.
+ */
+static struct zcomp_strm *zcomp_strm_alloc(void)
+{
+	struct zcomp_strm *zstrm;
+
+	zstrm = kmalloc(sizeof(*zstrm), GFP_NOIO);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->workmem = kmalloc(LZO1X_MEM_COMPRESS, GFP_NOIO);
+	/*
+	 * The output of a compressor may be larger than its input for
+	 * incompressible data: allow it up to two pages.
+	 */
+	zstrm->buffer = (void *)__get_free_pages(GFP_NOIO | __GFP_ZERO, 1);
+	if (!zstrm->workmem || !zstrm->buffer) {
+		zcomp_strm_free(zstrm);
+		return NULL;
+	}
+	return zstrm;
+}
+
+/*
+ * Get an idle stream, allocating a new one if all streams are busy and
+ * their number is below the limit, or waiting for one to be released.
+ */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_entry(comp->idle_strm.next,
+					struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+		/* Streams limit reached, wait for an idle stream */
+		if (comp->avail_strm >= comp->max_strm) {
+			spin_unlock(&comp->strm_lock);
+			wait_event(comp->strm_wait,
+				   !list_empty(&comp->idle_strm));
+			continue;
+		}
+		/* Allocate a new stream */
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+
+		zstrm = zcomp_strm_alloc();
+		if (zstrm)
+			return zstrm;
+
+		/* Out of memory: wait for one of the existing streams */
+		spin_lock(&comp->strm_lock);
+		comp->avail_strm--;
+		spin_unlock(&comp->strm_lock);
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+/* Put a stream back on the idle list, or free it if over the limit */
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	if (comp->avail_strm <= comp->max_strm) {
+		list_add(&zstrm->list, &comp->idle_strm);
+		spin_unlock(&comp->strm_lock);
+		wake_up(&comp->strm_wait);
+		return;
+	}
+
+	comp->avail_strm--;
+	spin_unlock(&comp->strm_lock);
+	zcomp_strm_free(zstrm);
+}
+
+/*
+ * Change the limit on the number of streams.  Idle streams above the new
+ * limit are freed now, busy ones when they are released.
+ */
+void zcomp_set_max_streams(struct zcomp *comp, int num_strm)
+{
+	struct zcomp_strm *zstrm;
+
+	spin_lock(&comp->strm_lock);
+	comp->max_strm = num_strm;
+	while (comp->avail_strm > num_strm && !list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(zstrm);
+		comp->avail_strm--;
+	}
+	spin_unlock(&comp->strm_lock);
+}
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len)
+{
+	return lzo1x_1_compress(src, PAGE_SIZE, zstrm->buffer, dst_len,
+				zstrm->workmem);
+}
+
+int zcomp_decompress(struct zcomp *comp, const unsigned char *src,
+		size_t src_len, unsigned char *dst)
+{
+	size_t dst_len = PAGE_SIZE;
+
+	return lzo1x_decompress_safe(src, src_len, dst, &dst_len);
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(zstrm);
+	}
+	kfree(comp);
+}
+
+/*
+ * Create a pool of at most max_strm compression streams.  One stream is
+ * allocated upfront, so that writes can always make progress.
+ */
+struct zcomp *zcomp_create(int max_strm)
+{
+	struct zcomp *comp;
+	struct zcomp_strm *zstrm;
+
+	comp = kmalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	comp->max_strm = max_strm;
+
+	zstrm = zcomp_strm_alloc();
+	if (!zstrm) {
+		kfree(comp);
+		return NULL;
+	}
+	list_add(&zstrm->list, &comp->idle_strm);
+	comp->avail_strm = 1;
+	return comp;
+}
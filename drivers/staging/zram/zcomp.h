@@ -0,0 +1,53 @@
+/*
+ * Compression streams for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/list.h>
+
+struct zcomp_strm {
+	/* compression/decompression buffer */
+	void *buffer;
+	/* compressor working memory */
+	void *workmem;
+	/* used in the list of idle streams */
+	struct list_head list;
+};
+
+/*
+ * A pool of compression streams, grown on demand up to max_strm streams:
+ * a writer takes an idle stream, allocates a new one if none is idle and
+ * the limit allows, or else waits for another writer to release one.
+ */
+struct zcomp {
+	spinlock_t strm_lock;	/* protects idle_strm, avail_strm, max_strm */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;		/* streams allocated, idle or in use */
+	int max_strm;
+};
+
+struct zcomp *zcomp_create(int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, const unsigned char *src,
+		size_t src_len, unsigned char *dst);
+
+void zcomp_set_max_streams(struct zcomp *comp, int num_strm);
+
+#endif /* _ZCOMP_H_ */
@@ -23,6 +23,7 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
@@ -42,51 +43,48 @@ struct zram *zram_devices;
 /* Module params (documentation at end) */
 static unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+/*
+ * The table entries are protected by the ZRAM_ACCESS bit spinlock of their
+ * value: callers of the helpers below hold it.
+ */
+static int zram_test_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	*v = *v + 1;
+	return zram->table[index].value & BIT(flag);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_set_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	*v = *v - 1;
+	zram->table[index].value |= BIT(flag);
 }
 
-static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
+static void zram_clear_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v + inc;
-	spin_unlock(&zram->stat64_lock);
+	zram->table[index].value &= ~BIT(flag);
 }
 
-static void zram_stat64_sub(struct zram *zram, u64 *v, u64 dec)
+static size_t zram_get_obj_size(struct zram *zram, u32 index)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v - dec;
-	spin_unlock(&zram->stat64_lock);
+	return zram->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
 }
 
-static void zram_stat64_inc(struct zram *zram, u64 *v)
+static void zram_set_obj_size(struct zram *zram, u32 index, size_t size)
 {
-	zram_stat64_add(zram, v, 1);
-}
+	unsigned long flags = zram->table[index].value >> ZRAM_FLAG_SHIFT;
 
-static int zram_test_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
-{
-	return zram->table[index].flags & BIT(flag);
+	zram->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
 }
 
-static void zram_set_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+static void zram_lock_slot(struct zram *zram, u32 index)
 {
-	zram->table[index].flags |= BIT(flag);
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].value);
 }
 
-static void zram_clear_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+static void zram_unlock_slot(struct zram *zram, u32 index)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].value);
 }
 
 static int page_zero_filled(void *ptr)
@@ -133,10 +131,11 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+/* Called with the slot locked */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	unsigned long handle = zram->table[index].handle;
-	u16 size = zram->table[index].size;
+	size_t size = zram_get_obj_size(zram, index);
 
 	if (unlikely(!handle)) {
 		/*
@@ -145,25 +144,24 @@ static void zram_free_page(struct zram *zram, size_t index)
 		 */
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
 			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
+			atomic64_dec(&zram->stats.pages_zero);
 		}
 		return;
 	}
 
 	if (unlikely(size > max_zpage_size))
-		zram_stat_dec(&zram->stats.bad_compress);
+		atomic64_dec(&zram->stats.bad_compress);
 
 	zs_free(zram->mem_pool, handle);
 
 	if (size <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
+		atomic64_dec(&zram->stats.good_compress);
 
-	zram_stat64_sub(zram, &zram->stats.compr_size,
-			zram->table[index].size);
-	zram_stat_dec(&zram->stats.pages_stored);
+	atomic64_sub(size, &zram->stats.compr_size);
+	atomic64_dec(&zram->stats.pages_stored);
 
 	zram->table[index].handle = 0;
-	zram->table[index].size = 0;
+	zram_set_obj_size(zram, index, 0);
 }
 
 static void handle_zero_page(struct bio_vec *bvec)
@@ -183,32 +181,72 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
+/* Decompress the whole page at index into mem */
+static int zram_decompress_page(struct zram *zram, unsigned char *mem,
+				u32 index)
+{
+	int ret = LZO_E_OK;
+	unsigned char *cmem;
+	unsigned long handle;
+	size_t size;
+
+	zram_lock_slot(zram, index);
+	handle = zram->table[index].handle;
+	size = zram_get_obj_size(zram, index);
+
+	if (zram_test_flag(zram, index, ZRAM_ZERO) || !handle) {
+		zram_unlock_slot(zram, index);
+		memset(mem, 0, PAGE_SIZE);
+		return 0;
+	}
+
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	if (size == PAGE_SIZE)
+		memcpy(mem, cmem, PAGE_SIZE);
+	else
+		ret = zcomp_decompress(zram->comp, cmem, size, mem);
+	zs_unmap_object(zram->mem_pool, handle);
+	zram_unlock_slot(zram, index);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret != LZO_E_OK)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		atomic64_inc(&zram->stats.failed_reads);
+		return ret;
+	}
+
+	return 0;
+}
+
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
 	int ret;
-	size_t clen;
 	struct page *page;
-	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	unsigned char *user_mem, *uncmem = NULL;
 
 	page = bvec->bv_page;
 
+	zram_lock_slot(zram, index);
 	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		zram_unlock_slot(zram, index);
 		handle_zero_page(bvec);
 		return 0;
 	}
 
 	/* Requested page is not present in compressed area */
 	if (unlikely(!zram->table[index].handle)) {
+		zram_unlock_slot(zram, index);
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
 		handle_zero_page(bvec);
 		return 0;
 	}
+	zram_unlock_slot(zram, index);
 
 	if (is_partial_io(bvec)) {
 		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
 		if (!uncmem) {
 			pr_info("Error allocating temp memory!\n");
 			return -ENOMEM;
@@ -218,139 +256,105 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	user_mem = kmap_atomic(page);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle,
-				ZS_MM_RO);
-
-	if (zram->table[index].size == PAGE_SIZE) {
-		memcpy(uncmem, cmem, PAGE_SIZE);
-		ret = LZO_E_OK;
-	} else {
-		ret = lzo1x_decompress_safe(cmem, zram->table[index].size,
-				    uncmem, &clen);
-	}
+	ret = zram_decompress_page(zram, uncmem, index);
 
 	if (is_partial_io(bvec)) {
-		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
-		       bvec->bv_len);
+		if (!ret)
+			memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+			       bvec->bv_len);
 		kfree(uncmem);
 	}
-
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
 	kunmap_atomic(user_mem);
 
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
+	if (unlikely(ret))
 		return ret;
-	}
 
 	flush_dcache_page(page);
 
 	return 0;
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
-{
-	int ret;
-	size_t clen = PAGE_SIZE;
-	unsigned char *cmem;
-	unsigned long handle = zram->table[index].handle;
-
-	if (zram_test_flag(zram, index, ZRAM_ZERO) || !handle) {
-		memset(mem, 0, PAGE_SIZE);
-		return 0;
-	}
-
-	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
-	ret = lzo1x_decompress_safe(cmem, zram->table[index].size,
-				    mem, &clen);
-	zs_unmap_object(zram->mem_pool, handle);
-
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
-	}
-
-	return 0;
-}
-
+/*
+ * Compression runs on a stream of its own, without any zram lock held,
+ * so that writes to different slots proceed in parallel.  Only the
+ * update of the table entry is done under the slot lock.
+ */
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
-	int ret;
+	int ret = 0;
 	size_t clen;
 	unsigned long handle;
 	struct page *page;
+	struct zcomp_strm *zstrm = NULL;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
 		 * This is a partial IO. We need to read the full page
 		 * before to write the changes.
 		 */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
 		if (!uncmem) {
 			pr_info("Error allocating temp memory!\n");
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
+		ret = zram_decompress_page(zram, uncmem, index);
+		if (ret)
 			goto out;
-		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].handle ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
+	zstrm = zcomp_strm_find(zram->comp);
 	user_mem = kmap_atomic(page);
 
-	if (is_partial_io(bvec))
+	if (is_partial_io(bvec)) {
 		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
 		       bvec->bv_len);
-	else
+		kunmap_atomic(user_mem);
+		user_mem = NULL;
+	} else {
 		uncmem = user_mem;
+	}
 
 	if (page_zero_filled(uncmem)) {
-		kunmap_atomic(user_mem);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
+		if (user_mem)
+			kunmap_atomic(user_mem);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_lock_slot(zram, index);
+		zram_free_page(zram, index);
 		zram_set_flag(zram, index, ZRAM_ZERO);
+		zram_unlock_slot(zram, index);
+
+		atomic64_inc(&zram->stats.pages_zero);
 		ret = 0;
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
-
-	kunmap_atomic(user_mem);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
+	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
+	if (!is_partial_io(bvec)) {
+		kunmap_atomic(user_mem);
+		user_mem = NULL;
+		uncmem = NULL;
+	}
 
 	if (unlikely(ret != LZO_E_OK)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
 
+	src = zstrm->buffer;
 	if (unlikely(clen > max_zpage_size)) {
-		zram_stat_inc(&zram->stats.bad_compress);
-		src = uncmem;
+		atomic64_inc(&zram->stats.bad_compress);
 		clen = PAGE_SIZE;
+		if (is_partial_io(bvec))
+			src = uncmem;
 	}
 
 	handle = zs_malloc(zram->mem_pool, clen);
@@ -362,43 +366,53 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	}
 	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
 
-	memcpy(cmem, src, clen);
+	if (clen == PAGE_SIZE && !is_partial_io(bvec)) {
+		/* Store the page uncompressed, from its original */
+		src = kmap_atomic(page);
+		memcpy(cmem, src, PAGE_SIZE);
+		kunmap_atomic(src);
+	} else {
+		memcpy(cmem, src, clen);
+	}
 
 	zs_unmap_object(zram->mem_pool, handle);
 
+	zcomp_strm_release(zram->comp, zstrm);
+	zstrm = NULL;
+
+	/*
+	 * Free memory associated with this sector before overwriting
+	 * the handle.
+	 */
+	zram_lock_slot(zram, index);
+	zram_free_page(zram, index);
 	zram->table[index].handle = handle;
-	zram->table[index].size = clen;
+	zram_set_obj_size(zram, index, clen);
+	zram_unlock_slot(zram, index);
 
 	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
-	zram_stat_inc(&zram->stats.pages_stored);
+	atomic64_add(clen, &zram->stats.compr_size);
+	atomic64_inc(&zram->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
-		zram_stat_inc(&zram->stats.good_compress);
-
-	return 0;
+		atomic64_inc(&zram->stats.good_compress);
 
 out:
+	if (zstrm)
+		zcomp_strm_release(zram->comp, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 	if (ret)
-		zram_stat64_inc(zram, &zram->stats.failed_writes);
+		atomic64_inc(&zram->stats.failed_writes);
 	return ret;
 }
 
 static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 			int offset, struct bio *bio, int rw)
 {
-	int ret;
-
-	if (rw == READ) {
-		down_read(&zram->lock);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
-		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
-	}
+	if (rw == READ)
+		return zram_bvec_read(zram, bvec, index, offset, bio);
 
-	return ret;
+	return zram_bvec_write(zram, bvec, index, offset);
 }
 
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
@@ -416,10 +430,10 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 
 	switch (rw) {
 	case READ:
-		zram_stat64_inc(zram, &zram->stats.num_reads);
+		atomic64_inc(&zram->stats.num_reads);
 		break;
 	case WRITE:
-		zram_stat64_inc(zram, &zram->stats.num_writes);
+		atomic64_inc(&zram->stats.num_writes);
 		break;
 	}
 
@@ -495,7 +509,7 @@ static void zram_make_request(struct request_queue *queue, struct bio *bio)
 		goto error_unlock;
 
 	if (!valid_io_request(zram, bio)) {
-		zram_stat64_inc(zram, &zram->stats.invalid_io);
+		atomic64_inc(&zram->stats.invalid_io);
 		goto error_unlock;
 	}
 
@@ -516,12 +530,10 @@ void __zram_reset_device(struct zram *zram)
 
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free the compression streams */
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
@@ -565,17 +577,9 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comp = zcomp_create(zram->max_comp_streams);
+	if (!zram->comp) {
+		pr_err("Error allocating compression streams\n");
 		ret = -ENOMEM;
 		goto fail_no_table;
 	}
@@ -593,7 +597,8 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = zs_create_pool("zram", GFP_NOIO | __GFP_HIGHMEM);
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name,
+					GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -622,8 +627,10 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_lock_slot(zram, index);
 	zram_free_page(zram, index);
-	zram_stat64_inc(zram, &zram->stats.notify_free);
+	zram_unlock_slot(zram, index);
+	atomic64_inc(&zram->stats.notify_free);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -635,9 +642,9 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
-	spin_lock_init(&zram->stat64_lock);
+	/* One compression stream per cpu, allocated as writers need them */
+	zram->max_comp_streams = num_online_cpus();
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
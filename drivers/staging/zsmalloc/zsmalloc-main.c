@@ -42,7 +42,9 @@
  *	For _first_ page only:
  *
  *	page->private (union with page->first_page): refers to the
- *		component page after the first page
+ *		component page after the first page.  For huge classes,
+ *		whose zspages are a single page holding a single object,
+ *		it holds the handle of that object instead.
  *	page->freelist: points to the first free object in zspage.
  *		Free objects are linked together using in-place
  *		metadata.
@@ -56,6 +58,12 @@
  *	PG_private: identifies the first component page
  *	PG_private2: identifies the last component page
  *
+ * Objects freed at random leave zspages sparsely used.  zs_compact(),
+ * triggered by the pool user or by the pool's shrinker under memory
+ * pressure, moves the objects of the emptiest zspages of a class into the
+ * fullest ones and frees the zspages emptied this way.  This is possible
+ * because zs_malloc() hands out handles which point to the location of
+ * the object rather than encode it (see zsmalloc_int.h).
  */
 
 #ifdef CONFIG_ZSMALLOC_DEBUG
@@ -75,6 +83,9 @@
 #include <linux/cpumask.h>
 #include <linux/cpu.h>
 #include <linux/vmalloc.h>
+#include <linux/bit_spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "zsmalloc.h"
 #include "zsmalloc_int.h"
@@ -91,6 +102,50 @@
 /* per-cpu VM mapping areas for zspage accesses that cross page boundaries */
 static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
 
+/* The words zs_malloc() handles point to */
+static struct kmem_cache *zs_handle_cache;
+
+static unsigned long alloc_handle(struct zs_pool *pool)
+{
+	return (unsigned long)kmem_cache_alloc(zs_handle_cache,
+					pool->flags & ~__GFP_HIGHMEM);
+}
+
+static void free_handle(unsigned long handle)
+{
+	kmem_cache_free(zs_handle_cache, (void *)handle);
+}
+
+/*
+ * The lowest bit of obj is always clear: storing it also releases the
+ * pin, unless the caller passes it with HANDLE_PIN_BIT set.
+ */
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	*(unsigned long *)handle = obj;
+}
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle & ~BIT(HANDLE_PIN_BIT);
+}
+
+/* Pin the object of a handle, so that compaction leaves it in place */
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
 static int is_first_page(struct page *page)
 {
 	return PagePrivate(page);
@@ -278,28 +333,30 @@ static struct page *get_next_page(struct page *page)
 	return next;
 }
 
-/* Encode <page, obj_idx> as a single handle value */
-static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
+/* Encode <page, obj_idx> as a single obj value */
+static void *location_to_obj(struct page *page, unsigned long obj_idx)
 {
-	unsigned long handle;
+	unsigned long obj;
 
 	if (!page) {
 		BUG_ON(obj_idx);
 		return NULL;
 	}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= (obj_idx & OBJ_INDEX_MASK);
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= (obj_idx & OBJ_INDEX_MASK);
+	obj <<= OBJ_TAG_BITS;
 
-	return (void *)handle;
+	return (void *)obj;
 }
 
-/* Decode <page, obj_idx> pair from the given object handle */
-static void obj_handle_to_location(unsigned long handle, struct page **page,
+/* Decode <page, obj_idx> pair from the given obj value */
+static void obj_to_location(unsigned long obj, struct page **page,
 				unsigned long *obj_idx)
 {
-	*page = pfn_to_page(handle >> OBJ_INDEX_BITS);
-	*obj_idx = handle & OBJ_INDEX_MASK;
+	obj >>= OBJ_TAG_BITS;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = obj & OBJ_INDEX_MASK;
 }
 
 static unsigned long obj_idx_to_offset(struct page *page,
@@ -376,7 +433,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		for (i = 1; i <= objs_on_page; i++) {
 			off += class->size;
 			if (off < PAGE_SIZE) {
-				link->next = obj_location_to_handle(page, i);
+				link->next = location_to_obj(page, i);
 				link += class->size / sizeof(*link);
 			}
 		}
@@ -387,7 +444,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		 * page (if present)
 		 */
 		next_page = get_next_page(page);
-		link->next = obj_location_to_handle(next_page, 0);
+		link->next = location_to_obj(next_page, 0);
 		kunmap_atomic(link);
 		page = next_page;
 		off = (off + class->size) % PAGE_SIZE;
@@ -441,9 +498,9 @@ static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
 
 	init_zspage(first_page, class);
 
-	first_page->freelist = obj_location_to_handle(first_page, 0);
+	first_page->freelist = location_to_obj(first_page, 0);
 	/* Maximum number of objects we can store in this zspage */
-	first_page->objects = class->pages_per_zspage * PAGE_SIZE / class->size;
+	first_page->objects = class->objs_per_zspage;
 
 	error = 0; /* Success */
 
@@ -552,6 +609,146 @@ static struct notifier_block zs_cpu_nb = {
 	.notifier_call = zs_cpu_notifier
 };
 
+#ifdef CONFIG_ZSMALLOC_STAT
+static struct dentry *zs_stat_root;
+
+/* Number of zspages on a fullness list, called with class->lock held */
+static unsigned long class_nr_zspages(struct size_class *class,
+				      enum fullness_group fg)
+{
+	struct page *head = class->fullness_list[fg];
+	struct page *page;
+	unsigned long nr = 0;
+
+	if (!head)
+		return 0;
+
+	nr++;
+	list_for_each_entry(page, &head->lru, lru)
+		nr++;
+
+	return nr;
+}
+
+static int zs_stats_size_show(struct seq_file *s, void *v)
+{
+	int i;
+	struct zs_pool *pool = s->private;
+	struct size_class *class;
+	unsigned long almost_full, almost_empty;
+	unsigned long obj_allocated, obj_used, pages_used, pages_compacted;
+	unsigned long total_almost_full = 0, total_almost_empty = 0;
+	unsigned long total_objs = 0, total_used_objs = 0, total_pages = 0;
+	unsigned long total_compacted = 0;
+
+	seq_printf(s, " %5s %5s %11s %12s %13s %10s %10s %16s %15s\n",
+			"class", "size", "almost_full", "almost_empty",
+			"obj_allocated", "obj_used", "pages_used",
+			"pages_per_zspage", "pages_compacted");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		almost_full = class_nr_zspages(class, ZS_ALMOST_FULL);
+		almost_empty = class_nr_zspages(class, ZS_ALMOST_EMPTY);
+		obj_allocated = class->obj_allocated;
+		obj_used = class->obj_used;
+		pages_used = class->pages_allocated;
+		pages_compacted = class->pages_compacted;
+		spin_unlock(&class->lock);
+
+		if (!pages_used && !pages_compacted)
+			continue;
+
+		seq_printf(s, " %5u %5u %11lu %12lu %13lu %10lu %10lu %16d %15lu\n",
+			i, class->size, almost_full, almost_empty,
+			obj_allocated, obj_used, pages_used,
+			class->pages_per_zspage, pages_compacted);
+
+		total_almost_full += almost_full;
+		total_almost_empty += almost_empty;
+		total_objs += obj_allocated;
+		total_used_objs += obj_used;
+		total_pages += pages_used;
+		total_compacted += pages_compacted;
+	}
+
+	seq_puts(s, "\n");
+	seq_printf(s, " %5s %5s %11lu %12lu %13lu %10lu %10lu %16s %15lu\n",
+			"Total", "", total_almost_full, total_almost_empty,
+			total_objs, total_used_objs, total_pages, "",
+			total_compacted);
+
+	return 0;
+}
+
+static int zs_stats_size_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_size_show, inode->i_private);
+}
+
+static const struct file_operations zs_stat_size_ops = {
+	.open		= zs_stats_size_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void zs_pool_stat_create(struct zs_pool *pool)
+{
+	if (!zs_stat_root)
+		return;
+
+	pool->stat_dentry = debugfs_create_dir(pool->name, zs_stat_root);
+	if (!pool->stat_dentry) {
+		pr_warn("debugfs dir <%s> creation failed\n", pool->name);
+		return;
+	}
+
+	if (!debugfs_create_file("classes", S_IFREG | S_IRUGO,
+				 pool->stat_dentry, pool, &zs_stat_size_ops))
+		pr_warn("%s: debugfs file entry <classes> creation failed\n",
+			pool->name);
+}
+
+static void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+	debugfs_remove_recursive(pool->stat_dentry);
+}
+
+static void zs_stat_init(void)
+{
+	if (!debugfs_initialized())
+		return;
+
+	zs_stat_root = debugfs_create_dir("zsmalloc", NULL);
+	if (!zs_stat_root)
+		pr_warn("debugfs 'zsmalloc' stat dir creation failed\n");
+}
+
+static void zs_stat_exit(void)
+{
+	debugfs_remove_recursive(zs_stat_root);
+}
+#else
+static inline void zs_pool_stat_create(struct zs_pool *pool)
+{
+}
+
+static inline void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+}
+
+static inline void zs_stat_init(void)
+{
+}
+
+static inline void zs_stat_exit(void)
+{
+}
+#endif /* CONFIG_ZSMALLOC_STAT */
+
 static void zs_exit(void)
 {
 	int cpu;
@@ -559,12 +756,22 @@ static void zs_exit(void)
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
+
+	zs_stat_exit();
+	kmem_cache_destroy(zs_handle_cache);
 }
 
 static int zs_init(void)
 {
 	int cpu, ret;
 
+	zs_handle_cache = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					    0, 0, NULL);
+	if (!zs_handle_cache)
+		return -ENOMEM;
+
+	zs_stat_init();
+
 	register_cpu_notifier(&zs_cpu_nb);
 	for_each_online_cpu(cpu) {
 		ret = zs_cpu_notifier(NULL, CPU_UP_PREPARE, (void *)(long)cpu);
@@ -577,6 +784,11 @@ fail:
 	return notifier_to_errno(ret);
 }
 
+static unsigned long zs_shrinker_count(struct shrinker *shrinker,
+				       struct shrink_control *sc);
+static unsigned long zs_shrinker_scan(struct shrinker *shrinker,
+				      struct shrink_control *sc);
+
 struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 {
 	int i, ovhd_size;
@@ -603,12 +815,26 @@ struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 		class->index = i;
 		spin_lock_init(&class->lock);
 		class->pages_per_zspage = get_pages_per_zspage(size);
-
+		class->objs_per_zspage = class->pages_per_zspage *
+						PAGE_SIZE / size;
+		if (class->pages_per_zspage == 1 &&
+		    class->objs_per_zspage == 1)
+			class->huge = true;
 	}
 
 	pool->flags = flags;
 	pool->name = name;
 
+	pool->shrinker.count_objects = zs_shrinker_count;
+	pool->shrinker.scan_objects = zs_shrinker_scan;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	if (register_shrinker(&pool->shrinker)) {
+		kfree(pool);
+		return NULL;
+	}
+
+	zs_pool_stat_create(pool);
+
 	return pool;
 }
 EXPORT_SYMBOL_GPL(zs_create_pool);
@@ -617,6 +843,9 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	unregister_shrinker(&pool->shrinker);
+	zs_pool_stat_destroy(pool);
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
 		struct size_class *class = &pool->size_class[i];
@@ -633,6 +862,62 @@ void zs_destroy_pool(struct zs_pool *pool)
 }
 EXPORT_SYMBOL_GPL(zs_destroy_pool);
 
+/* Take the first free object of a zspage for the given handle */
+static unsigned long obj_malloc(struct page *first_page,
+		struct size_class *class, unsigned long handle)
+{
+	unsigned long obj;
+	struct link_free *link;
+	struct page *m_page;
+	unsigned long m_objidx, m_offset;
+	void *vaddr;
+
+	obj = (unsigned long)first_page->freelist;
+	obj_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	vaddr = kmap_atomic(m_page);
+	link = (struct link_free *)vaddr + m_offset / sizeof(*link);
+	first_page->freelist = link->next;
+	if (!class->huge)
+		/* record handle in the header of allocated chunk */
+		link->handle = handle | OBJ_ALLOCATED_TAG;
+	else
+		/* record handle in first_page->private */
+		set_page_private(first_page, handle | OBJ_ALLOCATED_TAG);
+	kunmap_atomic(vaddr);
+
+	first_page->inuse++;
+	class->obj_used++;
+
+	return obj;
+}
+
+/* Give an object back to the freelist of its zspage */
+static void obj_free(struct size_class *class, unsigned long obj)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+	void *vaddr;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	vaddr = kmap_atomic(f_page);
+	/* Insert this object in containing zspage's freelist */
+	link = (struct link_free *)(vaddr + f_offset);
+	link->next = first_page->freelist;
+	if (class->huge)
+		set_page_private(first_page, 0);
+	kunmap_atomic(vaddr);
+	first_page->freelist = (void *)obj;
+
+	first_page->inuse--;
+	class->obj_used--;
+}
+
 /**
  * zs_malloc - Allocate block of given size from pool.
  * @pool: pool to allocate from
@@ -644,18 +929,22 @@ EXPORT_SYMBOL_GPL(zs_destroy_pool);
  */
 unsigned long zs_malloc(struct zs_pool *pool, size_t size)
 {
-	unsigned long obj;
-	struct link_free *link;
+	unsigned long handle, obj;
 	int class_idx;
 	struct size_class *class;
-
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
+	struct page *first_page;
 
 	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
 		return 0;
 
-	class_idx = get_size_class_index(size);
+	handle = alloc_handle(pool);
+	if (!handle)
+		return 0;
+
+	/* extra space in chunk to keep the handle */
+	size += ZS_HANDLE_SIZE;
+	class_idx = min_t(int, get_size_class_index(size),
+			  ZS_SIZE_CLASSES - 1);
 	class = &pool->size_class[class_idx];
 	BUG_ON(class_idx != class->index);
 
@@ -665,69 +954,58 @@ unsigned long zs_malloc(struct zs_pool *pool, size_t size)
 	if (!first_page) {
 		spin_unlock(&class->lock);
 		first_page = alloc_zspage(class, pool->flags);
-		if (unlikely(!first_page))
+		if (unlikely(!first_page)) {
+			free_handle(handle);
 			return 0;
+		}
 
 		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
 		spin_lock(&class->lock);
 		class->pages_allocated += class->pages_per_zspage;
+		class->obj_allocated += class->objs_per_zspage;
 	}
 
-	obj = (unsigned long)first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
-
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
-
-	first_page->inuse++;
+	obj = obj_malloc(first_page, class, handle);
 	/* Now move the zspage to another fullness group, if required */
 	fix_fullness_group(pool, first_page);
+	record_obj(handle, obj);
 	spin_unlock(&class->lock);
 
-	return obj;
+	return handle;
 }
 EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, unsigned long obj)
+void zs_free(struct zs_pool *pool, unsigned long handle)
 {
-	struct link_free *link;
 	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
-
-	int class_idx;
+	unsigned long obj, f_objidx;
+	unsigned int class_idx;
 	struct size_class *class;
 	enum fullness_group fullness;
 
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
-	obj_handle_to_location(obj, &f_page, &f_objidx);
+	/* Keep compaction away from the object while it is being freed */
+	pin_tag(handle);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &f_page, &f_objidx);
 	first_page = get_first_page(f_page);
 
 	get_zspage_mapping(first_page, &class_idx, &fullness);
 	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
 
 	spin_lock(&class->lock);
-
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = (void *)obj;
-
-	first_page->inuse--;
+	obj_free(class, obj);
 	fullness = fix_fullness_group(pool, first_page);
-
-	if (fullness == ZS_EMPTY)
+	if (fullness == ZS_EMPTY) {
 		class->pages_allocated -= class->pages_per_zspage;
-
+		class->obj_allocated -= class->objs_per_zspage;
+	}
 	spin_unlock(&class->lock);
+	unpin_tag(handle);
+
+	free_handle(handle);
 
 	if (fullness == ZS_EMPTY)
 		free_zspage(first_page);
@@ -746,31 +1024,39 @@ EXPORT_SYMBOL_GPL(zs_free);
  * Only one object can be mapped per cpu at a time. There is no protection
  * against nested mappings.
  *
- * This function returns with preemption and page faults disabled.
+ * This function returns with preemption and page faults disabled, and
+ * with the object pinned against compaction.
 */
 void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 			enum zs_mapmode mm)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
 	struct size_class *class;
 	struct mapping_area *area;
+	void *ret;
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	/* From now on, compaction cannot move the object */
+	pin_tag(handle);
+
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
 
 	area = &get_cpu_var(zs_map_area);
+	area->vm_mm = mm;
 	if (off + class->size <= PAGE_SIZE) {
 		/* this object is contained entirely within a page */
 		area->vm_addr = kmap_atomic(page);
-		return area->vm_addr + off;
+		ret = area->vm_addr + off;
+		goto out;
 	}
 
 	/* disable page faults to match kmap_atomic() return conditions */
@@ -779,20 +1065,26 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	if (mm != ZS_MM_WO)
 		zs_copy_map_object(area->vm_buf, page, off, class->size);
 	area->vm_addr = NULL;
-	return area->vm_buf;
+	ret = area->vm_buf;
+out:
+	if (!class->huge)
+		ret += ZS_HANDLE_SIZE;
+	return ret;
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
 void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
 	struct size_class *class;
 	struct mapping_area *area;
 
+	BUG_ON(!handle);
+
 	area = &__get_cpu_var(zs_map_area);
 	/* single-page object fastpath */
 	if (area->vm_addr) {
@@ -804,13 +1096,19 @@ void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 	if (area->vm_mm == ZS_MM_RO)
 		goto pfenable;
 
-	BUG_ON(!handle);
-
-	obj_handle_to_location(handle, &page, &obj_idx);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
 
+	/*
+	 * The header was not handed out to the caller, and was not even
+	 * copied in for ZS_MM_WO: restore it before copying back.
+	 */
+	if (!class->huge)
+		*(unsigned long *)area->vm_buf = handle | OBJ_ALLOCATED_TAG;
+
 	zs_copy_unmap_object(area->vm_buf, page, off, class->size);
 
 pfenable:
@@ -818,6 +1116,7 @@ pfenable:
 	pagefault_enable();
 out:
 	put_cpu_var(zs_map_area);
+	unpin_tag(handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
@@ -833,6 +1132,364 @@ u64 zs_get_total_size_bytes(struct zs_pool *pool)
 }
 EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
 
+/* Copy an object of the class from src to dst, both may span two pages */
+static void zs_object_copy(unsigned long dst, unsigned long src,
+				struct size_class *class)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_objidx, d_objidx;
+	unsigned long s_off, d_off;
+	void *s_addr, *d_addr;
+	int s_size, d_size, size;
+	int written = 0;
+
+	s_size = d_size = class->size;
+
+	obj_to_location(src, &s_page, &s_objidx);
+	obj_to_location(dst, &d_page, &d_objidx);
+
+	s_off = obj_idx_to_offset(s_page, s_objidx, class->size);
+	d_off = obj_idx_to_offset(d_page, d_objidx, class->size);
+
+	if (s_off + class->size > PAGE_SIZE)
+		s_size = PAGE_SIZE - s_off;
+
+	if (d_off + class->size > PAGE_SIZE)
+		d_size = PAGE_SIZE - d_off;
+
+	s_addr = kmap_atomic(s_page);
+	d_addr = kmap_atomic(d_page);
+
+	while (1) {
+		size = min(s_size, d_size);
+		memcpy(d_addr + d_off, s_addr + s_off, size);
+		written += size;
+
+		if (written == class->size)
+			break;
+
+		s_off += size;
+		s_size -= size;
+		d_off += size;
+		d_size -= size;
+
+		/* kmap_atomic() mappings must be undone in reverse order */
+		if (s_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			kunmap_atomic(s_addr);
+			s_page = get_next_page(s_page);
+			BUG_ON(!s_page);
+			s_addr = kmap_atomic(s_page);
+			d_addr = kmap_atomic(d_page);
+			s_size = class->size - written;
+			s_off = 0;
+		}
+
+		if (d_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			d_page = get_next_page(d_page);
+			BUG_ON(!d_page);
+			d_addr = kmap_atomic(d_page);
+			d_size = class->size - written;
+			d_off = 0;
+		}
+	}
+
+	kunmap_atomic(d_addr);
+	kunmap_atomic(s_addr);
+}
+
+/*
+ * Find the first allocated object starting in page at or after *index,
+ * and return its handle pinned.  Objects pinned by someone else are
+ * skipped.
+ */
+static unsigned long find_alloced_obj(struct page *page, int *index,
+					struct size_class *class)
+{
+	unsigned long head;
+	int offset = 0;
+	unsigned long handle = 0;
+	void *addr = kmap_atomic(page);
+
+	if (!is_first_page(page))
+		offset = page->index;
+	offset += class->size * *index;
+
+	while (offset < PAGE_SIZE) {
+		if (class->huge)
+			head = page_private(get_first_page(page));
+		else
+			head = *(unsigned long *)(addr + offset);
+
+		if (head & OBJ_ALLOCATED_TAG) {
+			handle = head & ~OBJ_ALLOCATED_TAG;
+			if (trypin_tag(handle))
+				break;
+			handle = 0;
+		}
+
+		offset += class->size;
+		(*index)++;
+	}
+
+	kunmap_atomic(addr);
+	return handle;
+}
+
+struct zs_compact_control {
+	/* Source page for migration which could be a subpage of zspage. */
+	struct page *s_page;
+	/*
+	 * Destination page for migration which should be a first page
+	 * of zspage.
+	 */
+	struct page *d_page;
+	/* Starting object index within @s_page used for live object
+	 * in the subpage. */
+	int index;
+};
+
+/*
+ * Move the objects of cc->s_page and the pages after it into
+ * cc->d_page, until either the source is empty or the destination
+ * is full.  Returns -ENOMEM in the latter case.
+ */
+static int migrate_zspage(struct size_class *class,
+				struct zs_compact_control *cc)
+{
+	unsigned long used_obj, free_obj;
+	unsigned long handle;
+	struct page *s_page = cc->s_page;
+	struct page *d_page = cc->d_page;
+	int index = cc->index;
+	int ret = 0;
+
+	while (1) {
+		handle = find_alloced_obj(s_page, &index, class);
+		if (!handle) {
+			s_page = get_next_page(s_page);
+			if (!s_page)
+				break;
+			index = 0;
+			continue;
+		}
+
+		/* Stop if there is no more space */
+		if (d_page->inuse == d_page->objects) {
+			unpin_tag(handle);
+			ret = -ENOMEM;
+			break;
+		}
+
+		used_obj = handle_to_obj(handle);
+		free_obj = obj_malloc(d_page, class, handle);
+		zs_object_copy(free_obj, used_obj, class);
+		index++;
+		/* Keep the object pinned until its handle is updated */
+		record_obj(handle, free_obj | BIT(HANDLE_PIN_BIT));
+		unpin_tag(handle);
+		obj_free(class, used_obj);
+	}
+
+	/* Remember last position in this iteration */
+	cc->s_page = s_page;
+	cc->index = index;
+
+	return ret;
+}
+
+static struct page *isolate_zspage(struct size_class *class,
+				   enum fullness_group first,
+				   enum fullness_group second)
+{
+	struct page *page;
+
+	page = class->fullness_list[first];
+	if (!page) {
+		page = class->fullness_list[second];
+		if (!page)
+			return NULL;
+		first = second;
+	}
+
+	remove_zspage(page, class, first);
+	return page;
+}
+
+/* The emptiest zspage, to move objects from */
+static struct page *isolate_source_page(struct size_class *class)
+{
+	return isolate_zspage(class, ZS_ALMOST_EMPTY, ZS_ALMOST_FULL);
+}
+
+/* The fullest zspage, to move objects to */
+static struct page *isolate_target_page(struct size_class *class)
+{
+	return isolate_zspage(class, ZS_ALMOST_FULL, ZS_ALMOST_EMPTY);
+}
+
+/*
+ * Put an isolated zspage back on the list matching its fullness, or free
+ * it if it is empty.  Called with class->lock held.
+ */
+static enum fullness_group putback_zspage(struct size_class *class,
+					  struct page *first_page)
+{
+	enum fullness_group fullness;
+
+	BUG_ON(!is_first_page(first_page));
+
+	fullness = get_fullness_group(first_page);
+	insert_zspage(first_page, class, fullness);
+	set_zspage_mapping(first_page, class->index, fullness);
+
+	if (fullness == ZS_EMPTY) {
+		class->pages_allocated -= class->pages_per_zspage;
+		class->obj_allocated -= class->objs_per_zspage;
+		free_zspage(first_page);
+	}
+
+	return fullness;
+}
+
+/*
+ * Number of pages compaction could free in the class, if the objects in
+ * use were packed into as few zspages as possible.
+ */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_wasted;
+
+	obj_wasted = class->obj_allocated - class->obj_used;
+	obj_wasted /= class->objs_per_zspage;
+
+	return obj_wasted * class->pages_per_zspage;
+}
+
+static unsigned long __zs_compact(struct zs_pool *pool,
+				  struct size_class *class)
+{
+	struct zs_compact_control cc;
+	struct page *src_page;
+	struct page *dst_page = NULL;
+	unsigned long freed = 0;
+
+	spin_lock(&class->lock);
+	while ((src_page = isolate_source_page(class))) {
+
+		BUG_ON(!is_first_page(src_page));
+
+		if (!zs_can_compact(class))
+			break;
+
+		cc.index = 0;
+		cc.s_page = src_page;
+
+		while ((dst_page = isolate_target_page(class))) {
+			cc.d_page = dst_page;
+			/*
+			 * If there is no more space in dst_page, try the
+			 * next fullest zspage.
+			 */
+			if (!migrate_zspage(class, &cc))
+				break;
+
+			putback_zspage(class, dst_page);
+		}
+
+		/* Stop if we couldn't find slot */
+		if (dst_page == NULL)
+			break;
+
+		putback_zspage(class, dst_page);
+		if (putback_zspage(class, src_page) == ZS_EMPTY) {
+			freed += class->pages_per_zspage;
+			class->pages_compacted += class->pages_per_zspage;
+		}
+		spin_unlock(&class->lock);
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+
+	if (src_page)
+		putback_zspage(class, src_page);
+
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - move objects out of sparsely used zspages
+ * @pool: pool to compact
+ *
+ * In each size class, move the objects of the emptiest zspages into the
+ * fullest ones, and free the zspages left empty.  Objects that are mapped
+ * or being freed meanwhile are left in place.
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+	struct size_class *class;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--) {
+		class = &pool->size_class[i];
+		/* Objects of huge classes have nowhere to go */
+		if (class->huge)
+			continue;
+		freed += __zs_compact(pool, class);
+	}
+
+	atomic_long_add(freed, &pool->pages_compacted);
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_pool_stats);
+
+static unsigned long zs_shrinker_scan(struct shrinker *shrinker,
+				      struct shrink_control *sc)
+{
+	unsigned long freed;
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+					    shrinker);
+
+	/*
+	 * Compact everything that can be: compaction only moves objects
+	 * within a class, so partial runs would not free much more.
+	 */
+	freed = zs_compact(pool);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+static unsigned long zs_shrinker_count(struct shrinker *shrinker,
+				       struct shrink_control *sc)
+{
+	int i;
+	unsigned long pages_to_free = 0;
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+					    shrinker);
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--) {
+		struct size_class *class = &pool->size_class[i];
+
+		if (class->huge)
+			continue;
+		pages_to_free += zs_can_compact(class);
+	}
+
+	return pages_to_free;
+}
+
 module_init(zs_init);
 module_exit(zs_exit);
 
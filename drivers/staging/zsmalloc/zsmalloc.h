@@ -28,6 +28,11 @@ enum zs_mapmode {
 
 struct zs_pool;
 
+struct zs_pool_stats {
+	/* Pages freed by compaction */
+	unsigned long pages_compacted;
+};
+
 struct zs_pool *zs_create_pool(const char *name, gfp_t flags);
 void zs_destroy_pool(struct zs_pool *pool);
 
@@ -40,4 +45,7 @@ void zs_unmap_object(struct zs_pool *pool, unsigned long handle);
 
 u64 zs_get_total_size_bytes(struct zs_pool *pool);
 
+unsigned long zs_compact(struct zs_pool *pool);
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats);
+
 #endif
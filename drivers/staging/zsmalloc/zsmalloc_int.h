@@ -16,6 +16,7 @@
 #include <linux/kernel.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/shrinker.h>
 
 /*
  * This must be power of 2 and greater than of equal to sizeof(link_free).
@@ -34,13 +35,24 @@
 
 /*
  * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (void *) handle value.
+ * as single (void *) value, the 'obj'.
  *
  * Note that object index <obj_idx> is relative to system
  * page <PFN> it is stored in, so for each sub-page belonging
  * to a zspage, obj_idx starts with 0.
  *
  * This is made more complicated by various memory models and PAE.
+ *
+ * The handle returned by zs_malloc() is the address of a word holding
+ * the obj, so that compaction can move the object by updating that word.
+ * The lowest bit of the word is a lock pinning the object in place, taken
+ * while the object is mapped or freed.
+ *
+ * The first word of an allocated object holds its handle, tagged with
+ * OBJ_ALLOCATED_TAG, so that compaction can tell allocated objects from
+ * free ones, whose first word is a link_free with that bit clear.  Objects
+ * of huge classes (one object per zspage) keep the handle in
+ * first_page->private instead.
  */
 
 #ifndef MAX_PHYSMEM_BITS
@@ -55,9 +67,14 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_TAG_BITS	1
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
+#define OBJ_ALLOCATED_TAG	1
+#define HANDLE_PIN_BIT		0
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 /* ZS_MIN_ALLOC_SIZE must be multiple of ZS_ALIGN */
 #define ZS_MIN_ALLOC_SIZE \
@@ -125,11 +142,18 @@ struct size_class {
 
 	/* Number of PAGE_SIZE sized pages to combine to form a 'zspage' */
 	int pages_per_zspage;
+	/* Number of objects a zspage can hold */
+	int objs_per_zspage;
+	/* Only one object per zspage: handle kept in first_page->private */
+	bool huge;
 
 	spinlock_t lock;
 
-	/* stats */
+	/* stats, protected by lock */
 	u64 pages_allocated;
+	unsigned long obj_allocated;	/* objects in the class' zspages */
+	unsigned long obj_used;		/* objects in use */
+	unsigned long pages_compacted;	/* pages freed by compaction */
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
@@ -137,12 +161,17 @@ struct size_class {
 /*
  * Placed within free objects to form a singly linked list.
  * For every zspage, first_page->freelist gives head of this list.
+ * Allocated objects keep their tagged handle in the same place.
  *
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* obj of next free chunk (encodes <PFN, obj_idx>) */
+		void *next;
+		/* Handle of allocated object, with OBJ_ALLOCATED_TAG */
+		unsigned long handle;
+	};
 };
 
 struct zs_pool {
@@ -150,6 +179,15 @@ struct zs_pool {
 
 	gfp_t flags;	/* allocation flags used when growing pool */
 	const char *name;
+
+	/* Compaction under memory pressure */
+	struct shrinker shrinker;
+	/* Total pages freed by compaction */
+	atomic_long_t pages_compacted;
+
+#ifdef CONFIG_ZSMALLOC_STAT
+	struct dentry *stat_dentry;
+#endif
 };
 
 #endif
@@ -27,6 +27,7 @@
 #include <linux/mempool.h>
 #include <linux/workqueue.h>
 #include <linux/cgroup.h>
+#include <linux/memcontrol.h>
 #include <scsi/sg.h>		/* for struct sg_iovec */
 
 #include <trace/events/block.h>
@@ -1680,16 +1681,34 @@ int bio_associate_current(struct bio *bio)
 	get_io_context_active(ioc);
 	bio->bi_ioc = ioc;
 
-	/* associate blkcg if exists */
+	/* associate blkcg if exists and @bio has none yet */
 	rcu_read_lock();
 	css = task_subsys_state(current, blkio_subsys_id);
-	if (css && css_tryget(css))
+	if (!bio->bi_css && css && css_tryget(css))
 		bio->bi_css = css;
 	rcu_read_unlock();
 
 	return 0;
 }
 
+/**
+ * bio_associate_page_blkcg - associate a bio with the owner of its pages
+ * @bio: target bio
+ *
+ * Writeback of dirty pages is mostly issued by the flusher threads, long
+ * after the pages were dirtied.  Associate @bio with the blkcg of the
+ * cgroup its first page is charged to, if the memory and blkio
+ * controllers are mounted together, so that the I/O is accounted to the
+ * cgroup that dirtied the data rather than to whoever writes it out.
+ */
+void bio_associate_page_blkcg(struct bio *bio)
+{
+	if (bio->bi_css || !bio->bi_vcnt)
+		return;
+
+	bio->bi_css = mem_cgroup_page_blkcg_css(bio_page(bio));
+}
+
 /**
  * bio_disassociate_task - undo bio_associate_current()
  * @bio: target bio
@@ -26,6 +26,7 @@
 #include <linux/writeback.h>
 #include <linux/blkdev.h>
 #include <linux/backing-dev.h>
+#include <linux/memcontrol.h>
 #include <linux/tracepoint.h>
 #include "internal.h"
 
@@ -46,6 +47,7 @@ struct wb_writeback_work {
 	unsigned int for_kupdate:1;
 	unsigned int range_cyclic:1;
 	unsigned int for_background:1;
+	unsigned short memcg_id;	/* only inodes this memcg dirtied */
 	enum wb_reason reason;		/* why was writeback initiated? */
 
 	struct list_head list;		/* pending work list */
@@ -182,6 +184,46 @@ void bdi_start_background_writeback(struct backing_dev_info *bdi)
 	spin_unlock_bh(&bdi->wb_lock);
 }
 
+/**
+ * bdi_start_memcg_writeback - start background writeback for a memcg
+ * @bdi: the backing device to write from
+ * @memcg_id: css id of the memory cgroup
+ *
+ * Description:
+ *   Queue background writeback of the inodes dirtied by the memcg, which
+ *   goes on for as long as the memcg is over its background dirty
+ *   threshold.  Nothing is queued if such work is pending already.
+ */
+void bdi_start_memcg_writeback(struct backing_dev_info *bdi,
+			       unsigned short memcg_id)
+{
+	struct wb_writeback_work *work;
+
+	spin_lock_bh(&bdi->wb_lock);
+	list_for_each_entry(work, &bdi->work_list, list) {
+		if (work->for_background && work->memcg_id == memcg_id) {
+			spin_unlock_bh(&bdi->wb_lock);
+			return;
+		}
+	}
+	spin_unlock_bh(&bdi->wb_lock);
+
+	work = kzalloc(sizeof(*work), GFP_ATOMIC);
+	if (!work) {
+		bdi_start_background_writeback(bdi);
+		return;
+	}
+
+	work->sync_mode	= WB_SYNC_NONE;
+	work->nr_pages	= LONG_MAX;
+	work->range_cyclic = 1;
+	work->for_background = 1;
+	work->memcg_id	= memcg_id;
+	work->reason	= WB_REASON_BACKGROUND;
+
+	bdi_queue_work(bdi, work);
+}
+
 /*
  * Remove the inode from the writeback list it is on.
  */
@@ -250,7 +292,8 @@ static bool inode_dirtied_after(struct inode *inode, unsigned long t)
 
 /*
  * Move expired (dirtied after work->older_than_this) dirty inodes from
- * @delaying_queue to @dispatch_queue.
+ * @delaying_queue to @dispatch_queue.  Work for a memcg leaves the inodes
+ * dirtied by other memcgs behind.
  */
 static int move_expired_inodes(struct list_head *delaying_queue,
 			       struct list_head *dispatch_queue,
@@ -263,11 +306,15 @@ static int move_expired_inodes(struct list_head *delaying_queue,
 	int do_sb_sort = 0;
 	int moved = 0;
 
-	while (!list_empty(delaying_queue)) {
-		inode = wb_inode(delaying_queue->prev);
+	list_for_each_prev_safe(pos, node, delaying_queue) {
+		inode = wb_inode(pos);
 		if (work->older_than_this &&
 		    inode_dirtied_after(inode, *work->older_than_this))
 			break;
+		if (work->memcg_id &&
+		    !mem_cgroup_mapping_dirtied_by(inode->i_mapping,
+						   work->memcg_id))
+			continue;
 		if (sb && sb != inode->i_sb)
 			do_sb_sort = 1;
 		sb = inode->i_sb;
@@ -753,10 +800,18 @@ long writeback_inodes_wb(struct bdi_writeback *wb, long nr_pages,
 	return nr_pages - work.nr_pages;
 }
 
-static bool over_bground_thresh(struct backing_dev_info *bdi)
+static bool over_bground_thresh(struct backing_dev_info *bdi,
+				unsigned short memcg_id)
 {
 	unsigned long background_thresh, dirty_thresh;
 
+	if (memcg_id) {
+		struct mem_cgroup_dirty_info info;
+
+		return memcg_dirty_info(memcg_id, &info) &&
+		       info.nr_file_dirty > info.background_thresh;
+	}
+
 	global_dirty_limits(&background_thresh, &dirty_thresh);
 
 	if (global_page_state(NR_FILE_DIRTY) +
@@ -827,9 +882,10 @@ static long wb_writeback(struct bdi_writeback *wb,
 
 		/*
 		 * For background writeout, stop when we are below the
-		 * background dirty threshold
+		 * background dirty threshold, the memcg's one for memcg work
 		 */
-		if (work->for_background && !over_bground_thresh(wb->bdi))
+		if (work->for_background &&
+		    !over_bground_thresh(wb->bdi, work->memcg_id))
 			break;
 
 		/*
@@ -921,7 +977,7 @@ static unsigned long get_nr_dirty_pages(void)
 
 static long wb_check_background_flush(struct bdi_writeback *wb)
 {
-	if (over_bground_thresh(wb->bdi)) {
+	if (over_bground_thresh(wb->bdi, 0)) {
 
 		struct wb_writeback_work work = {
 			.nr_pages	= LONG_MAX,
@@ -25,6 +25,7 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/uio.h>
+#include <linux/list_lru.h>
 
 /*
  *	Base types
@@ -92,9 +93,7 @@ typedef struct xfs_buftarg {
 
 	/* LRU control structures */
 	struct shrinker		bt_shrinker;
-	struct list_head	bt_lru;
-	spinlock_t		bt_lru_lock;
-	unsigned int		bt_lru_nr;
+	struct list_lru		bt_lru;
 } xfs_buftarg_t;
 
 struct xfs_buf;
@@ -127,10 +126,11 @@ typedef struct xfs_buf {
 	struct semaphore	b_sema;		/* semaphore for lockables */
 
 	/*
-	 * concurrent access to b_lru and b_lru_flags are protected by
-	 * bt_lru_lock and not by b_sema
+	 * concurrent access to b_lru_flags is protected by b_lock and not
+	 * by b_sema; b_lru itself is protected by the bt_lru list lock
 	 */
 	struct list_head	b_lru;		/* lru list */
+	spinlock_t		b_lock;		/* internal state lock */
 	xfs_buf_flags_t		b_lru_flags;	/* internal lru status flags */
 	wait_queue_head_t	b_waiters;	/* unpin waiters */
 	struct list_head	b_list;
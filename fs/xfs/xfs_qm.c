@@ -49,7 +49,10 @@
  */
 STATIC int	xfs_qm_init_quotainos(xfs_mount_t *);
 STATIC int	xfs_qm_init_quotainfo(xfs_mount_t *);
-STATIC int	xfs_qm_shake(struct shrinker *, struct shrink_control *);
+STATIC unsigned long xfs_qm_shrink_count(struct shrinker *,
+					 struct shrink_control *);
+STATIC unsigned long xfs_qm_shrink_scan(struct shrinker *,
+					struct shrink_control *);
 
 /*
  * We use the batch lookup interface to iterate over the dquots as it
@@ -715,7 +718,8 @@ xfs_qm_init_quotainfo(
 		qinf->qi_rtbwarnlimit = XFS_QM_RTBWARNLIMIT;
 	}
 
-	qinf->qi_shrinker.shrink = xfs_qm_shake;
+	qinf->qi_shrinker.count_objects = xfs_qm_shrink_count;
+	qinf->qi_shrinker.scan_objects = xfs_qm_shrink_scan;
 	qinf->qi_shrinker.seeks = DEFAULT_SEEKS;
 	register_shrinker(&qinf->qi_shrinker);
 	return 0;
@@ -1527,23 +1531,22 @@ out_busy:
 	XFS_STATS_INC(xs_qm_dqreclaim_misses);
 }
 
-STATIC int
-xfs_qm_shake(
+STATIC unsigned long
+xfs_qm_shrink_scan(
 	struct shrinker		*shrink,
 	struct shrink_control	*sc)
 {
 	struct xfs_quotainfo	*qi =
 		container_of(shrink, struct xfs_quotainfo, qi_shrinker);
-	int			nr_to_scan = sc->nr_to_scan;
+	long			nr_to_scan = sc->nr_to_scan;
+	unsigned long		freed = 0;
 	LIST_HEAD		(buffer_list);
 	LIST_HEAD		(dispose_list);
 	struct xfs_dquot	*dqp;
 	int			error;
 
 	if ((sc->gfp_mask & (__GFP_FS|__GFP_WAIT)) != (__GFP_FS|__GFP_WAIT))
-		return 0;
-	if (!nr_to_scan)
-		goto out;
+		return SHRINK_STOP;
 
 	mutex_lock(&qi->qi_lru_lock);
 	while (!list_empty(&qi->qi_lru_list)) {
@@ -1563,9 +1566,20 @@ xfs_qm_shake(
 		dqp = list_first_entry(&dispose_list, struct xfs_dquot, q_lru);
 		list_del_init(&dqp->q_lru);
 		xfs_qm_dqfree_one(dqp);
+		freed++;
 	}
 
-out:
+	return freed;
+}
+
+STATIC unsigned long
+xfs_qm_shrink_count(
+	struct shrinker		*shrink,
+	struct shrink_control	*sc)
+{
+	struct xfs_quotainfo	*qi =
+		container_of(shrink, struct xfs_quotainfo, qi_shrinker);
+
 	return (qi->qi_lru_count / 100) * sysctl_vfs_cache_pressure;
 }
 
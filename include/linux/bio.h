@@ -271,9 +271,11 @@ extern unsigned int bvec_nr_vecs(unsigned short idx);
 
 #ifdef CONFIG_BLK_CGROUP
 int bio_associate_current(struct bio *bio);
+void bio_associate_page_blkcg(struct bio *bio);
 void bio_disassociate_task(struct bio *bio);
 #else	/* CONFIG_BLK_CGROUP */
 static inline int bio_associate_current(struct bio *bio) { return -ENOENT; }
+static inline void bio_associate_page_blkcg(struct bio *bio) { }
 static inline void bio_disassociate_task(struct bio *bio) { }
 #endif	/* CONFIG_BLK_CGROUP */
 
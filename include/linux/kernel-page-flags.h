@@ -31,6 +31,7 @@
 
 #define KPF_KSM			21
 #define KPF_THP			22
+#define KPF_IDLE		23
 
 #ifdef __KERNEL__
 
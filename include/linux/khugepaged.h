@@ -46,6 +46,15 @@ static inline int khugepaged_enter(struct vm_area_struct *vma)
 				return -ENOMEM;
 	return 0;
 }
+
+/* shared shmem follows its own huge policy: see shmem_huge_enabled() */
+static inline int khugepaged_enter_shmem(struct vm_area_struct *vma)
+{
+	if (!test_bit(MMF_VM_HUGEPAGE, &vma->vm_mm->flags))
+		if (__khugepaged_enter(vma->vm_mm))
+			return -ENOMEM;
+	return 0;
+}
 #else /* CONFIG_TRANSPARENT_HUGEPAGE */
 static inline int khugepaged_fork(struct mm_struct *mm, struct mm_struct *oldmm)
 {
@@ -62,6 +71,10 @@ static inline int khugepaged_enter_vma_merge(struct vm_area_struct *vma)
 {
 	return 0;
 }
+static inline int khugepaged_enter_shmem(struct vm_area_struct *vma)
+{
+	return 0;
+}
 #endif /* CONFIG_TRANSPARENT_HUGEPAGE */
 
 #endif /* _LINUX_KHUGEPAGED_H */
@@ -23,13 +23,24 @@
 #include <linux/vm_event_item.h>
 
 struct mem_cgroup;
-struct page_cgroup;
 struct page;
+struct address_space;
 struct mm_struct;
 
 /* Stats that can be updated by kernel. */
 enum mem_cgroup_page_stat_item {
 	MEMCG_NR_FILE_MAPPED, /* # of pages charged as file rss */
+	MEMCG_NR_FILE_DIRTY, /* # of dirty pages in page cache */
+	MEMCG_NR_FILE_WRITEBACK, /* # of pages under writeback */
+};
+
+/* Dirty limits of a memcg and its dirty page counts, in pages */
+struct mem_cgroup_dirty_info {
+	unsigned long dirty_thresh;
+	unsigned long background_thresh;
+	unsigned long nr_file_dirty;
+	unsigned long nr_writeback;
+	unsigned short id;		/* css id of the memcg */
 };
 
 struct mem_cgroup_reclaim_cookie {
@@ -177,6 +188,16 @@ static inline void mem_cgroup_dec_page_stat(struct page *page,
 	mem_cgroup_update_page_stat(page, idx, -1);
 }
 
+bool mem_cgroup_dirty_info(unsigned long sys_available, unsigned short id,
+			   struct mem_cgroup_dirty_info *info);
+void mem_cgroup_mark_mapping_dirty(struct address_space *mapping,
+				   struct page *page);
+bool mem_cgroup_mapping_dirtied_by(struct address_space *mapping,
+				   unsigned short id);
+#ifdef CONFIG_BLK_CGROUP
+struct cgroup_subsys_state *mem_cgroup_page_blkcg_css(struct page *page);
+#endif
+
 unsigned long mem_cgroup_soft_limit_reclaim(struct zone *zone, int order,
 						gfp_t gfp_mask,
 						unsigned long *total_scanned);
@@ -354,6 +375,24 @@ static inline void mem_cgroup_dec_page_stat(struct page *page,
 {
 }
 
+static inline bool
+mem_cgroup_dirty_info(unsigned long sys_available, unsigned short id,
+		      struct mem_cgroup_dirty_info *info)
+{
+	return false;
+}
+
+static inline void mem_cgroup_mark_mapping_dirty(struct address_space *mapping,
+						 struct page *page)
+{
+}
+
+static inline bool
+mem_cgroup_mapping_dirtied_by(struct address_space *mapping, unsigned short id)
+{
+	return true;
+}
+
 static inline
 unsigned long mem_cgroup_soft_limit_reclaim(struct zone *zone, int order,
 					    gfp_t gfp_mask,
@@ -376,6 +415,14 @@ static inline void mem_cgroup_replace_page_cache(struct page *oldpage,
 }
 #endif /* CONFIG_MEMCG */
 
+#if !defined(CONFIG_MEMCG) && defined(CONFIG_BLK_CGROUP)
+static inline struct cgroup_subsys_state *
+mem_cgroup_page_blkcg_css(struct page *page)
+{
+	return NULL;
+}
+#endif
+
 #if !defined(CONFIG_MEMCG) || !defined(CONFIG_DEBUG_VM)
 static inline bool
 mem_cgroup_bad_page_check(struct page *page)
@@ -9,6 +9,7 @@
 #include <linux/prio_tree.h>
 #include <linux/rbtree.h>
 #include <linux/rwsem.h>
+#include <linux/seqlock.h>
 #include <linux/completion.h>
 #include <linux/cpumask.h>
 #include <linux/page-debug-flags.h>
@@ -151,6 +152,15 @@ struct page {
 		struct page *first_page;	/* Compound tail pages */
 	};
 
+#ifdef CONFIG_MEMCG
+	/*
+	 * The mem_cgroup the page is charged to, with PCG_* flags in
+	 * the low bits: see mm/memcontrol.c.  With double word aligned
+	 * struct pages, this fits in the padding after private.
+	 */
+	unsigned long memcg_data;
+#endif
+
 	/*
 	 * On machines where all RAM is mapped into kernel address space,
 	 * we can simply calculate the virtual address. On machines with
@@ -224,6 +234,16 @@ struct vm_region {
  * space that has a special rule for the page-fault handlers (ie a shared
  * library, the executable area etc).
  */
+#ifdef CONFIG_USERFAULTFD
+#define NULL_VM_UFFD_CTX ((struct vm_userfaultfd_ctx) { NULL, })
+struct vm_userfaultfd_ctx {
+	struct userfaultfd_ctx *ctx;
+};
+#else /* CONFIG_USERFAULTFD */
+#define NULL_VM_UFFD_CTX ((struct vm_userfaultfd_ctx) {})
+struct vm_userfaultfd_ctx {};
+#endif /* CONFIG_USERFAULTFD */
+
 struct vm_area_struct {
 	struct mm_struct * vm_mm;	/* The address space we belong to. */
 	unsigned long vm_start;		/* Our start address within vm_mm. */
@@ -278,6 +298,18 @@ struct vm_area_struct {
 #endif
 #ifdef CONFIG_NUMA
 	struct mempolicy *vm_policy;	/* NUMA policy for the VMA */
+#endif
+	struct vm_userfaultfd_ctx vm_userfaultfd_ctx;
+#ifdef CONFIG_SWAP
+	atomic_long_t swap_readahead_info; /* see swap_vma_readahead() */
+#endif
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	/*
+	 * Odd while the fields above are changed under mmap_sem, and left
+	 * odd once the vma is unmapped: see handle_speculative_fault().
+	 */
+	seqcount_t vm_sequence;
+	atomic_t vm_ref_count;		/* see get_vma()/put_vma() */
 #endif
 };
 
@@ -315,6 +347,10 @@ struct mm_rss_stat {
 struct mm_struct {
 	struct vm_area_struct * mmap;		/* list of VMAs */
 	struct rb_root mm_rb;
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	rwlock_t mm_rb_lock;			/* mm_rb writers vs get_vma() */
+	seqcount_t mm_seq;			/* odd while mremap moves ptes */
+#endif
 	struct vm_area_struct * mmap_cache;	/* last find_vma result */
 #ifdef CONFIG_MMU
 	unsigned long (*get_unmapped_area) (struct file *filp,
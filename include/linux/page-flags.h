@@ -53,6 +53,11 @@
  * PG_hwpoison indicates that a page got corrupted in hardware and contains
  * data with incorrect ECC bits that triggered a machine check. Accessing is
  * not safe since it may cause another machine check. Don't touch!
+ *
+ * PG_idle is set on a page through /sys/kernel/mm/page_idle/bitmap, and
+ * cleared whenever the page is accessed.  PG_young records that idle page
+ * tracking cleared the young bit of a pte mapping the page, so that
+ * page_referenced() still sees that reference (see mm/page_idle.c).
  */
 
 /*
@@ -108,6 +113,11 @@ enum pageflags {
 #endif
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 	PG_compound_lock,
+	PG_team,		/* shmem page of a huge page sized team */
+#endif
+#ifdef CONFIG_IDLE_PAGE_TRACKING
+	PG_young,		/* pte young bit cleared by idle tracking */
+	PG_idle,		/* Not accessed since marked idle */
 #endif
 	__NR_PAGEFLAGS,
 
@@ -228,9 +238,10 @@ PAGEFLAG(OwnerPriv1, owner_priv_1) TESTCLEARFLAG(OwnerPriv1, owner_priv_1)
 TESTPAGEFLAG(Writeback, writeback) TESTSCFLAG(Writeback, writeback)
 PAGEFLAG(MappedToDisk, mappedtodisk)
 
-/* PG_readahead is only used for file reads; PG_reclaim is only for writes */
+/* PG_readahead is only used for reads; PG_reclaim is only for writes */
 PAGEFLAG(Reclaim, reclaim) TESTCLEARFLAG(Reclaim, reclaim)
-PAGEFLAG(Readahead, reclaim)		/* Reminder to do async read-ahead */
+PAGEFLAG(Readahead, reclaim) TESTCLEARFLAG(Readahead, reclaim)
+					/* Reminder to do async read-ahead */
 
 #ifdef CONFIG_HIGHMEM
 /*
@@ -266,6 +277,14 @@ PAGEFLAG(Uncached, uncached)
 PAGEFLAG_FALSE(Uncached)
 #endif
 
+#ifdef CONFIG_IDLE_PAGE_TRACKING
+PAGEFLAG(Young, young) TESTCLEARFLAG(Young, young)
+PAGEFLAG(Idle, idle)
+#else
+PAGEFLAG_FALSE(Young) SETPAGEFLAG_NOOP(Young) TESTCLEARFLAG_FALSE(Young)
+PAGEFLAG_FALSE(Idle) SETPAGEFLAG_NOOP(Idle) CLEARPAGEFLAG_NOOP(Idle)
+#endif
+
 #ifdef CONFIG_MEMORY_FAILURE
 PAGEFLAG(HWPoison, hwpoison)
 TESTSCFLAG(HWPoison, hwpoison)
@@ -436,8 +455,18 @@ static inline int PageTransTail(struct page *page)
 	return PageTail(page);
 }
 
+/*
+ * PageTeam is set on the small pages of a huge page allocated for the
+ * shmem page cache and split up there, for as long as they stay in the
+ * page cache: while all HPAGE_PMD_NR of them are present, they may be
+ * mapped together by a huge pmd.
+ */
+PAGEFLAG(Team, team)
+
 #else
 
+PAGEFLAG_FALSE(Team) SETPAGEFLAG_NOOP(Team) CLEARPAGEFLAG_NOOP(Team)
+
 static inline int PageTransHuge(struct page *page)
 {
 	return 0;
@@ -221,7 +221,8 @@ void page_unlock_anon_vma(struct anon_vma *anon_vma);
 int page_mapped_in_vma(struct page *page, struct vm_area_struct *vma);
 
 /*
- * Called by migrate.c to remove migration ptes, but might be used more later.
+ * Called by migrate.c to remove migration ptes, and by page_idle.c to
+ * clear the young bits of the ptes mapping a page.
  */
 int rmap_walk(struct page *page, int (*rmap_one)(struct page *,
 		struct vm_area_struct *, unsigned long, void *), void *arg);
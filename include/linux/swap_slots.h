@@ -0,0 +1,32 @@
+/*
+ * Per-cpu caches of swap slots: allocation and freeing of swap entries
+ * in batches, to keep swap_lock off the swap out and swap in paths.
+ */
+#ifndef _LINUX_SWAP_SLOTS_H
+#define _LINUX_SWAP_SLOTS_H
+
+#include <linux/swap.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+
+#define SWAP_SLOTS_CACHE_SIZE			64
+#define THRESHOLD_ACTIVATE_SWAP_SLOTS_CACHE	(5 * SWAP_SLOTS_CACHE_SIZE)
+#define THRESHOLD_DEACTIVATE_SWAP_SLOTS_CACHE	(2 * SWAP_SLOTS_CACHE_SIZE)
+
+struct swap_slots_cache {
+	struct mutex	alloc_lock;	/* protects slots, nr, cur */
+	swp_entry_t	slots[SWAP_SLOTS_CACHE_SIZE];
+	int		nr;
+	int		cur;
+	spinlock_t	free_lock;	/* protects slots_ret, n_ret */
+	swp_entry_t	slots_ret[SWAP_SLOTS_CACHE_SIZE];
+	int		n_ret;
+};
+
+extern bool swap_slot_cache_enabled;
+
+void disable_swap_slots_cache_lock(void);
+void reenable_swap_slots_cache_unlock(void);
+void free_swap_slot(swp_entry_t entry);
+
+#endif /* _LINUX_SWAP_SLOTS_H */
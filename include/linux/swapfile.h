@@ -9,5 +9,6 @@ extern spinlock_t swap_lock;
 extern struct swap_list_t swap_list;
 extern struct swap_info_struct *swap_info[];
 extern int try_to_unuse(unsigned int, bool, unsigned long);
+extern atomic_t nr_rotate_swap;
 
 #endif /* _LINUX_SWAPFILE_H */
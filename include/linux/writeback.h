@@ -148,7 +148,9 @@ struct ctl_table;
 int dirty_writeback_centisecs_handler(struct ctl_table *, int,
 				      void __user *, size_t *, loff_t *);
 
+struct mem_cgroup_dirty_info;
 void global_dirty_limits(unsigned long *pbackground, unsigned long *pdirty);
+bool memcg_dirty_info(unsigned short id, struct mem_cgroup_dirty_info *info);
 unsigned long bdi_dirty_limit(struct backing_dev_info *bdi,
 			       unsigned long dirty);
 
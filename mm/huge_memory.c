@@ -17,6 +17,9 @@
 #include <linux/khugepaged.h>
 #include <linux/freezer.h>
 #include <linux/mman.h>
+#include <linux/file.h>
+#include <linux/shmem_fs.h>
+#include <linux/userfaultfd_k.h>
 #include <asm/tlb.h>
 #include <asm/pgalloc.h>
 #include "internal.h"
@@ -36,7 +39,8 @@ unsigned long transparent_hugepage_flags __read_mostly =
 	(1<<TRANSPARENT_HUGEPAGE_REQ_MADV_FLAG)|
 #endif
 	(1<<TRANSPARENT_HUGEPAGE_DEFRAG_FLAG)|
-	(1<<TRANSPARENT_HUGEPAGE_DEFRAG_KHUGEPAGED_FLAG);
+	(1<<TRANSPARENT_HUGEPAGE_DEFRAG_KHUGEPAGED_FLAG)|
+	(1<<TRANSPARENT_HUGEPAGE_USE_ZERO_PAGE_FLAG);
 
 /* default scan 8*512 pte (or vmas) every 30 second */
 static unsigned int khugepaged_pages_to_scan __read_mostly = HPAGE_PMD_NR*8;
@@ -135,6 +139,88 @@ static int set_recommended_min_free_kbytes(void)
 }
 late_initcall(set_recommended_min_free_kbytes);
 
+/*
+ * The huge zero page is allocated on first use, and mapped read-only by
+ * every huge pmd faulted by a read in an anonymous mapping.  Each such
+ * pmd holds a reference on it, and huge_zero_refcount holds one more of
+ * its own, which only the shrinker drops when the others have gone.
+ */
+static atomic_t huge_zero_refcount;
+static unsigned long huge_zero_pfn __read_mostly;
+
+static inline bool is_huge_zero_pfn(unsigned long pfn)
+{
+	unsigned long zero_pfn = ACCESS_ONCE(huge_zero_pfn);
+	return zero_pfn && pfn == zero_pfn;
+}
+
+bool is_huge_zero_pmd(pmd_t pmd)
+{
+	return is_huge_zero_pfn(pmd_pfn(pmd));
+}
+
+static unsigned long get_huge_zero_page(void)
+{
+	struct page *zero_page;
+retry:
+	if (likely(atomic_inc_not_zero(&huge_zero_refcount)))
+		return ACCESS_ONCE(huge_zero_pfn);
+
+	zero_page = alloc_pages((GFP_TRANSHUGE | __GFP_ZERO) & ~__GFP_MOVABLE,
+			HPAGE_PMD_ORDER);
+	if (!zero_page) {
+		count_vm_event(THP_ZERO_PAGE_ALLOC_FAILED);
+		return 0;
+	}
+	count_vm_event(THP_ZERO_PAGE_ALLOC);
+	preempt_disable();
+	if (cmpxchg(&huge_zero_pfn, 0, page_to_pfn(zero_page))) {
+		preempt_enable();
+		__free_pages(zero_page, HPAGE_PMD_ORDER);
+		goto retry;
+	}
+
+	/* We take an additional reference here: the shrinker puts it back */
+	atomic_set(&huge_zero_refcount, 2);
+	preempt_enable();
+	return ACCESS_ONCE(huge_zero_pfn);
+}
+
+static void put_huge_zero_page(void)
+{
+	/*
+	 * Counter should never go to zero here. Only the shrinker can put
+	 * the last reference.
+	 */
+	BUG_ON(atomic_dec_and_test(&huge_zero_refcount));
+}
+
+static unsigned long shrink_huge_zero_page_count(struct shrinker *shrink,
+						 struct shrink_control *sc)
+{
+	/* we can free the zero page only if the last reference remains */
+	return atomic_read(&huge_zero_refcount) == 1 ? HPAGE_PMD_NR : 0;
+}
+
+static unsigned long shrink_huge_zero_page_scan(struct shrinker *shrink,
+						struct shrink_control *sc)
+{
+	if (atomic_cmpxchg(&huge_zero_refcount, 1, 0) == 1) {
+		unsigned long zero_pfn = xchg(&huge_zero_pfn, 0);
+		BUG_ON(zero_pfn == 0);
+		__free_pages(pfn_to_page(zero_pfn), HPAGE_PMD_ORDER);
+		return HPAGE_PMD_NR;
+	}
+
+	return 0;
+}
+
+static struct shrinker huge_zero_page_shrinker = {
+	.count_objects = shrink_huge_zero_page_count,
+	.scan_objects = shrink_huge_zero_page_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
 static int start_khugepaged(void)
 {
 	int err = 0;
@@ -294,6 +380,21 @@ static ssize_t defrag_store(struct kobject *kobj,
 static struct kobj_attribute defrag_attr =
 	__ATTR(defrag, 0644, defrag_show, defrag_store);
 
+static ssize_t use_zero_page_show(struct kobject *kobj,
+		struct kobj_attribute *attr, char *buf)
+{
+	return single_flag_show(kobj, attr, buf,
+				TRANSPARENT_HUGEPAGE_USE_ZERO_PAGE_FLAG);
+}
+static ssize_t use_zero_page_store(struct kobject *kobj,
+		struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	return single_flag_store(kobj, attr, buf, count,
+				 TRANSPARENT_HUGEPAGE_USE_ZERO_PAGE_FLAG);
+}
+static struct kobj_attribute use_zero_page_attr =
+	__ATTR(use_zero_page, 0644, use_zero_page_show, use_zero_page_store);
+
 #ifdef CONFIG_DEBUG_VM
 static ssize_t debug_cow_show(struct kobject *kobj,
 				struct kobj_attribute *attr, char *buf)
@@ -315,8 +416,12 @@ static struct kobj_attribute debug_cow_attr =
 static struct attribute *hugepage_attr[] = {
 	&enabled_attr.attr,
 	&defrag_attr.attr,
+	&use_zero_page_attr.attr,
 #ifdef CONFIG_DEBUG_VM
 	&debug_cow_attr.attr,
+#endif
+#ifdef CONFIG_SHMEM
+	&shmem_enabled_attr.attr,
 #endif
 	NULL,
 };
@@ -568,6 +673,8 @@ static int __init hugepage_init(void)
 	if (totalram_pages < (512 << (20 - PAGE_SHIFT)))
 		transparent_hugepage_flags = 0;
 
+	register_shrinker(&huge_zero_page_shrinker);
+
 	start_khugepaged();
 
 	set_recommended_min_free_kbytes();
@@ -674,6 +781,24 @@ static int __do_huge_pmd_anonymous_page(struct mm_struct *mm,
 	return 0;
 }
 
+static bool set_huge_zero_page(pgtable_t pgtable, struct mm_struct *mm,
+		struct vm_area_struct *vma, unsigned long haddr, pmd_t *pmd,
+		unsigned long zero_pfn)
+{
+	pmd_t entry;
+
+	assert_spin_locked(&mm->page_table_lock);
+	if (!pmd_none(*pmd))
+		return false;
+	entry = pfn_pmd(zero_pfn, vma->vm_page_prot);
+	entry = pmd_wrprotect(entry);
+	entry = pmd_mkhuge(entry);
+	set_pmd_at(mm, haddr, pmd, entry);
+	prepare_pmd_huge_pte(pgtable, mm);
+	mm->nr_ptes++;
+	return true;
+}
+
 static inline gfp_t alloc_hugepage_gfpmask(int defrag, gfp_t extra_gfp)
 {
 	return (GFP_TRANSHUGE & ~(defrag ? 0 : __GFP_WAIT)) | extra_gfp;
@@ -704,11 +829,38 @@ int do_huge_pmd_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	unsigned long haddr = address & HPAGE_PMD_MASK;
 	pte_t *pte;
 
-	if (haddr >= vma->vm_start && haddr + HPAGE_PMD_SIZE <= vma->vm_end) {
+	/* Leave missing pages of userfaultfd ranges to do_anonymous_page() */
+	if (haddr >= vma->vm_start && haddr + HPAGE_PMD_SIZE <= vma->vm_end &&
+	    !userfaultfd_missing(vma)) {
 		if (unlikely(anon_vma_prepare(vma)))
 			return VM_FAULT_OOM;
 		if (unlikely(khugepaged_enter(vma)))
 			return VM_FAULT_OOM;
+		if (!(flags & FAULT_FLAG_WRITE) &&
+		    transparent_hugepage_use_zero_page()) {
+			pgtable_t pgtable;
+			unsigned long zero_pfn;
+			bool set;
+
+			pgtable = pte_alloc_one(mm, haddr);
+			if (unlikely(!pgtable))
+				return VM_FAULT_OOM;
+			zero_pfn = get_huge_zero_page();
+			if (unlikely(!zero_pfn)) {
+				pte_free(mm, pgtable);
+				count_vm_event(THP_FAULT_FALLBACK);
+				goto out;
+			}
+			spin_lock(&mm->page_table_lock);
+			set = set_huge_zero_page(pgtable, mm, vma, haddr, pmd,
+						 zero_pfn);
+			spin_unlock(&mm->page_table_lock);
+			if (!set) {
+				pte_free(mm, pgtable);
+				put_huge_zero_page();
+			}
+			return 0;
+		}
 		page = alloc_hugepage_vma(transparent_hugepage_defrag(vma),
 					  vma, haddr, numa_node_id(), 0);
 		if (unlikely(!page)) {
@@ -759,6 +911,13 @@ int copy_huge_pmd(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 	pgtable_t pgtable;
 	int ret;
 
+	/*
+	 * A team of shmem pages is not copied: the child faults it in
+	 * again, as it would the ptes of any other shared mapping.
+	 */
+	if (vma->vm_ops)
+		return 0;
+
 	ret = -ENOMEM;
 	pgtable = pte_alloc_one(dst_mm, addr);
 	if (unlikely(!pgtable))
@@ -773,6 +932,26 @@ int copy_huge_pmd(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		pte_free(dst_mm, pgtable);
 		goto out_unlock;
 	}
+	/*
+	 * The page_table_lock is enough to be sure that the huge zero pmd
+	 * is not under splitting, since we never split the huge zero page
+	 * itself, only its pmd into a page table.
+	 */
+	if (is_huge_zero_pmd(pmd)) {
+		unsigned long zero_pfn;
+		bool set;
+		/*
+		 * get_huge_zero_page() will never allocate a new page here,
+		 * since we already have a zero page to copy. It just takes a
+		 * reference.
+		 */
+		zero_pfn = get_huge_zero_page();
+		set = set_huge_zero_page(pgtable, dst_mm, vma, addr, dst_pmd,
+					 zero_pfn);
+		BUG_ON(!set); /* unexpected !pmd_none(dst_pmd) */
+		ret = 0;
+		goto out_unlock;
+	}
 	if (unlikely(pmd_trans_splitting(pmd))) {
 		/* split huge page running from under us */
 		spin_unlock(&src_mm->page_table_lock);
@@ -821,6 +1000,71 @@ pgtable_t get_pmd_huge_pte(struct mm_struct *mm)
 	return pgtable;
 }
 
+static int do_huge_pmd_wp_zero_page_fallback(struct mm_struct *mm,
+		struct vm_area_struct *vma, unsigned long address,
+		pmd_t *pmd, pmd_t orig_pmd, unsigned long haddr)
+{
+	pgtable_t pgtable;
+	pmd_t _pmd;
+	struct page *page;
+	int i, ret = 0;
+
+	page = alloc_page_vma(GFP_HIGHUSER_MOVABLE, vma, address);
+	if (!page) {
+		ret |= VM_FAULT_OOM;
+		goto out;
+	}
+
+	if (mem_cgroup_newpage_charge(page, mm, GFP_KERNEL)) {
+		put_page(page);
+		ret |= VM_FAULT_OOM;
+		goto out;
+	}
+
+	clear_user_highpage(page, address);
+	__SetPageUptodate(page);
+
+	spin_lock(&mm->page_table_lock);
+	if (unlikely(!pmd_same(*pmd, orig_pmd)))
+		goto out_free_page;
+
+	pmdp_clear_flush_notify(vma, haddr, pmd);
+	/* leave pmd empty until pte is filled */
+
+	pgtable = get_pmd_huge_pte(mm);
+	pmd_populate(mm, &_pmd, pgtable);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++, haddr += PAGE_SIZE) {
+		pte_t *pte, entry;
+		if (haddr == (address & PAGE_MASK)) {
+			entry = mk_pte(page, vma->vm_page_prot);
+			entry = maybe_mkwrite(pte_mkdirty(entry), vma);
+			page_add_new_anon_rmap(page, vma, haddr);
+		} else {
+			entry = pfn_pte(my_zero_pfn(haddr), vma->vm_page_prot);
+			entry = pte_mkspecial(entry);
+		}
+		pte = pte_offset_map(&_pmd, haddr);
+		VM_BUG_ON(!pte_none(*pte));
+		set_pte_at(mm, haddr, pte, entry);
+		pte_unmap(pte);
+	}
+	smp_wmb(); /* make pte visible before pmd */
+	pmd_populate(mm, pmd, pgtable);
+	spin_unlock(&mm->page_table_lock);
+	put_huge_zero_page();
+	inc_mm_counter(mm, MM_ANONPAGES);
+
+	ret |= VM_FAULT_WRITE;
+out:
+	return ret;
+out_free_page:
+	spin_unlock(&mm->page_table_lock);
+	mem_cgroup_uncharge_page(page);
+	put_page(page);
+	goto out;
+}
+
 static int do_huge_pmd_wp_page_fallback(struct mm_struct *mm,
 					struct vm_area_struct *vma,
 					unsigned long address,
@@ -918,17 +1162,19 @@ int do_huge_pmd_wp_page(struct mm_struct *mm, struct vm_area_struct *vma,
 			unsigned long address, pmd_t *pmd, pmd_t orig_pmd)
 {
 	int ret = 0;
-	struct page *page, *new_page;
+	struct page *page = NULL, *new_page;
 	unsigned long haddr;
 
 	VM_BUG_ON(!vma->anon_vma);
+	haddr = address & HPAGE_PMD_MASK;
+	if (is_huge_zero_pmd(orig_pmd))
+		goto alloc;
 	spin_lock(&mm->page_table_lock);
 	if (unlikely(!pmd_same(*pmd, orig_pmd)))
 		goto out_unlock;
 
 	page = pmd_page(orig_pmd);
 	VM_BUG_ON(!PageCompound(page) || !PageHead(page));
-	haddr = address & HPAGE_PMD_MASK;
 	if (page_mapcount(page) == 1) {
 		pmd_t entry;
 		entry = pmd_mkyoung(orig_pmd);
@@ -940,7 +1186,7 @@ int do_huge_pmd_wp_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	}
 	get_page(page);
 	spin_unlock(&mm->page_table_lock);
-
+alloc:
 	if (transparent_hugepage_enabled(vma) &&
 	    !transparent_hugepage_debug_cow())
 		new_page = alloc_hugepage_vma(transparent_hugepage_defrag(vma),
@@ -950,28 +1196,43 @@ int do_huge_pmd_wp_page(struct mm_struct *mm, struct vm_area_struct *vma,
 
 	if (unlikely(!new_page)) {
 		count_vm_event(THP_FAULT_FALLBACK);
-		ret = do_huge_pmd_wp_page_fallback(mm, vma, address,
-						   pmd, orig_pmd, page, haddr);
-		if (ret & VM_FAULT_OOM)
-			split_huge_page(page);
-		put_page(page);
+		if (!page) {
+			ret = do_huge_pmd_wp_zero_page_fallback(mm, vma,
+					address, pmd, orig_pmd, haddr);
+			/* let the retry find ptes, as after a split below */
+			if (ret & VM_FAULT_OOM)
+				split_huge_page_pmd(vma, address, pmd);
+		} else {
+			ret = do_huge_pmd_wp_page_fallback(mm, vma, address,
+					pmd, orig_pmd, page, haddr);
+			if (ret & VM_FAULT_OOM)
+				split_huge_page(page);
+			put_page(page);
+		}
 		goto out;
 	}
 	count_vm_event(THP_FAULT_ALLOC);
 
 	if (unlikely(mem_cgroup_newpage_charge(new_page, mm, GFP_KERNEL))) {
 		put_page(new_page);
-		split_huge_page(page);
-		put_page(page);
+		if (page) {
+			split_huge_page(page);
+			put_page(page);
+		} else
+			split_huge_page_pmd(vma, address, pmd);
 		ret |= VM_FAULT_OOM;
 		goto out;
 	}
 
-	copy_user_huge_page(new_page, page, haddr, vma, HPAGE_PMD_NR);
+	if (!page)
+		clear_huge_page(new_page, haddr, HPAGE_PMD_NR);
+	else
+		copy_user_huge_page(new_page, page, haddr, vma, HPAGE_PMD_NR);
 	__SetPageUptodate(new_page);
 
 	spin_lock(&mm->page_table_lock);
-	put_page(page);
+	if (page)
+		put_page(page);
 	if (unlikely(!pmd_same(*pmd, orig_pmd))) {
 		spin_unlock(&mm->page_table_lock);
 		mem_cgroup_uncharge_page(new_page);
@@ -979,7 +1240,6 @@ int do_huge_pmd_wp_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		goto out;
 	} else {
 		pmd_t entry;
-		VM_BUG_ON(!PageHead(page));
 		entry = mk_pmd(new_page, vma->vm_page_prot);
 		entry = maybe_pmd_mkwrite(pmd_mkdirty(entry), vma);
 		entry = pmd_mkhuge(entry);
@@ -987,8 +1247,14 @@ int do_huge_pmd_wp_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		page_add_new_anon_rmap(new_page, vma, haddr);
 		set_pmd_at(mm, haddr, pmd, entry);
 		update_mmu_cache(vma, address, entry);
-		page_remove_rmap(page);
-		put_page(page);
+		if (!page) {
+			add_mm_counter(mm, MM_ANONPAGES, HPAGE_PMD_NR);
+			put_huge_zero_page();
+		} else {
+			VM_BUG_ON(!PageHead(page));
+			page_remove_rmap(page);
+			put_page(page);
+		}
 		ret |= VM_FAULT_WRITE;
 	}
 out_unlock:
@@ -1009,8 +1275,12 @@ struct page *follow_trans_huge_pmd(struct mm_struct *mm,
 	if (flags & FOLL_WRITE && !pmd_write(*pmd))
 		goto out;
 
+	/* Avoid dumping the huge zero page */
+	if ((flags & FOLL_DUMP) && is_huge_zero_pmd(*pmd))
+		return ERR_PTR(-EFAULT);
+
 	page = pmd_page(*pmd);
-	VM_BUG_ON(!PageHead(page));
+	VM_BUG_ON(!PageHead(page) && !PageTeam(page));
 	if (flags & FOLL_TOUCH) {
 		pmd_t _pmd;
 		/*
@@ -1025,7 +1295,7 @@ struct page *follow_trans_huge_pmd(struct mm_struct *mm,
 		set_pmd_at(mm, addr & HPAGE_PMD_MASK, pmd, _pmd);
 	}
 	page += (addr & ~HPAGE_PMD_MASK) >> PAGE_SHIFT;
-	VM_BUG_ON(!PageCompound(page));
+	VM_BUG_ON(!PageCompound(page) && !PageTeam(page));
 	if (flags & FOLL_GET)
 		get_page_foll(page);
 
@@ -1041,17 +1311,44 @@ int zap_huge_pmd(struct mmu_gather *tlb, struct vm_area_struct *vma,
 	if (__pmd_trans_huge_lock(pmd, vma) == 1) {
 		struct page *page;
 		pgtable_t pgtable;
+
+		if (vma->vm_ops) {
+			pmd_t orig_pmd;
+			int i;
+
+			orig_pmd = pmdp_get_and_clear(tlb->mm, addr, pmd);
+			tlb_remove_pmd_tlb_entry(tlb, pmd, addr);
+			spin_unlock(&tlb->mm->page_table_lock);
+			page = pmd_page(orig_pmd);
+			for (i = 0; i < HPAGE_PMD_NR; i++, page++) {
+				VM_BUG_ON(!PageTeam(page));
+				if (pmd_dirty(orig_pmd))
+					set_page_dirty(page);
+				page_remove_rmap(page);
+				tlb_remove_page(tlb, page);
+			}
+			add_mm_counter(tlb->mm, MM_FILEPAGES, -HPAGE_PMD_NR);
+			return 1;
+		}
+		pmd_t orig_pmd = *pmd;
+
 		pgtable = get_pmd_huge_pte(tlb->mm);
-		page = pmd_page(*pmd);
 		pmd_clear(pmd);
 		tlb_remove_pmd_tlb_entry(tlb, pmd, addr);
-		page_remove_rmap(page);
-		VM_BUG_ON(page_mapcount(page) < 0);
-		add_mm_counter(tlb->mm, MM_ANONPAGES, -HPAGE_PMD_NR);
-		VM_BUG_ON(!PageHead(page));
-		tlb->mm->nr_ptes--;
-		spin_unlock(&tlb->mm->page_table_lock);
-		tlb_remove_page(tlb, page);
+		if (is_huge_zero_pmd(orig_pmd)) {
+			tlb->mm->nr_ptes--;
+			spin_unlock(&tlb->mm->page_table_lock);
+			put_huge_zero_page();
+		} else {
+			page = pmd_page(orig_pmd);
+			page_remove_rmap(page);
+			VM_BUG_ON(page_mapcount(page) < 0);
+			add_mm_counter(tlb->mm, MM_ANONPAGES, -HPAGE_PMD_NR);
+			VM_BUG_ON(!PageHead(page));
+			tlb->mm->nr_ptes--;
+			spin_unlock(&tlb->mm->page_table_lock);
+			tlb_remove_page(tlb, page);
+		}
 		pte_free(tlb->mm, pgtable);
 		ret = 1;
 	}
@@ -1090,7 +1387,7 @@ int move_huge_pmd(struct vm_area_struct *vma, struct vm_area_struct *new_vma,
 	if ((old_addr & ~HPAGE_PMD_MASK) ||
 	    (new_addr & ~HPAGE_PMD_MASK) ||
 	    old_end - old_addr < HPAGE_PMD_SIZE ||
-	    (new_vma->vm_flags & VM_NOHUGEPAGE))
+	    (new_vma->vm_flags & VM_NOHUGEPAGE) || vma->vm_ops)
 		goto out;
 
 	/*
@@ -1131,6 +1428,114 @@ int change_huge_pmd(struct vm_area_struct *vma, pmd_t *pmd,
 	return ret;
 }
 
+/*
+ * Map the team of shmem pages headed by the locked @page with a huge pmd,
+ * if all its pages are still in the page cache, uptodate and unlocked.
+ * Each page of the team holds a reference and a mapcount for the pmd.
+ * Returns VM_FAULT_FALLBACK if the team is incomplete, so that the
+ * fault is handled by ptes instead; or 0 if the pmd is now populated.
+ */
+int map_team_by_pmd(struct vm_area_struct *vma, unsigned long address,
+		    pmd_t *pmd, struct page *page, unsigned int flags)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+	struct address_space *mapping = page->mapping;
+	pgoff_t index = page->index;
+	int mapped = 0;
+	int nr, i;
+
+	VM_BUG_ON(!PageLocked(page));
+	if (!PageTeam(page) || (index & (HPAGE_PMD_NR - 1)) ||
+	    !PageUptodate(page))
+		return VM_FAULT_FALLBACK;
+
+	for (nr = 1; nr < HPAGE_PMD_NR; nr++) {
+		struct page *member = page + nr;
+
+		if (!get_page_unless_zero(member))
+			break;
+		if (!trylock_page(member)) {
+			put_page(member);
+			break;
+		}
+		if (member->mapping != mapping ||
+		    member->index != index + nr ||
+		    !PageTeam(member) || !PageUptodate(member) ||
+		    PageHWPoison(member)) {
+			unlock_page(member);
+			put_page(member);
+			break;
+		}
+	}
+
+	if (nr == HPAGE_PMD_NR) {
+		spin_lock(&mm->page_table_lock);
+		if (likely(pmd_none(*pmd))) {
+			pmd_t entry;
+
+			entry = mk_pmd(page, vma->vm_page_prot);
+			if (flags & FAULT_FLAG_WRITE)
+				entry = maybe_pmd_mkwrite(pmd_mkdirty(entry),
+							  vma);
+			entry = pmd_mkhuge(entry);
+			get_page(page);
+			for (i = 0; i < HPAGE_PMD_NR; i++)
+				page_add_file_rmap(page + i);
+			set_pmd_at(mm, haddr, pmd, entry);
+			add_mm_counter(mm, MM_FILEPAGES, HPAGE_PMD_NR);
+			mapped = 1;
+		}
+		spin_unlock(&mm->page_table_lock);
+	}
+
+	for (i = 1; i < nr; i++) {
+		unlock_page(page + i);
+		if (!mapped)
+			put_page(page + i);
+	}
+	if (nr < HPAGE_PMD_NR)
+		return VM_FAULT_FALLBACK;
+	if (mapped)
+		count_vm_event(THP_FILE_MAPPED);
+	return 0;
+}
+
+/*
+ * Unmap a team of shmem pages mapped by a huge pmd.  The pages stay in
+ * the page cache, and are faulted back in by ptes (or by a huge pmd
+ * again) when next accessed: so this is how a team pmd is "split".
+ */
+void unmap_team_by_pmd(struct vm_area_struct *vma, unsigned long address,
+		       pmd_t *pmd)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+	struct page *page;
+	pmd_t orig_pmd;
+	int i;
+
+	spin_lock(&mm->page_table_lock);
+	if (unlikely(!pmd_trans_huge(*pmd))) {
+		spin_unlock(&mm->page_table_lock);
+		return;
+	}
+	orig_pmd = pmdp_clear_flush_notify(vma, haddr, pmd);
+	spin_unlock(&mm->page_table_lock);
+
+	page = pmd_page(orig_pmd);
+	for (i = 0; i < HPAGE_PMD_NR; i++, page++) {
+		VM_BUG_ON(!PageTeam(page));
+		if (pmd_dirty(orig_pmd))
+			set_page_dirty(page);
+		if (pmd_young(orig_pmd))
+			mark_page_accessed(page);
+		page_remove_rmap(page);
+		put_page(page);
+	}
+	add_mm_counter(mm, MM_FILEPAGES, -HPAGE_PMD_NR);
+}
+
 /*
  * Returns 1 if a given pmd maps a stable (not under splitting) thp.
  * Returns -1 if it maps a thp under splitting. Returns 0 otherwise.
@@ -1200,6 +1605,58 @@ out:
 	return ret;
 }
 
+static pmd_t *mm_find_pmd(struct mm_struct *mm, unsigned long address)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+
+	pgd = pgd_offset(mm, address);
+	if (!pgd_present(*pgd))
+		return NULL;
+
+	pud = pud_offset(pgd, address);
+	if (!pud_present(*pud))
+		return NULL;
+
+	return pmd_offset(pud, address);
+}
+
+/*
+ * Check whether @address in @mm is mapped by a huge pmd to the team of
+ * shmem pages which @page belongs to.  If so, return the pmd with the
+ * page_table_lock held; otherwise return NULL.
+ */
+pmd_t *page_check_team_pmd(struct page *page, struct mm_struct *mm,
+			   unsigned long address)
+{
+	pmd_t *pmd;
+
+	pmd = mm_find_pmd(mm, address);
+	if (!pmd || !pmd_trans_huge(*pmd))
+		return NULL;
+
+	spin_lock(&mm->page_table_lock);
+	if (pmd_trans_huge(*pmd) &&
+	    page_to_pfn(page) - pmd_pfn(*pmd) < HPAGE_PMD_NR)
+		return pmd;
+	spin_unlock(&mm->page_table_lock);
+	return NULL;
+}
+
+/*
+ * The young bit of a huge pmd is shared by the whole team of shmem pages
+ * it maps: count it as a reference to each of them, but leave it to the
+ * first page of the team to clear it.  Called with page_table_lock held.
+ */
+int page_referenced_team_pmd(struct page *page, struct vm_area_struct *vma,
+			     unsigned long address, pmd_t *pmd)
+{
+	if (page->index & (HPAGE_PMD_NR - 1))
+		return pmd_young(*pmd);
+	return pmdp_clear_flush_young_notify(vma, address & HPAGE_PMD_MASK,
+					     pmd);
+}
+
 static int __split_huge_page_splitting(struct page *page,
 				       struct vm_area_struct *vma,
 				       unsigned long address)
@@ -1282,6 +1739,10 @@ static void __split_huge_page_refcount(struct page *page)
 				      (1L << PG_mlocked) |
 				      (1L << PG_uptodate)));
 		page_tail->flags |= (1L << PG_dirty);
+		if (PageYoung(page))
+			SetPageYoung(page_tail);
+		if (PageIdle(page))
+			SetPageIdle(page_tail);
 
 		/* clear PageTail before overwriting first_page */
 		smp_wmb();
@@ -1497,12 +1958,18 @@ out:
 int hugepage_madvise(struct vm_area_struct *vma,
 		     unsigned long *vm_flags, int advice)
 {
+	unsigned long no_thp = VM_NO_THP;
+
+	/* Shared mappings of shmem may use huge pages from its page cache */
+	if (vma->vm_file && shmem_mapping(vma->vm_file->f_mapping))
+		no_thp &= ~(VM_SHARED | VM_MAYSHARE);
+
 	switch (advice) {
 	case MADV_HUGEPAGE:
 		/*
 		 * Be somewhat over-protective like KSM for now!
 		 */
-		if (*vm_flags & (VM_HUGEPAGE | VM_NO_THP))
+		if (*vm_flags & (VM_HUGEPAGE | no_thp))
 			return -EINVAL;
 		*vm_flags &= ~VM_NOHUGEPAGE;
 		*vm_flags |= VM_HUGEPAGE;
@@ -1513,12 +1980,15 @@ int hugepage_madvise(struct vm_area_struct *vma,
 		 */
 		if (unlikely(khugepaged_enter_vma_merge(vma)))
 			return -ENOMEM;
+		if (no_thp != VM_NO_THP && (*vm_flags & VM_SHARED) &&
+		    unlikely(khugepaged_enter_shmem(vma)))
+			return -ENOMEM;
 		break;
 	case MADV_NOHUGEPAGE:
 		/*
 		 * Be somewhat over-protective like KSM for now!
 		 */
-		if (*vm_flags & (VM_NOHUGEPAGE | VM_NO_THP))
+		if (*vm_flags & (VM_NOHUGEPAGE | no_thp))
 			return -EINVAL;
 		*vm_flags &= ~VM_HUGEPAGE;
 		*vm_flags |= VM_NOHUGEPAGE;
@@ -1732,7 +2202,8 @@ static int __collapse_huge_page_isolate(struct vm_area_struct *vma,
 	     _pte++, address += PAGE_SIZE) {
 		pte_t pteval = *_pte;
 		if (pte_none(pteval)) {
-			if (++none <= khugepaged_max_ptes_none)
+			if (!userfaultfd_armed(vma) &&
+			    ++none <= khugepaged_max_ptes_none)
 				continue;
 			else {
 				release_pte_pages(pte, _pte);
@@ -2042,7 +2513,8 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 	     _pte++, _address += PAGE_SIZE) {
 		pte_t pteval = *_pte;
 		if (pte_none(pteval)) {
-			if (++none <= khugepaged_max_ptes_none)
+			if (!userfaultfd_armed(vma) &&
+			    ++none <= khugepaged_max_ptes_none)
 				continue;
 			else
 				goto out_unmap;
@@ -2103,6 +2575,69 @@ static void collect_mm_slot(struct mm_slot *mm_slot)
 	}
 }
 
+/*
+ * Now that the extent of shmem mapped at @address is a complete team,
+ * remove the page table which mapped it by ptes, so that the next fault
+ * there can map the team by pmd.
+ */
+static void khugepaged_retract_ptes(struct mm_struct *mm, struct file *file,
+				    pgoff_t pgoff, unsigned long address)
+{
+	struct address_space *mapping = file->f_mapping;
+	struct vm_area_struct *vma;
+	pmd_t *pmd, _pmd;
+
+	down_write(&mm->mmap_sem);
+	if (unlikely(khugepaged_test_exit(mm)))
+		goto out;
+	/* The vma may have changed while we did not hold mmap_sem */
+	vma = find_vma(mm, address);
+	if (!vma || vma->vm_file != file || vma->vm_start > address ||
+	    address + HPAGE_PMD_SIZE > vma->vm_end ||
+	    linear_page_index(vma, address) != pgoff ||
+	    !shmem_huge_enabled(vma))
+		goto out;
+	pmd = mm_find_pmd(mm, address);
+	if (!pmd || pmd_none(*pmd) || pmd_trans_huge(*pmd))
+		goto out;
+
+	zap_page_range(vma, address, HPAGE_PMD_SIZE, NULL);
+
+	/* Keep rmap walks of the file away from the page table being freed */
+	mutex_lock(&mapping->i_mmap_mutex);
+	spin_lock(&mm->page_table_lock);
+	_pmd = pmdp_clear_flush_notify(vma, address, pmd);
+	mm->nr_ptes--;
+	spin_unlock(&mm->page_table_lock);
+	mutex_unlock(&mapping->i_mmap_mutex);
+	pte_free(mm, pmd_pgtable(_pmd));
+
+	khugepaged_pages_collapsed++;
+out:
+	up_write(&mm->mmap_sem);
+}
+
+/*
+ * Collapse the extent of shmem mapped at @address into a team, if it is
+ * not already one.  Called with mmap_sem held for reading, which is
+ * released before returning.
+ */
+static void khugepaged_collapse_shmem(struct mm_struct *mm,
+				      struct vm_area_struct *vma,
+				      unsigned long address)
+{
+	struct file *file = vma->vm_file;
+	pgoff_t pgoff = linear_page_index(vma, address);
+
+	get_file(file);
+	up_read(&mm->mmap_sem);
+
+	if (!shmem_collapse_team(mm, file->f_mapping, pgoff,
+				 khugepaged_max_ptes_none))
+		khugepaged_retract_ptes(mm, file, pgoff, address);
+	fput(file);
+}
+
 static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 					    struct page **hpage)
 	__releases(&khugepaged_mm_lock)
@@ -2143,6 +2678,43 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 			break;
 		}
 
+		if (shmem_huge_enabled(vma)) {
+			pmd_t *pmd;
+
+			hstart = (vma->vm_start + ~HPAGE_PMD_MASK) &
+				 HPAGE_PMD_MASK;
+			hend = vma->vm_end & HPAGE_PMD_MASK;
+			if (hstart >= hend)
+				goto skip;
+			if (linear_page_index(vma, hstart) &
+			    (HPAGE_PMD_NR - 1))
+				goto skip;
+			if (khugepaged_scan.address > hend)
+				goto skip;
+			if (khugepaged_scan.address < hstart)
+				khugepaged_scan.address = hstart;
+
+			while (khugepaged_scan.address < hend) {
+				cond_resched();
+				pmd = mm_find_pmd(mm, khugepaged_scan.address);
+				if (pmd && pmd_trans_huge(*pmd)) {
+					/* already mapped by pmd */
+					khugepaged_scan.address += HPAGE_PMD_SIZE;
+					progress++;
+					if (progress >= pages)
+						goto breakouterloop;
+					continue;
+				}
+				khugepaged_collapse_shmem(mm, vma,
+						khugepaged_scan.address);
+				/* we released mmap_sem so break loop */
+				khugepaged_scan.address += HPAGE_PMD_SIZE;
+				progress += HPAGE_PMD_NR;
+				goto breakouterloop_mmap_sem;
+			}
+			continue;
+		}
+
 		if ((!(vma->vm_flags & VM_HUGEPAGE) &&
 		     !khugepaged_always()) ||
 		    (vma->vm_flags & VM_NOHUGEPAGE)) {
@@ -2375,15 +2947,58 @@ static int khugepaged(void *none)
 	return 0;
 }
 
-void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd)
+/*
+ * Replace the huge zero pmd by a page table of small zero page ptes.
+ */
+static void __split_huge_zero_page_pmd(struct vm_area_struct *vma,
+		unsigned long haddr, pmd_t *pmd)
 {
+	struct mm_struct *mm = vma->vm_mm;
+	pgtable_t pgtable;
+	pmd_t _pmd;
+	int i;
+
+	pmdp_clear_flush_notify(vma, haddr, pmd);
+	/* leave pmd empty until pte is filled */
+
+	pgtable = get_pmd_huge_pte(mm);
+	pmd_populate(mm, &_pmd, pgtable);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++, haddr += PAGE_SIZE) {
+		pte_t *pte, entry;
+		entry = pfn_pte(my_zero_pfn(haddr), vma->vm_page_prot);
+		entry = pte_mkspecial(entry);
+		pte = pte_offset_map(&_pmd, haddr);
+		VM_BUG_ON(!pte_none(*pte));
+		set_pte_at(mm, haddr, pte, entry);
+		pte_unmap(pte);
+	}
+	smp_wmb(); /* make pte visible before pmd */
+	pmd_populate(mm, pmd, pgtable);
+	put_huge_zero_page();
+}
+
+void __split_huge_page_pmd(struct vm_area_struct *vma, unsigned long address,
+		pmd_t *pmd)
+{
+	struct mm_struct *mm = vma->vm_mm;
 	struct page *page;
 
+	if (vma->vm_ops) {
+		unmap_team_by_pmd(vma, address, pmd);
+		return;
+	}
+
 	spin_lock(&mm->page_table_lock);
 	if (unlikely(!pmd_trans_huge(*pmd))) {
 		spin_unlock(&mm->page_table_lock);
 		return;
 	}
+	if (is_huge_zero_pmd(*pmd)) {
+		__split_huge_zero_page_pmd(vma, address & HPAGE_PMD_MASK, pmd);
+		spin_unlock(&mm->page_table_lock);
+		return;
+	}
 	page = pmd_page(*pmd);
 	VM_BUG_ON(!page_count(page));
 	get_page(page);
@@ -2395,31 +3010,33 @@ void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd)
 	BUG_ON(pmd_trans_huge(*pmd));
 }
 
-static void split_huge_page_address(struct mm_struct *mm,
+void split_huge_page_pmd_mm(struct mm_struct *mm, unsigned long address,
+		pmd_t *pmd)
+{
+	struct vm_area_struct *vma;
+
+	if (!pmd_trans_huge(*pmd))
+		return;
+	vma = find_vma(mm, address);
+	BUG_ON(vma == NULL);
+	__split_huge_page_pmd(vma, address, pmd);
+}
+
+static void split_huge_page_address(struct vm_area_struct *vma,
 				    unsigned long address)
 {
-	pgd_t *pgd;
-	pud_t *pud;
 	pmd_t *pmd;
 
 	VM_BUG_ON(!(address & ~HPAGE_PMD_MASK));
 
-	pgd = pgd_offset(mm, address);
-	if (!pgd_present(*pgd))
-		return;
-
-	pud = pud_offset(pgd, address);
-	if (!pud_present(*pud))
-		return;
-
-	pmd = pmd_offset(pud, address);
-	if (!pmd_present(*pmd))
+	pmd = mm_find_pmd(vma->vm_mm, address);
+	if (!pmd || !pmd_present(*pmd))
 		return;
 	/*
 	 * Caller holds the mmap_sem write mode, so a huge pmd cannot
 	 * materialize from under us.
 	 */
-	split_huge_page_pmd(mm, pmd);
+	split_huge_page_pmd(vma, address, pmd);
 }
 
 void __vma_adjust_trans_huge(struct vm_area_struct *vma,
@@ -2435,7 +3052,7 @@ void __vma_adjust_trans_huge(struct vm_area_struct *vma,
 	if (start & ~HPAGE_PMD_MASK &&
 	    (start & HPAGE_PMD_MASK) >= vma->vm_start &&
 	    (start & HPAGE_PMD_MASK) + HPAGE_PMD_SIZE <= vma->vm_end)
-		split_huge_page_address(vma->vm_mm, start);
+		split_huge_page_address(vma, start);
 
 	/*
 	 * If the new end address isn't hpage aligned and it could
@@ -2445,7 +3062,7 @@ void __vma_adjust_trans_huge(struct vm_area_struct *vma,
 	if (end & ~HPAGE_PMD_MASK &&
 	    (end & HPAGE_PMD_MASK) >= vma->vm_start &&
 	    (end & HPAGE_PMD_MASK) + HPAGE_PMD_SIZE <= vma->vm_end)
-		split_huge_page_address(vma->vm_mm, end);
+		split_huge_page_address(vma, end);
 
 	/*
 	 * If we're also updating the vma->vm_next->vm_start, if the new
@@ -2459,6 +3076,6 @@ void __vma_adjust_trans_huge(struct vm_area_struct *vma,
 		if (nstart & ~HPAGE_PMD_MASK &&
 		    (nstart & HPAGE_PMD_MASK) >= next->vm_start &&
 		    (nstart & HPAGE_PMD_MASK) + HPAGE_PMD_SIZE <= next->vm_end)
-			split_huge_page_address(next->vm_mm, nstart);
+			split_huge_page_address(next, nstart);
 	}
 }
@@ -37,6 +37,18 @@ static inline void __put_page(struct page *page)
 	atomic_dec(&page->_count);
 }
 
+/*
+ * A page which leaves the page cache leaves its team of shmem pages too:
+ * see shmem_alloc_team().  Called under mapping->tree_lock.
+ */
+static inline void page_cache_leave_team(struct page *page)
+{
+	if (PageTeam(page)) {
+		ClearPageTeam(page);
+		__dec_zone_page_state(page, NR_SHMEM_HUGEPAGES);
+	}
+}
+
 static inline void __get_page_tail_foll(struct page *page,
 					bool get_page_head)
 {
@@ -95,6 +107,21 @@ extern void putback_lru_page(struct page *page);
  * in mm/page_alloc.c
  */
 extern void __free_pages_bootmem(struct page *page, unsigned int order);
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+extern unsigned long early_initialised_end_pfn(unsigned long start_pfn,
+					       unsigned long end_pfn);
+extern void reserve_bootmem_region(phys_addr_t start, phys_addr_t end);
+#else
+static inline unsigned long early_initialised_end_pfn(unsigned long start_pfn,
+						      unsigned long end_pfn)
+{
+	return end_pfn;
+}
+
+static inline void reserve_bootmem_region(phys_addr_t start, phys_addr_t end)
+{
+}
+#endif
 extern void prep_compound_page(struct page *page, unsigned long order);
 #ifdef CONFIG_MEMORY_FAILURE
 extern bool is_free_buddy_page(struct page *page);
@@ -131,6 +158,9 @@ struct compact_control {
 	int migratetype;		/* MOVABLE, RECLAIMABLE etc */
 	struct zone *zone;
 	bool *contended;		/* True if a lock was contended */
+	bool proactive;			/* kcompactd compacting ahead of
+					   demand, stops once the zone is
+					   no longer fragmented */
 };
 
 unsigned long
@@ -190,7 +220,7 @@ static inline int mlocked_vma_newpage(struct vm_area_struct *vma,
  * must be called with vma's mmap_sem held for read or write, and page locked.
  */
 extern void mlock_vma_page(struct page *page);
-extern void munlock_vma_page(struct page *page);
+extern unsigned int munlock_vma_page(struct page *page);
 
 /*
  * Clear the page's PageMlocked().  This can be useful in a situation where
@@ -23,7 +23,6 @@
 #include <linux/pagemap.h>
 #include <linux/rmap.h>
 #include <linux/spinlock.h>
-#include <linux/jhash.h>
 #include <linux/delay.h>
 #include <linux/kthread.h>
 #include <linux/wait.h>
@@ -86,28 +85,38 @@
  * @mm_list: link into the mm_slots list, rooted in ksm_mm_head
  * @rmap_list: head for this mm_slot's singly-linked list of rmap_items
  * @mm: the mm that this information is valid for
+ * @scanning: a ksmd thread (or unmerge) is working on this mm_slot
  */
 struct mm_slot {
 	struct hlist_node link;
 	struct list_head mm_list;
 	struct rmap_item *rmap_list;
 	struct mm_struct *mm;
+	bool scanning;
 };
 
 /**
  * struct ksm_scan - cursor for scanning
- * @mm_slot: the current mm_slot we are scanning
+ * @mm_slot: the mm_slot we are scanning, or NULL between mm_slots
  * @address: the next address inside that to be scanned
  * @rmap_list: link to the next rmap to be scanned in the rmap_list
- * @seqnr: count of completed full scans (needed when removing unstable node)
+ * @stale_list: rmap_items dropped under mmap_sem, to be freed after it
+ * @thread: the ksmd thread using this cursor
+ * @pages_scanned: number of pages this thread has scanned
+ * @cpu_time: nanoseconds of cpu time this thread has spent scanning
  *
- * There is only the one ksm_scan instance of this cursor structure.
+ * There is one ksm_scan per ksmd thread: each thread claims the next
+ * mm_slot from ksm_mm_cursor, and scans it to the end before claiming
+ * another.
  */
 struct ksm_scan {
 	struct mm_slot *mm_slot;
 	unsigned long address;
 	struct rmap_item **rmap_list;
-	unsigned long seqnr;
+	struct rmap_item *stale_list;
+	struct task_struct *thread;
+	unsigned long pages_scanned;
+	u64 cpu_time;
 };
 
 /**
@@ -115,11 +124,15 @@ struct ksm_scan {
  * @node: rb node of this ksm page in the stable tree
  * @hlist: hlist head of rmap_items using this ksm page
  * @kpfn: page frame number of this ksm page
+ * @nid: NUMA node id of the stable tree in which this node is linked
  */
 struct stable_node {
 	struct rb_node node;
 	struct hlist_head hlist;
 	unsigned long kpfn;
+#ifdef CONFIG_NUMA
+	int nid;
+#endif
 };
 
 /**
@@ -129,6 +142,7 @@ struct stable_node {
  * @mm: the memory structure this rmap_item is pointing into
  * @address: the virtual address this rmap_item tracks (+ flags in low bits)
  * @oldchecksum: previous checksum of the page at that virtual address
+ * @nid: NUMA node id of the tree (stable or unstable) holding this rmap_item
  * @node: rb node of this rmap_item in the unstable tree
  * @head: pointer to stable_node heading this list in the stable tree
  * @hlist: link into hlist of rmap_items hanging off that stable_node
@@ -139,6 +153,9 @@ struct rmap_item {
 	struct mm_struct *mm;
 	unsigned long address;		/* + low bits used for flags below */
 	unsigned int oldchecksum;	/* when unstable */
+#ifdef CONFIG_NUMA
+	int nid;			/* when in either tree */
+#endif
 	union {
 		struct rb_node node;	/* when node of unstable tree */
 		struct {		/* when listed from stable tree */
@@ -152,9 +169,32 @@ struct rmap_item {
 #define UNSTABLE_FLAG	0x100	/* is a node of the unstable tree */
 #define STABLE_FLAG	0x200	/* is listed from the stable tree */
 
-/* The stable and unstable tree heads */
-static struct rb_root root_stable_tree = RB_ROOT;
-static struct rb_root root_unstable_tree = RB_ROOT;
+/**
+ * struct ksm_tree - the stable and unstable trees of one NUMA node
+ * @stable: root of the stable tree
+ * @unstable: root of the unstable tree
+ * @mutex: serializes all searches, insertions and removals in both trees
+ * @pages_shared: the number of nodes in the stable tree
+ * @pages_sharing: the number of page slots additionally sharing those nodes
+ * @pages_unshared: the number of nodes in the unstable tree
+ *
+ * The tree mutex nests outside mmap_sem and the page lock: a ksmd thread
+ * holds it while merging, but never takes it while holding mmap_sem.
+ */
+struct ksm_tree {
+	struct rb_root stable;
+	struct rb_root unstable;
+	struct mutex mutex;
+	unsigned long pages_shared;
+	unsigned long pages_sharing;
+	unsigned long pages_unshared;
+};
+
+/*
+ * The stable and unstable trees, one pair per NUMA node (nr_node_ids of
+ * them); but only the first pair is used while ksm_merge_across_nodes.
+ */
+static struct ksm_tree *ksm_trees;
 
 #define MM_SLOTS_HASH_SHIFT 10
 #define MM_SLOTS_HASH_HEADS (1 << MM_SLOTS_HASH_SHIFT)
@@ -163,25 +203,25 @@ static struct hlist_head mm_slots_hash[MM_SLOTS_HASH_HEADS];
 static struct mm_slot ksm_mm_head = {
 	.mm_list = LIST_HEAD_INIT(ksm_mm_head.mm_list),
 };
-static struct ksm_scan ksm_scan = {
-	.mm_slot = &ksm_mm_head,
-};
 
-static struct kmem_cache *rmap_item_cache;
-static struct kmem_cache *stable_node_cache;
-static struct kmem_cache *mm_slot_cache;
+/* The mm_slot last claimed for scanning in this pass, or ksm_mm_head */
+static struct mm_slot *ksm_mm_cursor = &ksm_mm_head;
+
+/* The number of mm_slots claimed by ksmd threads */
+static unsigned int ksm_nr_scanning;
 
-/* The number of nodes in the stable tree */
-static unsigned long ksm_pages_shared;
+/* Count of completed full scans (needed when removing unstable node) */
+static unsigned long ksm_seqnr;
 
-/* The number of page slots additionally sharing those nodes */
-static unsigned long ksm_pages_sharing;
+#define KSM_MAX_THREADS	32
+static struct ksm_scan ksm_scans[KSM_MAX_THREADS];
 
-/* The number of nodes in the unstable tree */
-static unsigned long ksm_pages_unshared;
+static struct kmem_cache *rmap_item_cache;
+static struct kmem_cache *stable_node_cache;
+static struct kmem_cache *mm_slot_cache;
 
 /* The number of rmap_items in use: to calculate pages_volatile */
-static unsigned long ksm_rmap_items;
+static atomic_long_t ksm_rmap_items = ATOMIC_LONG_INIT(0);
 
 /* Number of pages ksmd should scan in one batch */
 static unsigned int ksm_thread_pages_to_scan = 100;
@@ -189,13 +229,28 @@ static unsigned int ksm_thread_pages_to_scan = 100;
 /* Milliseconds ksmd should sleep between batches */
 static unsigned int ksm_thread_sleep_millisecs = 20;
 
+/* Number of ksmd threads scanning in parallel */
+static unsigned int ksm_nr_threads;
+
+#ifdef CONFIG_NUMA
+/* Zeroed when merging across nodes is not allowed */
+static unsigned int ksm_merge_across_nodes = 1;
+#define NUMA(x)		(x)
+#define DO_NUMA(x)	do { (x); } while (0)
+#else
+#define ksm_merge_across_nodes	1U
+#define NUMA(x)		(0)
+#define DO_NUMA(x)	do { } while (0)
+#endif
+
 #define KSM_RUN_STOP	0
 #define KSM_RUN_MERGE	1
 #define KSM_RUN_UNMERGE	2
 static unsigned int ksm_run = KSM_RUN_STOP;
 
 static DECLARE_WAIT_QUEUE_HEAD(ksm_thread_wait);
-static DEFINE_MUTEX(ksm_thread_mutex);
+static DECLARE_RWSEM(ksm_thread_sem);
+static DEFINE_MUTEX(ksm_threads_mutex);
 static DEFINE_SPINLOCK(ksm_mmlist_lock);
 
 #define KSM_KMEM_CACHE(__struct, __flags) kmem_cache_create("ksm_"#__struct,\
@@ -240,13 +295,13 @@ static inline struct rmap_item *alloc_rmap_item(void)
 
 	rmap_item = kmem_cache_zalloc(rmap_item_cache, GFP_KERNEL);
 	if (rmap_item)
-		ksm_rmap_items++;
+		atomic_long_inc(&ksm_rmap_items);
 	return rmap_item;
 }
 
 static inline void free_rmap_item(struct rmap_item *rmap_item)
 {
-	ksm_rmap_items--;
+	atomic_long_dec(&ksm_rmap_items);
 	rmap_item->mm = NULL;	/* debug safety */
 	kmem_cache_free(rmap_item_cache, rmap_item);
 }
@@ -297,11 +352,86 @@ static void insert_to_mm_slots_hash(struct mm_struct *mm,
 	hlist_add_head(&mm_slot->link, bucket);
 }
 
+/*
+ * Remove mm_slot from the hash and from the mm list, stepping the cursor
+ * back to the previous mm_slot if it rests on this one.
+ * Called with ksm_mmlist_lock held.
+ */
+static void remove_mm_slot(struct mm_slot *mm_slot)
+{
+	if (ksm_mm_cursor == mm_slot)
+		ksm_mm_cursor = list_entry(mm_slot->mm_list.prev,
+					   struct mm_slot, mm_list);
+	hlist_del(&mm_slot->link);
+	list_del(&mm_slot->mm_list);
+}
+
+/*
+ * Give back the mm_slot claimed by this ksmd thread: it may be freed by
+ * __ksm_exit from now on.  Called with ksm_mmlist_lock held.
+ */
+static void release_mm_slot(struct ksm_scan *scan)
+{
+	if (scan->mm_slot)		/* else already freed */
+		scan->mm_slot->scanning = false;
+	scan->mm_slot = NULL;
+	ksm_nr_scanning--;
+}
+
 static inline int in_stable_tree(struct rmap_item *rmap_item)
 {
 	return rmap_item->address & STABLE_FLAG;
 }
 
+/*
+ * The tree which a page at kpfn belongs in: that of its node, unless
+ * pages are allowed to be merged across nodes.
+ */
+static inline int get_kpfn_nid(unsigned long kpfn)
+{
+	return ksm_merge_across_nodes ? 0 : pfn_to_nid(kpfn);
+}
+
+static inline struct ksm_tree *stable_node_tree(struct stable_node *stable_node)
+{
+	return &ksm_trees[NUMA(stable_node->nid)];
+}
+
+static inline struct ksm_tree *rmap_item_tree(struct rmap_item *rmap_item)
+{
+	return &ksm_trees[NUMA(rmap_item->nid)];
+}
+
+static unsigned long ksm_pages_shared(void)
+{
+	unsigned long pages = 0;
+	int nid;
+
+	for (nid = 0; nid < nr_node_ids; nid++)
+		pages += ksm_trees[nid].pages_shared;
+	return pages;
+}
+
+static unsigned long ksm_pages_sharing(void)
+{
+	unsigned long pages = 0;
+	int nid;
+
+	for (nid = 0; nid < nr_node_ids; nid++)
+		pages += ksm_trees[nid].pages_sharing;
+	return pages;
+}
+
+static unsigned long ksm_pages_unshared(void)
+{
+	unsigned long pages = 0;
+	int nid;
+
+	for (nid = 0; nid < nr_node_ids; nid++)
+		pages += ksm_trees[nid].pages_unshared;
+	return pages;
+}
+
 /*
  * ksmd, and unmerge_and_remove_all_rmap_items(), must not touch an mm's
  * page tables after it has passed through ksm_exit() - which, if necessary,
@@ -447,22 +577,26 @@ out:		page = NULL;
 	return page;
 }
 
+/*
+ * Called with the mutex of the stable_node's tree held.
+ */
 static void remove_node_from_stable_tree(struct stable_node *stable_node)
 {
+	struct ksm_tree *tree = stable_node_tree(stable_node);
 	struct rmap_item *rmap_item;
 	struct hlist_node *hlist;
 
 	hlist_for_each_entry(rmap_item, hlist, &stable_node->hlist, hlist) {
 		if (rmap_item->hlist.next)
-			ksm_pages_sharing--;
+			tree->pages_sharing--;
 		else
-			ksm_pages_shared--;
+			tree->pages_shared--;
 		put_anon_vma(rmap_item->anon_vma);
 		rmap_item->address &= PAGE_MASK;
 		cond_resched();
 	}
 
-	rb_erase(&stable_node->node, &root_stable_tree);
+	rb_erase(&stable_node->node, &tree->stable);
 	free_stable_node(stable_node);
 }
 
@@ -484,7 +618,7 @@ static void remove_node_from_stable_tree(struct stable_node *stable_node)
  * a page to put something that might look like our key in page->mapping.
  *
  * include/linux/pagemap.h page_cache_get_speculative() is a good reference,
- * but this is different - made simpler by ksm_thread_mutex being held, but
+ * but this is different - made simpler by the tree mutex being held, but
  * interesting for assuming that no other use of the struct page could ever
  * put our expected_mapping into page->mapping (or a field of the union which
  * coincides with page->mapping).  The RCU calls are not for KSM at all, but
@@ -523,9 +657,12 @@ stale:
 /*
  * Removing rmap_item from stable or unstable tree.
  * This function will clean the information from the stable/unstable tree.
+ * Called with the mutex of the rmap_item's tree held.
  */
-static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
+static void __remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 {
+	struct ksm_tree *tree = rmap_item_tree(rmap_item);
+
 	if (rmap_item->address & STABLE_FLAG) {
 		struct stable_node *stable_node;
 		struct page *page;
@@ -541,9 +678,9 @@ static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		put_page(page);
 
 		if (stable_node->hlist.first)
-			ksm_pages_sharing--;
+			tree->pages_sharing--;
 		else
-			ksm_pages_shared--;
+			tree->pages_shared--;
 
 		put_anon_vma(rmap_item->anon_vma);
 		rmap_item->address &= PAGE_MASK;
@@ -552,31 +689,73 @@ static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		unsigned char age;
 		/*
 		 * Usually ksmd can and must skip the rb_erase, because
-		 * root_unstable_tree was already reset to RB_ROOT.
+		 * the unstable tree was already reset to RB_ROOT.
 		 * But be careful when an mm is exiting: do the rb_erase
 		 * if this rmap_item was inserted by this scan, rather
 		 * than left over from before.
 		 */
-		age = (unsigned char)(ksm_scan.seqnr - rmap_item->address);
+		age = (unsigned char)(ksm_seqnr - rmap_item->address);
 		BUG_ON(age > 1);
 		if (!age)
-			rb_erase(&rmap_item->node, &root_unstable_tree);
+			rb_erase(&rmap_item->node, &tree->unstable);
 
-		ksm_pages_unshared--;
+		tree->pages_unshared--;
 		rmap_item->address &= PAGE_MASK;
 	}
 out:
 	cond_resched();		/* we're called from many long loops */
 }
 
-static void remove_trailing_rmap_items(struct mm_slot *mm_slot,
-				       struct rmap_item **rmap_list)
+/*
+ * Only the ksmd thread scanning its mm inserts an rmap_item into a tree,
+ * and its tree does not change while it is linked there; but another
+ * ksmd thread may move it from the unstable to the stable tree, or the
+ * stable_node may go stale: so check the flags again under the mutex.
+ */
+static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
+{
+	struct ksm_tree *tree;
+
+	if (!(rmap_item->address & (STABLE_FLAG | UNSTABLE_FLAG))) {
+		cond_resched();
+		return;
+	}
+
+	tree = rmap_item_tree(rmap_item);
+	mutex_lock(&tree->mutex);
+	__remove_rmap_item_from_tree(rmap_item);
+	mutex_unlock(&tree->mutex);
+}
+
+/*
+ * The tree mutex cannot be taken while holding mmap_sem, so rmap_items
+ * dropped under mmap_sem are queued on a stale list, and only removed
+ * from their trees and freed by free_stale_rmap_items() after it.
+ */
+static inline void stale_rmap_item(struct rmap_item *rmap_item,
+				   struct rmap_item **stale_list)
+{
+	rmap_item->rmap_list = *stale_list;
+	*stale_list = rmap_item;
+}
+
+static void free_stale_rmap_items(struct rmap_item **stale_list)
+{
+	while (*stale_list) {
+		struct rmap_item *rmap_item = *stale_list;
+		*stale_list = rmap_item->rmap_list;
+		remove_rmap_item_from_tree(rmap_item);
+		free_rmap_item(rmap_item);
+	}
+}
+
+static void remove_trailing_rmap_items(struct rmap_item **rmap_list,
+				       struct rmap_item **stale_list)
 {
 	while (*rmap_list) {
 		struct rmap_item *rmap_item = *rmap_list;
 		*rmap_list = rmap_item->rmap_list;
-		remove_rmap_item_from_tree(rmap_item);
-		free_rmap_item(rmap_item);
+		stale_rmap_item(rmap_item, stale_list);
 	}
 }
 
@@ -616,18 +795,25 @@ static int unmerge_ksm_pages(struct vm_area_struct *vma,
  */
 static int unmerge_and_remove_all_rmap_items(void)
 {
-	struct mm_slot *mm_slot;
+	struct mm_slot *mm_slot, *next;
 	struct mm_struct *mm;
 	struct vm_area_struct *vma;
-	int err = 0;
+	struct rmap_item *stale_list = NULL;
+	int i, err = 0;
 
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(ksm_mm_head.mm_list.next,
+	/* ksmd threads are locked out: start them afresh when they resume */
+	for (i = 0; i < KSM_MAX_THREADS; i++) {
+		if (ksm_scans[i].mm_slot)
+			release_mm_slot(&ksm_scans[i]);
+	}
+	mm_slot = list_entry(ksm_mm_head.mm_list.next,
 						struct mm_slot, mm_list);
+	mm_slot->scanning = true;
+	ksm_mm_cursor = mm_slot;
 	spin_unlock(&ksm_mmlist_lock);
 
-	for (mm_slot = ksm_scan.mm_slot;
-			mm_slot != &ksm_mm_head; mm_slot = ksm_scan.mm_slot) {
+	while (mm_slot != &ksm_mm_head) {
 		mm = mm_slot->mm;
 		down_read(&mm->mmap_sem);
 		for (vma = mm->mmap; vma; vma = vma->vm_next) {
@@ -641,45 +827,74 @@ static int unmerge_and_remove_all_rmap_items(void)
 				goto error;
 		}
 
-		remove_trailing_rmap_items(mm_slot, &mm_slot->rmap_list);
+		remove_trailing_rmap_items(&mm_slot->rmap_list, &stale_list);
 
 		spin_lock(&ksm_mmlist_lock);
-		ksm_scan.mm_slot = list_entry(mm_slot->mm_list.next,
+		next = list_entry(mm_slot->mm_list.next,
 						struct mm_slot, mm_list);
+		next->scanning = true;
+		ksm_mm_cursor = next;
+		mm_slot->scanning = false;
 		if (ksm_test_exit(mm)) {
-			hlist_del(&mm_slot->link);
-			list_del(&mm_slot->mm_list);
+			remove_mm_slot(mm_slot);
 			spin_unlock(&ksm_mmlist_lock);
 
 			free_mm_slot(mm_slot);
 			clear_bit(MMF_VM_MERGEABLE, &mm->flags);
 			up_read(&mm->mmap_sem);
+			free_stale_rmap_items(&stale_list);
 			mmdrop(mm);
 		} else {
 			spin_unlock(&ksm_mmlist_lock);
 			up_read(&mm->mmap_sem);
+			free_stale_rmap_items(&stale_list);
 		}
+		mm_slot = next;
 	}
 
-	ksm_scan.seqnr = 0;
+	spin_lock(&ksm_mmlist_lock);
+	ksm_mm_head.scanning = false;
+	ksm_mm_cursor = &ksm_mm_head;
+	spin_unlock(&ksm_mmlist_lock);
+	ksm_seqnr = 0;
 	return 0;
 
 error:
 	up_read(&mm->mmap_sem);
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = &ksm_mm_head;
+	mm_slot->scanning = false;
+	ksm_mm_cursor = &ksm_mm_head;
 	spin_unlock(&ksm_mmlist_lock);
 	return err;
 }
 #endif /* CONFIG_SYSFS */
 
+/*
+ * The checksum only has to notice that a page has changed since the last
+ * scan, so it need not be as well mixed as jhash2.  Each word is added
+ * into one of four lanes, which is then multiplied by an odd constant:
+ * every step is invertible, so any change to a single word changes its
+ * lane; and the lanes are independent, so the loop is bounded by memory
+ * bandwidth rather than by the latency of the multiply.
+ */
 static u32 calc_checksum(struct page *page)
 {
-	u32 checksum;
-	void *addr = kmap_atomic(page);
-	checksum = jhash2(addr, PAGE_SIZE / 4, 17);
+	unsigned long *addr = kmap_atomic(page);
+	unsigned long a = 0, b = 0, c = 0, d = 0;
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(long); i += 4) {
+		a = (a + addr[i]) * GOLDEN_RATIO_PRIME;
+		b = (b + addr[i + 1]) * GOLDEN_RATIO_PRIME;
+		c = (c + addr[i + 2]) * GOLDEN_RATIO_PRIME;
+		d = (d + addr[i + 3]) * GOLDEN_RATIO_PRIME;
+	}
 	kunmap_atomic(addr);
-	return checksum;
+
+	a = (a + b) * GOLDEN_RATIO_PRIME;
+	a = (a + c) * GOLDEN_RATIO_PRIME;
+	a = (a + d) * GOLDEN_RATIO_PRIME;
+	return hash_long(a, 32);
 }
 
 static int memcmp_pages(struct page *page1, struct page *page2)
@@ -985,11 +1200,11 @@ static struct page *try_to_merge_two_pages(struct rmap_item *rmap_item,
  * with identical content to the page that we are scanning right now.
  *
  * This function returns the stable tree node of identical content if found,
- * NULL otherwise.
+ * NULL otherwise.  Called with the mutex of the nid tree held.
  */
-static struct page *stable_tree_search(struct page *page)
+static struct page *stable_tree_search(struct page *page, int nid)
 {
-	struct rb_node *node = root_stable_tree.rb_node;
+	struct rb_node *node = ksm_trees[nid].stable.rb_node;
 	struct stable_node *stable_node;
 
 	stable_node = page_stable_node(page);
@@ -1028,11 +1243,12 @@ static struct page *stable_tree_search(struct page *page)
  * into the stable tree.
  *
  * This function returns the stable tree node just allocated on success,
- * NULL otherwise.
+ * NULL otherwise.  Called with the mutex of the nid tree held.
  */
-static struct stable_node *stable_tree_insert(struct page *kpage)
+static struct stable_node *stable_tree_insert(struct page *kpage, int nid)
 {
-	struct rb_node **new = &root_stable_tree.rb_node;
+	struct ksm_tree *tree = &ksm_trees[nid];
+	struct rb_node **new = &tree->stable.rb_node;
 	struct rb_node *parent = NULL;
 	struct stable_node *stable_node;
 
@@ -1069,11 +1285,12 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 		return NULL;
 
 	rb_link_node(&stable_node->node, parent, new);
-	rb_insert_color(&stable_node->node, &root_stable_tree);
+	rb_insert_color(&stable_node->node, &tree->stable);
 
 	INIT_HLIST_HEAD(&stable_node->hlist);
 
 	stable_node->kpfn = page_to_pfn(kpage);
+	DO_NUMA(stable_node->nid = nid);
 	set_page_stable_node(kpage, stable_node);
 
 	return stable_node;
@@ -1091,15 +1308,18 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
  * to the currently scanned page, NULL otherwise.
  *
  * This function does both searching and inserting, because they share
- * the same walking algorithm in an rbtree.
+ * the same walking algorithm in an rbtree.  Called with the mutex of the
+ * nid tree held.
  */
 static
 struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 					      struct page *page,
-					      struct page **tree_pagep)
+					      struct page **tree_pagep,
+					      int nid)
 
 {
-	struct rb_node **new = &root_unstable_tree.rb_node;
+	struct ksm_tree *tree = &ksm_trees[nid];
+	struct rb_node **new = &tree->unstable.rb_node;
 	struct rb_node *parent = NULL;
 
 	while (*new) {
@@ -1121,6 +1341,15 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 			return NULL;
 		}
 
+		/*
+		 * If tree_page has been migrated to another node since it
+		 * was inserted, do not merge it across nodes here.
+		 */
+		if (!ksm_merge_across_nodes && page_to_nid(tree_page) != nid) {
+			put_page(tree_page);
+			return NULL;
+		}
+
 		ret = memcmp_pages(page, tree_page);
 
 		parent = *new;
@@ -1137,30 +1366,34 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 	}
 
 	rmap_item->address |= UNSTABLE_FLAG;
-	rmap_item->address |= (ksm_scan.seqnr & SEQNR_MASK);
+	rmap_item->address |= (ksm_seqnr & SEQNR_MASK);
+	DO_NUMA(rmap_item->nid = nid);
 	rb_link_node(&rmap_item->node, parent, new);
-	rb_insert_color(&rmap_item->node, &root_unstable_tree);
+	rb_insert_color(&rmap_item->node, &tree->unstable);
 
-	ksm_pages_unshared++;
+	tree->pages_unshared++;
 	return NULL;
 }
 
 /*
  * stable_tree_append - add another rmap_item to the linked list of
  * rmap_items hanging off a given node of the stable tree, all sharing
- * the same ksm page.
+ * the same ksm page.  Called with the mutex of that stable tree held.
  */
 static void stable_tree_append(struct rmap_item *rmap_item,
 			       struct stable_node *stable_node)
 {
+	struct ksm_tree *tree = stable_node_tree(stable_node);
+
 	rmap_item->head = stable_node;
 	rmap_item->address |= STABLE_FLAG;
+	DO_NUMA(rmap_item->nid = stable_node->nid);
 	hlist_add_head(&rmap_item->hlist, &stable_node->hlist);
 
 	if (rmap_item->hlist.next)
-		ksm_pages_sharing++;
+		tree->pages_sharing++;
 	else
-		ksm_pages_shared++;
+		tree->pages_shared++;
 }
 
 /*
@@ -1177,14 +1410,28 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	struct rmap_item *tree_rmap_item;
 	struct page *tree_page = NULL;
 	struct stable_node *stable_node;
+	struct ksm_tree *tree;
 	struct page *kpage;
 	unsigned int checksum;
+	int nid;
 	int err;
 
 	remove_rmap_item_from_tree(rmap_item);
 
+	/*
+	 * A forked ksm page is found in the tree of its stable_node,
+	 * any other page is looked for in the tree of its own node.
+	 */
+	stable_node = page_stable_node(page);
+	if (stable_node)
+		nid = NUMA(stable_node->nid);
+	else
+		nid = get_kpfn_nid(page_to_pfn(page));
+	tree = &ksm_trees[nid];
+
 	/* We first start with searching the page inside the stable tree */
-	kpage = stable_tree_search(page);
+	mutex_lock(&tree->mutex);
+	kpage = stable_tree_search(page, nid);
 	if (kpage) {
 		err = try_to_merge_with_ksm_page(rmap_item, page, kpage);
 		if (!err) {
@@ -1197,8 +1444,9 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			unlock_page(kpage);
 		}
 		put_page(kpage);
-		return;
+		goto out;
 	}
+	mutex_unlock(&tree->mutex);
 
 	/*
 	 * If the hash value of the page has changed from the last time
@@ -1212,8 +1460,9 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 		return;
 	}
 
+	mutex_lock(&tree->mutex);
 	tree_rmap_item =
-		unstable_tree_search_insert(rmap_item, page, &tree_page);
+		unstable_tree_search_insert(rmap_item, page, &tree_page, nid);
 	if (tree_rmap_item) {
 		kpage = try_to_merge_two_pages(rmap_item, page,
 						tree_rmap_item, tree_page);
@@ -1224,10 +1473,10 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 		 * tree, and insert it instead as new node in the stable tree.
 		 */
 		if (kpage) {
-			remove_rmap_item_from_tree(tree_rmap_item);
+			__remove_rmap_item_from_tree(tree_rmap_item);
 
 			lock_page(kpage);
-			stable_node = stable_tree_insert(kpage);
+			stable_node = stable_tree_insert(kpage, nid);
 			if (stable_node) {
 				stable_tree_append(tree_rmap_item, stable_node);
 				stable_tree_append(rmap_item, stable_node);
@@ -1246,9 +1495,11 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			}
 		}
 	}
+out:
+	mutex_unlock(&tree->mutex);
 }
 
-static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
+static struct rmap_item *get_next_rmap_item(struct ksm_scan *scan,
 					    struct rmap_item **rmap_list,
 					    unsigned long addr)
 {
@@ -1261,14 +1512,13 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 		if (rmap_item->address > addr)
 			break;
 		*rmap_list = rmap_item->rmap_list;
-		remove_rmap_item_from_tree(rmap_item);
-		free_rmap_item(rmap_item);
+		stale_rmap_item(rmap_item, &scan->stale_list);
 	}
 
 	rmap_item = alloc_rmap_item();
 	if (rmap_item) {
 		/* It has already been zeroed */
-		rmap_item->mm = mm_slot->mm;
+		rmap_item->mm = scan->mm_slot->mm;
 		rmap_item->address = addr;
 		rmap_item->rmap_list = *rmap_list;
 		*rmap_list = rmap_item;
@@ -1276,18 +1526,35 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 	return rmap_item;
 }
 
-static struct rmap_item *scan_get_next_rmap_item(struct page **page)
+/*
+ * Claim the next mm_slot after the cursor for a ksmd thread to scan,
+ * skipping those claimed by other threads.  When the cursor has come
+ * round to the end of the list, and no other thread is still scanning
+ * an mm_slot, a full scan is complete: reset the unstable trees for the
+ * next.  Returns NULL when there is nothing left to claim in this pass.
+ */
+static struct mm_slot *claim_mm_slot(void)
 {
-	struct mm_struct *mm;
 	struct mm_slot *slot;
-	struct vm_area_struct *vma;
-	struct rmap_item *rmap_item;
+	int nid;
 
-	if (list_empty(&ksm_mm_head.mm_list))
-		return NULL;
+	spin_lock(&ksm_mmlist_lock);
+	slot = ksm_mm_cursor;
+	do {
+		slot = list_entry(slot->mm_list.next, struct mm_slot, mm_list);
+	} while (slot != &ksm_mm_head && slot->scanning);
 
-	slot = ksm_scan.mm_slot;
 	if (slot == &ksm_mm_head) {
+		if (ksm_nr_scanning || ksm_mm_cursor == &ksm_mm_head) {
+			spin_unlock(&ksm_mmlist_lock);
+			return NULL;
+		}
+		ksm_mm_cursor = &ksm_mm_head;
+		ksm_seqnr++;
+		for (nid = 0; nid < nr_node_ids; nid++)
+			ksm_trees[nid].unstable = RB_ROOT;
+		spin_unlock(&ksm_mmlist_lock);
+
 		/*
 		 * A number of pages can hang around indefinitely on per-cpu
 		 * pagevecs, raised page count preventing write_protect_page
@@ -1299,22 +1566,36 @@ static struct rmap_item *scan_get_next_rmap_item(struct page **page)
 		 * so we don't IPI too often when pages_to_scan is set low).
 		 */
 		lru_add_drain_all();
+		return NULL;
+	}
 
-		root_unstable_tree = RB_ROOT;
+	slot->scanning = true;
+	ksm_mm_cursor = slot;
+	ksm_nr_scanning++;
+	spin_unlock(&ksm_mmlist_lock);
+	return slot;
+}
 
-		spin_lock(&ksm_mmlist_lock);
-		slot = list_entry(slot->mm_list.next, struct mm_slot, mm_list);
-		ksm_scan.mm_slot = slot;
-		spin_unlock(&ksm_mmlist_lock);
-		/*
-		 * Although we tested list_empty() above, a racing __ksm_exit
-		 * of the last mm on the list may have removed it since then.
-		 */
-		if (slot == &ksm_mm_head)
-			return NULL;
+static struct rmap_item *scan_get_next_rmap_item(struct ksm_scan *scan,
+						  struct page **page)
+{
+	struct mm_struct *mm;
+	struct mm_slot *slot;
+	struct vm_area_struct *vma;
+	struct rmap_item *rmap_item;
+
+	if (list_empty(&ksm_mm_head.mm_list))
+		return NULL;
+
+	slot = scan->mm_slot;
+	if (!slot) {
 next_mm:
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		slot = claim_mm_slot();
+		if (!slot)
+			return NULL;
+		scan->mm_slot = slot;
+		scan->address = 0;
+		scan->rmap_list = &slot->rmap_list;
 	}
 
 	mm = slot->mm;
@@ -1322,60 +1603,58 @@ next_mm:
 	if (ksm_test_exit(mm))
 		vma = NULL;
 	else
-		vma = find_vma(mm, ksm_scan.address);
+		vma = find_vma(mm, scan->address);
 
 	for (; vma; vma = vma->vm_next) {
 		if (!(vma->vm_flags & VM_MERGEABLE))
 			continue;
-		if (ksm_scan.address < vma->vm_start)
-			ksm_scan.address = vma->vm_start;
+		if (scan->address < vma->vm_start)
+			scan->address = vma->vm_start;
 		if (!vma->anon_vma)
-			ksm_scan.address = vma->vm_end;
+			scan->address = vma->vm_end;
 
-		while (ksm_scan.address < vma->vm_end) {
+		while (scan->address < vma->vm_end) {
 			if (ksm_test_exit(mm))
 				break;
-			*page = follow_page(vma, ksm_scan.address, FOLL_GET);
+			*page = follow_page(vma, scan->address, FOLL_GET);
 			if (IS_ERR_OR_NULL(*page)) {
-				ksm_scan.address += PAGE_SIZE;
+				scan->address += PAGE_SIZE;
 				cond_resched();
 				continue;
 			}
 			if (PageAnon(*page) ||
 			    page_trans_compound_anon(*page)) {
-				flush_anon_page(vma, *page, ksm_scan.address);
+				flush_anon_page(vma, *page, scan->address);
 				flush_dcache_page(*page);
-				rmap_item = get_next_rmap_item(slot,
-					ksm_scan.rmap_list, ksm_scan.address);
+				rmap_item = get_next_rmap_item(scan,
+					scan->rmap_list, scan->address);
 				if (rmap_item) {
-					ksm_scan.rmap_list =
+					scan->rmap_list =
 							&rmap_item->rmap_list;
-					ksm_scan.address += PAGE_SIZE;
+					scan->address += PAGE_SIZE;
 				} else
 					put_page(*page);
 				up_read(&mm->mmap_sem);
+				free_stale_rmap_items(&scan->stale_list);
 				return rmap_item;
 			}
 			put_page(*page);
-			ksm_scan.address += PAGE_SIZE;
+			scan->address += PAGE_SIZE;
 			cond_resched();
 		}
 	}
 
 	if (ksm_test_exit(mm)) {
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		scan->address = 0;
+		scan->rmap_list = &slot->rmap_list;
 	}
 	/*
 	 * Nuke all the rmap_items that are above this current rmap:
 	 * because there were no VM_MERGEABLE vmas with such addresses.
 	 */
-	remove_trailing_rmap_items(slot, ksm_scan.rmap_list);
+	remove_trailing_rmap_items(scan->rmap_list, &scan->stale_list);
 
-	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(slot->mm_list.next,
-						struct mm_slot, mm_list);
-	if (ksm_scan.address == 0) {
+	if (scan->address == 0) {
 		/*
 		 * We've completed a full scan of all vmas, holding mmap_sem
 		 * throughout, and found no VM_MERGEABLE: so do the same as
@@ -1385,46 +1664,56 @@ next_mm:
 		 * or when all VM_MERGEABLE areas have been unmapped (and
 		 * mmap_sem then protects against race with MADV_MERGEABLE).
 		 */
-		hlist_del(&slot->link);
-		list_del(&slot->mm_list);
+		spin_lock(&ksm_mmlist_lock);
+		remove_mm_slot(slot);
+		scan->mm_slot = NULL;
 		spin_unlock(&ksm_mmlist_lock);
 
 		free_mm_slot(slot);
 		clear_bit(MMF_VM_MERGEABLE, &mm->flags);
 		up_read(&mm->mmap_sem);
+		free_stale_rmap_items(&scan->stale_list);
 		mmdrop(mm);
 	} else {
-		spin_unlock(&ksm_mmlist_lock);
 		up_read(&mm->mmap_sem);
+		free_stale_rmap_items(&scan->stale_list);
 	}
 
-	/* Repeat until we've completed scanning the whole list */
-	slot = ksm_scan.mm_slot;
-	if (slot != &ksm_mm_head)
-		goto next_mm;
+	/*
+	 * Only give up the mm_slot once its stale rmap_items are gone: the
+	 * mm must not be freed while they may be found in a tree, nor may
+	 * the unstable trees be reset while they are being removed.
+	 */
+	spin_lock(&ksm_mmlist_lock);
+	release_mm_slot(scan);
+	spin_unlock(&ksm_mmlist_lock);
 
-	ksm_scan.seqnr++;
-	return NULL;
+	/* Repeat until we've completed scanning the whole list */
+	goto next_mm;
 }
 
 /**
  * ksm_do_scan  - the ksm scanner main worker function.
+ * @scan - the cursor of this ksmd thread.
  * @scan_npages - number of pages we want to scan before we return.
  */
-static void ksm_do_scan(unsigned int scan_npages)
+static void ksm_do_scan(struct ksm_scan *scan, unsigned int scan_npages)
 {
 	struct rmap_item *rmap_item;
 	struct page *uninitialized_var(page);
+	u64 start = task_sched_runtime(current);
 
 	while (scan_npages-- && likely(!freezing(current))) {
 		cond_resched();
-		rmap_item = scan_get_next_rmap_item(&page);
+		rmap_item = scan_get_next_rmap_item(scan, &page);
 		if (!rmap_item)
-			return;
+			break;
 		if (!PageKsm(page) || !in_stable_tree(rmap_item))
 			cmp_and_merge_page(page, rmap_item);
 		put_page(page);
+		scan->pages_scanned++;
 	}
+	scan->cpu_time += task_sched_runtime(current) - start;
 }
 
 static int ksmd_should_run(void)
@@ -1432,16 +1721,18 @@ static int ksmd_should_run(void)
 	return (ksm_run & KSM_RUN_MERGE) && !list_empty(&ksm_mm_head.mm_list);
 }
 
-static int ksm_scan_thread(void *nothing)
+static int ksm_scan_thread(void *data)
 {
+	struct ksm_scan *scan = data;
+
 	set_freezable();
 	set_user_nice(current, 5);
 
 	while (!kthread_should_stop()) {
-		mutex_lock(&ksm_thread_mutex);
+		down_read(&ksm_thread_sem);
 		if (ksmd_should_run())
-			ksm_do_scan(ksm_thread_pages_to_scan);
-		mutex_unlock(&ksm_thread_mutex);
+			ksm_do_scan(scan, ksm_thread_pages_to_scan);
+		up_read(&ksm_thread_sem);
 
 		try_to_freeze();
 
@@ -1453,6 +1744,44 @@ static int ksm_scan_thread(void *nothing)
 				ksmd_should_run() || kthread_should_stop());
 		}
 	}
+
+	/* Leave the rest of a half scanned mm_slot to the next pass */
+	spin_lock(&ksm_mmlist_lock);
+	if (scan->mm_slot)
+		release_mm_slot(scan);
+	spin_unlock(&ksm_mmlist_lock);
+	return 0;
+}
+
+/*
+ * Start or stop ksmd threads until nr of them are running.
+ * Called with ksm_threads_mutex held.
+ */
+static int ksm_set_nr_threads(unsigned int nr)
+{
+	struct ksm_scan *scan;
+	struct task_struct *thread;
+
+	while (ksm_nr_threads < nr) {
+		scan = &ksm_scans[ksm_nr_threads];
+		if (!ksm_nr_threads)
+			thread = kthread_run(ksm_scan_thread, scan, "ksmd");
+		else
+			thread = kthread_run(ksm_scan_thread, scan,
+					     "ksmd/%u", ksm_nr_threads);
+		if (IS_ERR(thread)) {
+			printk(KERN_ERR "ksm: creating kthread failed\n");
+			return PTR_ERR(thread);
+		}
+		scan->thread = thread;
+		ksm_nr_threads++;
+	}
+
+	while (ksm_nr_threads > nr) {
+		scan = &ksm_scans[--ksm_nr_threads];
+		kthread_stop(scan->thread);
+		scan->thread = NULL;
+	}
 	return 0;
 }
 
@@ -1518,7 +1847,7 @@ int __ksm_enter(struct mm_struct *mm)
 	 * down a little; when fork is followed by immediate exec, we don't
 	 * want ksmd to waste time setting up and tearing down an rmap_list.
 	 */
-	list_add_tail(&mm_slot->mm_list, &ksm_scan.mm_slot->mm_list);
+	list_add_tail(&mm_slot->mm_list, &ksm_mm_cursor->mm_list);
 	spin_unlock(&ksm_mmlist_lock);
 
 	set_bit(MMF_VM_MERGEABLE, &mm->flags);
@@ -1538,7 +1867,7 @@ void __ksm_exit(struct mm_struct *mm)
 	/*
 	 * This process is exiting: if it's straightforward (as is the
 	 * case when ksmd was never running), free mm_slot immediately.
-	 * But if it's at the cursor or has rmap_items linked to it, use
+	 * But if it's being scanned or has rmap_items linked to it, use
 	 * mmap_sem to synchronize with any break_cows before pagetables
 	 * are freed, and leave the mm_slot on the list for ksmd to free.
 	 * Beware: ksm may already have noticed it exiting and freed the slot.
@@ -1546,14 +1875,16 @@ void __ksm_exit(struct mm_struct *mm)
 
 	spin_lock(&ksm_mmlist_lock);
 	mm_slot = get_mm_slot(mm);
-	if (mm_slot && ksm_scan.mm_slot != mm_slot) {
+	if (mm_slot && !mm_slot->scanning) {
 		if (!mm_slot->rmap_list) {
-			hlist_del(&mm_slot->link);
-			list_del(&mm_slot->mm_list);
+			remove_mm_slot(mm_slot);
 			easy_to_free = 1;
 		} else {
+			if (ksm_mm_cursor == mm_slot)
+				ksm_mm_cursor = list_entry(mm_slot->mm_list.prev,
+							   struct mm_slot, mm_list);
 			list_move(&mm_slot->mm_list,
-				  &ksm_scan.mm_slot->mm_list);
+				  &ksm_mm_cursor->mm_list);
 		}
 	}
 	spin_unlock(&ksm_mmlist_lock);
@@ -1696,7 +2027,7 @@ out:
 	return ret;
 }
 
-#ifdef CONFIG_MIGRATION
+#if defined(CONFIG_MIGRATION) || defined(CONFIG_IDLE_PAGE_TRACKING)
 int rmap_walk_ksm(struct page *page, int (*rmap_one)(struct page *,
 		  struct vm_area_struct *, unsigned long, void *), void *arg)
 {
@@ -1746,7 +2077,9 @@ again:
 out:
 	return ret;
 }
+#endif
 
+#ifdef CONFIG_MIGRATION
 void ksm_migrate_page(struct page *newpage, struct page *oldpage)
 {
 	struct stable_node *stable_node;
@@ -1768,14 +2101,18 @@ static struct stable_node *ksm_check_stable_tree(unsigned long start_pfn,
 						 unsigned long end_pfn)
 {
 	struct rb_node *node;
+	int nid;
 
-	for (node = rb_first(&root_stable_tree); node; node = rb_next(node)) {
-		struct stable_node *stable_node;
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		for (node = rb_first(&ksm_trees[nid].stable); node;
+						node = rb_next(node)) {
+			struct stable_node *stable_node;
 
-		stable_node = rb_entry(node, struct stable_node, node);
-		if (stable_node->kpfn >= start_pfn &&
-		    stable_node->kpfn < end_pfn)
-			return stable_node;
+			stable_node = rb_entry(node, struct stable_node, node);
+			if (stable_node->kpfn >= start_pfn &&
+			    stable_node->kpfn < end_pfn)
+				return stable_node;
+		}
 	}
 	return NULL;
 }
@@ -1791,13 +2128,13 @@ static int ksm_memory_callback(struct notifier_block *self,
 		/*
 		 * Keep it very simple for now: just lock out ksmd and
 		 * MADV_UNMERGEABLE while any memory is going offline.
-		 * mutex_lock_nested() is necessary because lockdep was alarmed
-		 * that here we take ksm_thread_mutex inside notifier chain
+		 * down_write_nested() is necessary because lockdep was alarmed
+		 * that here we take ksm_thread_sem inside notifier chain
 		 * mutex, and later take notifier chain mutex inside
-		 * ksm_thread_mutex to unlock it.   But that's safe because both
+		 * ksm_thread_sem to unlock it.   But that's safe because both
 		 * are inside mem_hotplug_mutex.
 		 */
-		mutex_lock_nested(&ksm_thread_mutex, SINGLE_DEPTH_NESTING);
+		down_write_nested(&ksm_thread_sem, SINGLE_DEPTH_NESTING);
 		break;
 
 	case MEM_OFFLINE:
@@ -1805,6 +2142,7 @@ static int ksm_memory_callback(struct notifier_block *self,
 		 * Most of the work is done by page migration; but there might
 		 * be a few stable_nodes left over, still pointing to struct
 		 * pages which have been offlined: prune those from the tree.
+		 * No tree mutex is needed, with all ksmd threads locked out.
 		 */
 		while ((stable_node = ksm_check_stable_tree(mn->start_pfn,
 					mn->start_pfn + mn->nr_pages)) != NULL)
@@ -1812,7 +2150,7 @@ static int ksm_memory_callback(struct notifier_block *self,
 		/* fallthrough */
 
 	case MEM_CANCEL_OFFLINE:
-		mutex_unlock(&ksm_thread_mutex);
+		up_write(&ksm_thread_sem);
 		break;
 	}
 	return NOTIFY_OK;
@@ -1901,7 +2239,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 	 * on the list for when ksmd may be set running again).
 	 */
 
-	mutex_lock(&ksm_thread_mutex);
+	down_write(&ksm_thread_sem);
 	if (ksm_run != flags) {
 		ksm_run = flags;
 		if (flags & KSM_RUN_UNMERGE) {
@@ -1917,7 +2255,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 			}
 		}
 	}
-	mutex_unlock(&ksm_thread_mutex);
+	up_write(&ksm_thread_sem);
 
 	if (flags & KSM_RUN_MERGE)
 		wake_up_interruptible(&ksm_thread_wait);
@@ -1926,24 +2264,86 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 }
 KSM_ATTR(run);
 
+static ssize_t scan_threads_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_nr_threads);
+}
+
+static ssize_t scan_threads_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
+{
+	int err;
+	unsigned long nr_threads;
+
+	err = strict_strtoul(buf, 10, &nr_threads);
+	if (err || nr_threads < 1 || nr_threads > KSM_MAX_THREADS)
+		return -EINVAL;
+
+	mutex_lock(&ksm_threads_mutex);
+	err = ksm_set_nr_threads(nr_threads);
+	mutex_unlock(&ksm_threads_mutex);
+
+	return err ? err : count;
+}
+KSM_ATTR(scan_threads);
+
+#ifdef CONFIG_NUMA
+static ssize_t merge_across_nodes_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_merge_across_nodes);
+}
+
+static ssize_t merge_across_nodes_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	int err;
+	unsigned long knob;
+
+	err = strict_strtoul(buf, 10, &knob);
+	if (err || knob > 1)
+		return -EINVAL;
+
+	/*
+	 * Pages already merged stay in the tree they were merged in, but
+	 * new merges would then be looked for in a different tree: so only
+	 * allow a change while nothing is merged (e.g. after run 2).
+	 */
+	down_write(&ksm_thread_sem);
+	if (ksm_merge_across_nodes != knob) {
+		if (ksm_pages_shared())
+			err = -EBUSY;
+		else
+			ksm_merge_across_nodes = knob;
+	}
+	up_write(&ksm_thread_sem);
+
+	return err ? err : count;
+}
+KSM_ATTR(merge_across_nodes);
+#endif
+
 static ssize_t pages_shared_show(struct kobject *kobj,
 				 struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_shared);
+	return sprintf(buf, "%lu\n", ksm_pages_shared());
 }
 KSM_ATTR_RO(pages_shared);
 
 static ssize_t pages_sharing_show(struct kobject *kobj,
 				  struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_sharing);
+	return sprintf(buf, "%lu\n", ksm_pages_sharing());
 }
 KSM_ATTR_RO(pages_sharing);
 
 static ssize_t pages_unshared_show(struct kobject *kobj,
 				   struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_unshared);
+	return sprintf(buf, "%lu\n", ksm_pages_unshared());
 }
 KSM_ATTR_RO(pages_unshared);
 
@@ -1952,8 +2352,9 @@ static ssize_t pages_volatile_show(struct kobject *kobj,
 {
 	long ksm_pages_volatile;
 
-	ksm_pages_volatile = ksm_rmap_items - ksm_pages_shared
-				- ksm_pages_sharing - ksm_pages_unshared;
+	ksm_pages_volatile = atomic_long_read(&ksm_rmap_items)
+				- ksm_pages_shared() - ksm_pages_sharing()
+				- ksm_pages_unshared();
 	/*
 	 * It was not worth any locking to calculate that statistic,
 	 * but it might therefore sometimes be negative: conceal that.
@@ -1967,19 +2368,50 @@ KSM_ATTR_RO(pages_volatile);
 static ssize_t full_scans_show(struct kobject *kobj,
 			       struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_scan.seqnr);
+	return sprintf(buf, "%lu\n", ksm_seqnr);
 }
 KSM_ATTR_RO(full_scans);
 
+static ssize_t pages_scanned_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	unsigned long pages = 0;
+	int i;
+
+	for (i = 0; i < KSM_MAX_THREADS; i++)
+		pages += ksm_scans[i].pages_scanned;
+	return sprintf(buf, "%lu\n", pages);
+}
+KSM_ATTR_RO(pages_scanned);
+
+static ssize_t cpu_time_millisecs_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	u64 cpu_time = 0;
+	int i;
+
+	for (i = 0; i < KSM_MAX_THREADS; i++)
+		cpu_time += ksm_scans[i].cpu_time;
+	return sprintf(buf, "%llu\n",
+		       (unsigned long long)div_u64(cpu_time, NSEC_PER_MSEC));
+}
+KSM_ATTR_RO(cpu_time_millisecs);
+
 static struct attribute *ksm_attrs[] = {
 	&sleep_millisecs_attr.attr,
 	&pages_to_scan_attr.attr,
 	&run_attr.attr,
+	&scan_threads_attr.attr,
+#ifdef CONFIG_NUMA
+	&merge_across_nodes_attr.attr,
+#endif
 	&pages_shared_attr.attr,
 	&pages_sharing_attr.attr,
 	&pages_unshared_attr.attr,
 	&pages_volatile_attr.attr,
 	&full_scans_attr.attr,
+	&pages_scanned_attr.attr,
+	&cpu_time_millisecs_attr.attr,
 	NULL,
 };
 
@@ -1991,26 +2423,37 @@ static struct attribute_group ksm_attr_group = {
 
 static int __init ksm_init(void)
 {
-	struct task_struct *ksm_thread;
+	int nid;
 	int err;
 
 	err = ksm_slab_init();
 	if (err)
 		goto out;
 
-	ksm_thread = kthread_run(ksm_scan_thread, NULL, "ksmd");
-	if (IS_ERR(ksm_thread)) {
-		printk(KERN_ERR "ksm: creating kthread failed\n");
-		err = PTR_ERR(ksm_thread);
+	err = -ENOMEM;
+	ksm_trees = kcalloc(nr_node_ids, sizeof(*ksm_trees), GFP_KERNEL);
+	if (!ksm_trees)
 		goto out_free;
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		ksm_trees[nid].stable = RB_ROOT;
+		ksm_trees[nid].unstable = RB_ROOT;
+		mutex_init(&ksm_trees[nid].mutex);
 	}
 
+	mutex_lock(&ksm_threads_mutex);
+	err = ksm_set_nr_threads(1);
+	mutex_unlock(&ksm_threads_mutex);
+	if (err)
+		goto out_free_trees;
+
 #ifdef CONFIG_SYSFS
 	err = sysfs_create_group(mm_kobj, &ksm_attr_group);
 	if (err) {
 		printk(KERN_ERR "ksm: register sysfs failed\n");
-		kthread_stop(ksm_thread);
-		goto out_free;
+		mutex_lock(&ksm_threads_mutex);
+		ksm_set_nr_threads(0);
+		mutex_unlock(&ksm_threads_mutex);
+		goto out_free_trees;
 	}
 #else
 	ksm_run = KSM_RUN_MERGE;	/* no way for user to start it */
@@ -2019,13 +2462,15 @@ static int __init ksm_init(void)
 
 #ifdef CONFIG_MEMORY_HOTREMOVE
 	/*
-	 * Choose a high priority since the callback takes ksm_thread_mutex:
+	 * Choose a high priority since the callback takes ksm_thread_sem:
 	 * later callbacks could only be taking locks which nest within that.
 	 */
 	hotplug_memory_notifier(ksm_memory_callback, 100);
 #endif
 	return 0;
 
+out_free_trees:
+	kfree(ksm_trees);
 out_free:
 	ksm_slab_free();
 out:
@@ -30,6 +30,7 @@
 #include <linux/smp.h>
 #include <linux/page-flags.h>
 #include <linux/backing-dev.h>
+#include <linux/writeback.h>
 #include <linux/bit_spinlock.h>
 #include <linux/rcupdate.h>
 #include <linux/limits.h>
@@ -46,9 +47,10 @@
 #include <linux/seq_file.h>
 #include <linux/vmalloc.h>
 #include <linux/mm_inline.h>
-#include <linux/page_cgroup.h>
+#include <linux/swap_cgroup.h>
 #include <linux/cpu.h>
 #include <linux/oom.h>
+#include <linux/shmem_fs.h>
 #include "internal.h"
 #include <net/sock.h>
 #include <net/tcp_memcontrol.h>
@@ -87,6 +89,8 @@ enum mem_cgroup_stat_index {
 	MEM_CGROUP_STAT_CACHE, 	   /* # of pages charged as cache */
 	MEM_CGROUP_STAT_RSS,	   /* # of pages charged as anon rss */
 	MEM_CGROUP_STAT_FILE_MAPPED,  /* # of pages charged as file rss */
+	MEM_CGROUP_STAT_FILE_DIRTY,   /* # of dirty pages in page cache */
+	MEM_CGROUP_STAT_WRITEBACK,    /* # of pages under writeback */
 	MEM_CGROUP_STAT_SWAP, /* # of pages, swapped out */
 	MEM_CGROUP_STAT_NSTATS,
 };
@@ -95,6 +99,8 @@ static const char * const mem_cgroup_stat_names[] = {
 	"cache",
 	"rss",
 	"mapped_file",
+	"dirty",
+	"writeback",
 	"swap",
 };
 
@@ -286,6 +292,9 @@ struct mem_cgroup {
 	atomic_t	refcnt;
 
 	int	swappiness;
+	/* dirty limits, in percent of the memory the memcg may dirty */
+	int	dirty_ratio;
+	int	dirty_background_ratio;
 	/* OOM-Killer disable */
 	int		oom_kill_disable;
 
@@ -402,6 +411,40 @@ enum charge_type {
 #define MEM_CGROUP_RECLAIM_SHRINK_BIT	0x1
 #define MEM_CGROUP_RECLAIM_SHRINK	(1 << MEM_CGROUP_RECLAIM_SHRINK_BIT)
 
+/*
+ * page->memcg_data holds the mem_cgroup a page is charged to, with these
+ * flags in the low bits, which mem_cgroup pointers leave clear.  Changes
+ * that depend on the flags go through cmpxchg(), so charge, uncharge,
+ * migration and moving of charges agree on the state of a page without a
+ * lock of their own: beyond that, they rely on the page lock, or on
+ * zone->lru_lock for pages that may be on the LRU.
+ */
+enum {
+	PCG_USED,		/* the page is charged to the mem_cgroup */
+	PCG_MIGRATION,		/* under page migration */
+	NR_PCG_FLAGS,
+};
+
+#define PCG_FLAGS_MASK	((1UL << NR_PCG_FLAGS) - 1)
+#define PCG_USED_MASK	(1UL << PCG_USED)
+#define PCG_MIGRATION_MASK	(1UL << PCG_MIGRATION)
+
+static inline unsigned long page_memcg_data(struct page *page)
+{
+	return ACCESS_ONCE(page->memcg_data);
+}
+
+static inline struct mem_cgroup *memcg_data_to_memcg(unsigned long data)
+{
+	return (struct mem_cgroup *)(data & ~PCG_FLAGS_MASK);
+}
+
+static inline bool page_memcg_update(struct page *page, unsigned long old,
+				     unsigned long new)
+{
+	return cmpxchg(&page->memcg_data, old, new) == old;
+}
+
 static void mem_cgroup_get(struct mem_cgroup *memcg);
 static void mem_cgroup_put(struct mem_cgroup *memcg);
 
@@ -500,7 +543,7 @@ struct cgroup_subsys_state *mem_cgroup_css(struct mem_cgroup *memcg)
 }
 
 static struct mem_cgroup_per_zone *
-page_cgroup_zoneinfo(struct mem_cgroup *memcg, struct page *page)
+mem_cgroup_page_zoneinfo(struct mem_cgroup *memcg, struct page *page)
 {
 	int nid = page_to_nid(page);
 	int zid = page_zonenum(page);
@@ -1070,16 +1113,16 @@ struct lruvec *mem_cgroup_zone_lruvec(struct zone *zone,
 }
 
 /*
- * Following LRU functions are allowed to be used without PCG_LOCK.
- * Operations are called by routine of global LRU independently from memcg.
- * What we have to take care of here is validness of pc->mem_cgroup.
+ * Following LRU functions are called by routine of global LRU independently
+ * from memcg.  What we have to take care of here is validness of the
+ * page's mem_cgroup.
  *
- * Changes to pc->mem_cgroup happens when
+ * Changes to page->memcg_data happen when
  * 1. charge
  * 2. moving account
  * In typical case, "charge" is done before add-to-lru. Exception is SwapCache.
  * It is added to LRU before charge.
- * If PCG_USED bit is not set, page_cgroup is not added to this private LRU.
+ * If PCG_USED bit is not set, the page is not added to this private LRU.
  * When moving account, the page is not on LRU. It's isolated.
  */
 
@@ -1092,27 +1135,32 @@ struct lruvec *mem_cgroup_page_lruvec(struct page *page, struct zone *zone)
 {
 	struct mem_cgroup_per_zone *mz;
 	struct mem_cgroup *memcg;
-	struct page_cgroup *pc;
+	unsigned long data;
 
 	if (mem_cgroup_disabled())
 		return &zone->lruvec;
-
-	pc = lookup_page_cgroup(page);
-	memcg = pc->mem_cgroup;
+again:
+	data = page_memcg_data(page);
+	memcg = memcg_data_to_memcg(data);
 
 	/*
 	 * Surreptitiously switch any uncharged offlist page to root:
 	 * an uncharged page off lru does nothing to secure
 	 * its former mem_cgroup from sudden removal.
 	 *
-	 * Our caller holds lru_lock, and PageCgroupUsed is updated
-	 * under page_cgroup lock: between them, they make all uses
-	 * of pc->mem_cgroup safe.
+	 * Our caller holds lru_lock, and PCG_USED is updated atomically
+	 * with the mem_cgroup: between them, they make all uses of
+	 * page->memcg_data safe.
 	 */
-	if (!PageLRU(page) && !PageCgroupUsed(pc) && memcg != root_mem_cgroup)
-		pc->mem_cgroup = memcg = root_mem_cgroup;
+	if (!PageLRU(page) && !(data & PCG_USED_MASK) &&
+	    memcg != root_mem_cgroup) {
+		if (!page_memcg_update(page, data,
+				       (unsigned long)root_mem_cgroup))
+			goto again;
+		memcg = root_mem_cgroup;
+	}
 
-	mz = page_cgroup_zoneinfo(memcg, page);
+	mz = mem_cgroup_page_zoneinfo(memcg, page);
 	return &mz->lruvec;
 }
 
@@ -1261,6 +1309,23 @@ int mem_cgroup_swappiness(struct mem_cgroup *memcg)
 	return memcg->swappiness;
 }
 
+static int mem_cgroup_dirty_ratio(struct mem_cgroup *memcg)
+{
+	/* the root is limited by the global dirty limits alone */
+	if (memcg->css.cgroup->parent == NULL)
+		return vm_dirty_ratio;
+
+	return memcg->dirty_ratio;
+}
+
+static int mem_cgroup_dirty_background_ratio(struct mem_cgroup *memcg)
+{
+	if (memcg->css.cgroup->parent == NULL)
+		return dirty_background_ratio;
+
+	return memcg->dirty_background_ratio;
+}
+
 /*
  * memcg->moving_account is used for checking possibility that some thread is
  * calling move_account(). When a thread on CPU-A starts moving pages under
@@ -1303,7 +1368,7 @@ static void mem_cgroup_end_move(struct mem_cgroup *memcg)
  *
  * mem_cgroup_stolen() -  checking whether a cgroup is mc.from or not. This
  *			  is used for avoiding races in accounting.  If true,
- *			  pc->mem_cgroup may be overwritten.
+ *			  the mem_cgroup of a page may be overwritten.
  *
  * mem_cgroup_under_move() - checking a cgroup is mc.from or mc.to or
  *			  under hierarchy of moving cgroups. This is for
@@ -1936,18 +2001,13 @@ static bool mem_cgroup_handle_oom(struct mem_cgroup *memcg, gfp_t mask,
  *
  * Notes: Race condition
  *
- * We usually use page_cgroup_lock() for accessing page_cgroup member but
- * it tends to be costly. But considering some conditions, we doesn't need
- * to do so _always_.
- *
- * Considering "charge", lock_page_cgroup() is not required because all
- * file-stat operations happen after a page is attached to radix-tree. There
- * are no race with "charge".
+ * Considering "charge", there are no race because all file-stat operations
+ * happen after a page is attached to radix-tree.
  *
- * Considering "uncharge", we know that memcg doesn't clear pc->mem_cgroup
- * at "uncharge" intentionally. So, we always see valid pc->mem_cgroup even
- * if there are race with "uncharge". Statistics itself is properly handled
- * by flags.
+ * Considering "uncharge", we know that memcg doesn't clear the page's
+ * mem_cgroup at "uncharge" intentionally. So, we always see a valid
+ * mem_cgroup even if there are race with "uncharge". Statistics itself is
+ * properly handled by flags.
  *
  * Considering "move", this is an only case we see a race. To make the race
  * small, we check mm->moving_account and detect there are possibility of race
@@ -1958,12 +2018,12 @@ void __mem_cgroup_begin_update_page_stat(struct page *page,
 				bool *locked, unsigned long *flags)
 {
 	struct mem_cgroup *memcg;
-	struct page_cgroup *pc;
+	unsigned long data;
 
-	pc = lookup_page_cgroup(page);
 again:
-	memcg = pc->mem_cgroup;
-	if (unlikely(!memcg || !PageCgroupUsed(pc)))
+	data = page_memcg_data(page);
+	memcg = memcg_data_to_memcg(data);
+	if (unlikely(!memcg || !(data & PCG_USED_MASK)))
 		return;
 	/*
 	 * If this memory cgroup is not under account moving, we don't
@@ -1975,7 +2035,8 @@ again:
 		return;
 
 	move_lock_mem_cgroup(memcg, flags);
-	if (memcg != pc->mem_cgroup || !PageCgroupUsed(pc)) {
+	data = page_memcg_data(page);
+	if (memcg != memcg_data_to_memcg(data) || !(data & PCG_USED_MASK)) {
 		move_unlock_mem_cgroup(memcg, flags);
 		goto again;
 	}
@@ -1984,34 +2045,39 @@ again:
 
 void __mem_cgroup_end_update_page_stat(struct page *page, unsigned long *flags)
 {
-	struct page_cgroup *pc = lookup_page_cgroup(page);
-
 	/*
-	 * It's guaranteed that pc->mem_cgroup never changes while
-	 * lock is held because a routine modifies pc->mem_cgroup
-	 * should take move_lock_mem_cgroup().
+	 * It's guaranteed that the page's mem_cgroup never changes while
+	 * lock is held because a routine modifies it should take
+	 * move_lock_mem_cgroup().
 	 */
-	move_unlock_mem_cgroup(pc->mem_cgroup, flags);
+	move_unlock_mem_cgroup(memcg_data_to_memcg(page_memcg_data(page)),
+			       flags);
 }
 
 void mem_cgroup_update_page_stat(struct page *page,
 				 enum mem_cgroup_page_stat_item idx, int val)
 {
 	struct mem_cgroup *memcg;
-	struct page_cgroup *pc = lookup_page_cgroup(page);
-	unsigned long uninitialized_var(flags);
+	unsigned long data;
 
 	if (mem_cgroup_disabled())
 		return;
 
-	memcg = pc->mem_cgroup;
-	if (unlikely(!memcg || !PageCgroupUsed(pc)))
+	data = page_memcg_data(page);
+	memcg = memcg_data_to_memcg(data);
+	if (unlikely(!memcg || !(data & PCG_USED_MASK)))
 		return;
 
 	switch (idx) {
 	case MEMCG_NR_FILE_MAPPED:
 		idx = MEM_CGROUP_STAT_FILE_MAPPED;
 		break;
+	case MEMCG_NR_FILE_DIRTY:
+		idx = MEM_CGROUP_STAT_FILE_DIRTY;
+		break;
+	case MEMCG_NR_FILE_WRITEBACK:
+		idx = MEM_CGROUP_STAT_WRITEBACK;
+		break;
 	default:
 		BUG();
 	}
@@ -2301,7 +2367,7 @@ static int mem_cgroup_do_charge(struct mem_cgroup *memcg, gfp_t gfp_mask,
  * has TIF_MEMDIE, this function returns -EINTR while writing root_mem_cgroup
  * to *ptr. There are two reasons for this. 1: fatal threads should quit as soon
  * as possible without any hazards. 2: all pages should have a valid
- * pc->mem_cgroup. If mm is NULL and the caller doesn't pass a valid memcg
+ * mem_cgroup. If mm is NULL and the caller doesn't pass a valid memcg
  * pointer, that is treated as a charge to root_mem_cgroup.
  *
  * So __mem_cgroup_try_charge() will return
@@ -2503,49 +2569,182 @@ static struct mem_cgroup *mem_cgroup_lookup(unsigned short id)
 struct mem_cgroup *try_get_mem_cgroup_from_page(struct page *page)
 {
 	struct mem_cgroup *memcg = NULL;
-	struct page_cgroup *pc;
+	unsigned long data;
 	unsigned short id;
 	swp_entry_t ent;
 
 	VM_BUG_ON(!PageLocked(page));
 
-	pc = lookup_page_cgroup(page);
-	lock_page_cgroup(pc);
-	if (PageCgroupUsed(pc)) {
-		memcg = pc->mem_cgroup;
-		if (memcg && !css_tryget(&memcg->css))
+	/*
+	 * The mem_cgroup may lose the page to a concurrent move of charges
+	 * and be removed: rcu keeps it around until css_tryget() tells.
+	 */
+	rcu_read_lock();
+	data = page_memcg_data(page);
+	if (data & PCG_USED_MASK) {
+		memcg = memcg_data_to_memcg(data);
+		if (!css_tryget(&memcg->css))
 			memcg = NULL;
 	} else if (PageSwapCache(page)) {
 		ent.val = page_private(page);
 		id = lookup_swap_cgroup_id(ent);
-		rcu_read_lock();
 		memcg = mem_cgroup_lookup(id);
 		if (memcg && !css_tryget(&memcg->css))
 			memcg = NULL;
-		rcu_read_unlock();
 	}
-	unlock_page_cgroup(pc);
+	rcu_read_unlock();
 	return memcg;
 }
 
+/**
+ * mem_cgroup_dirty_info - dirty limits and dirty pages of a memcg
+ * @sys_available: number of globally dirtyable pages
+ * @id: css id of the memcg, or 0 for the memcg of the current task
+ * @info: filled in with the limits and page counts of the memcg
+ *
+ * The memory a memcg may dirty is what it can still charge, plus the
+ * file pages it already holds, capped by @sys_available; its dirty
+ * ratios apply to that.  Returns false if the memcg has no dirty limits
+ * of its own: it is the root memcg, or it is gone.
+ */
+bool mem_cgroup_dirty_info(unsigned long sys_available, unsigned short id,
+			   struct mem_cgroup_dirty_info *info)
+{
+	struct mem_cgroup *memcg;
+	unsigned long available;
+	long nr_dirty, nr_writeback;
+
+	if (mem_cgroup_disabled())
+		return false;
+
+	rcu_read_lock();
+	if (id)
+		memcg = mem_cgroup_lookup(id);
+	else
+		memcg = mem_cgroup_from_task(current);
+	if (!memcg || mem_cgroup_is_root(memcg) || !css_tryget(&memcg->css)) {
+		rcu_read_unlock();
+		return false;
+	}
+	rcu_read_unlock();
+
+	available = min(mem_cgroup_margin(memcg), sys_available);
+	available += mem_cgroup_nr_lru_pages(memcg, LRU_ALL_FILE);
+	available = min(available, sys_available);
+
+	info->dirty_thresh = available * memcg->dirty_ratio / 100;
+	info->background_thresh =
+		available * memcg->dirty_background_ratio / 100;
+	if (info->background_thresh >= info->dirty_thresh)
+		info->background_thresh = info->dirty_thresh / 2;
+
+	/* a racing move of charges may leave the percpu sums negative */
+	nr_dirty = mem_cgroup_read_stat(memcg, MEM_CGROUP_STAT_FILE_DIRTY);
+	nr_writeback = mem_cgroup_read_stat(memcg, MEM_CGROUP_STAT_WRITEBACK);
+	info->nr_file_dirty = max(nr_dirty, 0L);
+	info->nr_writeback = max(nr_writeback, 0L);
+	info->id = css_id(&memcg->css);
+
+	css_put(&memcg->css);
+	return true;
+}
+
+/**
+ * mem_cgroup_mark_mapping_dirty - record who dirties the pages of a mapping
+ * @mapping: the mapping @page belongs to
+ * @page: the page being dirtied
+ *
+ * The first dirty page of @mapping makes its memcg the owner of the
+ * mapping's dirty pages; a page dirtied on behalf of another memcg makes
+ * the mapping shared.  Writeback for a memcg only looks at the mappings
+ * it owns and the shared ones.  Called under mapping->tree_lock, before
+ * @page is tagged dirty.
+ */
+void mem_cgroup_mark_mapping_dirty(struct address_space *mapping,
+				   struct page *page)
+{
+	struct mem_cgroup *memcg;
+	unsigned long data;
+	unsigned short id = 0;
+
+	if (mem_cgroup_disabled())
+		return;
+
+	rcu_read_lock();
+	data = page_memcg_data(page);
+	memcg = memcg_data_to_memcg(data);
+	if (memcg && (data & PCG_USED_MASK))
+		id = css_id(&memcg->css);
+	rcu_read_unlock();
+
+	if (!mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+		mapping->dirty_memcg_id = id;
+	else if (mapping->dirty_memcg_id != id)
+		mapping->dirty_memcg_id = 0;
+}
+
+/*
+ * Whether writeback for the memcg with css id @id should look at
+ * @mapping: it does if the memcg owns the dirty pages of @mapping or if
+ * nobody does.
+ */
+bool mem_cgroup_mapping_dirtied_by(struct address_space *mapping,
+				   unsigned short id)
+{
+	unsigned short owner = ACCESS_ONCE(mapping->dirty_memcg_id);
+
+	return !owner || owner == id;
+}
+
+#ifdef CONFIG_BLK_CGROUP
+/**
+ * mem_cgroup_page_blkcg_css - blkio state of the cgroup a page is charged to
+ * @page: the page
+ *
+ * Returns the blkio css of the cgroup whose memcg @page is charged to,
+ * with a reference held, if the memory and blkio controllers are mounted
+ * together and that is not the root cgroup; NULL otherwise.  This lets
+ * the block layer charge writeback I/O to the cgroup that dirtied the
+ * pages rather than to the flusher thread issuing it.
+ */
+struct cgroup_subsys_state *mem_cgroup_page_blkcg_css(struct page *page)
+{
+	struct cgroup_subsys_state *css = NULL;
+	struct mem_cgroup *memcg;
+	unsigned long data;
+
+	if (mem_cgroup_disabled())
+		return NULL;
+
+	rcu_read_lock();
+	data = page_memcg_data(page);
+	memcg = memcg_data_to_memcg(data);
+	if (memcg && (data & PCG_USED_MASK) && !mem_cgroup_is_root(memcg)) {
+		css = cgroup_subsys_state(memcg->css.cgroup, blkio_subsys_id);
+		if (css && !css_tryget(css))
+			css = NULL;
+	}
+	rcu_read_unlock();
+	return css;
+}
+#endif
+
 static void __mem_cgroup_commit_charge(struct mem_cgroup *memcg,
 				       struct page *page,
 				       unsigned int nr_pages,
 				       enum charge_type ctype,
 				       bool lrucare)
 {
-	struct page_cgroup *pc = lookup_page_cgroup(page);
 	struct zone *uninitialized_var(zone);
 	struct lruvec *lruvec;
 	bool was_on_lru = false;
 	bool anon;
 
-	lock_page_cgroup(pc);
-	VM_BUG_ON(PageCgroupUsed(pc));
 	/*
-	 * we don't need page_cgroup_lock about tail pages, becase they are not
-	 * accessed by any other context at this point.
+	 * The page is either new, or locked: nobody else charges or
+	 * uncharges it meanwhile.
 	 */
+	VM_BUG_ON(page_memcg_data(page) & PCG_USED_MASK);
 
 	/*
 	 * In some cases, SwapCache and FUSE(splice_buf->radixtree), the page
@@ -2555,27 +2754,23 @@ static void __mem_cgroup_commit_charge(struct mem_cgroup *memcg,
 		zone = page_zone(page);
 		spin_lock_irq(&zone->lru_lock);
 		if (PageLRU(page)) {
-			lruvec = mem_cgroup_zone_lruvec(zone, pc->mem_cgroup);
+			lruvec = mem_cgroup_zone_lruvec(zone,
+				memcg_data_to_memcg(page_memcg_data(page)));
 			ClearPageLRU(page);
 			del_page_from_lru_list(page, lruvec, page_lru(page));
 			was_on_lru = true;
 		}
 	}
 
-	pc->mem_cgroup = memcg;
 	/*
-	 * We access a page_cgroup asynchronously without lock_page_cgroup().
-	 * Especially when a page_cgroup is taken from a page, pc->mem_cgroup
-	 * is accessed after testing USED bit. To make pc->mem_cgroup visible
-	 * before USED bit, we need memory barrier here.
-	 * See mem_cgroup_add_lru_list(), etc.
- 	 */
-	smp_wmb();
-	SetPageCgroupUsed(pc);
+	 * The page's mem_cgroup is read without locks, after testing the
+	 * USED bit: set both in one go.  See mem_cgroup_page_lruvec(), etc.
+	 */
+	page->memcg_data = (unsigned long)memcg | PCG_USED_MASK;
 
 	if (lrucare) {
 		if (was_on_lru) {
-			lruvec = mem_cgroup_zone_lruvec(zone, pc->mem_cgroup);
+			lruvec = mem_cgroup_zone_lruvec(zone, memcg);
 			VM_BUG_ON(PageLRU(page));
 			SetPageLRU(page);
 			add_page_to_lru_list(page, lruvec, page_lru(page));
@@ -2589,7 +2784,6 @@ static void __mem_cgroup_commit_charge(struct mem_cgroup *memcg,
 		anon = false;
 
 	mem_cgroup_charge_statistics(memcg, anon, nr_pages);
-	unlock_page_cgroup(pc);
 
 	/*
 	 * "charge_statistics" updated event counter. Then, check it.
@@ -2601,7 +2795,7 @@ static void __mem_cgroup_commit_charge(struct mem_cgroup *memcg,
 
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 
-#define PCGF_NOCOPY_AT_SPLIT (1 << PCG_LOCK | 1 << PCG_MIGRATION)
+#define PCGF_NOCOPY_AT_SPLIT PCG_MIGRATION_MASK
 /*
  * Because tail pages are not marked as "used", set it. We're under
  * zone->lru_lock, 'splitting on pmd' and compound_lock.
@@ -2610,18 +2804,12 @@ static void __mem_cgroup_commit_charge(struct mem_cgroup *memcg,
  */
 void mem_cgroup_split_huge_fixup(struct page *head)
 {
-	struct page_cgroup *head_pc = lookup_page_cgroup(head);
-	struct page_cgroup *pc;
 	int i;
 
 	if (mem_cgroup_disabled())
 		return;
-	for (i = 1; i < HPAGE_PMD_NR; i++) {
-		pc = head_pc + i;
-		pc->mem_cgroup = head_pc->mem_cgroup;
-		smp_wmb();/* see __commit_charge() */
-		pc->flags = head_pc->flags & ~PCGF_NOCOPY_AT_SPLIT;
-	}
+	for (i = 1; i < HPAGE_PMD_NR; i++)
+		head[i].memcg_data = head->memcg_data & ~PCGF_NOCOPY_AT_SPLIT;
 }
 #endif /* CONFIG_TRANSPARENT_HUGEPAGE */
 
@@ -2629,7 +2817,6 @@ void mem_cgroup_split_huge_fixup(struct page *head)
  * mem_cgroup_move_account - move account of the page
  * @page: the page
  * @nr_pages: number of regular pages (>1 for huge pages)
- * @pc:	page_cgroup of the page.
  * @from: mem_cgroup which the page is moved from.
  * @to:	mem_cgroup which the page is moved to. @from != @to.
  *
@@ -2642,11 +2829,10 @@ void mem_cgroup_split_huge_fixup(struct page *head)
  */
 static int mem_cgroup_move_account(struct page *page,
 				   unsigned int nr_pages,
-				   struct page_cgroup *pc,
 				   struct mem_cgroup *from,
 				   struct mem_cgroup *to)
 {
-	unsigned long flags;
+	unsigned long flags, old;
 	int ret;
 	bool anon = PageAnon(page);
 
@@ -2662,13 +2848,19 @@ static int mem_cgroup_move_account(struct page *page,
 	if (nr_pages > 1 && !PageTransHuge(page))
 		goto out;
 
-	lock_page_cgroup(pc);
+	move_lock_mem_cgroup(from, &flags);
 
+	/*
+	 * Uncharge and migration may update the flags meanwhile.  The
+	 * caller should have done css_get on "to".
+	 */
 	ret = -EINVAL;
-	if (!PageCgroupUsed(pc) || pc->mem_cgroup != from)
-		goto unlock;
-
-	move_lock_mem_cgroup(from, &flags);
+	do {
+		old = page_memcg_data(page);
+		if (!(old & PCG_USED_MASK) || memcg_data_to_memcg(old) != from)
+			goto unlock;
+	} while (!page_memcg_update(page, old,
+			(unsigned long)to | (old & PCG_FLAGS_MASK)));
 
 	if (!anon && page_mapped(page)) {
 		/* Update mapped_file data for mem_cgroup */
@@ -2677,10 +2869,21 @@ static int mem_cgroup_move_account(struct page *page,
 		__this_cpu_inc(to->stat->count[MEM_CGROUP_STAT_FILE_MAPPED]);
 		preempt_enable();
 	}
+	/* Only page cache that accounts dirty pages has them in the stats */
+	if (!anon && PageDirty(page) && page->mapping &&
+	    mapping_cap_account_dirty(page->mapping)) {
+		preempt_disable();
+		__this_cpu_dec(from->stat->count[MEM_CGROUP_STAT_FILE_DIRTY]);
+		__this_cpu_inc(to->stat->count[MEM_CGROUP_STAT_FILE_DIRTY]);
+		preempt_enable();
+	}
+	if (PageWriteback(page)) {
+		preempt_disable();
+		__this_cpu_dec(from->stat->count[MEM_CGROUP_STAT_WRITEBACK]);
+		__this_cpu_inc(to->stat->count[MEM_CGROUP_STAT_WRITEBACK]);
+		preempt_enable();
+	}
 	mem_cgroup_charge_statistics(from, anon, -nr_pages);
-
-	/* caller should have done css_get */
-	pc->mem_cgroup = to;
 	mem_cgroup_charge_statistics(to, anon, nr_pages);
 	/*
 	 * We charges against "to" which may not have any tasks. Then, "to"
@@ -2689,10 +2892,9 @@ static int mem_cgroup_move_account(struct page *page,
 	 * guaranteed that "to" is never removed. So, we don't check rmdir
 	 * status here.
 	 */
-	move_unlock_mem_cgroup(from, &flags);
 	ret = 0;
 unlock:
-	unlock_page_cgroup(pc);
+	move_unlock_mem_cgroup(from, &flags);
 	/*
 	 * check events
 	 */
@@ -2707,7 +2909,6 @@ out:
  */
 
 static int mem_cgroup_move_parent(struct page *page,
-				  struct page_cgroup *pc,
 				  struct mem_cgroup *child)
 {
 	struct mem_cgroup *parent;
@@ -2737,8 +2938,7 @@ static int mem_cgroup_move_parent(struct page *page,
 	if (nr_pages > 1)
 		flags = compound_lock_irqsave(page);
 
-	ret = mem_cgroup_move_account(page, nr_pages,
-				pc, child, parent);
+	ret = mem_cgroup_move_account(page, nr_pages, child, parent);
 	if (!ret)
 		__mem_cgroup_cancel_local_charge(child, nr_pages);
 
@@ -2797,7 +2997,7 @@ int mem_cgroup_newpage_charge(struct page *page,
 /*
  * While swap-in, try_charge -> commit or cancel, the page is locked.
  * And when try_charge() successfully returns, one refcnt to memcg without
- * struct page_cgroup is acquired. This refcnt will be consumed by
+ * a page is acquired. This refcnt will be consumed by
  * "commit()" or removed by "cancel()"
  */
 static int __mem_cgroup_try_charge_swapin(struct mm_struct *mm,
@@ -2806,10 +3006,8 @@ static int __mem_cgroup_try_charge_swapin(struct mm_struct *mm,
 					  struct mem_cgroup **memcgp)
 {
 	struct mem_cgroup *memcg;
-	struct page_cgroup *pc;
 	int ret;
 
-	pc = lookup_page_cgroup(page);
 	/*
 	 * Every swap fault against a single page tries to charge the
 	 * page, bail as early as possible.  shmem_unuse() encounters
@@ -2817,7 +3015,7 @@ static int __mem_cgroup_try_charge_swapin(struct mm_struct *mm,
 	 * the page lock, which serializes swap cache removal, which
 	 * in turn serializes uncharging.
 	 */
-	if (PageCgroupUsed(pc))
+	if (page_memcg_data(page) & PCG_USED_MASK)
 		return 0;
 	if (!do_swap_account)
 		goto charge_cur_mm;
@@ -2991,7 +3189,7 @@ __mem_cgroup_uncharge_common(struct page *page, enum charge_type ctype,
 {
 	struct mem_cgroup *memcg = NULL;
 	unsigned int nr_pages = 1;
-	struct page_cgroup *pc;
+	unsigned long old;
 	bool anon;
 
 	if (mem_cgroup_disabled())
@@ -3003,20 +3201,14 @@ __mem_cgroup_uncharge_common(struct page *page, enum charge_type ctype,
 		nr_pages <<= compound_order(page);
 		VM_BUG_ON(!PageTransHuge(page));
 	}
+again:
 	/*
-	 * Check if our page_cgroup is valid
+	 * Check if the page is charged
 	 */
-	pc = lookup_page_cgroup(page);
-	if (unlikely(!PageCgroupUsed(pc)))
+	old = page_memcg_data(page);
+	if (unlikely(!(old & PCG_USED_MASK)))
 		return NULL;
 
-	lock_page_cgroup(pc);
-
-	memcg = pc->mem_cgroup;
-
-	if (!PageCgroupUsed(pc))
-		goto unlock_out;
-
 	anon = PageAnon(page);
 
 	switch (ctype) {
@@ -3031,7 +3223,7 @@ __mem_cgroup_uncharge_common(struct page *page, enum charge_type ctype,
 	case MEM_CGROUP_CHARGE_TYPE_DROP:
 		/* See mem_cgroup_prepare_migration() */
 		if (page_mapped(page))
-			goto unlock_out;
+			return NULL;
 		/*
 		 * Pages under migration may not be uncharged.  But
 		 * end_migration() /must/ be the one uncharging the
@@ -3039,34 +3231,38 @@ __mem_cgroup_uncharge_common(struct page *page, enum charge_type ctype,
 		 * here with the migration bit still set.  See the
 		 * res_counter handling below.
 		 */
-		if (!end_migration && PageCgroupMigration(pc))
-			goto unlock_out;
+		if (!end_migration && (old & PCG_MIGRATION_MASK))
+			return NULL;
 		break;
 	case MEM_CGROUP_CHARGE_TYPE_SWAPOUT:
 		if (!PageAnon(page)) {	/* Shared memory */
 			if (page->mapping && !page_is_file_cache(page))
-				goto unlock_out;
+				return NULL;
 		} else if (page_mapped(page)) /* Anon */
-				goto unlock_out;
+				return NULL;
 		break;
 	default:
 		break;
 	}
 
-	mem_cgroup_charge_statistics(memcg, anon, -nr_pages);
-
-	ClearPageCgroupUsed(pc);
 	/*
-	 * pc->mem_cgroup is not cleared here. It will be accessed when it's
-	 * freed from LRU. This is safe because uncharged page is expected not
-	 * to be reused (freed soon). Exception is SwapCache, it's handled by
-	 * special functions.
+	 * The mem_cgroup is not cleared here. It will be accessed when the
+	 * page is freed from LRU. This is safe because uncharged page is
+	 * expected not to be reused (freed soon). Exception is SwapCache,
+	 * it's handled by special functions.
+	 *
+	 * Moving the charge, or starting migration, meanwhile makes us look
+	 * again.
 	 */
+	if (!page_memcg_update(page, old, old & ~PCG_USED_MASK))
+		goto again;
+
+	memcg = memcg_data_to_memcg(old);
+	mem_cgroup_charge_statistics(memcg, anon, -nr_pages);
 
-	unlock_page_cgroup(pc);
 	/*
-	 * even after unlock, we have memcg->res.usage here and this memcg
-	 * will never be freed.
+	 * even after clearing USED, we have memcg->res.usage here and this
+	 * memcg will never be freed.
 	 */
 	memcg_check_events(memcg, page);
 	if (do_swap_account && ctype == MEM_CGROUP_CHARGE_TYPE_SWAPOUT) {
@@ -3082,10 +3278,6 @@ __mem_cgroup_uncharge_common(struct page *page, enum charge_type ctype,
 		mem_cgroup_do_uncharge(memcg, nr_pages, ctype);
 
 	return memcg;
-
-unlock_out:
-	unlock_page_cgroup(pc);
-	return NULL;
 }
 
 void mem_cgroup_uncharge_page(struct page *page)
@@ -3261,7 +3453,7 @@ void mem_cgroup_prepare_migration(struct page *page, struct page *newpage,
 				  struct mem_cgroup **memcgp)
 {
 	struct mem_cgroup *memcg = NULL;
-	struct page_cgroup *pc;
+	unsigned long old, new;
 	enum charge_type ctype;
 
 	*memcgp = NULL;
@@ -3270,11 +3462,12 @@ void mem_cgroup_prepare_migration(struct page *page, struct page *newpage,
 	if (mem_cgroup_disabled())
 		return;
 
-	pc = lookup_page_cgroup(page);
-	lock_page_cgroup(pc);
-	if (PageCgroupUsed(pc)) {
-		memcg = pc->mem_cgroup;
-		css_get(&memcg->css);
+	rcu_read_lock();
+	do {
+		old = page_memcg_data(page);
+		if (!(old & PCG_USED_MASK))
+			break;
+		new = old;
 		/*
 		 * At migrating an anonymous page, its mapcount goes down
 		 * to 0 and uncharge() will be called. But, even if it's fully
@@ -3305,9 +3498,15 @@ void mem_cgroup_prepare_migration(struct page *page, struct page *newpage,
 		 * hook to usual swap-out path will catch the event.
 		 */
 		if (PageAnon(page))
-			SetPageCgroupMigration(pc);
-	}
-	unlock_page_cgroup(pc);
+			new |= PCG_MIGRATION_MASK;
+		if (new == old || page_memcg_update(page, old, new)) {
+			memcg = memcg_data_to_memcg(old);
+			/* rcu keeps it around, see try_get_mem_cgroup_from_page() */
+			css_get(&memcg->css);
+			break;
+		}
+	} while (1);
+	rcu_read_unlock();
 	/*
 	 * If the page is not charged at this point,
 	 * we return here.
@@ -3339,7 +3538,6 @@ void mem_cgroup_end_migration(struct mem_cgroup *memcg,
 	struct page *oldpage, struct page *newpage, bool migration_ok)
 {
 	struct page *used, *unused;
-	struct page_cgroup *pc;
 	bool anon;
 
 	if (!memcg)
@@ -3364,10 +3562,7 @@ void mem_cgroup_end_migration(struct mem_cgroup *memcg,
 	 * of the page goes down to zero, temporarly.
 	 * Clear the flag and check the page should be charged.
 	 */
-	pc = lookup_page_cgroup(oldpage);
-	lock_page_cgroup(pc);
-	ClearPageCgroupMigration(pc);
-	unlock_page_cgroup(pc);
+	clear_bit(PCG_MIGRATION, &oldpage->memcg_data);
 
 	/*
 	 * If a page is a file cache, radix-tree replacement is very atomic
@@ -3397,21 +3592,23 @@ void mem_cgroup_replace_page_cache(struct page *oldpage,
 				  struct page *newpage)
 {
 	struct mem_cgroup *memcg = NULL;
-	struct page_cgroup *pc;
+	unsigned long old;
 	enum charge_type type = MEM_CGROUP_CHARGE_TYPE_CACHE;
 
 	if (mem_cgroup_disabled())
 		return;
 
-	pc = lookup_page_cgroup(oldpage);
 	/* fix accounting on old pages */
-	lock_page_cgroup(pc);
-	if (PageCgroupUsed(pc)) {
-		memcg = pc->mem_cgroup;
-		mem_cgroup_charge_statistics(memcg, false, -1);
-		ClearPageCgroupUsed(pc);
-	}
-	unlock_page_cgroup(pc);
+	do {
+		old = page_memcg_data(oldpage);
+		if (!(old & PCG_USED_MASK))
+			break;
+		if (page_memcg_update(oldpage, old, old & ~PCG_USED_MASK)) {
+			memcg = memcg_data_to_memcg(old);
+			mem_cgroup_charge_statistics(memcg, false, -1);
+			break;
+		}
+	} while (1);
 
 	/*
 	 * When called from shmem_replace_page(), in some cases the
@@ -3422,44 +3619,26 @@ void mem_cgroup_replace_page_cache(struct page *oldpage,
 	/*
 	 * Even if newpage->mapping was NULL before starting replacement,
 	 * the newpage may be on LRU(or pagevec for LRU) already. We lock
-	 * LRU while we overwrite pc->mem_cgroup.
+	 * LRU while we overwrite its mem_cgroup.
 	 */
 	__mem_cgroup_commit_charge(memcg, newpage, 1, type, true);
 }
 
 #ifdef CONFIG_DEBUG_VM
-static struct page_cgroup *lookup_page_cgroup_used(struct page *page)
-{
-	struct page_cgroup *pc;
-
-	pc = lookup_page_cgroup(page);
-	/*
-	 * Can be NULL while feeding pages into the page allocator for
-	 * the first time, i.e. during boot or memory hotplug;
-	 * or when mem_cgroup_disabled().
-	 */
-	if (likely(pc) && PageCgroupUsed(pc))
-		return pc;
-	return NULL;
-}
-
 bool mem_cgroup_bad_page_check(struct page *page)
 {
 	if (mem_cgroup_disabled())
 		return false;
 
-	return lookup_page_cgroup_used(page) != NULL;
+	return page_memcg_data(page) & PCG_USED_MASK;
 }
 
 void mem_cgroup_print_bad_page(struct page *page)
 {
-	struct page_cgroup *pc;
+	unsigned long data = page_memcg_data(page);
 
-	pc = lookup_page_cgroup_used(page);
-	if (pc) {
-		printk(KERN_ALERT "pc:%p pc->flags:%lx pc->mem_cgroup:%p\n",
-		       pc, pc->flags, pc->mem_cgroup);
-	}
+	if (data & PCG_USED_MASK)
+		printk(KERN_ALERT "page->memcg_data:%lx\n", data);
 }
 #endif
 
@@ -3686,9 +3865,9 @@ unsigned long mem_cgroup_soft_limit_reclaim(struct zone *zone, int order,
 }
 
 /*
- * Traverse a specified page_cgroup list and try to drop them all.  This doesn't
- * reclaim the pages page themselves - it just removes the page_cgroups.
- * Returns true if some page_cgroups were not freed, indicating that the caller
+ * Traverse a specified lru list and try to move all its pages' charges to
+ * the parent.  This doesn't reclaim the pages themselves.
+ * Returns true if some pages were not moved, indicating that the caller
  * must retry this operation.
  */
 static bool mem_cgroup_force_empty_list(struct mem_cgroup *memcg,
@@ -3709,7 +3888,6 @@ static bool mem_cgroup_force_empty_list(struct mem_cgroup *memcg,
 	loop += 256;
 	busy = NULL;
 	while (loop--) {
-		struct page_cgroup *pc;
 		struct page *page;
 
 		spin_lock_irqsave(&zone->lru_lock, flags);
@@ -3726,10 +3904,8 @@ static bool mem_cgroup_force_empty_list(struct mem_cgroup *memcg,
 		}
 		spin_unlock_irqrestore(&zone->lru_lock, flags);
 
-		pc = lookup_page_cgroup(page);
-
-		if (mem_cgroup_move_parent(page, pc, memcg)) {
-			/* found lock contention or "pc" is obsolete. */
+		if (mem_cgroup_move_parent(page, memcg)) {
+			/* found lock contention or the page is obsolete. */
 			busy = page;
 			cond_resched();
 		} else
@@ -4266,6 +4442,43 @@ static int mem_cgroup_swappiness_write(struct cgroup *cgrp, struct cftype *cft,
 	return 0;
 }
 
+static u64 mem_cgroup_dirty_ratio_read(struct cgroup *cgrp, struct cftype *cft)
+{
+	return mem_cgroup_dirty_ratio(mem_cgroup_from_cont(cgrp));
+}
+
+static int mem_cgroup_dirty_ratio_write(struct cgroup *cgrp, struct cftype *cft,
+					u64 val)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_cont(cgrp);
+
+	/* the root follows vm.dirty_ratio */
+	if (val > 100 || cgrp->parent == NULL)
+		return -EINVAL;
+
+	memcg->dirty_ratio = val;
+	return 0;
+}
+
+static u64 mem_cgroup_dirty_background_ratio_read(struct cgroup *cgrp,
+						  struct cftype *cft)
+{
+	return mem_cgroup_dirty_background_ratio(mem_cgroup_from_cont(cgrp));
+}
+
+static int mem_cgroup_dirty_background_ratio_write(struct cgroup *cgrp,
+						   struct cftype *cft, u64 val)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_cont(cgrp);
+
+	/* the root follows vm.dirty_background_ratio */
+	if (val > 100 || cgrp->parent == NULL)
+		return -EINVAL;
+
+	memcg->dirty_background_ratio = val;
+	return 0;
+}
+
 static void __mem_cgroup_threshold(struct mem_cgroup *memcg, bool swap)
 {
 	struct mem_cgroup_threshold_ary *t;
@@ -4672,6 +4885,16 @@ static struct cftype mem_cgroup_files[] = {
 		.read_u64 = mem_cgroup_swappiness_read,
 		.write_u64 = mem_cgroup_swappiness_write,
 	},
+	{
+		.name = "dirty_ratio",
+		.read_u64 = mem_cgroup_dirty_ratio_read,
+		.write_u64 = mem_cgroup_dirty_ratio_write,
+	},
+	{
+		.name = "dirty_background_ratio",
+		.read_u64 = mem_cgroup_dirty_background_ratio_read,
+		.write_u64 = mem_cgroup_dirty_background_ratio_write,
+	},
 	{
 		.name = "move_charge_at_immigrate",
 		.read_u64 = mem_cgroup_move_charge_read,
@@ -4977,8 +5200,12 @@ mem_cgroup_create(struct cgroup *cont)
 	memcg->last_scanned_node = MAX_NUMNODES;
 	INIT_LIST_HEAD(&memcg->oom_notify);
 
-	if (parent)
+	if (parent) {
 		memcg->swappiness = mem_cgroup_swappiness(parent);
+		memcg->dirty_ratio = mem_cgroup_dirty_ratio(parent);
+		memcg->dirty_background_ratio =
+			mem_cgroup_dirty_background_ratio(parent);
+	}
 	atomic_set(&memcg->refcnt, 1);
 	memcg->move_charge_at_immigrate = 0;
 	mutex_init(&memcg->thresholds_lock);
@@ -5165,16 +5392,20 @@ static struct page *mc_handle_file_pte(struct vm_area_struct *vma,
 		pgoff = pte_to_pgoff(ptent);
 
 	/* page is moved even if it's not RSS of this task(page-faulted). */
-	page = find_get_page(mapping, pgoff);
-
 #ifdef CONFIG_SWAP
 	/* shmem/tmpfs may report page out on swap: account for that too. */
-	if (radix_tree_exceptional_entry(page)) {
-		swp_entry_t swap = radix_to_swp_entry(page);
-		if (do_swap_account)
-			*entry = swap;
-		page = find_get_page(&swapper_space, swap.val);
-	}
+	if (shmem_mapping(mapping)) {
+		page = find_get_entry(mapping, pgoff);
+		if (radix_tree_exceptional_entry(page)) {
+			swp_entry_t swap = radix_to_swp_entry(page);
+			if (do_swap_account)
+				*entry = swap;
+			page = find_get_page(&swapper_space, swap.val);
+		}
+	} else
+		page = find_get_page(mapping, pgoff);
+#else
+	page = find_get_page(mapping, pgoff);
 #endif
 	return page;
 }
@@ -5183,9 +5414,9 @@ static enum mc_target_type get_mctgt_type(struct vm_area_struct *vma,
 		unsigned long addr, pte_t ptent, union mc_target *target)
 {
 	struct page *page = NULL;
-	struct page_cgroup *pc;
 	enum mc_target_type ret = MC_TARGET_NONE;
 	swp_entry_t ent = { .val = 0 };
+	unsigned long data;
 
 	if (pte_present(ptent))
 		page = mc_handle_present_pte(vma, addr, ptent);
@@ -5197,13 +5428,13 @@ static enum mc_target_type get_mctgt_type(struct vm_area_struct *vma,
 	if (!page && !ent.val)
 		return ret;
 	if (page) {
-		pc = lookup_page_cgroup(page);
+		data = page_memcg_data(page);
 		/*
-		 * Do only loose check w/o page_cgroup lock.
-		 * mem_cgroup_move_account() checks the pc is valid or not under
-		 * the lock.
+		 * Do only loose check here.  mem_cgroup_move_account() checks
+		 * the page is still charged to mc.from when it moves it.
 		 */
-		if (PageCgroupUsed(pc) && pc->mem_cgroup == mc.from) {
+		if ((data & PCG_USED_MASK) &&
+		    memcg_data_to_memcg(data) == mc.from) {
 			ret = MC_TARGET_PAGE;
 			if (target)
 				target->page = page;
@@ -5231,15 +5462,16 @@ static enum mc_target_type get_mctgt_type_thp(struct vm_area_struct *vma,
 		unsigned long addr, pmd_t pmd, union mc_target *target)
 {
 	struct page *page = NULL;
-	struct page_cgroup *pc;
 	enum mc_target_type ret = MC_TARGET_NONE;
+	unsigned long data;
 
 	page = pmd_page(pmd);
-	VM_BUG_ON(!page || !PageHead(page));
-	if (!move_anon())
+	VM_BUG_ON(!page || (!PageHead(page) && !PageTeam(page)));
+	/* a team of shmem pages is charged page by page */
+	if (!move_anon() || !PageAnon(page))
 		return ret;
-	pc = lookup_page_cgroup(page);
-	if (PageCgroupUsed(pc) && pc->mem_cgroup == mc.from) {
+	data = page_memcg_data(page);
+	if ((data & PCG_USED_MASK) && memcg_data_to_memcg(data) == mc.from) {
 		ret = MC_TARGET_PAGE;
 		if (target) {
 			get_page(page);
@@ -5433,7 +5665,6 @@ static int mem_cgroup_move_charge_pte_range(pmd_t *pmd,
 	enum mc_target_type target_type;
 	union mc_target target;
 	struct page *page;
-	struct page_cgroup *pc;
 
 	/*
 	 * We don't take compound_lock() here but no race with splitting thp
@@ -5454,9 +5685,8 @@ static int mem_cgroup_move_charge_pte_range(pmd_t *pmd,
 		if (target_type == MC_TARGET_PAGE) {
 			page = target.page;
 			if (!isolate_lru_page(page)) {
-				pc = lookup_page_cgroup(page);
 				if (!mem_cgroup_move_account(page, HPAGE_PMD_NR,
-							pc, mc.from, mc.to)) {
+							mc.from, mc.to)) {
 					mc.precharge -= HPAGE_PMD_NR;
 					mc.moved_charge += HPAGE_PMD_NR;
 				}
@@ -5484,8 +5714,7 @@ retry:
 			page = target.page;
 			if (isolate_lru_page(page))
 				goto put;
-			pc = lookup_page_cgroup(page);
-			if (!mem_cgroup_move_account(page, 1, pc,
+			if (!mem_cgroup_move_account(page, 1,
 						     mc.from, mc.to)) {
 				mc.precharge--;
 				/* we uncharge from mc.from later. */
@@ -57,6 +57,8 @@
 #include <linux/swapops.h>
 #include <linux/elf.h>
 #include <linux/gfp.h>
+#include <linux/debugfs.h>
+#include <linux/userfaultfd_k.h>
 
 #include <asm/io.h>
 #include <asm/pgalloc.h>
@@ -206,8 +208,7 @@ void tlb_gather_mmu(struct mmu_gather *tlb, struct mm_struct *mm, bool fullmm)
 	tlb->mm = mm;
 
 	tlb->fullmm     = fullmm;
-	tlb->start	= -1UL;
-	tlb->end	= 0;
+	__tlb_reset_range(tlb);
 	tlb->need_flush = 0;
 	tlb->fast_mode  = (num_possible_cpus() == 1);
 	tlb->local.next = NULL;
@@ -228,6 +229,7 @@ void tlb_flush_mmu(struct mmu_gather *tlb)
 		return;
 	tlb->need_flush = 0;
 	tlb_flush(tlb);
+	__tlb_reset_range(tlb);
 #ifdef CONFIG_HAVE_RCU_TABLE_FREE
 	tlb_table_flush(tlb);
 #endif
@@ -244,14 +246,13 @@ void tlb_flush_mmu(struct mmu_gather *tlb)
 
 /* tlb_finish_mmu
  *	Called at the end of the shootdown operation to free up any resources
- *	that were required.
+ *	that were required.  The final flush only covers the addresses that
+ *	were actually unmapped, as gathered by __tlb_adjust_range().
  */
 void tlb_finish_mmu(struct mmu_gather *tlb, unsigned long start, unsigned long end)
 {
 	struct mmu_gather_batch *batch, *next;
 
-	tlb->start = start;
-	tlb->end   = end;
 	tlb_flush_mmu(tlb);
 
 	/* keep the page table cache within bounds */
@@ -717,20 +718,6 @@ static inline int is_cow_mapping(vm_flags_t flags)
 	return (flags & (VM_SHARED | VM_MAYWRITE)) == VM_MAYWRITE;
 }
 
-#ifndef is_zero_pfn
-static inline int is_zero_pfn(unsigned long pfn)
-{
-	return pfn == zero_pfn;
-}
-#endif
-
-#ifndef my_zero_pfn
-static inline unsigned long my_zero_pfn(unsigned long addr)
-{
-	return zero_pfn;
-}
-#endif
-
 /*
  * vm_normal_page -- This function gets the "struct page" associated with a pte.
  *
@@ -1208,11 +1195,6 @@ again:
 	 */
 	if (force_flush) {
 		force_flush = 0;
-
-#ifdef HAVE_GENERIC_MMU_GATHER
-		tlb->start = addr;
-		tlb->end = end;
-#endif
 		tlb_flush_mmu(tlb);
 		if (addr != end)
 			goto again;
@@ -1235,7 +1217,9 @@ static inline unsigned long zap_pmd_range(struct mmu_gather *tlb,
 		if (pmd_trans_huge(*pmd)) {
 			if (next - addr != HPAGE_PMD_SIZE) {
 #ifdef CONFIG_DEBUG_VM
-				if (!rwsem_is_locked(&tlb->mm->mmap_sem)) {
+				/* truncation may unmap a file pmd without it */
+				if (!vma->vm_ops &&
+				    !rwsem_is_locked(&tlb->mm->mmap_sem)) {
 					pr_err("%s: mmap_sem is unlocked! addr=0x%lx end=0x%lx vma->vm_start=0x%lx vma->vm_end=0x%lx\n",
 						__func__, addr, end,
 						vma->vm_start,
@@ -1243,7 +1227,7 @@ static inline unsigned long zap_pmd_range(struct mmu_gather *tlb,
 					BUG();
 				}
 #endif
-				split_huge_page_pmd(vma->vm_mm, pmd);
+				split_huge_page_pmd(vma, addr, pmd);
 			} else if (zap_huge_pmd(tlb, vma, pmd, addr))
 				goto next;
 			/* fall through */
@@ -1512,7 +1496,7 @@ struct page *follow_page(struct vm_area_struct *vma, unsigned long address,
 	}
 	if (pmd_trans_huge(*pmd)) {
 		if (flags & FOLL_SPLIT) {
-			split_huge_page_pmd(mm, pmd);
+			split_huge_page_pmd(vma, address, pmd);
 			goto split_fallthrough;
 		}
 		spin_lock(&mm->page_table_lock);
@@ -1531,7 +1515,7 @@ struct page *follow_page(struct vm_area_struct *vma, unsigned long address,
 		/* fall through */
 	}
 split_fallthrough:
-	if (unlikely(pmd_bad(*pmd)))
+	if (unlikely(pmd_none(*pmd) || pmd_bad(*pmd)))
 		goto no_page_table;
 
 	ptep = pte_offset_map_lock(mm, pmd, address, &ptl);
@@ -2925,10 +2909,10 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		goto out;
 	}
 	delayacct_set_flag(DELAYACCT_PF_SWAPIN);
-	page = lookup_swap_cache(entry);
+	page = lookup_swap_cache(entry, vma, address);
 	if (!page) {
-		page = swapin_readahead(entry,
-					GFP_HIGHUSER_MOVABLE, vma, address);
+		page = swapin_readahead_vma(entry, GFP_HIGHUSER_MOVABLE,
+					    vma, address, pmd);
 		if (!page) {
 			/*
 			 * Back out if somebody else faulted in this pte
@@ -3134,6 +3118,11 @@ static int do_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		page_table = pte_offset_map_lock(mm, pmd, address, &ptl);
 		if (!pte_none(*page_table))
 			goto unlock;
+		/* Deliver the page fault to userland, check inside PT lock */
+		if (userfaultfd_missing(vma)) {
+			pte_unmap_unlock(page_table, ptl);
+			return handle_userfault(vma, address, flags);
+		}
 		goto setpte;
 	}
 
@@ -3156,6 +3145,14 @@ static int do_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	if (!pte_none(*page_table))
 		goto release;
 
+	/* Deliver the page fault to userland, check inside PT lock */
+	if (userfaultfd_missing(vma)) {
+		pte_unmap_unlock(page_table, ptl);
+		mem_cgroup_uncharge_page(page);
+		page_cache_release(page);
+		return handle_userfault(vma, address, flags);
+	}
+
 	inc_mm_counter_fast(mm, MM_ANONPAGES);
 	page_add_new_anon_rmap(page, vma, address);
 setpte:
@@ -3176,6 +3173,43 @@ oom:
 	return VM_FAULT_OOM;
 }
 
+/**
+ * do_set_pte - setup new PTE entry for given page and add reverse page mapping.
+ *
+ * @vma: virtual memory area
+ * @address: user virtual address
+ * @page: page to map
+ * @pte: pointer to target page table entry
+ * @write: true, if new entry is writable
+ * @anon: true, if it's anonymous page
+ *
+ * Caller must hold page table lock relevant for @pte.
+ *
+ * Target users are page handler itself and implementations of
+ * vm_ops->map_pages.
+ */
+void do_set_pte(struct vm_area_struct *vma, unsigned long address,
+		struct page *page, pte_t *pte, bool write, bool anon)
+{
+	pte_t entry;
+
+	flush_icache_page(vma, page);
+	entry = mk_pte(page, vma->vm_page_prot);
+	if (write)
+		entry = maybe_mkwrite(pte_mkdirty(entry), vma);
+	if (anon) {
+		inc_mm_counter_fast(vma->vm_mm, MM_ANONPAGES);
+		page_add_new_anon_rmap(page, vma, address);
+	} else {
+		inc_mm_counter_fast(vma->vm_mm, MM_FILEPAGES);
+		page_add_file_rmap(page);
+	}
+	set_pte_at(vma->vm_mm, address, pte, entry);
+
+	/* no need to invalidate: a not-present page won't be cached */
+	update_mmu_cache(vma, address, pte);
+}
+
 /*
  * __do_fault() tries to create a new page mapping. It aggressively
  * tries to share with existing pages, but makes a separate copy if
@@ -3197,7 +3231,6 @@ static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	spinlock_t *ptl;
 	struct page *page;
 	struct page *cow_page;
-	pte_t entry;
 	int anon = 0;
 	struct page *dirty_page = NULL;
 	struct vm_fault vmf;
@@ -3306,25 +3339,12 @@ static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	 */
 	/* Only go through if we didn't race with anybody else... */
 	if (likely(pte_same(*page_table, orig_pte))) {
-		flush_icache_page(vma, page);
-		entry = mk_pte(page, vma->vm_page_prot);
-		if (flags & FAULT_FLAG_WRITE)
-			entry = maybe_mkwrite(pte_mkdirty(entry), vma);
-		if (anon) {
-			inc_mm_counter_fast(mm, MM_ANONPAGES);
-			page_add_new_anon_rmap(page, vma, address);
-		} else {
-			inc_mm_counter_fast(mm, MM_FILEPAGES);
-			page_add_file_rmap(page);
-			if (flags & FAULT_FLAG_WRITE) {
-				dirty_page = page;
-				get_page(dirty_page);
-			}
+		do_set_pte(vma, address, page, page_table,
+			   flags & FAULT_FLAG_WRITE, anon);
+		if (!anon && (flags & FAULT_FLAG_WRITE)) {
+			dirty_page = page;
+			get_page(dirty_page);
 		}
-		set_pte_at(mm, address, page_table, entry);
-
-		/* no need to invalidate: a not-present page won't be cached */
-		update_mmu_cache(vma, address, page_table);
 	} else {
 		if (cow_page)
 			mem_cgroup_uncharge_page(cow_page);
@@ -3375,6 +3395,103 @@ uncharge_out:
 	return ret;
 }
 
+/*
+ * On a read fault of a file mapping, the pages around the faulting one
+ * that are already uptodate in the page cache are mapped as well, up to
+ * fault_around_bytes worth aligned on its own size.  This saves one
+ * fault per page for programs walking through their mapped files.
+ */
+static unsigned long fault_around_bytes = 65536;
+
+static inline unsigned long fault_around_pages(void)
+{
+	return fault_around_bytes >> PAGE_SHIFT;
+}
+
+static inline unsigned long fault_around_mask(void)
+{
+	return ~(fault_around_bytes - 1) & PAGE_MASK;
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int fault_around_bytes_get(void *data, u64 *val)
+{
+	*val = fault_around_bytes;
+	return 0;
+}
+
+static int fault_around_bytes_set(void *data, u64 val)
+{
+	/* the window must not cross a page table */
+	if (val / PAGE_SIZE > PTRS_PER_PTE)
+		return -EINVAL;
+	if (val > PAGE_SIZE)
+		fault_around_bytes = rounddown_pow_of_two(val);
+	else
+		fault_around_bytes = PAGE_SIZE; /* rounddown_pow_of_two(0) is undefined */
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(fault_around_bytes_fops,
+		fault_around_bytes_get, fault_around_bytes_set, "%llu\n");
+
+static int __init fault_around_debugfs(void)
+{
+	void *ret;
+
+	ret = debugfs_create_file("fault_around_bytes", 0644, NULL, NULL,
+			&fault_around_bytes_fops);
+	if (!ret)
+		printk(KERN_WARNING "Failed to create fault_around_bytes in debugfs\n");
+	return 0;
+}
+late_initcall(fault_around_debugfs);
+#endif
+
+/*
+ * Let ->map_pages() fill in the ptes around @address that are still none,
+ * within the fault-around window, the vma and the page table of @pte.
+ * Called with the pte lock held.
+ */
+static void do_fault_around(struct vm_area_struct *vma, unsigned long address,
+		pte_t *pte, pgoff_t pgoff, unsigned int flags)
+{
+	unsigned long start_addr;
+	pgoff_t max_pgoff;
+	struct vm_fault vmf;
+	int off;
+
+	start_addr = max(address & fault_around_mask(), vma->vm_start);
+	off = ((address - start_addr) >> PAGE_SHIFT) & (PTRS_PER_PTE - 1);
+	pte -= off;
+	pgoff -= off;
+
+	/*
+	 * max_pgoff is either end of page table or end of vma
+	 * or fault_around_pages() from pgoff, depending what is nearest.
+	 */
+	max_pgoff = pgoff - ((start_addr >> PAGE_SHIFT) & (PTRS_PER_PTE - 1)) +
+		PTRS_PER_PTE - 1;
+	max_pgoff = min3(max_pgoff, vma_pages(vma) + vma->vm_pgoff - 1,
+			pgoff + fault_around_pages() - 1);
+
+	/* Check if it makes any sense to call ->map_pages */
+	while (!pte_none(*pte)) {
+		if (++pgoff > max_pgoff)
+			return;
+		start_addr += PAGE_SIZE;
+		if (start_addr >= vma->vm_end)
+			return;
+		pte++;
+	}
+
+	vmf.virtual_address = (void __user *) start_addr;
+	vmf.pte = pte;
+	vmf.pgoff = pgoff;
+	vmf.max_pgoff = max_pgoff;
+	vmf.flags = flags;
+	vma->vm_ops->map_pages(vma, &vmf);
+}
+
 static int do_linear_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 		unsigned long address, pte_t *page_table, pmd_t *pmd,
 		unsigned int flags, pte_t orig_pte)
@@ -3382,6 +3499,21 @@ static int do_linear_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	pgoff_t pgoff = (((address & PAGE_MASK)
 			- vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
 
+	if (!(flags & FAULT_FLAG_WRITE) && vma->vm_ops->map_pages &&
+	    fault_around_pages() > 1) {
+		spinlock_t *ptl = pte_lockptr(mm, pmd);
+
+		spin_lock(ptl);
+		if (likely(pte_same(*page_table, orig_pte)))
+			do_fault_around(vma, address, page_table, pgoff, flags);
+		/* the faulting page was mapped, or someone raced with us */
+		if (!pte_same(*page_table, orig_pte)) {
+			pte_unmap_unlock(page_table, ptl);
+			return 0;
+		}
+		spin_unlock(ptl);
+	}
+
 	pte_unmap(page_table);
 	return __do_fault(mm, vma, address, pmd, pgoff, flags, orig_pte);
 }
@@ -3514,10 +3646,14 @@ retry:
 	pmd = pmd_alloc(mm, pud, address);
 	if (!pmd)
 		return VM_FAULT_OOM;
-	if (pmd_none(*pmd) && transparent_hugepage_enabled(vma)) {
-		if (!vma->vm_ops)
-			return do_huge_pmd_anonymous_page(mm, vma, address,
-							  pmd, flags);
+	if (pmd_none(*pmd) && !vma->vm_ops &&
+	    transparent_hugepage_enabled(vma)) {
+		return do_huge_pmd_anonymous_page(mm, vma, address, pmd, flags);
+	} else if (pmd_none(*pmd) && vma->vm_ops && vma->vm_ops->pmd_fault) {
+		int ret = vma->vm_ops->pmd_fault(vma, address, pmd, flags);
+
+		if (!(ret & VM_FAULT_FALLBACK))
+			return ret;
 	} else {
 		pmd_t orig_pmd = *pmd;
 		int ret;
@@ -3527,6 +3663,14 @@ retry:
 			if (flags & FAULT_FLAG_WRITE &&
 			    !pmd_write(orig_pmd) &&
 			    !pmd_trans_splitting(orig_pmd)) {
+				/*
+				 * A file pmd is never copied on write: fault
+				 * the page in by pte, where that is decided.
+				 */
+				if (vma->vm_ops) {
+					split_huge_page_pmd(vma, address, pmd);
+					goto retry;
+				}
 				ret = do_huge_pmd_wp_page(mm, vma, address, pmd,
 							  orig_pmd);
 				/*
@@ -3563,6 +3707,184 @@ retry:
 	return handle_pte_fault(mm, vma, address, pte, pmd, flags);
 }
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+/*
+ * Walk to the pte mapping @address and lock it, without mmap_sem.
+ *
+ * Interrupts are off during the walk, so the page tables cannot be freed
+ * under us: that waits for the TLB flush IPI to this cpu, as it does for
+ * get_user_pages_fast().  The pte lock is only tried, since its holder
+ * may be waiting for that same IPI.  Once it is held and the pmd still
+ * points to the table, the table stays: it is zapped under that lock
+ * before it can be freed.
+ */
+static pte_t *spf_pte_lock(struct mm_struct *mm, unsigned long address,
+			   spinlock_t **ptlp)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd, pmdval;
+	pte_t *pte = NULL;
+	spinlock_t *ptl;
+
+	local_irq_disable();
+	pgd = pgd_offset(mm, address);
+	if (!pgd_present(*pgd))
+		goto out;
+	pud = pud_offset(pgd, address);
+	if (!pud_present(*pud))
+		goto out;
+	pmd = pmd_offset(pud, address);
+	pmdval = *pmd;
+	barrier();
+	/* Allocating page tables is left to the mmap_sem path */
+	if (pmd_none(pmdval) || pmd_trans_huge(pmdval) || pmd_bad(pmdval))
+		goto out;
+
+	ptl = pte_lockptr(mm, &pmdval);
+	pte = pte_offset_map(&pmdval, address);
+	if (!spin_trylock(ptl)) {
+		pte_unmap(pte);
+		pte = NULL;
+		goto out;
+	}
+	if (pmd_val(*pmd) != pmd_val(pmdval)) {
+		pte_unmap_unlock(pte, ptl);
+		pte = NULL;
+		goto out;
+	}
+	*ptlp = ptl;
+out:
+	local_irq_enable();
+	return pte;
+}
+
+/*
+ * Try to handle a fault on private anonymous memory without mmap_sem.
+ *
+ * The vma is looked up and pinned with get_vma(), its fields are read
+ * at a vm_sequence count and only trusted if the count is unchanged once
+ * the pte is locked.  Writers bump the count under mmap_sem around any
+ * change a fault depends on, and leave it odd when the vma is unmapped,
+ * before its page tables are zapped.  Anything beyond filling an empty
+ * pte of a populated page table is left to handle_mm_fault().
+ *
+ * Returns 0 if the fault was handled, VM_FAULT_RETRY if the caller has
+ * to take mmap_sem and go through the regular path.
+ */
+int handle_speculative_fault(struct mm_struct *mm, unsigned long address,
+			     unsigned int flags)
+{
+	struct vm_area_struct *vma;
+	unsigned int seq, mm_seq;
+	unsigned long vm_flags;
+	pgprot_t vm_page_prot;
+	struct page *page = NULL;
+	spinlock_t *ptl;
+	pte_t *pte, entry;
+
+	vma = get_vma(mm, address);
+	if (!vma)
+		goto out_abort;
+
+	/* Not read_seqcount_begin(): an unmapped vma stays odd forever */
+	seq = ACCESS_ONCE(vma->vm_sequence.sequence);
+	smp_rmb();
+	mm_seq = ACCESS_ONCE(mm->mm_seq.sequence);
+	smp_rmb();
+	if ((seq | mm_seq) & 1)
+		goto out_put;
+
+	if (address < vma->vm_start || address >= vma->vm_end)
+		goto out_put;
+	vm_flags = vma->vm_flags;
+	vm_page_prot = vma->vm_page_prot;
+
+	if (vma->vm_ops || vma->vm_file || !vma->anon_vma)
+		goto out_put;
+	/* Missing pages of userfaultfd ranges are filled in by userland */
+	if (userfaultfd_missing(vma))
+		goto out_put;
+	/* No stack guard pages, hugetlb or pfn mappings here */
+	if (vm_flags & (VM_GROWSDOWN | VM_GROWSUP | VM_HUGETLB |
+			VM_PFNMAP | VM_MIXEDMAP | VM_NONLINEAR))
+		goto out_put;
+	if (flags & FAULT_FLAG_WRITE) {
+		if (!(vm_flags & VM_WRITE))
+			goto out_put;
+	} else if (!(vm_flags & (VM_READ | VM_EXEC | VM_WRITE)))
+		goto out_put;
+#ifdef CONFIG_NUMA
+	if (vma->vm_policy)
+		goto out_put;
+#endif
+
+	if (!(flags & FAULT_FLAG_WRITE)) {
+		/* Use the zero-page for reads */
+		entry = pte_mkspecial(pfn_pte(my_zero_pfn(address),
+					      vm_page_prot));
+	} else {
+		/*
+		 * Not allocated for @vma: mbind() could free a policy
+		 * installed behind our back.  The task policy applies to
+		 * a vma without one anyway.
+		 */
+		page = alloc_zeroed_user_highpage_movable(NULL, address);
+		if (!page)
+			goto out_put;
+		__SetPageUptodate(page);
+
+		if (mem_cgroup_newpage_charge(page, mm, GFP_KERNEL)) {
+			page_cache_release(page);
+			goto out_put;
+		}
+
+		entry = mk_pte(page, vm_page_prot);
+		if (vm_flags & VM_WRITE)
+			entry = pte_mkwrite(pte_mkdirty(entry));
+	}
+
+	pte = spf_pte_lock(mm, address, &ptl);
+	if (!pte)
+		goto out_release;
+	if (read_seqcount_retry(&vma->vm_sequence, seq) ||
+	    read_seqcount_retry(&mm->mm_seq, mm_seq))
+		goto out_unlock;
+	if (!pte_none(*pte))
+		goto out_unlock;
+
+	if (page) {
+		inc_mm_counter_fast(mm, MM_ANONPAGES);
+		page_add_new_anon_rmap(page, vma, address);
+	}
+	set_pte_at(mm, address, pte, entry);
+
+	/* No need to invalidate - it was non-present before */
+	update_mmu_cache(vma, address, pte);
+	pte_unmap_unlock(pte, ptl);
+	put_vma(vma);
+
+	count_vm_event(PGFAULT);
+	count_vm_event(SPECULATIVE_PGFAULT);
+	mem_cgroup_count_vm_event(mm, PGFAULT);
+	check_sync_rss_stat(current);
+	return 0;
+
+out_unlock:
+	pte_unmap_unlock(pte, ptl);
+out_release:
+	if (page) {
+		mem_cgroup_uncharge_page(page);
+		page_cache_release(page);
+	}
+out_put:
+	put_vma(vma);
+out_abort:
+	count_vm_event(SPECULATIVE_PGFAULT_ABORT);
+	return VM_FAULT_RETRY;
+}
+#endif /* CONFIG_SPECULATIVE_PAGE_FAULT */
+
 #ifndef __PAGETABLE_PUD_FOLDED
 /*
  * Allocate page upper directory.
@@ -354,6 +354,8 @@ static int migrate_page_move_mapping(struct address_space *mapping,
 		__dec_zone_page_state(page, NR_SHMEM);
 		__inc_zone_page_state(newpage, NR_SHMEM);
 	}
+	/* a team of shmem pages is physically contiguous: newpage is not */
+	page_cache_leave_team(page);
 	spin_unlock_irq(&mapping->tree_lock);
 
 	return 0;
@@ -427,6 +429,10 @@ void migrate_page_copy(struct page *newpage, struct page *page)
 		SetPageChecked(newpage);
 	if (PageMappedToDisk(page))
 		SetPageMappedToDisk(newpage);
+	if (PageYoung(page))
+		SetPageYoung(newpage);
+	if (PageIdle(page))
+		SetPageIdle(newpage);
 
 	if (PageDirty(page)) {
 		clear_page_dirty_for_io(page);
@@ -11,6 +11,7 @@
 #include <linux/swap.h>
 #include <linux/swapops.h>
 #include <linux/pagemap.h>
+#include <linux/pagevec.h>
 #include <linux/mempolicy.h>
 #include <linux/syscalls.h>
 #include <linux/sched.h>
@@ -18,6 +19,8 @@
 #include <linux/rmap.h>
 #include <linux/mmzone.h>
 #include <linux/hugetlb.h>
+#include <linux/memcontrol.h>
+#include <linux/mm_inline.h>
 
 #include "internal.h"
 
@@ -88,9 +91,53 @@ void mlock_vma_page(struct page *page)
 	}
 }
 
+/*
+ * Finish munlock after successful page isolation
+ *
+ * Page must be locked. This is a wrapper for try_to_munlock()
+ * and putback_lru_page() with munlock accounting.
+ */
+static void __munlock_isolated_page(struct page *page)
+{
+	int ret = SWAP_AGAIN;
+
+	/*
+	 * Optimization: if the page was mapped just once, that's our mapping
+	 * and we don't need to check all the other vmas.
+	 */
+	if (page_mapcount(page) > 1)
+		ret = try_to_munlock(page);
+
+	/* Did try_to_unlock() succeed or punt? */
+	if (ret != SWAP_MLOCK)
+		count_vm_event(UNEVICTABLE_PGMUNLOCKED);
+
+	putback_lru_page(page);
+}
+
+/*
+ * Accounting for page isolation fail during munlock
+ *
+ * Performs accounting when page isolation fails in munlock. There is nothing
+ * else to do because it means some other task has already removed the page
+ * from the LRU. putback_lru_page() will take care of removing the page from
+ * the unevictable list, if necessary. vmscan [page_referenced()] will move
+ * the page back to the unevictable list if some other vma has it mlocked.
+ */
+static void __munlock_isolation_failed(struct page *page)
+{
+	if (PageUnevictable(page))
+		count_vm_event(UNEVICTABLE_PGSTRANDED);
+	else
+		count_vm_event(UNEVICTABLE_PGMUNLOCKED);
+}
+
 /**
  * munlock_vma_page - munlock a vma page
- * @page - page to be unlocked
+ * @page - page to be unlocked, either a normal page or THP page head
+ *
+ * returns the size of the page as a page mask (0 for normal page,
+ *         HPAGE_PMD_NR - 1 for THP head page)
  *
  * called from munlock()/munmap() path with page supposedly on the LRU.
  * When we munlock a page, because the vma where we found the page is being
@@ -103,44 +150,26 @@ void mlock_vma_page(struct page *page)
  * can't isolate the page, we leave it for putback_lru_page() and vmscan
  * [page_referenced()/try_to_unmap()] to deal with.
  */
-void munlock_vma_page(struct page *page)
+unsigned int munlock_vma_page(struct page *page)
 {
 	BUG_ON(!PageLocked(page));
 
 	if (TestClearPageMlocked(page)) {
 		dec_zone_page_state(page, NR_MLOCK);
-		if (!isolate_lru_page(page)) {
-			int ret = SWAP_AGAIN;
-
-			/*
-			 * Optimization: if the page was mapped just once,
-			 * that's our mapping and we don't need to check all the
-			 * other vmas.
-			 */
-			if (page_mapcount(page) > 1)
-				ret = try_to_munlock(page);
-			/*
-			 * did try_to_unlock() succeed or punt?
-			 */
-			if (ret != SWAP_MLOCK)
-				count_vm_event(UNEVICTABLE_PGMUNLOCKED);
-
-			putback_lru_page(page);
-		} else {
-			/*
-			 * Some other task has removed the page from the LRU.
-			 * putback_lru_page() will take care of removing the
-			 * page from the unevictable list, if necessary.
-			 * vmscan [page_referenced()] will move the page back
-			 * to the unevictable list if some other vma has it
-			 * mlocked.
-			 */
-			if (PageUnevictable(page))
-				count_vm_event(UNEVICTABLE_PGSTRANDED);
-			else
-				count_vm_event(UNEVICTABLE_PGMUNLOCKED);
-		}
+		if (!isolate_lru_page(page))
+			__munlock_isolated_page(page);
+		else
+			__munlock_isolation_failed(page);
 	}
+
+	/*
+	 * Whether or not the page was still mlocked, a THP is munlocked as
+	 * a whole through its head: tell the caller to skip the tail pages.
+	 * Racing with a split, we may return a smaller mask than the page
+	 * was munlocked with; that costs no more than a useless scan of the
+	 * former tail pages.
+	 */
+	return hpage_nr_pages(page) - 1;
 }
 
 /**
@@ -252,6 +281,201 @@ no_mlock:
 	return nr_pages;		/* error or pages NOT mlocked */
 }
 
+/*
+ * Putback multiple evictable pages to the LRU
+ *
+ * Batched putback of evictable inactive pages of one type, anon or file,
+ * that bypasses the per-cpu pvec. Some of the pages might have meanwhile
+ * become unevictable but that is OK.
+ */
+static void __putback_lru_fast(struct pagevec *pvec, int file, int *pgrescued)
+{
+	if (!pagevec_count(pvec))
+		return;
+
+	count_vm_events(UNEVICTABLE_PGMUNLOCKED, pagevec_count(pvec));
+	/*
+	 * __pagevec_lru_add() calls release_pages() so we don't call
+	 * put_page() explicitly
+	 */
+	__pagevec_lru_add(pvec, LRU_INACTIVE_ANON + LRU_FILE * file);
+	count_vm_events(UNEVICTABLE_PGRESCUED, *pgrescued);
+	*pgrescued = 0;
+}
+
+/*
+ * Munlock a batch of pages from the same zone
+ *
+ * The work is split to two main phases. First phase clears the Mlocked flag
+ * and attempts to isolate the pages, all under a single zone lru lock.
+ * The second phase finishes the munlock only for pages where isolation
+ * succeeded.
+ *
+ * Note that the pagevec may be modified during the process.
+ */
+static void __munlock_pagevec(struct pagevec *pvec, struct zone *zone)
+{
+	int i;
+	int nr = pagevec_count(pvec);
+	int delta_munlocked = -nr;
+	struct pagevec pvec_putback;
+	struct pagevec pvec_fast[2];	/* indexed by page_is_file_cache() */
+	int pgrescued[2] = { 0, 0 };
+
+	pagevec_init(&pvec_putback, 0);
+
+	/* Phase 1: page isolation */
+	spin_lock_irq(&zone->lru_lock);
+	for (i = 0; i < nr; i++) {
+		struct page *page = pvec->pages[i];
+
+		if (TestClearPageMlocked(page)) {
+			if (PageLRU(page)) {
+				struct lruvec *lruvec;
+
+				/*
+				 * We already have the pin from follow_page(),
+				 * so we can spare the get_page() here.
+				 */
+				lruvec = mem_cgroup_page_lruvec(page, zone);
+				ClearPageLRU(page);
+				del_page_from_lru_list(page, lruvec,
+						       page_lru(page));
+				continue;
+			}
+			__munlock_isolation_failed(page);
+		} else {
+			delta_munlocked++;
+		}
+
+		/*
+		 * We won't be munlocking this page in the next phase
+		 * but we still need to release the follow_page() pin.
+		 * We cannot do it under lru_lock however: if it's the
+		 * last pin, __page_cache_release() would deadlock.
+		 */
+		pagevec_add(&pvec_putback, pvec->pages[i]);
+		pvec->pages[i] = NULL;
+	}
+	__mod_zone_page_state(zone, NR_MLOCK, delta_munlocked);
+	spin_unlock_irq(&zone->lru_lock);
+
+	/* Now we can release pins of pages that we are not munlocking */
+	pagevec_release(&pvec_putback);
+
+	/*
+	 * Phase 2: page munlock.  A page mapped only by us, which has not
+	 * been mlocked again meanwhile, goes straight back to its inactive
+	 * list in a batch below; the rest need try_to_munlock() and the
+	 * full putback_lru_page().
+	 */
+	pagevec_init(&pvec_fast[0], 0);
+	pagevec_init(&pvec_fast[1], 0);
+	for (i = 0; i < nr; i++) {
+		struct page *page = pvec->pages[i];
+		int file;
+
+		if (!page)
+			continue;
+
+		lock_page(page);
+		if (page_mapcount(page) <= 1 && !PageActive(page) &&
+		    page_evictable(page, NULL)) {
+			file = page_is_file_cache(page);
+			if (TestClearPageUnevictable(page))
+				pgrescued[file]++;
+			unlock_page(page);
+			/* The follow_page() pin goes with the pagevec */
+			if (!pagevec_add(&pvec_fast[file], page))
+				__putback_lru_fast(&pvec_fast[file], file,
+						   &pgrescued[file]);
+			continue;
+		}
+
+		/*
+		 * Slow path.  We don't want to lose the last pin
+		 * before unlock_page().
+		 */
+		get_page(page);		/* for putback_lru_page() */
+		__munlock_isolated_page(page);
+		unlock_page(page);
+		put_page(page);		/* from follow_page() */
+	}
+
+	/* Phase 3: putback of the pages that qualified for the fast path */
+	__putback_lru_fast(&pvec_fast[0], 0, &pgrescued[0]);
+	__putback_lru_fast(&pvec_fast[1], 1, &pgrescued[1]);
+}
+
+/*
+ * Fill up pagevec for __munlock_pagevec using pte walk
+ *
+ * The function expects that the pagevec holds the page for @start, pinned
+ * by follow_page().  It walks the ptes after @start, up to the end of the
+ * page table, and adds to the pagevec the pages that are present, pinned,
+ * in the same zone, and not parts of a THP.  It stops at the first page
+ * that does not qualify, or when the pagevec is full.
+ *
+ * Returns the address of the next page that should be scanned.
+ */
+static unsigned long __munlock_pagevec_fill(struct pagevec *pvec,
+		struct vm_area_struct *vma, int zoneid, unsigned long start,
+		unsigned long end)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte;
+	spinlock_t *ptl;
+
+	/*
+	 * The page at @start was found by follow_page() under the same
+	 * hold of mmap_sem, so its page table is there - unless it was
+	 * a team of shmem pages mapped by a huge pmd, which we leave to
+	 * follow_page().
+	 */
+	pgd = pgd_offset(mm, start);
+	pud = pud_offset(pgd, start);
+	pmd = pmd_offset(pud, start);
+	if (pmd_none(*pmd) || pmd_trans_huge(*pmd) || unlikely(pmd_bad(*pmd)))
+		return start + PAGE_SIZE;
+
+	/* Make sure we do not cross the page table boundary */
+	end = pgd_addr_end(start, end);
+	end = pud_addr_end(start, end);
+	end = pmd_addr_end(start, end);
+
+	pte = pte_offset_map_lock(mm, pmd, start, &ptl);
+	/* The page next to the pinned page is the first we will try to get */
+	start += PAGE_SIZE;
+	while (start < end) {
+		struct page *page = NULL;
+
+		pte++;
+		if (pte_present(*pte))
+			page = vm_normal_page(vma, start, *pte);
+		/*
+		 * Break if the page could not be obtained, or its node+zone
+		 * does not match, or it is part of a THP.
+		 */
+		if (!page || page_zone_id(page) != zoneid ||
+		    PageTransCompound(page))
+			break;
+
+		get_page(page);
+		/*
+		 * Increase the address that will be returned *before* the
+		 * eventual break due to pvec becoming full by adding the page
+		 */
+		start += PAGE_SIZE;
+		if (pagevec_add(pvec, page) == 0)
+			break;
+	}
+	pte_unmap_unlock(pte, ptl);
+	return start;
+}
+
 /*
  * munlock_vma_pages_range() - munlock all pages in the vma range.'
  * @vma - vma containing range to be munlock()ed.
@@ -269,17 +493,26 @@ no_mlock:
  * still on lru.  In unmap path, pages might be scanned by reclaim
  * and re-mlocked by try_to_{munlock|unmap} before we unmap and
  * free them.  This will result in freeing mlocked pages.
+ *
+ * Normal pages are munlocked in batches of a pagevec, isolated from the
+ * LRU under a single hold of the zone's lru_lock; a THP is munlocked as
+ * one unit through its head page.
  */
 void munlock_vma_pages_range(struct vm_area_struct *vma,
 			     unsigned long start, unsigned long end)
 {
-	unsigned long addr;
-
 	lru_add_drain();
 	vma->vm_flags &= ~VM_LOCKED;
 
-	for (addr = start; addr < end; addr += PAGE_SIZE) {
+	while (start < end) {
 		struct page *page;
+		unsigned int page_mask = 0;
+		unsigned long page_increm;
+		struct pagevec pvec;
+		struct zone *zone;
+		int zoneid;
+
+		pagevec_init(&pvec, 0);
 		/*
 		 * Although FOLL_DUMP is intended for get_dump_page(),
 		 * it just so happens that its special treatment of the
@@ -287,20 +520,49 @@ void munlock_vma_pages_range(struct vm_area_struct *vma,
 		 * suits munlock very well (and if somehow an abnormal page
 		 * has sneaked into the range, we won't oops here: great).
 		 */
-		page = follow_page(vma, addr, FOLL_GET | FOLL_DUMP);
+		page = follow_page(vma, start, FOLL_GET | FOLL_DUMP);
 		if (page && !IS_ERR(page)) {
-			lock_page(page);
-			/*
-			 * Like in __mlock_vma_pages_range(),
-			 * because we lock page here and migration is
-			 * blocked by the elevated reference, we need
-			 * only check for file-cache page truncation.
-			 */
-			if (page->mapping)
-				munlock_vma_page(page);
-			unlock_page(page);
-			put_page(page);
+			if (PageTransCompound(page)) {
+				lock_page(page);
+				/*
+				 * Like in __mlock_vma_pages_range(),
+				 * because we lock page here and migration is
+				 * blocked by the elevated reference, we need
+				 * only check for file-cache page truncation.
+				 * A THP found here may have been split before
+				 * we locked it, so munlock_vma_page()
+				 * computes the page_mask under the lock.
+				 */
+				if (page->mapping)
+					page_mask = munlock_vma_page(page);
+				unlock_page(page);
+				put_page(page);	/* follow_page() */
+			} else {
+				/*
+				 * Non-huge pages are handled in batches via
+				 * pagevec.  The pin from follow_page()
+				 * prevents them from collapsing by THP.
+				 */
+				pagevec_add(&pvec, page);
+				zone = page_zone(page);
+				zoneid = page_zone_id(page);
+
+				/*
+				 * Try to fill the rest of pagevec using fast
+				 * pte walk.  This will also update start to
+				 * the next page to process.  Then munlock the
+				 * pagevec.
+				 */
+				start = __munlock_pagevec_fill(&pvec, vma,
+						zoneid, start, end);
+				__munlock_pagevec(&pvec, zone);
+				goto next;
+			}
 		}
+		/* Skip the rest of a THP, starting mid-page if we were split */
+		page_increm = 1 + (~(start >> PAGE_SHIFT) & page_mask);
+		start += page_increm * PAGE_SIZE;
+next:
 		cond_resched();
 	}
 }
@@ -329,7 +591,8 @@ static int mlock_fixup(struct vm_area_struct *vma, struct vm_area_struct **prev,
 
 	pgoff = vma->vm_pgoff + ((start - vma->vm_start) >> PAGE_SHIFT);
 	*prev = vma_merge(mm, *prev, start, end, newflags, vma->anon_vma,
-			  vma->vm_file, pgoff, vma_policy(vma));
+			  vma->vm_file, pgoff, vma_policy(vma),
+			  vma->vm_userfaultfd_ctx);
 	if (*prev) {
 		vma = *prev;
 		goto success;
@@ -362,10 +625,12 @@ success:
 	 * set VM_LOCKED, __mlock_vma_pages_range will bring it back.
 	 */
 
+	vm_write_begin(vma);
 	if (lock)
 		vma->vm_flags = newflags;
 	else
 		munlock_vma_pages_range(vma, start, end);
+	vm_write_end(vma);
 
 out:
 	*prev = vma;
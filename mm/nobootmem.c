@@ -105,8 +105,14 @@ static void __init __free_pages_memory(unsigned long start, unsigned long end)
 		__free_pages_bootmem(pfn_to_page(i), 0);
 }
 
+/*
+ * Free the pages of [start, end) whose struct pages are initialised: with
+ * @deferred, the range may extend into the part of a node whose struct
+ * pages deferred_init_memmap() initialises and frees later on.  All of
+ * it is counted.
+ */
 static unsigned long __init __free_memory_core(phys_addr_t start,
-				 phys_addr_t end)
+				 phys_addr_t end, bool deferred)
 {
 	unsigned long start_pfn = PFN_UP(start);
 	unsigned long end_pfn = min_t(unsigned long,
@@ -115,7 +121,11 @@ static unsigned long __init __free_memory_core(phys_addr_t start,
 	if (start_pfn > end_pfn)
 		return 0;
 
-	__free_pages_memory(start_pfn, end_pfn);
+	if (deferred)
+		__free_pages_memory(start_pfn,
+				    early_initialised_end_pfn(start_pfn, end_pfn));
+	else
+		__free_pages_memory(start_pfn, end_pfn);
 
 	return end_pfn - start_pfn;
 }
@@ -124,15 +134,22 @@ unsigned long __init free_low_memory_core_early(int nodeid)
 {
 	unsigned long count = 0;
 	phys_addr_t start, end, size;
+	struct memblock_region *reg;
 	u64 i;
 
+	for_each_memblock(reserved, reg)
+		reserve_bootmem_region(reg->base, reg->base + reg->size);
+
 	for_each_free_mem_range(i, MAX_NUMNODES, &start, &end, NULL)
-		count += __free_memory_core(start, end);
+		count += __free_memory_core(start, end, true);
 
-	/* free range that is used for reserved array if we allocate it */
+	/*
+	 * free range that is used for reserved array if we allocate it:
+	 * it is reserved, so its struct pages are initialised already
+	 */
 	size = get_allocated_memblock_reserved_regions_info(&start);
 	if (size)
-		count += __free_memory_core(start, start + size);
+		count += __free_memory_core(start, start + size, false);
 
 	return count;
 }
@@ -35,6 +35,7 @@
 #include <linux/buffer_head.h> /* __set_page_dirty_buffers */
 #include <linux/pagevec.h>
 #include <linux/timer.h>
+#include <linux/memcontrol.h>
 #include <trace/events/writeback.h>
 
 /*
@@ -272,6 +273,18 @@ void global_dirty_limits(unsigned long *pbackground, unsigned long *pdirty)
 	trace_global_dirty_state(background, dirty);
 }
 
+/**
+ * memcg_dirty_info - dirty limits and dirty pages of a memory cgroup
+ * @id: css id of the memcg, or 0 for the memcg of the current task
+ * @info: filled in with the limits and page counts of the memcg
+ *
+ * Returns false if the memcg has no dirty limits of its own.
+ */
+bool memcg_dirty_info(unsigned short id, struct mem_cgroup_dirty_info *info)
+{
+	return mem_cgroup_dirty_info(global_dirtyable_memory(), id, info);
+}
+
 /**
  * zone_dirtyable_memory - number of dirtyable pages in a zone
  * @zone: the zone
@@ -1179,6 +1192,37 @@ static long bdi_min_pause(struct backing_dev_info *bdi,
 	return pages >= DIRTY_POLL_THRESH ? 1 + t / 2 : t;
 }
 
+/*
+ * Keep the dirty pages of the current task's memory cgroup under the dirty
+ * limits of the memcg, so that one cgroup streaming writes does not use up
+ * the global dirty limit that everybody else is throttled against.  Over
+ * its background threshold, writeback of the inodes the memcg dirtied is
+ * started; over its dirty threshold, the task waits for it to progress.
+ */
+static void balance_memcg_dirty_pages(struct backing_dev_info *bdi)
+{
+	struct mem_cgroup_dirty_info info;
+	long pause = max(HZ / 100, 1);
+
+	for (;;) {
+		if (!memcg_dirty_info(0, &info))
+			break;
+
+		if (info.nr_file_dirty > info.background_thresh)
+			bdi_start_memcg_writeback(bdi, info.id);
+
+		if (info.nr_file_dirty + info.nr_writeback <= info.dirty_thresh)
+			break;
+
+		__set_current_state(TASK_KILLABLE);
+		io_schedule_timeout(pause);
+		pause = min_t(long, pause * 2, MAX_PAUSE);
+
+		if (fatal_signal_pending(current))
+			break;
+	}
+}
+
 /*
  * balance_dirty_pages() must be called by processes which are generating dirty
  * data.  It looks at the number of dirty pages in the machine and will force
@@ -1209,6 +1253,8 @@ static void balance_dirty_pages(struct address_space *mapping,
 	struct backing_dev_info *bdi = mapping->backing_dev_info;
 	unsigned long start_time = jiffies;
 
+	balance_memcg_dirty_pages(bdi);
+
 	for (;;) {
 		unsigned long now = jiffies;
 
@@ -1957,10 +2003,16 @@ int __set_page_dirty_no_writeback(struct page *page)
 /*
  * Helper function for set_page_dirty family.
  * NOTE: This relies on being atomic wrt interrupts.
+ *
+ * Callers hold mapping->tree_lock and should set the page dirty and call
+ * this under mem_cgroup_begin_update_page_stat(), so that a concurrent
+ * move of the page to another memcg sees the page and its stat together.
  */
 void account_page_dirtied(struct page *page, struct address_space *mapping)
 {
 	if (mapping_cap_account_dirty(mapping)) {
+		mem_cgroup_mark_mapping_dirty(mapping, page);
+		mem_cgroup_inc_page_stat(page, MEMCG_NR_FILE_DIRTY);
 		__inc_zone_page_state(page, NR_FILE_DIRTY);
 		__inc_zone_page_state(page, NR_DIRTIED);
 		__inc_bdi_stat(mapping->backing_dev_info, BDI_RECLAIMABLE);
@@ -2000,12 +2052,18 @@ EXPORT_SYMBOL(account_page_writeback);
  */
 int __set_page_dirty_nobuffers(struct page *page)
 {
+	bool locked;
+	unsigned long flags;
+
+	mem_cgroup_begin_update_page_stat(page, &locked, &flags);
 	if (!TestSetPageDirty(page)) {
 		struct address_space *mapping = page_mapping(page);
 		struct address_space *mapping2;
 
-		if (!mapping)
+		if (!mapping) {
+			mem_cgroup_end_update_page_stat(page, &locked, &flags);
 			return 1;
+		}
 
 		spin_lock_irq(&mapping->tree_lock);
 		mapping2 = page_mapping(page);
@@ -2017,12 +2075,15 @@ int __set_page_dirty_nobuffers(struct page *page)
 				page_index(page), PAGECACHE_TAG_DIRTY);
 		}
 		spin_unlock_irq(&mapping->tree_lock);
+		mem_cgroup_end_update_page_stat(page, &locked, &flags);
+
 		if (mapping->host) {
 			/* !PageAnon && !swapper_space */
 			__mark_inode_dirty(mapping->host, I_DIRTY_PAGES);
 		}
 		return 1;
 	}
+	mem_cgroup_end_update_page_stat(page, &locked, &flags);
 	return 0;
 }
 EXPORT_SYMBOL(__set_page_dirty_nobuffers);
@@ -2138,6 +2199,9 @@ EXPORT_SYMBOL(set_page_dirty_lock);
 int clear_page_dirty_for_io(struct page *page)
 {
 	struct address_space *mapping = page_mapping(page);
+	bool locked;
+	unsigned long flags;
+	int ret = 0;
 
 	BUG_ON(!PageLocked(page));
 
@@ -2179,13 +2243,16 @@ int clear_page_dirty_for_io(struct page *page)
 		 * the desired exclusion. See mm/memory.c:do_wp_page()
 		 * for more comments.
 		 */
+		mem_cgroup_begin_update_page_stat(page, &locked, &flags);
 		if (TestClearPageDirty(page)) {
+			mem_cgroup_dec_page_stat(page, MEMCG_NR_FILE_DIRTY);
 			dec_zone_page_state(page, NR_FILE_DIRTY);
 			dec_bdi_stat(mapping->backing_dev_info,
 					BDI_RECLAIMABLE);
-			return 1;
+			ret = 1;
 		}
-		return 0;
+		mem_cgroup_end_update_page_stat(page, &locked, &flags);
+		return ret;
 	}
 	return TestClearPageDirty(page);
 }
@@ -2194,8 +2261,11 @@ EXPORT_SYMBOL(clear_page_dirty_for_io);
 int test_clear_page_writeback(struct page *page)
 {
 	struct address_space *mapping = page_mapping(page);
+	bool locked;
+	unsigned long memcg_flags;
 	int ret;
 
+	mem_cgroup_begin_update_page_stat(page, &locked, &memcg_flags);
 	if (mapping) {
 		struct backing_dev_info *bdi = mapping->backing_dev_info;
 		unsigned long flags;
@@ -2216,17 +2286,22 @@ int test_clear_page_writeback(struct page *page)
 		ret = TestClearPageWriteback(page);
 	}
 	if (ret) {
+		mem_cgroup_dec_page_stat(page, MEMCG_NR_FILE_WRITEBACK);
 		dec_zone_page_state(page, NR_WRITEBACK);
 		inc_zone_page_state(page, NR_WRITTEN);
 	}
+	mem_cgroup_end_update_page_stat(page, &locked, &memcg_flags);
 	return ret;
 }
 
 int test_set_page_writeback(struct page *page)
 {
 	struct address_space *mapping = page_mapping(page);
+	bool locked;
+	unsigned long memcg_flags;
 	int ret;
 
+	mem_cgroup_begin_update_page_stat(page, &locked, &memcg_flags);
 	if (mapping) {
 		struct backing_dev_info *bdi = mapping->backing_dev_info;
 		unsigned long flags;
@@ -2251,8 +2326,11 @@ int test_set_page_writeback(struct page *page)
 	} else {
 		ret = TestSetPageWriteback(page);
 	}
-	if (!ret)
+	if (!ret) {
+		mem_cgroup_inc_page_stat(page, MEMCG_NR_FILE_WRITEBACK);
 		account_page_writeback(page);
+	}
+	mem_cgroup_end_update_page_stat(page, &locked, &memcg_flags);
 	return ret;
 
 }
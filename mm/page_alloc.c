@@ -48,7 +48,6 @@
 #include <linux/backing-dev.h>
 #include <linux/fault-inject.h>
 #include <linux/page-isolation.h>
-#include <linux/page_cgroup.h>
 #include <linux/debugobjects.h>
 #include <linux/kmemleak.h>
 #include <linux/compaction.h>
@@ -56,6 +55,7 @@
 #include <linux/ftrace_event.h>
 #include <linux/memcontrol.h>
 #include <linux/prefetch.h>
+#include <linux/kthread.h>
 #include <linux/migrate.h>
 #include <linux/page-debug-flags.h>
 
@@ -3738,6 +3738,87 @@ static void setup_zone_migrate_reserve(struct zone *zone)
 	}
 }
 
+static void __meminit __init_single_page(struct page *page, unsigned long pfn,
+					 unsigned long zone, int nid)
+{
+	struct zone *z = &NODE_DATA(nid)->node_zones[zone];
+
+	set_page_links(page, zone, nid, pfn);
+	mminit_verify_page_links(page, zone, nid, pfn);
+	init_page_count(page);
+	reset_page_mapcount(page);
+	SetPageReserved(page);
+	/*
+	 * Mark the block movable so that blocks are reserved for
+	 * movable at startup. This will force kernel allocations
+	 * to reserve their blocks rather than leaking throughout
+	 * the address space during boot when many long-lived
+	 * kernel allocations are made. Later some blocks near
+	 * the start are marked MIGRATE_RESERVE by
+	 * setup_zone_migrate_reserve()
+	 *
+	 * bitmap is created for zone's valid pfn range. but memmap
+	 * can be created for invalid pages (for alignment)
+	 * check here not to call set_pageblock_migratetype() against
+	 * pfn out of zone.
+	 */
+	if ((z->zone_start_pfn <= pfn)
+	    && (pfn < z->zone_start_pfn + z->spanned_pages)
+	    && !(pfn & (pageblock_nr_pages - 1)))
+		set_pageblock_migratetype(page, MIGRATE_MOVABLE);
+
+	INIT_LIST_HEAD(&page->lru);
+#ifdef WANT_PAGE_VIRTUAL
+	/* The shift won't overflow because ZONE_NORMAL is below 4G. */
+	if (!is_highmem_idx(zone))
+		set_page_address(page, __va(pfn << PAGE_SHIFT));
+#endif
+}
+
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+/* Pages of the highest zone of a node that are initialised at boot */
+#define DEFERRED_INIT_EARLY_PAGES	(2UL << (30 - PAGE_SHIFT))
+
+static inline void reset_deferred_meminit(pg_data_t *pgdat)
+{
+	pgdat->first_deferred_pfn = ULONG_MAX;
+}
+
+/*
+ * Returns false if the struct pages from @pfn to the end of the zone are
+ * to be initialised later, by deferred_init_memmap().  The lower zones
+ * are initialised in full, for address-constrained allocations, and
+ * the highest zone of the node up to a section boundary past
+ * DEFERRED_INIT_EARLY_PAGES, for the rest of the boot.
+ */
+static inline bool update_defer_init(pg_data_t *pgdat, unsigned long pfn,
+				     unsigned long zone_end,
+				     unsigned long *nr_initialised)
+{
+	if (zone_end < node_end_pfn(pgdat->node_id))
+		return true;
+
+	(*nr_initialised)++;
+	if (*nr_initialised > DEFERRED_INIT_EARLY_PAGES &&
+	    (pfn & (PAGES_PER_SECTION - 1)) == 0) {
+		pgdat->first_deferred_pfn = pfn;
+		return false;
+	}
+	return true;
+}
+#else
+static inline void reset_deferred_meminit(pg_data_t *pgdat)
+{
+}
+
+static inline bool update_defer_init(pg_data_t *pgdat, unsigned long pfn,
+				     unsigned long zone_end,
+				     unsigned long *nr_initialised)
+{
+	return true;
+}
+#endif /* CONFIG_DEFERRED_STRUCT_PAGE_INIT */
+
 /*
  * Initially all pages are reserved - free ones are freed
  * up by free_all_bootmem() once the early boot process is
@@ -3746,15 +3827,14 @@ static void setup_zone_migrate_reserve(struct zone *zone)
 void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 		unsigned long start_pfn, enum memmap_context context)
 {
-	struct page *page;
+	pg_data_t *pgdat = NODE_DATA(nid);
 	unsigned long end_pfn = start_pfn + size;
+	unsigned long nr_initialised = 0;
 	unsigned long pfn;
-	struct zone *z;
 
 	if (highest_memmap_pfn < end_pfn - 1)
 		highest_memmap_pfn = end_pfn - 1;
 
-	z = &NODE_DATA(nid)->node_zones[zone];
 	for (pfn = start_pfn; pfn < end_pfn; pfn++) {
 		/*
 		 * There can be holes in boot-time mem_map[]s
@@ -3766,41 +3846,208 @@ void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 				continue;
 			if (!early_pfn_in_nid(pfn, nid))
 				continue;
+			if (!update_defer_init(pgdat, pfn, end_pfn,
+					       &nr_initialised))
+				break;
+		}
+		__init_single_page(pfn_to_page(pfn), pfn, zone, nid);
+	}
+}
+
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+/* The zone of @pgdat which @pfn, in the deferred part of the node, is in */
+static int __init deferred_zone_idx(pg_data_t *pgdat, unsigned long pfn)
+{
+	int zid;
+
+	for (zid = 0; zid < MAX_NR_ZONES - 1; zid++) {
+		struct zone *zone = &pgdat->node_zones[zid];
+
+		if (zone->spanned_pages &&
+		    pfn < zone->zone_start_pfn + zone->spanned_pages)
+			break;
+	}
+	return zid;
+}
+
+/*
+ * Clamp [start_pfn, end_pfn), free memory within one node, to the pages
+ * whose struct pages are initialised already: free_all_bootmem() frees
+ * those, and leaves the rest to deferred_init_memmap().
+ */
+unsigned long __init early_initialised_end_pfn(unsigned long start_pfn,
+					       unsigned long end_pfn)
+{
+	pg_data_t *pgdat = NODE_DATA(early_pfn_to_nid(start_pfn));
+
+	return clamp(pgdat->first_deferred_pfn, start_pfn, end_pfn);
+}
+
+/*
+ * Initialise the struct pages of a range reserved in memblock which lie
+ * in the deferred part of a node: they are never freed, so
+ * deferred_init_memmap() does not touch them, and they stay reserved
+ * as memmap_init_zone() leaves them.
+ */
+void __init reserve_bootmem_region(phys_addr_t start, phys_addr_t end)
+{
+	unsigned long pfn = PFN_DOWN(start);
+	unsigned long end_pfn = PFN_UP(end);
+	pg_data_t *pgdat = NULL;
+	int nid = 0, zid = 0;
+
+	for (; pfn < end_pfn; pfn++) {
+		if (!pgdat || !(pfn & (MAX_ORDER_NR_PAGES - 1))) {
+			nid = early_pfn_to_nid(pfn);
+			pgdat = NODE_DATA(nid);
+			zid = deferred_zone_idx(pgdat,
+						pgdat->first_deferred_pfn);
+		}
+		if (pfn < pgdat->first_deferred_pfn || !early_pfn_valid(pfn))
+			continue;
+		__init_single_page(pfn_to_page(pfn), pfn, zid, nid);
+	}
+}
+
+/* Free @nr_pages initialised pages from @pfn to the buddy allocator */
+static void __init deferred_free_range(unsigned long pfn,
+				       unsigned long nr_pages)
+{
+	while (nr_pages) {
+		unsigned int order = MAX_ORDER - 1;
+
+		while ((pfn & ((1UL << order) - 1)) || (1UL << order) > nr_pages)
+			order--;
+		__free_pages_bootmem(pfn_to_page(pfn), order);
+		pfn += 1UL << order;
+		nr_pages -= 1UL << order;
+	}
+}
+
+/*
+ * Initialise the struct pages of [pfn, end_pfn) in the deferred @zone,
+ * except for those reserve_bootmem_region() initialised already.  If
+ * @free, the range is memory of the node and its pages are freed to the
+ * buddy allocator as they are initialised; otherwise it is a hole, and
+ * they are left reserved.  Returns the number of pages freed.
+ */
+static unsigned long __init deferred_init_range(struct zone *zone,
+		unsigned long pfn, unsigned long end_pfn, bool free)
+{
+	int nid = zone_to_nid(zone);
+	int zid = zone_idx(zone);
+	unsigned long free_pfn = pfn;
+	unsigned long nr_free = 0, nr_freed = 0;
+
+	for (; pfn < end_pfn; pfn++) {
+		struct page *page;
+
+		/* Free a MAX_ORDER block while its struct pages are hot */
+		if (!(pfn & (MAX_ORDER_NR_PAGES - 1))) {
+			deferred_free_range(free_pfn, nr_free);
+			nr_freed += nr_free;
+			nr_free = 0;
+			cond_resched();
 		}
+
+		if (!free &&
+		    (!early_pfn_valid(pfn) || !early_pfn_in_nid(pfn, nid)))
+			continue;
+
 		page = pfn_to_page(pfn);
-		set_page_links(page, zone, nid, pfn);
-		mminit_verify_page_links(page, zone, nid, pfn);
-		init_page_count(page);
-		reset_page_mapcount(page);
-		SetPageReserved(page);
-		/*
-		 * Mark the block movable so that blocks are reserved for
-		 * movable at startup. This will force kernel allocations
-		 * to reserve their blocks rather than leaking throughout
-		 * the address space during boot when many long-lived
-		 * kernel allocations are made. Later some blocks near
-		 * the start are marked MIGRATE_RESERVE by
-		 * setup_zone_migrate_reserve()
-		 *
-		 * bitmap is created for zone's valid pfn range. but memmap
-		 * can be created for invalid pages (for alignment)
-		 * check here not to call set_pageblock_migratetype() against
-		 * pfn out of zone.
-		 */
-		if ((z->zone_start_pfn <= pfn)
-		    && (pfn < z->zone_start_pfn + z->spanned_pages)
-		    && !(pfn & (pageblock_nr_pages - 1)))
-			set_pageblock_migratetype(page, MIGRATE_MOVABLE);
+		if (page->flags) {
+			/* Reserved, see reserve_bootmem_region() */
+			deferred_free_range(free_pfn, nr_free);
+			nr_freed += nr_free;
+			nr_free = 0;
+			continue;
+		}
 
-		INIT_LIST_HEAD(&page->lru);
-#ifdef WANT_PAGE_VIRTUAL
-		/* The shift won't overflow because ZONE_NORMAL is below 4G. */
-		if (!is_highmem_idx(zone))
-			set_page_address(page, __va(pfn << PAGE_SHIFT));
-#endif
+		__init_single_page(page, pfn, zid, nid);
+		if (free) {
+			if (!nr_free)
+				free_pfn = pfn;
+			nr_free++;
+		}
 	}
+	deferred_free_range(free_pfn, nr_free);
+	return nr_freed + nr_free;
 }
 
+static atomic_t pgdat_init_n_undone __initdata;
+static __initdata DECLARE_COMPLETION(pgdat_init_all_done_comp);
+
+/*
+ * Initialise the struct pages that memmap_init_zone() left from
+ * first_deferred_pfn to the end of the node, and free its memory.
+ */
+static int __init deferred_init_memmap(void *data)
+{
+	pg_data_t *pgdat = data;
+	int nid = pgdat->node_id;
+	const struct cpumask *cpumask = cpumask_of_node(nid);
+	unsigned long first_pfn = pgdat->first_deferred_pfn;
+	unsigned long start = jiffies;
+	unsigned long nr_pages = 0;
+	unsigned long start_pfn, end_pfn, zone_end, pfn;
+	struct zone *zone;
+	int i;
+
+	if (first_pfn == ULONG_MAX)
+		goto out;
+
+	/* Bind to the cpus of the node, where its memory is local */
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(current, cpumask);
+
+	zone = &pgdat->node_zones[deferred_zone_idx(pgdat, first_pfn)];
+	zone_end = zone->zone_start_pfn + zone->spanned_pages;
+
+	pfn = first_pfn;
+	for_each_mem_pfn_range(i, nid, &start_pfn, &end_pfn, NULL) {
+		start_pfn = max(start_pfn, first_pfn);
+		end_pfn = min(end_pfn, zone_end);
+		if (start_pfn >= end_pfn)
+			continue;
+		deferred_init_range(zone, pfn, start_pfn, false);
+		nr_pages += deferred_init_range(zone, start_pfn, end_pfn, true);
+		pfn = end_pfn;
+	}
+	deferred_init_range(zone, pfn, zone_end, false);
+	pgdat->first_deferred_pfn = ULONG_MAX;
+
+	pr_info("node %d initialised, %lu pages in %ums\n", nid, nr_pages,
+		jiffies_to_msecs(jiffies - start));
+out:
+	if (atomic_dec_and_test(&pgdat_init_n_undone))
+		complete(&pgdat_init_all_done_comp);
+	return 0;
+}
+
+/*
+ * Initialise the struct pages deferred at boot with one kthread per node,
+ * and wait for them, before the initcalls run.
+ */
+void __init page_alloc_init_late(void)
+{
+	unsigned long start = jiffies;
+	struct task_struct *thread;
+	int nid;
+
+	atomic_set(&pgdat_init_n_undone, num_node_state(N_HIGH_MEMORY));
+	for_each_node_state(nid, N_HIGH_MEMORY) {
+		thread = kthread_run(deferred_init_memmap, NODE_DATA(nid),
+				     "pgdatinit%d", nid);
+		if (IS_ERR(thread))
+			deferred_init_memmap(NODE_DATA(nid));
+	}
+
+	wait_for_completion(&pgdat_init_all_done_comp);
+	pr_info("deferred struct page init took %ums\n",
+		jiffies_to_msecs(jiffies - start));
+}
+#endif /* CONFIG_DEFERRED_STRUCT_PAGE_INIT */
+
 static void __meminit zone_init_free_lists(struct zone *zone)
 {
 	int order, t;
@@ -4397,7 +4644,9 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 	pgdat_resize_init(pgdat);
 	init_waitqueue_head(&pgdat->kswapd_wait);
 	init_waitqueue_head(&pgdat->pfmemalloc_wait);
-	pgdat_page_cgroup_init(pgdat);
+#ifdef CONFIG_COMPACTION
+	init_waitqueue_head(&pgdat->kcompactd_wait);
+#endif
 
 	for (j = 0; j < MAX_NR_ZONES; j++) {
 		struct zone *zone = pgdat->node_zones + j;
@@ -4522,6 +4771,7 @@ void __paginginit free_area_init_node(int nid, unsigned long *zones_size,
 	pgdat->node_id = nid;
 	pgdat->node_start_pfn = node_start_pfn;
 	calculate_node_totalpages(pgdat, zones_size, zholes_size);
+	reset_deferred_meminit(pgdat);
 
 	alloc_node_mem_map(pgdat);
 #ifdef CONFIG_FLAT_NODE_MEM_MAP
@@ -6004,6 +6254,11 @@ static const struct trace_print_flags pageflag_names[] = {
 #endif
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 	{1UL << PG_compound_lock,	"compound_lock"	},
+	{1UL << PG_team,		"team"		},
+#endif
+#ifdef CONFIG_IDLE_PAGE_TRACKING
+	{1UL << PG_young,		"young"		},
+	{1UL << PG_idle,		"idle"		},
 #endif
 };
 
@@ -0,0 +1,246 @@
+/*
+ * linux/mm/page_idle.c
+ *
+ * Idle page tracking.  /sys/kernel/mm/page_idle/bitmap holds one bit per
+ * page frame: writing a 1 to the bit of a user page marks it idle, and the
+ * bit reads back as 1 for as long as the page has not been accessed since.
+ * Sampling the bitmap gives the working set of a workload without
+ * touching the referenced state that page reclaim relies on.
+ *
+ * A page is idle if PG_idle is set.  mark_page_accessed() and
+ * page_referenced() clear it; the young bits of the ptes mapping the page
+ * are only looked at when the bitmap is read or written.  Whenever idle
+ * tracking clears such a young bit it sets PG_young instead, which
+ * page_referenced() counts as the reference it would otherwise have seen,
+ * so that LRU aging is not disturbed.
+ */
+#include <linux/init.h>
+#include <linux/bootmem.h>
+#include <linux/fs.h>
+#include <linux/sysfs.h>
+#include <linux/kobject.h>
+#include <linux/mm.h>
+#include <linux/mmzone.h>
+#include <linux/pagemap.h>
+#include <linux/rmap.h>
+#include <linux/ksm.h>
+#include <linux/huge_mm.h>
+#include <linux/mmu_notifier.h>
+
+#define BITMAP_CHUNK_SIZE	sizeof(u64)
+#define BITMAP_CHUNK_BITS	(BITMAP_CHUNK_SIZE * BITS_PER_BYTE)
+
+/*
+ * Idle page tracking only considers user memory pages, for other types of
+ * pages the idle flag is always unset and an attempt to set it is silently
+ * ignored.
+ *
+ * We treat a page as a user memory page if it is on an LRU list, because it
+ * is always safe to pass such a page to rmap_walk(), which is essential for
+ * idle page tracking.  With such an indicator of user pages we can skip
+ * isolated pages, but since there are not usually many of them, it will
+ * hardly affect the overall result.
+ *
+ * This function tries to get a user memory page by pfn as described above.
+ */
+static struct page *page_idle_get_page(unsigned long pfn)
+{
+	struct page *page;
+	struct zone *zone;
+
+	if (!pfn_valid(pfn))
+		return NULL;
+
+	page = pfn_to_page(pfn);
+	if (!PageLRU(page) || !get_page_unless_zero(page))
+		return NULL;
+
+	zone = page_zone(page);
+	spin_lock_irq(&zone->lru_lock);
+	if (unlikely(!PageLRU(page))) {
+		put_page(page);
+		page = NULL;
+	}
+	spin_unlock_irq(&zone->lru_lock);
+	return page;
+}
+
+static int page_idle_clear_pte_refs_one(struct page *page,
+					struct vm_area_struct *vma,
+					unsigned long address, void *arg)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	int referenced = 0;
+	pmd_t *pmd;
+
+	if (unlikely(PageTransHuge(page))) {
+		spin_lock(&mm->page_table_lock);
+		pmd = page_check_address_pmd(page, mm, address,
+					     PAGE_CHECK_ADDRESS_PMD_FLAG);
+		if (pmd)
+			referenced = pmdp_clear_young_notify(vma, address, pmd);
+		spin_unlock(&mm->page_table_lock);
+	} else if (unlikely(PageTeam(page)) &&
+		   (pmd = page_check_team_pmd(page, mm, address))) {
+		referenced = page_referenced_team_pmd(page, vma, address, pmd);
+		spin_unlock(&mm->page_table_lock);
+	} else {
+		pte_t *pte;
+		spinlock_t *ptl;
+
+		pte = page_check_address(page, mm, address, &ptl, 0);
+		if (pte) {
+			referenced = ptep_clear_young_notify(vma, address, pte);
+			pte_unmap_unlock(pte, ptl);
+		}
+	}
+
+	if (referenced) {
+		ClearPageIdle(page);
+		/*
+		 * We cleared the referenced bit in a mapping to this page.
+		 * To avoid interference with page reclaim, mark it young so
+		 * that page_referenced() will return > 0.
+		 */
+		SetPageYoung(page);
+	}
+	return SWAP_AGAIN;
+}
+
+static void page_idle_clear_pte_refs(struct page *page)
+{
+	struct anon_vma *anon_vma = NULL;
+
+	if (!page_mapped(page) || !trylock_page(page))
+		return;
+
+	/*
+	 * rmap_walk() takes the anon_vma lock without checking that the
+	 * anon_vma is still there: hold a reference on it meanwhile, as
+	 * migration does.  KSM pages hold their own references.
+	 */
+	if (PageAnon(page) && !PageKsm(page)) {
+		anon_vma = page_get_anon_vma(page);
+		if (!anon_vma)
+			goto out;
+	}
+
+	rmap_walk(page, page_idle_clear_pte_refs_one, NULL);
+
+	if (anon_vma)
+		put_anon_vma(anon_vma);
+out:
+	unlock_page(page);
+}
+
+static ssize_t page_idle_bitmap_read(struct file *file, struct kobject *kobj,
+				     struct bin_attribute *attr, char *buf,
+				     loff_t pos, size_t count)
+{
+	u64 *out = (u64 *)buf;
+	struct page *page;
+	unsigned long pfn, end_pfn;
+	int bit;
+
+	if (pos % BITMAP_CHUNK_SIZE || count % BITMAP_CHUNK_SIZE)
+		return -EINVAL;
+
+	pfn = pos * BITS_PER_BYTE;
+	if (pfn >= max_pfn)
+		return 0;
+
+	end_pfn = pfn + count * BITS_PER_BYTE;
+	if (end_pfn > max_pfn)
+		end_pfn = ALIGN(max_pfn, BITMAP_CHUNK_BITS);
+
+	for (; pfn < end_pfn; pfn++) {
+		bit = pfn % BITMAP_CHUNK_BITS;
+		if (!bit)
+			*out = 0ULL;
+		page = page_idle_get_page(pfn);
+		if (page) {
+			if (PageIdle(page)) {
+				/*
+				 * The page might have been referenced via a
+				 * pte, in which case it is not idle. Clear
+				 * refs and recheck.
+				 */
+				page_idle_clear_pte_refs(page);
+				if (PageIdle(page))
+					*out |= 1ULL << bit;
+			}
+			put_page(page);
+		}
+		if (bit == BITMAP_CHUNK_BITS - 1)
+			out++;
+		cond_resched();
+	}
+	return (char *)out - buf;
+}
+
+static ssize_t page_idle_bitmap_write(struct file *file, struct kobject *kobj,
+				      struct bin_attribute *attr, char *buf,
+				      loff_t pos, size_t count)
+{
+	const u64 *in = (u64 *)buf;
+	struct page *page;
+	unsigned long pfn, end_pfn;
+	int bit;
+
+	if (pos % BITMAP_CHUNK_SIZE || count % BITMAP_CHUNK_SIZE)
+		return -EINVAL;
+
+	pfn = pos * BITS_PER_BYTE;
+	if (pfn >= max_pfn)
+		return -ENXIO;
+
+	end_pfn = pfn + count * BITS_PER_BYTE;
+	if (end_pfn > max_pfn)
+		end_pfn = ALIGN(max_pfn, BITMAP_CHUNK_BITS);
+
+	for (; pfn < end_pfn; pfn++) {
+		bit = pfn % BITMAP_CHUNK_BITS;
+		if ((*in >> bit) & 1) {
+			page = page_idle_get_page(pfn);
+			if (page) {
+				page_idle_clear_pte_refs(page);
+				SetPageIdle(page);
+				put_page(page);
+			}
+		}
+		if (bit == BITMAP_CHUNK_BITS - 1)
+			in++;
+		cond_resched();
+	}
+	return (char *)in - buf;
+}
+
+static struct bin_attribute page_idle_bitmap_attr = {
+	.attr	= {
+		.name	= "bitmap",
+		.mode	= S_IRUSR | S_IWUSR,
+	},
+	.read	= page_idle_bitmap_read,
+	.write	= page_idle_bitmap_write,
+};
+
+static int __init page_idle_init(void)
+{
+	struct kobject *page_idle_kobj;
+	int err;
+
+	page_idle_kobj = kobject_create_and_add("page_idle", mm_kobj);
+	if (!page_idle_kobj) {
+		pr_err("page_idle: failed to create sysfs directory\n");
+		return -ENOMEM;
+	}
+
+	err = sysfs_create_bin_file(page_idle_kobj, &page_idle_bitmap_attr);
+	if (err) {
+		pr_err("page_idle: register sysfs failed\n");
+		kobject_put(page_idle_kobj);
+		return err;
+	}
+	return 0;
+}
+subsys_initcall(page_idle_init);
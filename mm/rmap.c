@@ -696,10 +696,9 @@ int page_referenced_one(struct page *page, struct vm_area_struct *vma,
 {
 	struct mm_struct *mm = vma->vm_mm;
 	int referenced = 0;
+	pmd_t *pmd;
 
 	if (unlikely(PageTransHuge(page))) {
-		pmd_t *pmd;
-
 		spin_lock(&mm->page_table_lock);
 		/*
 		 * rmap might return false positives; we must filter
@@ -723,6 +722,18 @@ int page_referenced_one(struct page *page, struct vm_area_struct *vma,
 		if (pmdp_clear_flush_young_notify(vma, address, pmd))
 			referenced++;
 		spin_unlock(&mm->page_table_lock);
+	} else if (unlikely(PageTeam(page)) &&
+		   (pmd = page_check_team_pmd(page, mm, address))) {
+		if (vma->vm_flags & VM_LOCKED) {
+			spin_unlock(&mm->page_table_lock);
+			*mapcount = 0;	/* break early from loop */
+			*vm_flags |= VM_LOCKED;
+			goto out;
+		}
+
+		if (page_referenced_team_pmd(page, vma, address, pmd))
+			referenced++;
+		spin_unlock(&mm->page_table_lock);
 	} else {
 		pte_t *pte;
 		spinlock_t *ptl;
@@ -756,6 +767,12 @@ int page_referenced_one(struct page *page, struct vm_area_struct *vma,
 		pte_unmap_unlock(pte, ptl);
 	}
 
+	if (referenced)
+		ClearPageIdle(page);
+	/* A reference seen and cleared by idle page tracking */
+	if (TestClearPageYoung(page))
+		referenced++;
+
 	(*mapcount)--;
 
 	if (referenced)
@@ -1241,6 +1258,28 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 	spinlock_t *ptl;
 	int ret = SWAP_AGAIN;
 
+	if (unlikely(PageTeam(page))) {
+		pmd_t *pmd = page_check_team_pmd(page, mm, address);
+
+		if (pmd) {
+			spin_unlock(&mm->page_table_lock);
+			if (!(flags & TTU_IGNORE_MLOCK)) {
+				if (vma->vm_flags & VM_LOCKED)
+					goto out_mlock_unlocked;
+
+				if (TTU_ACTION(flags) == TTU_MUNLOCK)
+					goto out;
+			}
+			/*
+			 * A huge pmd maps the whole team of shmem pages:
+			 * unmap it, the pages themselves stay in the page
+			 * cache, and the others can be faulted back by ptes.
+			 */
+			unmap_team_by_pmd(vma, address, pmd);
+			goto out;
+		}
+	}
+
 	pte = page_check_address(page, mm, address, &ptl, 0);
 	if (!pte)
 		goto out;
@@ -1285,6 +1324,24 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 	} else if (PageAnon(page)) {
 		swp_entry_t entry = { .val = page_private(page) };
 
+		/* MADV_FREE page check, migration keeps the page */
+		if (!PageSwapBacked(page) &&
+		    TTU_ACTION(flags) != TTU_MIGRATION) {
+			if (!PageDirty(page)) {
+				dec_mm_counter(mm, MM_ANONPAGES);
+				goto discard;
+			}
+			/*
+			 * The page was written to since MADV_FREE, it can
+			 * not be discarded anymore: map it back and turn it
+			 * into a regular anonymous page again.
+			 */
+			set_pte_at(mm, address, pte, pteval);
+			SetPageSwapBacked(page);
+			ret = SWAP_FAIL;
+			goto out_unmap;
+		}
+
 		if (PageSwapCache(page)) {
 			/*
 			 * Store the swap location in the pte.
@@ -1323,6 +1380,7 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 	} else
 		dec_mm_counter(mm, MM_FILEPAGES);
 
+discard:
 	page_remove_rmap(page);
 	page_cache_release(page);
 
@@ -1333,7 +1391,7 @@ out:
 
 out_mlock:
 	pte_unmap_unlock(pte, ptl);
-
+out_mlock_unlocked:
 
 	/*
 	 * We need mmap_sem locking, Otherwise VM_LOCKED check makes
@@ -1717,10 +1775,11 @@ void __put_anon_vma(struct anon_vma *anon_vma)
 	anon_vma_free(anon_vma);
 }
 
-#ifdef CONFIG_MIGRATION
+#if defined(CONFIG_MIGRATION) || defined(CONFIG_IDLE_PAGE_TRACKING)
 /*
  * rmap_walk() and its helpers rmap_walk_anon() and rmap_walk_file():
- * Called by migrate.c to remove migration ptes, but might be used more later.
+ * Called by migrate.c to remove migration ptes, and by page_idle.c to
+ * clear the young bits of the ptes mapping a page.
  */
 static int rmap_walk_anon(struct page *page, int (*rmap_one)(struct page *,
 		struct vm_area_struct *, unsigned long, void *), void *arg)
@@ -1793,7 +1852,7 @@ int rmap_walk(struct page *page, int (*rmap_one)(struct page *,
 	else
 		return rmap_walk_file(page, rmap_one, arg);
 }
-#endif /* CONFIG_MIGRATION */
+#endif /* CONFIG_MIGRATION || CONFIG_IDLE_PAGE_TRACKING */
 
 #ifdef CONFIG_HUGETLB_PAGE
 /*
@@ -64,10 +64,13 @@ static struct vfsmount *shm_mnt;
 #include <linux/highmem.h>
 #include <linux/seq_file.h>
 #include <linux/magic.h>
+#include <linux/khugepaged.h>
 
 #include <asm/uaccess.h>
 #include <asm/pgtable.h>
 
+#include "internal.h"
+
 #define BLOCKS_PER_PAGE  (PAGE_CACHE_SIZE/512)
 #define VM_ACCT(size)    (PAGE_CACHE_ALIGN(size) >> PAGE_SHIFT)
 
@@ -121,13 +124,14 @@ static bool shmem_should_replace_page(struct page *page, gfp_t gfp);
 static int shmem_replace_page(struct page **pagep, gfp_t gfp,
 				struct shmem_inode_info *info, pgoff_t index);
 static int shmem_getpage_gfp(struct inode *inode, pgoff_t index,
-	struct page **pagep, enum sgp_type sgp, gfp_t gfp, int *fault_type);
+	struct page **pagep, enum sgp_type sgp, gfp_t gfp,
+	struct vm_area_struct *vma, int *fault_type);
 
 static inline int shmem_getpage(struct inode *inode, pgoff_t index,
 	struct page **pagep, enum sgp_type sgp, int *fault_type)
 {
 	return shmem_getpage_gfp(inode, index, pagep, sgp,
-			mapping_gfp_mask(inode->i_mapping), fault_type);
+			mapping_gfp_mask(inode->i_mapping), NULL, fault_type);
 }
 
 static inline struct shmem_sb_info *SHMEM_SB(struct super_block *sb)
@@ -135,6 +139,78 @@ static inline struct shmem_sb_info *SHMEM_SB(struct super_block *sb)
 	return sb->s_fs_info;
 }
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Huge pages on tmpfs and shared memory, as chosen by the huge= mount
+ * option, or for the internal mount by the shmem_enabled sysfs knob:
+ *
+ * SHMEM_HUGE_NEVER:
+ *	allocate small pages only;
+ * SHMEM_HUGE_ALWAYS:
+ *	allocate a team of pages whenever an extent is first touched;
+ * SHMEM_HUGE_WITHIN_SIZE:
+ *	only allocate a team if it will lie fully within i_size,
+ *	also respect madvise(MADV_HUGEPAGE) on the mapping;
+ * SHMEM_HUGE_ADVISE:
+ *	only allocate a team when faulting a MADV_HUGEPAGE mapping.
+ *
+ * The shmem_enabled knob also accepts, for all mounts at once:
+ *
+ * SHMEM_HUGE_DENY:
+ *	small pages only, overriding the mount option, for emergencies;
+ * SHMEM_HUGE_FORCE:
+ *	teams wherever possible, without the mount option, for testing.
+ */
+#define SHMEM_HUGE_NEVER	0
+#define SHMEM_HUGE_ALWAYS	1
+#define SHMEM_HUGE_WITHIN_SIZE	2
+#define SHMEM_HUGE_ADVISE	3
+#define SHMEM_HUGE_DENY		(-1)
+#define SHMEM_HUGE_FORCE	(-2)
+
+static int shmem_huge __read_mostly;
+
+#if defined(CONFIG_SYSFS) || defined(CONFIG_TMPFS)
+static int shmem_parse_huge(const char *str)
+{
+	if (!strcmp(str, "never"))
+		return SHMEM_HUGE_NEVER;
+	if (!strcmp(str, "always"))
+		return SHMEM_HUGE_ALWAYS;
+	if (!strcmp(str, "within_size"))
+		return SHMEM_HUGE_WITHIN_SIZE;
+	if (!strcmp(str, "advise"))
+		return SHMEM_HUGE_ADVISE;
+	if (!strcmp(str, "deny"))
+		return SHMEM_HUGE_DENY;
+	if (!strcmp(str, "force"))
+		return SHMEM_HUGE_FORCE;
+	return -EINVAL;
+}
+
+static const char *shmem_format_huge(int huge)
+{
+	switch (huge) {
+	case SHMEM_HUGE_NEVER:
+		return "never";
+	case SHMEM_HUGE_ALWAYS:
+		return "always";
+	case SHMEM_HUGE_WITHIN_SIZE:
+		return "within_size";
+	case SHMEM_HUGE_ADVISE:
+		return "advise";
+	case SHMEM_HUGE_DENY:
+		return "deny";
+	case SHMEM_HUGE_FORCE:
+		return "force";
+	default:
+		VM_BUG_ON(1);
+		return "bad_val";
+	}
+}
+#endif
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
+
 /*
  * shmem_file_setup pre-accounts the whole fixed size of a VM object,
  * for shared memory and for shared anonymous (/dev/zero) mappings
@@ -159,10 +235,11 @@ static inline void shmem_unacct_size(unsigned long flags, loff_t size)
  * shmem_getpage reports shmem_acct_block failure as -ENOSPC not -ENOMEM,
  * so that a failure on a sparse tmpfs mapping will give SIGBUS not OOM.
  */
-static inline int shmem_acct_block(unsigned long flags)
+static inline int shmem_acct_block(unsigned long flags, long pages)
 {
 	return (flags & VM_NORESERVE) ?
-		security_vm_enough_memory_mm(current->mm, VM_ACCT(PAGE_CACHE_SIZE)) : 0;
+		security_vm_enough_memory_mm(current->mm,
+				pages * VM_ACCT(PAGE_CACHE_SIZE)) : 0;
 }
 
 static inline void shmem_unacct_blocks(unsigned long flags, long pages)
@@ -184,6 +261,11 @@ static struct backing_dev_info shmem_backing_dev_info  __read_mostly = {
 	.capabilities	= BDI_CAP_NO_ACCT_AND_WRITEBACK | BDI_CAP_SWAP_BACKED,
 };
 
+bool shmem_mapping(struct address_space *mapping)
+{
+	return mapping->backing_dev_info == &shmem_backing_dev_info;
+}
+
 static LIST_HEAD(shmem_swaplist);
 static DEFINE_MUTEX(shmem_swaplist_mutex);
 
@@ -307,6 +389,8 @@ static int shmem_add_to_page_cache(struct page *page,
 		mapping->nrpages++;
 		__inc_zone_page_state(page, NR_FILE_PAGES);
 		__inc_zone_page_state(page, NR_SHMEM);
+		if (PageTeam(page))
+			__inc_zone_page_state(page, NR_SHMEM_HUGEPAGES);
 		spin_unlock_irq(&mapping->tree_lock);
 	} else {
 		page->mapping = NULL;
@@ -330,6 +414,7 @@ static void shmem_delete_from_page_cache(struct page *page, void *radswap)
 	mapping->nrpages--;
 	__dec_zone_page_state(page, NR_FILE_PAGES);
 	__dec_zone_page_state(page, NR_SHMEM);
+	page_cache_leave_team(page);
 	spin_unlock_irq(&mapping->tree_lock);
 	page_cache_release(page);
 	BUG_ON(error);
@@ -953,6 +1038,27 @@ static struct page *shmem_alloc_page(gfp_t gfp,
 	 */
 	return alloc_page_vma(gfp, &pvma, 0);
 }
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static struct page *shmem_alloc_hugepage(gfp_t gfp,
+			struct shmem_inode_info *info, pgoff_t index)
+{
+	struct vm_area_struct pvma;
+
+	/* Create a pseudo vma that just contains the policy */
+	pvma.vm_start = 0;
+	/* Bias interleave by inode number to distribute better across nodes */
+	pvma.vm_pgoff = index + info->vfs_inode.i_ino;
+	pvma.vm_ops = NULL;
+	pvma.vm_policy = mpol_shared_policy_lookup(&info->policy, index);
+
+	/*
+	 * alloc_pages_vma() will drop the shared policy reference
+	 */
+	return alloc_pages_vma(gfp, HPAGE_PMD_ORDER, &pvma, 0,
+			       numa_node_id());
+}
+#endif
 #else /* !CONFIG_NUMA */
 #ifdef CONFIG_TMPFS
 static inline void shmem_show_mpol(struct seq_file *seq, struct mempolicy *mpol)
@@ -971,6 +1077,14 @@ static inline struct page *shmem_alloc_page(gfp_t gfp,
 {
 	return alloc_page(gfp);
 }
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static inline struct page *shmem_alloc_hugepage(gfp_t gfp,
+			struct shmem_inode_info *info, pgoff_t index)
+{
+	return alloc_pages(gfp, HPAGE_PMD_ORDER);
+}
+#endif
 #endif /* CONFIG_NUMA */
 
 #if !defined(CONFIG_NUMA) || !defined(CONFIG_TMPFS)
@@ -1063,6 +1177,194 @@ static int shmem_replace_page(struct page **pagep, gfp_t gfp,
 	return error;
 }
 
+/*
+ * Reserve blocks for @pages new pages of @inode, as shmem_getpage_gfp()
+ * does for one, but without retrying after recalculation.
+ */
+static int shmem_reserve_blocks(struct inode *inode, long pages)
+{
+	struct shmem_inode_info *info = SHMEM_I(inode);
+	struct shmem_sb_info *sbinfo = SHMEM_SB(inode->i_sb);
+
+	if (shmem_acct_block(info->flags, pages))
+		return -ENOSPC;
+	if (sbinfo->max_blocks) {
+		if (sbinfo->max_blocks < pages ||
+		    percpu_counter_compare(&sbinfo->used_blocks,
+					   sbinfo->max_blocks - pages) > 0) {
+			shmem_unacct_blocks(info->flags, pages);
+			return -ENOSPC;
+		}
+		percpu_counter_add(&sbinfo->used_blocks, pages);
+	}
+	return 0;
+}
+
+static void shmem_unreserve_blocks(struct inode *inode, long pages)
+{
+	struct shmem_inode_info *info = SHMEM_I(inode);
+	struct shmem_sb_info *sbinfo = SHMEM_SB(inode->i_sb);
+
+	if (sbinfo->max_blocks)
+		percpu_counter_add(&sbinfo->used_blocks, -pages);
+	shmem_unacct_blocks(info->flags, pages);
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * A huge page for shmem is allocated as a "team" of small pages: split at
+ * once, each page of the team is a page cache page like any other (and
+ * may be swapped out, truncated or migrated separately), marked PageTeam
+ * for as long as it stays in the page cache.  While all the pages of a
+ * team remain, shmem_pmd_fault() can map them together by a huge pmd.
+ */
+static bool shmem_team_wanted(struct inode *inode, pgoff_t index,
+			      struct vm_area_struct *vma, gfp_t gfp)
+{
+	pgoff_t hindex = round_down(index, HPAGE_PMD_NR);
+
+	if (shmem_huge == SHMEM_HUGE_DENY)
+		return false;
+	/* drivers constrain the zone of their shmem: leave them alone */
+	if (gfp_zone(gfp) != gfp_zone(GFP_HIGHUSER_MOVABLE))
+		return false;
+	if (shmem_huge == SHMEM_HUGE_FORCE)
+		return true;
+
+	switch (SHMEM_SB(inode->i_sb)->huge) {
+	case SHMEM_HUGE_ALWAYS:
+		return true;
+	case SHMEM_HUGE_WITHIN_SIZE:
+		if (hindex + HPAGE_PMD_NR <=
+		    DIV_ROUND_UP(i_size_read(inode), PAGE_CACHE_SIZE))
+			return true;
+		/* fall through */
+	case SHMEM_HUGE_ADVISE:
+		return vma && (vma->vm_flags & VM_HUGEPAGE);
+	default:
+		return false;
+	}
+}
+
+static bool shmem_extent_empty(struct address_space *mapping, pgoff_t hindex)
+{
+	struct radix_tree_iter iter;
+	void **slot;
+	bool empty = true;
+
+	rcu_read_lock();
+	radix_tree_for_each_slot(slot, &mapping->page_tree, &iter, hindex) {
+		if (iter.index < hindex + HPAGE_PMD_NR)
+			empty = false;
+		break;
+	}
+	rcu_read_unlock();
+	return empty;
+}
+
+/*
+ * Allocate a team for the empty extent around @index, and add all its
+ * pages to the page cache.  Returns the page for @index locked, and not
+ * yet uptodate, just as shmem_getpage_gfp() allocates a single page; or
+ * NULL if no team could be allocated or inserted, leaving nothing behind.
+ */
+static struct page *shmem_alloc_team(struct inode *inode, pgoff_t index,
+				     gfp_t gfp)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct shmem_inode_info *info = SHMEM_I(inode);
+	pgoff_t hindex = round_down(index, HPAGE_PMD_NR);
+	struct page *head, *page;
+	int error = 0;
+	int i, nr;
+
+	if (!shmem_extent_empty(mapping, hindex))
+		return NULL;
+	if (shmem_reserve_blocks(inode, HPAGE_PMD_NR))
+		return NULL;
+
+	head = shmem_alloc_hugepage(gfp | __GFP_NORETRY | __GFP_NOWARN |
+				    __GFP_NO_KSWAPD, info, hindex);
+	if (!head) {
+		count_vm_event(THP_FILE_FALLBACK);
+		shmem_unreserve_blocks(inode, HPAGE_PMD_NR);
+		return NULL;
+	}
+	split_page(head, HPAGE_PMD_ORDER);
+
+	for (nr = 0; nr < HPAGE_PMD_NR; nr++) {
+		page = head + nr;
+		SetPageSwapBacked(page);
+		SetPageTeam(page);
+		__set_page_locked(page);
+		if (hindex + nr != index) {
+			clear_highpage(page);
+			flush_dcache_page(page);
+			SetPageUptodate(page);
+		}
+		error = mem_cgroup_cache_charge(page, current->mm,
+						gfp & GFP_RECLAIM_MASK);
+		if (error)
+			break;
+		error = radix_tree_preload(gfp & GFP_RECLAIM_MASK);
+		if (!error) {
+			error = shmem_add_to_page_cache(page, mapping,
+						hindex + nr, gfp, NULL);
+			radix_tree_preload_end();
+		}
+		if (error) {
+			mem_cgroup_uncharge_cache_page(page);
+			break;
+		}
+	}
+
+	if (error) {
+		/* Raced with another allocation in the extent: undo */
+		for (i = 0; i < HPAGE_PMD_NR; i++) {
+			page = head + i;
+			if (i < nr)
+				delete_from_page_cache(page);
+			if (i <= nr)
+				unlock_page(page);
+			page_cache_release(page);
+		}
+		count_vm_event(THP_FILE_FALLBACK);
+		shmem_unreserve_blocks(inode, HPAGE_PMD_NR);
+		return NULL;
+	}
+
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		page = head + i;
+		lru_cache_add_anon(page);
+		if (hindex + i != index) {
+			unlock_page(page);
+			page_cache_release(page);
+		}
+	}
+
+	spin_lock(&info->lock);
+	info->alloced += HPAGE_PMD_NR;
+	inode->i_blocks += BLOCKS_PER_PAGE * HPAGE_PMD_NR;
+	shmem_recalc_inode(inode);
+	spin_unlock(&info->lock);
+
+	count_vm_event(THP_FILE_ALLOC);
+	return head + (index - hindex);
+}
+#else
+static inline bool shmem_team_wanted(struct inode *inode, pgoff_t index,
+				     struct vm_area_struct *vma, gfp_t gfp)
+{
+	return false;
+}
+
+static inline struct page *shmem_alloc_team(struct inode *inode,
+					    pgoff_t index, gfp_t gfp)
+{
+	return NULL;
+}
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
+
 /*
  * shmem_getpage_gfp - find page in cache, or get from swap, or allocate
  *
@@ -1071,7 +1373,8 @@ static int shmem_replace_page(struct page **pagep, gfp_t gfp,
  * entry since a page cannot live in both the swap and page cache
  */
 static int shmem_getpage_gfp(struct inode *inode, pgoff_t index,
-	struct page **pagep, enum sgp_type sgp, gfp_t gfp, int *fault_type)
+	struct page **pagep, enum sgp_type sgp, gfp_t gfp,
+	struct vm_area_struct *vma, int *fault_type)
 {
 	struct address_space *mapping = inode->i_mapping;
 	struct shmem_inode_info *info;
@@ -1086,7 +1389,7 @@ static int shmem_getpage_gfp(struct inode *inode, pgoff_t index,
 		return -EFBIG;
 repeat:
 	swap.val = 0;
-	page = find_lock_page(mapping, index);
+	page = find_lock_entry(mapping, index);
 	if (radix_tree_exceptional_entry(page)) {
 		swap = radix_to_swp_entry(page);
 		page = NULL;
@@ -1120,7 +1423,7 @@ repeat:
 
 	if (swap.val) {
 		/* Look it up and read it in.. */
-		page = lookup_swap_cache(swap);
+		page = lookup_swap_cache(swap, NULL, 0);
 		if (!page) {
 			/* here we actually do the io */
 			if (fault_type)
@@ -1172,7 +1475,17 @@ repeat:
 		swap_free(swap);
 
 	} else {
-		if (shmem_acct_block(info->flags)) {
+		if (shmem_team_wanted(inode, index, vma, gfp)) {
+			page = shmem_alloc_team(inode, index, gfp);
+			if (page) {
+				alloced = true;
+				if (sgp == SGP_FALLOC)
+					sgp = SGP_WRITE;
+				goto clear;
+			}
+		}
+
+		if (shmem_acct_block(info->flags, 1)) {
 			error = -ENOSPC;
 			goto failed;
 		}
@@ -1292,7 +1605,8 @@ static int shmem_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	int error;
 	int ret = VM_FAULT_LOCKED;
 
-	error = shmem_getpage(inode, vmf->pgoff, &vmf->page, SGP_CACHE, &ret);
+	error = shmem_getpage_gfp(inode, vmf->pgoff, &vmf->page, SGP_CACHE,
+			mapping_gfp_mask(inode->i_mapping), vma, &ret);
 	if (error)
 		return ((error == -ENOMEM) ? VM_FAULT_OOM : VM_FAULT_SIGBUS);
 
@@ -1303,6 +1617,256 @@ static int shmem_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	return ret;
 }
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static int shmem_pmd_fault(struct vm_area_struct *vma, unsigned long address,
+			   pmd_t *pmd, unsigned int flags)
+{
+	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+	struct page *page;
+	pgoff_t hindex;
+	int error;
+	int ret = 0;
+
+	if (haddr < vma->vm_start || haddr + HPAGE_PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	hindex = linear_page_index(vma, haddr);
+	if (hindex & (HPAGE_PMD_NR - 1))
+		return VM_FAULT_FALLBACK;
+	if (hindex + HPAGE_PMD_NR >
+	    DIV_ROUND_UP(i_size_read(inode), PAGE_CACHE_SIZE))
+		return VM_FAULT_FALLBACK;
+	if (!shmem_huge_enabled(vma))
+		return VM_FAULT_FALLBACK;
+
+	/* Errors are left for the pte fault to report */
+	error = shmem_getpage_gfp(inode, hindex, &page, SGP_CACHE,
+			mapping_gfp_mask(inode->i_mapping), vma, &ret);
+	if (error)
+		return VM_FAULT_FALLBACK;
+
+	ret |= map_team_by_pmd(vma, address, pmd, page, flags);
+	unlock_page(page);
+	page_cache_release(page);
+
+	if (ret & VM_FAULT_MAJOR) {
+		count_vm_event(PGMAJFAULT);
+		mem_cgroup_count_vm_event(vma->vm_mm, PGMAJFAULT);
+	}
+	return ret;
+}
+
+bool shmem_huge_enabled(struct vm_area_struct *vma)
+{
+	struct inode *inode;
+	loff_t i_size;
+	pgoff_t off;
+
+	if (!vma->vm_file || !shmem_mapping(vma->vm_file->f_mapping))
+		return false;
+	/* only shared mappings of the page cache can map its teams */
+	if ((vma->vm_flags & (VM_SHARED | VM_NONLINEAR | VM_NOHUGEPAGE)) !=
+	    VM_SHARED)
+		return false;
+	if (shmem_huge == SHMEM_HUGE_FORCE)
+		return true;
+	if (shmem_huge == SHMEM_HUGE_DENY)
+		return false;
+
+	inode = vma->vm_file->f_mapping->host;
+	switch (SHMEM_SB(inode->i_sb)->huge) {
+	case SHMEM_HUGE_ALWAYS:
+		return true;
+	case SHMEM_HUGE_WITHIN_SIZE:
+		off = round_up(vma->vm_pgoff, HPAGE_PMD_NR);
+		i_size = round_up(i_size_read(inode), PAGE_CACHE_SIZE);
+		if (i_size >= HPAGE_PMD_SIZE &&
+		    i_size >> PAGE_CACHE_SHIFT >= off)
+			return true;
+		/* fall through */
+	case SHMEM_HUGE_ADVISE:
+		return vma->vm_flags & VM_HUGEPAGE;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Which of the pages in the extent at @index are present, and do they
+ * already make up a team?  Returns -EBUSY if any of them is on swap.
+ */
+static int shmem_extent_status(struct address_space *mapping, pgoff_t index,
+			       int *present)
+{
+	struct radix_tree_iter iter;
+	unsigned long pfn, first = 0;
+	struct page *page;
+	void **slot;
+	int team = 1;
+	int nr = 0;
+
+	rcu_read_lock();
+	radix_tree_for_each_slot(slot, &mapping->page_tree, &iter, index) {
+		if (iter.index >= index + HPAGE_PMD_NR)
+			break;
+		page = radix_tree_deref_slot(slot);
+		if (!page)
+			continue;
+		if (radix_tree_exception(page)) {
+			rcu_read_unlock();
+			return -EBUSY;
+		}
+		pfn = page_to_pfn(page) - (iter.index - index);
+		if (!PageTeam(page) || (pfn & (HPAGE_PMD_NR - 1)) ||
+		    (nr && pfn != first))
+			team = 0;
+		first = pfn;
+		nr++;
+	}
+	rcu_read_unlock();
+
+	*present = nr;
+	return nr == HPAGE_PMD_NR && team;
+}
+
+static int shmem_collapse_page(struct page *page, struct page *new, gfp_t gfp)
+{
+	struct address_space *mapping = page->mapping;
+
+	if (!PageUptodate(page))
+		return -EBUSY;
+	if (page_mapped(page))
+		unmap_mapping_range(mapping,
+				(loff_t)page->index << PAGE_CACHE_SHIFT,
+				PAGE_CACHE_SIZE, 0);
+	/* Not mapped, nor pinned by anyone but the cache and us? */
+	if (page_mapped(page) || page_count(page) != 2)
+		return -EBUSY;
+
+	copy_highpage(new, page);
+	SetPageUptodate(new);
+	return replace_page_cache_page(page, new, gfp & GFP_RECLAIM_MASK);
+}
+
+static int shmem_collapse_hole(struct inode *inode, struct page *new,
+			       pgoff_t index, struct mm_struct *mm, gfp_t gfp)
+{
+	struct shmem_inode_info *info = SHMEM_I(inode);
+	int error;
+
+	error = shmem_reserve_blocks(inode, 1);
+	if (error)
+		return error;
+
+	clear_highpage(new);
+	flush_dcache_page(new);
+	SetPageUptodate(new);
+	error = mem_cgroup_cache_charge(new, mm, gfp & GFP_RECLAIM_MASK);
+	if (!error) {
+		error = radix_tree_preload(gfp & GFP_RECLAIM_MASK);
+		if (!error) {
+			error = shmem_add_to_page_cache(new, inode->i_mapping,
+							index, gfp, NULL);
+			radix_tree_preload_end();
+		}
+		if (error)
+			mem_cgroup_uncharge_cache_page(new);
+	}
+	if (error) {
+		shmem_unreserve_blocks(inode, 1);
+		return error;
+	}
+
+	spin_lock(&info->lock);
+	info->alloced++;
+	inode->i_blocks += BLOCKS_PER_PAGE;
+	shmem_recalc_inode(inode);
+	spin_unlock(&info->lock);
+	return 0;
+}
+
+/*
+ * For khugepaged: gather the extent at @index into a team, copying the
+ * pages already present and zeroing up to @max_holes holes, so that it
+ * can then be mapped by a huge pmd.  Rather than wait, give up on pages
+ * which are busy or on swap: pages already moved into the new team stay
+ * there, as ordinary page cache.  Returns 0 if the extent is (now) a
+ * complete team.
+ */
+int shmem_collapse_team(struct mm_struct *mm, struct address_space *mapping,
+			pgoff_t index, int max_holes)
+{
+	struct inode *inode = mapping->host;
+	struct shmem_inode_info *info = SHMEM_I(inode);
+	gfp_t gfp = mapping_gfp_mask(mapping);
+	struct page *head, *page, *new;
+	int present;
+	int error;
+	int i, nr;
+
+	VM_BUG_ON(index & (HPAGE_PMD_NR - 1));
+	if (index + HPAGE_PMD_NR >
+	    DIV_ROUND_UP(i_size_read(inode), PAGE_CACHE_SIZE))
+		return -EINVAL;
+
+	error = shmem_extent_status(mapping, index, &present);
+	if (error)
+		return error > 0 ? 0 : error;
+	if (HPAGE_PMD_NR - present > max_holes)
+		return -EAGAIN;
+
+	head = shmem_alloc_hugepage(gfp | __GFP_NORETRY | __GFP_NOWARN |
+				    __GFP_NO_KSWAPD, info, index);
+	if (!head) {
+		count_vm_event(THP_COLLAPSE_ALLOC_FAILED);
+		return -ENOMEM;
+	}
+	count_vm_event(THP_COLLAPSE_ALLOC);
+	split_page(head, HPAGE_PMD_ORDER);
+
+	/* Let pages on this cpu's lru pagevecs show their true count */
+	lru_add_drain();
+
+	for (nr = 0; nr < HPAGE_PMD_NR; nr++) {
+		new = head + nr;
+		SetPageSwapBacked(new);
+		SetPageTeam(new);
+		__set_page_locked(new);
+
+		page = find_lock_entry(mapping, index + nr);
+		if (radix_tree_exceptional_entry(page)) {
+			error = -EBUSY;
+			break;
+		}
+		if (page) {
+			error = shmem_collapse_page(page, new, gfp);
+			unlock_page(page);
+			page_cache_release(page);
+		} else
+			error = shmem_collapse_hole(inode, new, index + nr,
+						    mm, gfp);
+		if (error)
+			break;
+	}
+
+	/* Pages placed in the cache may not be backed by swap: dirty them */
+	for (i = 0; i < nr; i++) {
+		new = head + i;
+		lru_cache_add_anon(new);
+		set_page_dirty(new);
+		unlock_page(new);
+		page_cache_release(new);
+	}
+	for (i = nr; i < HPAGE_PMD_NR; i++) {
+		new = head + i;
+		if (i == nr)
+			unlock_page(new);
+		page_cache_release(new);
+	}
+	return error;
+}
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
+
 #ifdef CONFIG_NUMA
 static int shmem_set_policy(struct vm_area_struct *vma, struct mempolicy *mpol)
 {
@@ -1346,11 +1910,25 @@ out_nomem:
 	return retval;
 }
 
+/*
+ * Let khugepaged gather the pages of this mapping into teams, if it has
+ * room for a huge pmd.
+ */
+static void shmem_khugepaged_enter(struct vm_area_struct *vma)
+{
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	if (((vma->vm_start + ~HPAGE_PMD_MASK) & HPAGE_PMD_MASK) <
+	    (vma->vm_end & HPAGE_PMD_MASK) && shmem_huge_enabled(vma))
+		khugepaged_enter_shmem(vma);
+#endif
+}
+
 static int shmem_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	file_accessed(file);
 	vma->vm_ops = &shmem_vm_ops;
 	vma->vm_flags |= VM_CAN_NONLINEAR;
+	shmem_khugepaged_enter(vma);
 	return 0;
 }
 
@@ -2503,6 +3081,14 @@ static int shmem_parse_options(char *options, struct shmem_sb_info *sbinfo,
 		} else if (!strcmp(this_char,"mpol")) {
 			if (mpol_parse_str(value, &sbinfo->mpol, 1))
 				goto bad_val;
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+		} else if (!strcmp(this_char, "huge")) {
+			int huge = shmem_parse_huge(value);
+
+			if (huge < 0)
+				goto bad_val;
+			sbinfo->huge = huge;
+#endif
 		} else {
 			printk(KERN_ERR "tmpfs: Bad mount option %s\n",
 			       this_char);
@@ -2548,6 +3134,7 @@ static int shmem_remount_fs(struct super_block *sb, int *flags, char *data)
 	sbinfo->max_blocks  = config.max_blocks;
 	sbinfo->max_inodes  = config.max_inodes;
 	sbinfo->free_inodes = config.max_inodes - inodes;
+	sbinfo->huge        = config.huge;
 
 	mpol_put(sbinfo->mpol);
 	sbinfo->mpol        = config.mpol;	/* transfers initial ref */
@@ -2573,6 +3160,10 @@ static int shmem_show_options(struct seq_file *seq, struct dentry *root)
 	if (!gid_eq(sbinfo->gid, GLOBAL_ROOT_GID))
 		seq_printf(seq, ",gid=%u",
 				from_kgid_munged(&init_user_ns, sbinfo->gid));
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	if (sbinfo->huge)
+		seq_printf(seq, ",huge=%s", shmem_format_huge(sbinfo->huge));
+#endif
 	shmem_show_mpol(seq, sbinfo->mpol);
 	return 0;
 }
@@ -2786,6 +3377,9 @@ static const struct super_operations shmem_ops = {
 
 static const struct vm_operations_struct shmem_vm_ops = {
 	.fault		= shmem_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	.pmd_fault	= shmem_pmd_fault,
+#endif
 #ifdef CONFIG_NUMA
 	.set_policy     = shmem_set_policy,
 	.get_policy     = shmem_get_policy,
@@ -2843,6 +3437,57 @@ out4:
 	return error;
 }
 
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && defined(CONFIG_SYSFS)
+static ssize_t shmem_enabled_show(struct kobject *kobj,
+		struct kobj_attribute *attr, char *buf)
+{
+	int values[] = {
+		SHMEM_HUGE_ALWAYS,
+		SHMEM_HUGE_WITHIN_SIZE,
+		SHMEM_HUGE_ADVISE,
+		SHMEM_HUGE_NEVER,
+		SHMEM_HUGE_DENY,
+		SHMEM_HUGE_FORCE,
+	};
+	int i, count;
+
+	for (i = 0, count = 0; i < ARRAY_SIZE(values); i++) {
+		const char *fmt = shmem_huge == values[i] ? "[%s] " : "%s ";
+
+		count += sprintf(buf + count, fmt,
+				shmem_format_huge(values[i]));
+	}
+	buf[count - 1] = '\n';
+	return count;
+}
+
+static ssize_t shmem_enabled_store(struct kobject *kobj,
+		struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	char tmp[16];
+	int huge;
+
+	if (count + 1 > sizeof(tmp))
+		return -EINVAL;
+	memcpy(tmp, buf, count);
+	tmp[count] = '\0';
+	if (count && tmp[count - 1] == '\n')
+		tmp[count - 1] = '\0';
+
+	huge = shmem_parse_huge(tmp);
+	if (huge == -EINVAL)
+		return -EINVAL;
+
+	shmem_huge = huge;
+	if (shmem_huge >= SHMEM_HUGE_NEVER && !IS_ERR(shm_mnt))
+		SHMEM_SB(shm_mnt->mnt_sb)->huge = shmem_huge;
+	return count;
+}
+
+struct kobj_attribute shmem_enabled_attr =
+	__ATTR(shmem_enabled, 0644, shmem_enabled_show, shmem_enabled_store);
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE && CONFIG_SYSFS */
+
 #else /* !CONFIG_SHMEM */
 
 /*
@@ -2886,6 +3531,24 @@ void shmem_unlock_mapping(struct address_space *mapping)
 {
 }
 
+bool shmem_mapping(struct address_space *mapping)
+{
+	return false;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+bool shmem_huge_enabled(struct vm_area_struct *vma)
+{
+	return false;
+}
+
+int shmem_collapse_team(struct mm_struct *mm, struct address_space *mapping,
+			pgoff_t index, int max_holes)
+{
+	return -EINVAL;
+}
+#endif
+
 void shmem_truncate_range(struct inode *inode, loff_t lstart, loff_t lend)
 {
 	truncate_inode_pages_range(inode->i_mapping, lstart, lend);
@@ -2897,6 +3560,7 @@ EXPORT_SYMBOL_GPL(shmem_truncate_range);
 #define shmem_get_inode(sb, dir, mode, dev, flags)	ramfs_get_inode(sb, dir, mode, dev)
 #define shmem_acct_size(flags, size)		0
 #define shmem_unacct_size(flags, size)		do {} while (0)
+#define shmem_khugepaged_enter(vma)		do {} while (0)
 
 #endif /* CONFIG_SHMEM */
 
@@ -2984,6 +3648,7 @@ int shmem_zero_setup(struct vm_area_struct *vma)
 	vma->vm_file = file;
 	vma->vm_ops = &shmem_vm_ops;
 	vma->vm_flags |= VM_CAN_NONLINEAR;
+	shmem_khugepaged_enter(vma);
 	return 0;
 }
 
@@ -3011,7 +3676,8 @@ struct page *shmem_read_mapping_page_gfp(struct address_space *mapping,
 	int error;
 
 	BUG_ON(mapping->a_ops != &shmem_aops);
-	error = shmem_getpage_gfp(inode, index, &page, SGP_CACHE, gfp, NULL);
+	error = shmem_getpage_gfp(inode, index, &page, SGP_CACHE, gfp, NULL,
+				  NULL);
 	if (error)
 		page = ERR_PTR(error);
 	else
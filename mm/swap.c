@@ -39,6 +39,7 @@ int page_cluster;
 static DEFINE_PER_CPU(struct pagevec[NR_LRU_LISTS], lru_add_pvecs);
 static DEFINE_PER_CPU(struct pagevec, lru_rotate_pvecs);
 static DEFINE_PER_CPU(struct pagevec, lru_deactivate_pvecs);
+static DEFINE_PER_CPU(struct pagevec, lru_lazyfree_pvecs);
 
 /*
  * This path almost never happens for VM activity - pages are normally
@@ -440,9 +441,13 @@ void mark_page_accessed(struct page *page)
 			PageReferenced(page) && PageLRU(page)) {
 		activate_page(page);
 		ClearPageReferenced(page);
+		if (page_is_file_cache(page))
+			workingset_activation(page);
 	} else if (!PageReferenced(page)) {
 		SetPageReferenced(page);
 	}
+	if (PageIdle(page))
+		ClearPageIdle(page);
 }
 EXPORT_SYMBOL(mark_page_accessed);
 
@@ -566,6 +571,33 @@ static void lru_deactivate_fn(struct page *page, struct lruvec *lruvec,
 	update_page_reclaim_stat(lruvec, file, 0);
 }
 
+/*
+ * Lazyfree pages are clean anonymous pages that the owner does not need
+ * anymore (MADV_FREE).  They get PG_swapbacked cleared, which also puts
+ * them on the inactive file list, so that reclaim finds them without
+ * swap and discards them instead of swapping them out.
+ */
+static void lru_lazyfree_fn(struct page *page, struct lruvec *lruvec,
+			    void *arg)
+{
+	bool active;
+
+	if (!PageLRU(page) || !PageAnon(page) || !PageSwapBacked(page) ||
+	    PageSwapCache(page) || PageUnevictable(page))
+		return;
+
+	active = PageActive(page);
+
+	del_page_from_lru_list(page, lruvec, LRU_INACTIVE_ANON + active);
+	ClearPageActive(page);
+	ClearPageReferenced(page);
+	ClearPageSwapBacked(page);
+	add_page_to_lru_list(page, lruvec, LRU_INACTIVE_FILE);
+
+	__count_vm_events(PGLAZYFREE, hpage_nr_pages(page));
+	update_page_reclaim_stat(lruvec, 1, 0);
+}
+
 /*
  * Drain pages out of the cpu's pagevecs.
  * Either "cpu" is the current CPU, and preemption has already been
@@ -597,6 +629,10 @@ void lru_add_drain_cpu(int cpu)
 	if (pagevec_count(pvec))
 		pagevec_lru_move_fn(pvec, lru_deactivate_fn, NULL);
 
+	pvec = &per_cpu(lru_lazyfree_pvecs, cpu);
+	if (pagevec_count(pvec))
+		pagevec_lru_move_fn(pvec, lru_lazyfree_fn, NULL);
+
 	activate_page_drain(cpu);
 }
 
@@ -626,6 +662,26 @@ void deactivate_page(struct page *page)
 	}
 }
 
+/**
+ * mark_page_lazyfree - make an anon page lazyfree
+ * @page: page to mark
+ *
+ * mark_page_lazyfree() moves @page to the inactive file list, to be
+ * discarded by reclaim unless it is written to again first.
+ */
+void mark_page_lazyfree(struct page *page)
+{
+	if (PageLRU(page) && PageAnon(page) && PageSwapBacked(page) &&
+	    !PageSwapCache(page) && !PageUnevictable(page)) {
+		struct pagevec *pvec = &get_cpu_var(lru_lazyfree_pvecs);
+
+		page_cache_get(page);
+		if (!pagevec_add(pvec, page))
+			pagevec_lru_move_fn(pvec, lru_lazyfree_fn, NULL);
+		put_cpu_var(lru_lazyfree_pvecs);
+	}
+}
+
 void lru_add_drain(void)
 {
 	lru_add_drain_cpu(get_cpu());
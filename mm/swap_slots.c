@@ -0,0 +1,211 @@
+/*
+ * linux/mm/swap_slots.c
+ *
+ * Per-cpu caches of swap slots.  get_swap_page() hands out slots from a
+ * per-cpu cache, refilled SWAP_SLOTS_CACHE_SIZE at a time by
+ * get_swap_pages() under a single hold of swap_lock, and free_swap_slot()
+ * collects the slots whose last reference went away and gives them back
+ * in a batch.  Slots in either cache keep SWAP_HAS_CACHE in swap_map, so
+ * nobody else allocates them meanwhile.
+ *
+ * The caches are only used while there is plenty of free swap, so that
+ * slots stranded in them cannot make allocations fail; swapoff turns them
+ * off while it empties a swap area.
+ */
+#include <linux/swap_slots.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/init.h>
+
+static DEFINE_PER_CPU(struct swap_slots_cache, swp_slots);
+static bool swap_slot_cache_active;
+bool swap_slot_cache_enabled;
+/* Serialize activation and draining of the caches */
+static DEFINE_MUTEX(swap_slots_cache_mutex);
+/* Held by swapoff while the caches are disabled */
+static DEFINE_MUTEX(swap_slots_cache_enable_mutex);
+
+#define use_swap_slot_cache (swap_slot_cache_active && swap_slot_cache_enabled)
+
+#define SLOTS_CACHE	0x1
+#define SLOTS_CACHE_RET	0x2
+
+static void drain_slots_cache_cpu(unsigned int cpu, unsigned int type)
+{
+	struct swap_slots_cache *cache = &per_cpu(swp_slots, cpu);
+
+	if (type & SLOTS_CACHE) {
+		mutex_lock(&cache->alloc_lock);
+		swapcache_free_entries(cache->slots + cache->cur, cache->nr);
+		cache->cur = 0;
+		cache->nr = 0;
+		mutex_unlock(&cache->alloc_lock);
+	}
+	if (type & SLOTS_CACHE_RET) {
+		spin_lock(&cache->free_lock);
+		swapcache_free_entries(cache->slots_ret, cache->n_ret);
+		cache->n_ret = 0;
+		spin_unlock(&cache->free_lock);
+	}
+}
+
+/* Called with swap_slots_cache_mutex held */
+static void __drain_swap_slots_cache(unsigned int type)
+{
+	unsigned int cpu;
+
+	/*
+	 * Walk the possible cpus rather than holding off cpu hotplug: the
+	 * cache of a cpu going down is drained by its notifier as well.
+	 */
+	for_each_possible_cpu(cpu)
+		drain_slots_cache_cpu(cpu, type);
+}
+
+static void deactivate_swap_slots_cache(void)
+{
+	mutex_lock(&swap_slots_cache_mutex);
+	if (swap_slot_cache_active) {
+		swap_slot_cache_active = false;
+		__drain_swap_slots_cache(SLOTS_CACHE | SLOTS_CACHE_RET);
+	}
+	mutex_unlock(&swap_slots_cache_mutex);
+}
+
+static void reactivate_swap_slots_cache(void)
+{
+	mutex_lock(&swap_slots_cache_mutex);
+	swap_slot_cache_active = true;
+	mutex_unlock(&swap_slots_cache_mutex);
+}
+
+void disable_swap_slots_cache_lock(void)
+{
+	mutex_lock(&swap_slots_cache_enable_mutex);
+	swap_slot_cache_enabled = false;
+	mutex_lock(&swap_slots_cache_mutex);
+	__drain_swap_slots_cache(SLOTS_CACHE | SLOTS_CACHE_RET);
+	mutex_unlock(&swap_slots_cache_mutex);
+}
+
+void reenable_swap_slots_cache_unlock(void)
+{
+	swap_slot_cache_enabled = true;
+	mutex_unlock(&swap_slots_cache_enable_mutex);
+}
+
+/*
+ * Use the caches only while free swap is well above what they can hold
+ * in total, and give back what they hold once it runs low.
+ */
+static bool check_cache_active(void)
+{
+	long pages;
+
+	if (!swap_slot_cache_enabled)
+		return false;
+
+	pages = nr_swap_pages;
+	if (!swap_slot_cache_active) {
+		if (pages > num_online_cpus() *
+		    THRESHOLD_ACTIVATE_SWAP_SLOTS_CACHE)
+			reactivate_swap_slots_cache();
+		goto out;
+	}
+
+	if (pages < num_online_cpus() * THRESHOLD_DEACTIVATE_SWAP_SLOTS_CACHE)
+		deactivate_swap_slots_cache();
+out:
+	return swap_slot_cache_active;
+}
+
+/* Called with cache->alloc_lock held */
+static int refill_swap_slots_cache(struct swap_slots_cache *cache)
+{
+	if (!use_swap_slot_cache || cache->nr)
+		return 0;
+
+	cache->cur = 0;
+	cache->nr = get_swap_pages(SWAP_SLOTS_CACHE_SIZE, cache->slots);
+
+	return cache->nr;
+}
+
+/*
+ * The last reference to a swap entry is gone, and its slot holds just
+ * SWAP_HAS_CACHE: queue it for swapcache_free_entries().
+ */
+void free_swap_slot(swp_entry_t entry)
+{
+	struct swap_slots_cache *cache;
+
+	cache = __this_cpu_ptr(&swp_slots);
+	if (use_swap_slot_cache) {
+		spin_lock(&cache->free_lock);
+		/* The cache may have been disabled before we got the lock */
+		if (!use_swap_slot_cache) {
+			spin_unlock(&cache->free_lock);
+			goto direct_free;
+		}
+		if (cache->n_ret >= SWAP_SLOTS_CACHE_SIZE) {
+			swapcache_free_entries(cache->slots_ret, cache->n_ret);
+			cache->n_ret = 0;
+		}
+		cache->slots_ret[cache->n_ret++] = entry;
+		spin_unlock(&cache->free_lock);
+	} else {
+direct_free:
+		swapcache_free_entries(&entry, 1);
+	}
+}
+
+swp_entry_t get_swap_page(void)
+{
+	struct swap_slots_cache *cache;
+	swp_entry_t entry;
+
+	entry.val = 0;
+	if (check_cache_active()) {
+		cache = __this_cpu_ptr(&swp_slots);
+		mutex_lock(&cache->alloc_lock);
+repeat:
+		if (cache->nr) {
+			entry = cache->slots[cache->cur++];
+			cache->nr--;
+		} else if (refill_swap_slots_cache(cache))
+			goto repeat;
+		mutex_unlock(&cache->alloc_lock);
+		if (entry.val)
+			return entry;
+	}
+
+	get_swap_pages(1, &entry);
+	return entry;
+}
+
+static int swap_slots_cpu_callback(struct notifier_block *nfb,
+				   unsigned long action, void *hcpu)
+{
+	unsigned int cpu = (unsigned long)hcpu;
+
+	if (action == CPU_DEAD || action == CPU_DEAD_FROZEN)
+		drain_slots_cache_cpu(cpu, SLOTS_CACHE | SLOTS_CACHE_RET);
+	return NOTIFY_OK;
+}
+
+static int __init swap_slots_init(void)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct swap_slots_cache *cache = &per_cpu(swp_slots, cpu);
+
+		mutex_init(&cache->alloc_lock);
+		spin_lock_init(&cache->free_lock);
+	}
+	hotcpu_notifier(swap_slots_cpu_callback, 0);
+	swap_slot_cache_enabled = true;
+	return 0;
+}
+subsys_initcall(swap_slots_init);
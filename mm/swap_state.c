@@ -10,6 +10,7 @@
 #include <linux/gfp.h>
 #include <linux/kernel_stat.h>
 #include <linux/swap.h>
+#include <linux/swap_slots.h>
 #include <linux/swapops.h>
 #include <linux/init.h>
 #include <linux/pagemap.h>
@@ -17,7 +18,9 @@
 #include <linux/blkdev.h>
 #include <linux/pagevec.h>
 #include <linux/migrate.h>
-#include <linux/page_cgroup.h>
+#include <linux/swapfile.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
 
 #include <asm/pgtable.h>
 
@@ -53,6 +56,33 @@ static struct {
 	unsigned long find_total;
 } swap_cache_info;
 
+/* Readahead pages found in swap cache since the last cluster readahead */
+static atomic_t swapin_readahead_hits = ATOMIC_INIT(4);
+
+static bool enable_vma_readahead __read_mostly = true;
+
+/*
+ * The per-vma readahead state packs the address of the last swap fault
+ * (or readahead hit) in the vma, the window used for it, and the number
+ * of readahead hits since, into one word.
+ */
+#define SWAP_RA_WIN_SHIFT	(PAGE_SHIFT / 2)
+#define SWAP_RA_HITS_MASK	((1UL << SWAP_RA_WIN_SHIFT) - 1)
+#define SWAP_RA_HITS_MAX	SWAP_RA_HITS_MASK
+#define SWAP_RA_WIN_MASK	(~PAGE_MASK & ~SWAP_RA_HITS_MASK)
+
+#define SWAP_RA_HITS(v)		((v) & SWAP_RA_HITS_MASK)
+#define SWAP_RA_WIN(v)		(((v) & SWAP_RA_WIN_MASK) >> SWAP_RA_WIN_SHIFT)
+#define SWAP_RA_ADDR(v)		((v) & PAGE_MASK)
+
+#define SWAP_RA_VAL(addr, win, hits)				\
+	(((addr) & PAGE_MASK) |					\
+	 (((win) << SWAP_RA_WIN_SHIFT) & SWAP_RA_WIN_MASK) |	\
+	 ((hits) & SWAP_RA_HITS_MASK))
+
+/* The ptes are copied for the readahead: bound their number */
+#define SWAP_RA_ORDER_CEILING	5
+
 void show_swap_cache_info(void)
 {
 	printk("%lu pages in swap cache\n", total_swapcache_pages);
@@ -253,20 +283,45 @@ void free_pages_and_swap_cache(struct page **pages, int nr)
 	}
 }
 
+static inline bool swap_use_vma_readahead(void)
+{
+	return ACCESS_ONCE(enable_vma_readahead) && !atomic_read(&nr_rotate_swap);
+}
+
 /*
  * Lookup a swap entry in the swap cache. A found page will be returned
  * unlocked and with its refcount incremented - we rely on the kernel
  * lock getting page table operations atomic even if we drop the page
  * lock before returning.
+ *
+ * A page brought in by readahead counts as a hit for the readahead
+ * window of @vma, or the global one if there is no vma.
  */
-struct page * lookup_swap_cache(swp_entry_t entry)
+struct page *lookup_swap_cache(swp_entry_t entry, struct vm_area_struct *vma,
+			       unsigned long addr)
 {
 	struct page *page;
+	unsigned long ra_val;
+	unsigned int win, hits;
 
 	page = find_get_page(&swapper_space, entry.val);
 
-	if (page)
+	if (page) {
 		INC_CACHE_INFO(find_success);
+		if (TestClearPageReadahead(page)) {
+			count_vm_event(SWAP_RA_HIT);
+			if (vma && swap_use_vma_readahead()) {
+				ra_val = atomic_long_read(&vma->swap_readahead_info);
+				win = SWAP_RA_WIN(ra_val);
+				hits = SWAP_RA_HITS(ra_val);
+				if (hits < SWAP_RA_HITS_MAX)
+					hits++;
+				atomic_long_set(&vma->swap_readahead_info,
+						SWAP_RA_VAL(addr, win, hits));
+			} else
+				atomic_inc(&swapin_readahead_hits);
+		}
+	}
 
 	INC_CACHE_INFO(find_total);
 	return page;
@@ -278,12 +333,14 @@ struct page * lookup_swap_cache(swp_entry_t entry)
  * A failure return means that either the page allocation failed or that
  * the swap entry is no longer in use.
  */
-struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
-			struct vm_area_struct *vma, unsigned long addr)
+static struct page *__read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr,
+			bool *page_allocated)
 {
 	struct page *found_page, *new_page = NULL;
 	int err;
 
+	*page_allocated = false;
 	do {
 		/*
 		 * First check the swap cache.  Since this is normally
@@ -316,6 +373,16 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 		err = swapcache_prepare(entry);
 		if (err == -EEXIST) {	/* seems racy */
 			radix_tree_preload_end();
+			/*
+			 * A slot parked in a swap slot cache has
+			 * SWAP_HAS_CACHE but no page and no users: it
+			 * would never show up in swap cache, so skip it.
+			 * While swapoff keeps the caches off, an unused
+			 * SWAP_HAS_CACHE slot is one that add_to_swap()
+			 * is about to put a page on, worth waiting for.
+			 */
+			if (!__swp_swapcount(entry) && swap_slot_cache_enabled)
+				break;
 			continue;
 		}
 		if (err) {		/* swp entry is obsolete ? */
@@ -334,6 +401,7 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 			 */
 			lru_cache_add_anon(new_page);
 			swap_readpage(new_page);
+			*page_allocated = true;
 			return new_page;
 		}
 		radix_tree_preload_end();
@@ -351,6 +419,71 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 	return found_page;
 }
 
+struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr)
+{
+	bool page_allocated;
+
+	return __read_swap_cache_async(entry, gfp_mask, vma, addr,
+				       &page_allocated);
+}
+
+/*
+ * Size the next readahead window from the hits of the previous one: the
+ * window grows to a power of two past the hits, but shrinks by at most
+ * half at a time.  Without hits, only a fault right next to the previous
+ * one keeps a small window, as that may be the start of a sequential
+ * access pattern.
+ */
+static unsigned int __swapin_nr_pages(unsigned long prev_offset,
+				      unsigned long offset,
+				      int hits, int max_pages,
+				      int prev_win)
+{
+	unsigned int pages, last_ra;
+
+	pages = hits + 2;
+	if (pages == 2) {
+		if (offset != prev_offset + 1 && offset != prev_offset - 1)
+			pages = 1;
+	} else {
+		unsigned int roundup = 4;
+		while (roundup < pages)
+			roundup <<= 1;
+		pages = roundup;
+	}
+
+	if (pages > max_pages)
+		pages = max_pages;
+
+	/* Don't shrink readahead too fast */
+	last_ra = prev_win / 2;
+	if (pages < last_ra)
+		pages = last_ra;
+
+	return pages;
+}
+
+static unsigned long swapin_nr_pages(unsigned long offset)
+{
+	static unsigned long prev_offset;
+	static atomic_t last_readahead_pages;
+	unsigned int hits, pages, max_pages;
+
+	max_pages = 1 << ACCESS_ONCE(page_cluster);
+	if (max_pages <= 1)
+		return 1;
+
+	hits = atomic_xchg(&swapin_readahead_hits, 0);
+	pages = __swapin_nr_pages(prev_offset, offset, hits, max_pages,
+				  atomic_read(&last_readahead_pages));
+	if (!hits)
+		prev_offset = offset;
+	atomic_set(&last_readahead_pages, pages);
+
+	return pages;
+}
+
 /**
  * swapin_readahead - swap in pages in hope we need them soon
  * @entry: swap entry of this memory
@@ -361,9 +494,10 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
  * Returns the struct page for entry and addr, after queueing swapin.
  *
  * Primitive swap readahead code. We simply read an aligned block of
- * (1 << page_cluster) entries in the swap area. This method is chosen
- * because it doesn't cost us any seek time.  We also make sure to queue
- * the 'original' request together with the readahead ones...
+ * entries in the swap area, sized by the hits of the last readahead, up
+ * to (1 << page_cluster) entries. This method is chosen because it
+ * doesn't cost us any seek time.  We also make sure to queue the
+ * 'original' request together with the readahead ones...
  *
  * This has been extended to use the NUMA policies from the mm triggering
  * the readahead.
@@ -374,10 +508,16 @@ struct page *swapin_readahead(swp_entry_t entry, gfp_t gfp_mask,
 			struct vm_area_struct *vma, unsigned long addr)
 {
 	struct page *page;
-	unsigned long offset = swp_offset(entry);
+	unsigned long entry_offset = swp_offset(entry);
+	unsigned long offset = entry_offset;
 	unsigned long start_offset, end_offset;
-	unsigned long mask = (1UL << page_cluster) - 1;
+	unsigned long mask;
 	struct blk_plug plug;
+	bool page_allocated;
+
+	mask = swapin_nr_pages(offset) - 1;
+	if (!mask)
+		goto skip;
 
 	/* Read a page_cluster sized and aligned cluster around offset. */
 	start_offset = offset & ~mask;
@@ -388,14 +528,206 @@ struct page *swapin_readahead(swp_entry_t entry, gfp_t gfp_mask,
 	blk_start_plug(&plug);
 	for (offset = start_offset; offset <= end_offset ; offset++) {
 		/* Ok, do the async read-ahead now */
-		page = read_swap_cache_async(swp_entry(swp_type(entry), offset),
-						gfp_mask, vma, addr);
+		page = __read_swap_cache_async(swp_entry(swp_type(entry), offset),
+					       gfp_mask, vma, addr,
+					       &page_allocated);
 		if (!page)
 			continue;
+		if (page_allocated && offset != entry_offset) {
+			SetPageReadahead(page);
+			count_vm_event(SWAP_RA);
+		}
 		page_cache_release(page);
 	}
 	blk_finish_plug(&plug);
 
 	lru_add_drain();	/* Push any new pages onto the LRU now */
+skip:
 	return read_swap_cache_async(entry, gfp_mask, vma, addr);
 }
+
+/*
+ * Clamp the readahead window [lpfn, rpfn) to the vma, and to the page
+ * table holding the faulting pte.
+ */
+static inline void swap_ra_clamp_pfn(struct vm_area_struct *vma,
+				     unsigned long faddr,
+				     unsigned long lpfn,
+				     unsigned long rpfn,
+				     unsigned long *start,
+				     unsigned long *end)
+{
+	*start = max3(lpfn, PFN_DOWN(vma->vm_start),
+		      PFN_DOWN(faddr & PMD_MASK));
+	*end = min3(rpfn, PFN_DOWN(vma->vm_end),
+		    PFN_DOWN((faddr & PMD_MASK) + PMD_SIZE));
+}
+
+/**
+ * swap_vma_readahead - swap in pages in hope we need them soon
+ * @fentry: swap entry of the faulting pte
+ * @gfp_mask: memory allocation flags
+ * @vma: user vma the faulting address belongs to
+ * @faddr: faulting address
+ * @pmd: pmd mapping the page table of @faddr
+ *
+ * Returns the struct page for fentry and faddr, after queueing swapin.
+ *
+ * Unlike swapin_readahead(), read ahead the swap entries of the ptes
+ * around the faulting address, wherever they live in swap: once swap is
+ * fragmented, the neighbours in the address space are far more likely
+ * to be accessed next than the neighbours on the swap device.  The
+ * window follows the direction of the faults, and is sized by the
+ * readahead hits in the vma since the previous fault.
+ *
+ * Caller must hold down_read on the vma->vm_mm.
+ */
+static struct page *swap_vma_readahead(swp_entry_t fentry, gfp_t gfp_mask,
+				       struct vm_area_struct *vma,
+				       unsigned long faddr, pmd_t *pmd)
+{
+	struct blk_plug plug;
+	struct page *page;
+	pte_t ptes[1 << SWAP_RA_ORDER_CEILING];
+	pte_t *pte;
+	swp_entry_t entry;
+	unsigned long ra_val, fpfn, pfn, start, end, left, addr;
+	unsigned int max_win, hits, prev_win, win, nr_pte, i;
+	bool page_allocated;
+
+	max_win = 1 << min_t(unsigned int, ACCESS_ONCE(page_cluster),
+			     SWAP_RA_ORDER_CEILING);
+	if (max_win == 1)
+		goto skip;
+
+	faddr &= PAGE_MASK;
+	fpfn = PFN_DOWN(faddr);
+	ra_val = atomic_long_read(&vma->swap_readahead_info);
+	pfn = PFN_DOWN(SWAP_RA_ADDR(ra_val));
+	prev_win = SWAP_RA_WIN(ra_val);
+	hits = SWAP_RA_HITS(ra_val);
+	win = __swapin_nr_pages(pfn, fpfn, hits, max_win, prev_win);
+	atomic_long_set(&vma->swap_readahead_info,
+			SWAP_RA_VAL(faddr, win, 0));
+	if (win == 1)
+		goto skip;
+
+	/* Read ahead in the direction of the faults, or around the fault */
+	if (fpfn == pfn + 1)
+		swap_ra_clamp_pfn(vma, faddr, fpfn, fpfn + win, &start, &end);
+	else if (pfn == fpfn + 1)
+		swap_ra_clamp_pfn(vma, faddr, fpfn - win + 1, fpfn + 1,
+				  &start, &end);
+	else {
+		left = (win - 1) / 2;
+		swap_ra_clamp_pfn(vma, faddr, fpfn - left, fpfn + win - left,
+				  &start, &end);
+	}
+	if (end <= start)
+		goto skip;
+	nr_pte = end - start;
+
+	/* Copy the ptes: the page table is not locked or kept mapped */
+	pte = pte_offset_map(pmd, start << PAGE_SHIFT);
+	for (i = 0; i < nr_pte; i++)
+		ptes[i] = pte[i];
+	pte_unmap(pte);
+
+	blk_start_plug(&plug);
+	for (i = 0, addr = start << PAGE_SHIFT; i < nr_pte;
+	     i++, addr += PAGE_SIZE) {
+		if (pte_none(ptes[i]) || pte_present(ptes[i]))
+			continue;
+		entry = pte_to_swp_entry(ptes[i]);
+		if (unlikely(non_swap_entry(entry)))
+			continue;
+		page = __read_swap_cache_async(entry, gfp_mask, vma, addr,
+					       &page_allocated);
+		if (!page)
+			continue;
+		if (page_allocated && addr != faddr) {
+			SetPageReadahead(page);
+			count_vm_event(SWAP_RA);
+		}
+		page_cache_release(page);
+	}
+	blk_finish_plug(&plug);
+
+	lru_add_drain();	/* Push any new pages onto the LRU now */
+skip:
+	return read_swap_cache_async(fentry, gfp_mask, vma, faddr);
+}
+
+/**
+ * swapin_readahead_vma - swap in the page of a swap pte fault
+ * @entry: swap entry of the faulting pte
+ * @gfp_mask: memory allocation flags
+ * @vma: user vma the faulting address belongs to
+ * @addr: faulting address
+ * @pmd: pmd mapping the page table of @addr
+ *
+ * Reads ahead by virtual address with swap_vma_readahead() when that
+ * is enabled, and by swap offset with swapin_readahead() otherwise.
+ */
+struct page *swapin_readahead_vma(swp_entry_t entry, gfp_t gfp_mask,
+				  struct vm_area_struct *vma,
+				  unsigned long addr, pmd_t *pmd)
+{
+	if (swap_use_vma_readahead())
+		return swap_vma_readahead(entry, gfp_mask, vma, addr, pmd);
+	return swapin_readahead(entry, gfp_mask, vma, addr);
+}
+
+#ifdef CONFIG_SYSFS
+static ssize_t vma_ra_enabled_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", enable_vma_readahead ? "true" : "false");
+}
+
+static ssize_t vma_ra_enabled_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
+{
+	if (!strncmp(buf, "true", 4) || !strncmp(buf, "1", 1))
+		enable_vma_readahead = true;
+	else if (!strncmp(buf, "false", 5) || !strncmp(buf, "0", 1))
+		enable_vma_readahead = false;
+	else
+		return -EINVAL;
+
+	return count;
+}
+static struct kobj_attribute vma_ra_enabled_attr =
+	__ATTR(vma_ra_enabled, 0644, vma_ra_enabled_show,
+	       vma_ra_enabled_store);
+
+static struct attribute *swap_attrs[] = {
+	&vma_ra_enabled_attr.attr,
+	NULL,
+};
+
+static struct attribute_group swap_attr_group = {
+	.attrs = swap_attrs,
+};
+
+static int __init swap_init_sysfs(void)
+{
+	int err;
+	struct kobject *swap_kobj;
+
+	swap_kobj = kobject_create_and_add("swap", mm_kobj);
+	if (!swap_kobj) {
+		printk(KERN_ERR "failed to create swap kobject\n");
+		return -ENOMEM;
+	}
+	err = sysfs_create_group(swap_kobj, &swap_attr_group);
+	if (err) {
+		printk(KERN_ERR "failed to register swap group\n");
+		kobject_put(swap_kobj);
+		return err;
+	}
+	return 0;
+}
+subsys_initcall(swap_init_sysfs);
+#endif
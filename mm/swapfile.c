@@ -33,12 +33,13 @@
 #include <linux/oom.h>
 #include <linux/frontswap.h>
 #include <linux/swapfile.h>
+#include <linux/swap_slots.h>
 #include <linux/export.h>
 
 #include <asm/pgtable.h>
 #include <asm/tlbflush.h>
 #include <linux/swapops.h>
-#include <linux/page_cgroup.h>
+#include <linux/swap_cgroup.h>
 
 static bool swap_count_continued(struct swap_info_struct *, pgoff_t,
 				 unsigned char);
@@ -50,6 +51,8 @@ static unsigned int nr_swapfiles;
 long nr_swap_pages;
 long total_swap_pages;
 static int least_priority;
+/* Number of swap areas on rotating disks, see swap_vma_readahead() */
+atomic_t nr_rotate_swap = ATOMIC_INIT(0);
 
 static const char Bad_file[] = "Bad swap file entry ";
 static const char Unused_file[] = "Unused swap file entry ";
@@ -173,14 +176,190 @@ static void discard_swap_cluster(struct swap_info_struct *si,
 	}
 }
 
-static int wait_for_discard(void *word)
+#define SWAPFILE_CLUSTER	256
+#define LATENCY_LIMIT		256
+
+static inline bool cluster_is_free(struct swap_cluster_info *info)
 {
-	schedule();
-	return 0;
+	return info->flags & CLUSTER_FLAG_FREE;
 }
 
-#define SWAPFILE_CLUSTER	256
-#define LATENCY_LIMIT		256
+/*
+ * Singly linked lists of clusters, threaded through the data field of
+ * struct swap_cluster_info; the caller holds swap_lock.
+ */
+static void cluster_list_add_tail(struct swap_cluster_info *ci,
+				  unsigned int *head, unsigned int *tail,
+				  unsigned int idx)
+{
+	ci[idx].data = CLUSTER_NULL;
+	if (*head == CLUSTER_NULL)
+		*head = idx;
+	else
+		ci[*tail].data = idx;
+	*tail = idx;
+}
+
+static unsigned int cluster_list_del_first(struct swap_cluster_info *ci,
+					   unsigned int *head,
+					   unsigned int *tail)
+{
+	unsigned int idx = *head;
+
+	*head = ci[idx].data;
+	if (*head == CLUSTER_NULL)
+		*tail = CLUSTER_NULL;
+	return idx;
+}
+
+/*
+ * Wait for the discard of a free cluster to complete before handing it
+ * out again: mark its slots bad meanwhile, so that a first-fit scan of
+ * swap_map cannot pick them up.
+ */
+static void swap_cluster_schedule_discard(struct swap_info_struct *si,
+					  unsigned int idx)
+{
+	memset(si->swap_map + idx * SWAPFILE_CLUSTER,
+	       SWAP_MAP_BAD, SWAPFILE_CLUSTER);
+	cluster_list_add_tail(si->cluster_info, &si->discard_cluster_head,
+			      &si->discard_cluster_tail, idx);
+	schedule_work(&si->discard_work);
+}
+
+/*
+ * Discard the clusters queued by swap_cluster_schedule_discard() and
+ * put them on the free list.  Called with swap_lock held, drops it
+ * around the discards.
+ */
+static void swap_do_scheduled_discard(struct swap_info_struct *si)
+{
+	struct swap_cluster_info *ci = si->cluster_info;
+	unsigned int idx;
+
+	while (si->discard_cluster_head != CLUSTER_NULL) {
+		idx = cluster_list_del_first(ci, &si->discard_cluster_head,
+					     &si->discard_cluster_tail);
+		spin_unlock(&swap_lock);
+
+		discard_swap_cluster(si, idx * SWAPFILE_CLUSTER,
+				     SWAPFILE_CLUSTER);
+
+		spin_lock(&swap_lock);
+		ci[idx].flags = CLUSTER_FLAG_FREE;
+		cluster_list_add_tail(ci, &si->free_cluster_head,
+				      &si->free_cluster_tail, idx);
+		memset(si->swap_map + idx * SWAPFILE_CLUSTER,
+		       0, SWAPFILE_CLUSTER);
+	}
+}
+
+static void swap_discard_work(struct work_struct *work)
+{
+	struct swap_info_struct *si;
+
+	si = container_of(work, struct swap_info_struct, discard_work);
+
+	spin_lock(&swap_lock);
+	swap_do_scheduled_discard(si);
+	spin_unlock(&swap_lock);
+}
+
+/*
+ * A slot of a cluster is going into use: the cluster cannot be free,
+ * scan_swap_map() takes free clusters off the free list before using
+ * them.
+ */
+static void inc_cluster_info_page(struct swap_info_struct *si,
+				  unsigned long offset)
+{
+	struct swap_cluster_info *ci = si->cluster_info;
+	unsigned long idx = offset / SWAPFILE_CLUSTER;
+
+	if (!ci)
+		return;
+	VM_BUG_ON(cluster_is_free(&ci[idx]));
+	ci[idx].data++;
+}
+
+/*
+ * A slot of a cluster has been freed: once the last one goes, the whole
+ * cluster is discarded if the device allows it, and made free again.
+ */
+static void dec_cluster_info_page(struct swap_info_struct *si,
+				  unsigned long offset)
+{
+	struct swap_cluster_info *ci = si->cluster_info;
+	unsigned long idx = offset / SWAPFILE_CLUSTER;
+
+	if (!ci)
+		return;
+	VM_BUG_ON(ci[idx].data == 0);
+	if (--ci[idx].data)
+		return;
+
+	if ((si->flags & (SWP_WRITEOK | SWP_DISCARDABLE)) ==
+	    (SWP_WRITEOK | SWP_DISCARDABLE)) {
+		swap_cluster_schedule_discard(si, idx);
+		return;
+	}
+	ci[idx].flags = CLUSTER_FLAG_FREE;
+	cluster_list_add_tail(ci, &si->free_cluster_head,
+			      &si->free_cluster_tail, idx);
+}
+
+/*
+ * Find a free slot in the cluster currently being allocated from, moving
+ * on to the next free cluster once it is full.  The current cluster holds
+ * an extra count, so that it cannot be freed under us.  Returns false if
+ * there is no free cluster left, and the caller has to fall back to a
+ * first-fit scan of swap_map.  Called with swap_lock held; it is dropped
+ * while waiting for pending discards.
+ */
+static bool scan_swap_map_ssd_cluster(struct swap_info_struct *si,
+				      unsigned long *offset)
+{
+	struct swap_cluster_info *ci = si->cluster_info;
+	unsigned long tmp, max;
+	unsigned int idx;
+
+new_cluster:
+	if (si->cluster_cur == CLUSTER_NULL) {
+		if (si->free_cluster_head != CLUSTER_NULL) {
+			idx = cluster_list_del_first(ci, &si->free_cluster_head,
+						     &si->free_cluster_tail);
+			ci[idx].flags = 0;
+			ci[idx].data = 1;
+			si->cluster_cur = idx;
+			si->cluster_next = idx * SWAPFILE_CLUSTER;
+		} else if (si->discard_cluster_head != CLUSTER_NULL) {
+			/*
+			 * Nothing is free but some clusters are waiting
+			 * for discard: do it now instead of scattering the
+			 * allocation over partly used clusters.
+			 */
+			swap_do_scheduled_discard(si);
+			goto new_cluster;
+		} else
+			return false;
+	}
+
+	/* Racing first-fit allocations may have used up part of it */
+	tmp = max_t(unsigned long, si->cluster_next,
+		    si->cluster_cur * SWAPFILE_CLUSTER);
+	max = min_t(unsigned long, si->max,
+		    (si->cluster_cur + 1) * SWAPFILE_CLUSTER);
+	while (tmp < max && si->swap_map[tmp])
+		tmp++;
+	if (tmp >= max) {
+		tmp = si->cluster_cur * SWAPFILE_CLUSTER;
+		si->cluster_cur = CLUSTER_NULL;
+		dec_cluster_info_page(si, tmp);
+		goto new_cluster;
+	}
+	*offset = tmp;
+	return true;
+}
 
 static unsigned long scan_swap_map(struct swap_info_struct *si,
 				   unsigned char usage)
@@ -189,7 +368,6 @@ static unsigned long scan_swap_map(struct swap_info_struct *si,
 	unsigned long scan_base;
 	unsigned long last_in_cluster = 0;
 	int latency_ration = LATENCY_LIMIT;
-	int found_free_cluster = 0;
 
 	/*
 	 * We try to cluster swap pages by allocating them sequentially
@@ -200,29 +378,25 @@ static unsigned long scan_swap_map(struct swap_info_struct *si,
 	 * overall disk seek times between swap pages.  -- sct
 	 * But we do now try to find an empty cluster.  -Andrea
 	 * And we let swap pages go all over an SSD partition.  Hugh
+	 * On SSD, free clusters are tracked in cluster_info and handed
+	 * out whole, so that each one is written (and later discarded)
+	 * as a unit.
 	 */
 
 	si->flags += SWP_SCANNING;
 	scan_base = offset = si->cluster_next;
 
+	if (si->cluster_info) {
+		if (!scan_swap_map_ssd_cluster(si, &offset))
+			scan_base = offset = si->lowest_bit;
+		goto checks;
+	}
+
 	if (unlikely(!si->cluster_nr--)) {
 		if (si->pages - si->inuse_pages < SWAPFILE_CLUSTER) {
 			si->cluster_nr = SWAPFILE_CLUSTER - 1;
 			goto checks;
 		}
-		if (si->flags & SWP_DISCARDABLE) {
-			/*
-			 * Start range check on racing allocations, in case
-			 * they overlap the cluster we eventually decide on
-			 * (we scan without swap_lock to allow preemption).
-			 * It's hardly conceivable that cluster_nr could be
-			 * wrapped during our scan, but don't depend on it.
-			 */
-			if (si->lowest_alloc)
-				goto checks;
-			si->lowest_alloc = si->max;
-			si->highest_alloc = 0;
-		}
 		spin_unlock(&swap_lock);
 
 		/*
@@ -246,7 +420,6 @@ static unsigned long scan_swap_map(struct swap_info_struct *si,
 				offset -= SWAPFILE_CLUSTER - 1;
 				si->cluster_next = offset;
 				si->cluster_nr = SWAPFILE_CLUSTER - 1;
-				found_free_cluster = 1;
 				goto checks;
 			}
 			if (unlikely(--latency_ration < 0)) {
@@ -267,7 +440,6 @@ static unsigned long scan_swap_map(struct swap_info_struct *si,
 				offset -= SWAPFILE_CLUSTER - 1;
 				si->cluster_next = offset;
 				si->cluster_nr = SWAPFILE_CLUSTER - 1;
-				found_free_cluster = 1;
 				goto checks;
 			}
 			if (unlikely(--latency_ration < 0)) {
@@ -279,7 +451,6 @@ static unsigned long scan_swap_map(struct swap_info_struct *si,
 		offset = scan_base;
 		spin_lock(&swap_lock);
 		si->cluster_nr = SWAPFILE_CLUSTER - 1;
-		si->lowest_alloc = 0;
 	}
 
 checks:
@@ -290,6 +461,15 @@ checks:
 	if (offset > si->highest_bit)
 		scan_base = offset = si->lowest_bit;
 
+	/*
+	 * A first-fit scan without swap_lock may land in a cluster freed
+	 * meanwhile: take a cluster off the free list properly instead.
+	 */
+	if (si->cluster_info &&
+	    cluster_is_free(&si->cluster_info[offset / SWAPFILE_CLUSTER]) &&
+	    scan_swap_map_ssd_cluster(si, &offset))
+		goto checks;
+
 	/* reuse swap entry of cache-only swap if not busy. */
 	if (vm_swap_full() && si->swap_map[offset] == SWAP_HAS_CACHE) {
 		int swap_was_freed;
@@ -315,62 +495,10 @@ checks:
 		si->highest_bit = 0;
 	}
 	si->swap_map[offset] = usage;
+	inc_cluster_info_page(si, offset);
 	si->cluster_next = offset + 1;
 	si->flags -= SWP_SCANNING;
 
-	if (si->lowest_alloc) {
-		/*
-		 * Only set when SWP_DISCARDABLE, and there's a scan
-		 * for a free cluster in progress or just completed.
-		 */
-		if (found_free_cluster) {
-			/*
-			 * To optimize wear-levelling, discard the
-			 * old data of the cluster, taking care not to
-			 * discard any of its pages that have already
-			 * been allocated by racing tasks (offset has
-			 * already stepped over any at the beginning).
-			 */
-			if (offset < si->highest_alloc &&
-			    si->lowest_alloc <= last_in_cluster)
-				last_in_cluster = si->lowest_alloc - 1;
-			si->flags |= SWP_DISCARDING;
-			spin_unlock(&swap_lock);
-
-			if (offset < last_in_cluster)
-				discard_swap_cluster(si, offset,
-					last_in_cluster - offset + 1);
-
-			spin_lock(&swap_lock);
-			si->lowest_alloc = 0;
-			si->flags &= ~SWP_DISCARDING;
-
-			smp_mb();	/* wake_up_bit advises this */
-			wake_up_bit(&si->flags, ilog2(SWP_DISCARDING));
-
-		} else if (si->flags & SWP_DISCARDING) {
-			/*
-			 * Delay using pages allocated by racing tasks
-			 * until the whole discard has been issued. We
-			 * could defer that delay until swap_writepage,
-			 * but it's easier to keep this self-contained.
-			 */
-			spin_unlock(&swap_lock);
-			wait_on_bit(&si->flags, ilog2(SWP_DISCARDING),
-				wait_for_discard, TASK_UNINTERRUPTIBLE);
-			spin_lock(&swap_lock);
-		} else {
-			/*
-			 * Note pages allocated by racing tasks while
-			 * scan for a free cluster is in progress, so
-			 * that its final discard can exclude them.
-			 */
-			if (offset < si->lowest_alloc)
-				si->lowest_alloc = offset;
-			if (offset > si->highest_alloc)
-				si->highest_alloc = offset;
-		}
-	}
 	return offset;
 
 scan:
@@ -411,17 +539,25 @@ no_page:
 	return 0;
 }
 
-swp_entry_t get_swap_page(void)
+/*
+ * Allocate up to n swap slots for the swap cache, all under one hold of
+ * swap_lock; returns the number allocated.  The per-cpu swap slot caches
+ * refill through here, see get_swap_page().
+ */
+int get_swap_pages(int n, swp_entry_t swp_entries[])
 {
 	struct swap_info_struct *si;
 	pgoff_t offset;
 	int type, next;
 	int wrapped = 0;
+	int n_ret = 0;
 
 	spin_lock(&swap_lock);
 	if (nr_swap_pages <= 0)
-		goto noswap;
-	nr_swap_pages--;
+		goto out;
+	if (n > nr_swap_pages)
+		n = nr_swap_pages;
+	nr_swap_pages -= n;
 
 	for (type = swap_list.next; type >= 0 && wrapped < 2; type = next) {
 		si = swap_info[type];
@@ -439,18 +575,21 @@ swp_entry_t get_swap_page(void)
 
 		swap_list.next = next;
 		/* This is called for allocating swap entry for cache */
-		offset = scan_swap_map(si, SWAP_HAS_CACHE);
-		if (offset) {
-			spin_unlock(&swap_lock);
-			return swp_entry(type, offset);
+		while (n_ret < n) {
+			offset = scan_swap_map(si, SWAP_HAS_CACHE);
+			if (!offset)
+				break;
+			swp_entries[n_ret++] = swp_entry(type, offset);
 		}
+		if (n_ret == n)
+			goto out;
 		next = swap_list.next;
 	}
 
-	nr_swap_pages++;
-noswap:
+	nr_swap_pages += n - n_ret;
+out:
 	spin_unlock(&swap_lock);
-	return (swp_entry_t) {0};
+	return n_ret;
 }
 
 /* The only caller of this function is now susupend routine */
@@ -511,8 +650,8 @@ out:
 	return NULL;
 }
 
-static unsigned char swap_entry_free(struct swap_info_struct *p,
-				     swp_entry_t entry, unsigned char usage)
+static unsigned char __swap_entry_free(struct swap_info_struct *p,
+				       swp_entry_t entry, unsigned char usage)
 {
 	unsigned long offset = swp_offset(entry);
 	unsigned char count;
@@ -545,31 +684,45 @@ static unsigned char swap_entry_free(struct swap_info_struct *p,
 		mem_cgroup_uncharge_swap(entry);
 
 	usage = count | has_cache;
-	p->swap_map[offset] = usage;
-
-	/* free if no reference */
-	if (!usage) {
-		if (offset < p->lowest_bit)
-			p->lowest_bit = offset;
-		if (offset > p->highest_bit)
-			p->highest_bit = offset;
-		if (swap_list.next >= 0 &&
-		    p->prio > swap_info[swap_list.next]->prio)
-			swap_list.next = p->type;
-		nr_swap_pages++;
-		p->inuse_pages--;
-		frontswap_invalidate_page(p->type, offset);
-		if (p->flags & SWP_BLKDEV) {
-			struct gendisk *disk = p->bdev->bd_disk;
-			if (disk->fops->swap_slot_free_notify)
-				disk->fops->swap_slot_free_notify(p->bdev,
-								  offset);
-		}
-	}
+	/*
+	 * The last reference is gone: keep the slot reserved with
+	 * SWAP_HAS_CACHE until free_swap_slot() returns it, in a batch,
+	 * through swapcache_free_entries().
+	 */
+	p->swap_map[offset] = usage ? : SWAP_HAS_CACHE;
 
 	return usage;
 }
 
+/*
+ * Return an unused slot, left with SWAP_HAS_CACHE alone by either
+ * __swap_entry_free() or get_swap_pages(), to the free pool.
+ */
+static void swap_entry_free(struct swap_info_struct *p, swp_entry_t entry)
+{
+	unsigned long offset = swp_offset(entry);
+
+	VM_BUG_ON(p->swap_map[offset] != SWAP_HAS_CACHE);
+	p->swap_map[offset] = 0;
+	dec_cluster_info_page(p, offset);
+
+	if (offset < p->lowest_bit)
+		p->lowest_bit = offset;
+	if (offset > p->highest_bit)
+		p->highest_bit = offset;
+	if (swap_list.next >= 0 &&
+	    p->prio > swap_info[swap_list.next]->prio)
+		swap_list.next = p->type;
+	nr_swap_pages++;
+	p->inuse_pages--;
+	frontswap_invalidate_page(p->type, offset);
+	if (p->flags & SWP_BLKDEV) {
+		struct gendisk *disk = p->bdev->bd_disk;
+		if (disk->fops->swap_slot_free_notify)
+			disk->fops->swap_slot_free_notify(p->bdev, offset);
+	}
+}
+
 /*
  * Caller has made sure that the swapdevice corresponding to entry
  * is still around or has not been recycled.
@@ -577,11 +730,14 @@ static unsigned char swap_entry_free(struct swap_info_struct *p,
 void swap_free(swp_entry_t entry)
 {
 	struct swap_info_struct *p;
+	unsigned char usage;
 
 	p = swap_info_get(entry);
 	if (p) {
-		swap_entry_free(p, entry, 1);
+		usage = __swap_entry_free(p, entry, 1);
 		spin_unlock(&swap_lock);
+		if (!usage)
+			free_swap_slot(entry);
 	}
 }
 
@@ -595,13 +751,32 @@ void swapcache_free(swp_entry_t entry, struct page *page)
 
 	p = swap_info_get(entry);
 	if (p) {
-		count = swap_entry_free(p, entry, SWAP_HAS_CACHE);
+		count = __swap_entry_free(p, entry, SWAP_HAS_CACHE);
 		if (page)
 			mem_cgroup_uncharge_swapcache(page, entry, count != 0);
 		spin_unlock(&swap_lock);
+		if (!count)
+			free_swap_slot(entry);
 	}
 }
 
+/*
+ * Release a batch of slots from the per-cpu swap slot caches, taking
+ * swap_lock only once for all of them.
+ */
+void swapcache_free_entries(swp_entry_t *entries, int n)
+{
+	int i;
+
+	if (n <= 0)
+		return;
+
+	spin_lock(&swap_lock);
+	for (i = 0; i < n; i++)
+		swap_entry_free(swap_info[swp_type(entries[i])], entries[i]);
+	spin_unlock(&swap_lock);
+}
+
 /*
  * How many references to page are currently swapped out?
  * This does not give an exact answer when swap count is continued,
@@ -622,6 +797,30 @@ int page_swapcount(struct page *page)
 	return count;
 }
 
+/*
+ * How many references to the entry are there?  Unlike page_swapcount(),
+ * this does not complain when the slot is free, and is used to tell a
+ * slot sitting unused in a swap slot cache from one being swapped in.
+ */
+int __swp_swapcount(swp_entry_t entry)
+{
+	struct swap_info_struct *p;
+	unsigned long offset;
+	int type = swp_type(entry);
+	int count = 0;
+
+	if (type >= nr_swapfiles)
+		return 0;
+	p = swap_info[type];
+	offset = swp_offset(entry);
+
+	spin_lock(&swap_lock);
+	if (p->swap_map && offset < p->max)
+		count = swap_count(p->swap_map[offset]);
+	spin_unlock(&swap_lock);
+	return count;
+}
+
 /*
  * We can write to an anon page without COW if there are no other references
  * to it.  And as a side-effect, free up its swap: because the old content
@@ -692,13 +891,15 @@ int free_swap_and_cache(swp_entry_t entry)
 {
 	struct swap_info_struct *p;
 	struct page *page = NULL;
+	unsigned char count;
 
 	if (non_swap_entry(entry))
 		return 1;
 
 	p = swap_info_get(entry);
 	if (p) {
-		if (swap_entry_free(p, entry, 1) == SWAP_HAS_CACHE) {
+		count = __swap_entry_free(p, entry, 1);
+		if (count == SWAP_HAS_CACHE) {
 			page = find_get_page(&swapper_space, entry.val);
 			if (page && !trylock_page(page)) {
 				page_cache_release(page);
@@ -706,6 +907,8 @@ int free_swap_and_cache(swp_entry_t entry)
 			}
 		}
 		spin_unlock(&swap_lock);
+		if (!count)
+			free_swap_slot(entry);
 	}
 	if (page) {
 		/*
@@ -1097,8 +1300,13 @@ int try_to_unuse(unsigned int type, bool frontswap,
 			 * has been freed independently, and will not be
 			 * reused since sys_swapoff() already disabled
 			 * allocation from here, or alloc_page() failed.
+			 * The entry may also be left unused in a swap slot
+			 * cache (frontswap calls us with the caches on), or
+			 * be a cluster being discarded, which swapoff waits
+			 * for anyway.
 			 */
-			if (!*swap_map)
+			swcount = *swap_map;
+			if (!swap_count(swcount) || swcount == SWAP_MAP_BAD)
 				continue;
 			retval = -ENOMEM;
 			break;
@@ -1480,6 +1688,7 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 {
 	struct swap_info_struct *p = NULL;
 	unsigned char *swap_map;
+	struct swap_cluster_info *cluster_info;
 	struct file *swap_file, *victim;
 	struct address_space *mapping;
 	struct inode *inode;
@@ -1545,6 +1754,11 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 	p->flags &= ~SWP_WRITEOK;
 	spin_unlock(&swap_lock);
 
+	/*
+	 * Return the slots cached per cpu, and keep the caches off so
+	 * that no slot of this area can hide in them while it is emptied.
+	 */
+	disable_swap_slots_cache_lock();
 	oom_score_adj = test_set_oom_score_adj(OOM_SCORE_ADJ_MAX);
 	err = try_to_unuse(type, false, 0); /* force all pages to be unused */
 	compare_swap_oom_score_adj(OOM_SCORE_ADJ_MAX, oom_score_adj);
@@ -1558,8 +1772,13 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 		 */
 		/* re-insert swap space back into swap_list */
 		enable_swap_info(p, p->prio, p->swap_map, frontswap_map_get(p));
+		reenable_swap_slots_cache_unlock();
 		goto out_dput;
 	}
+	reenable_swap_slots_cache_unlock();
+
+	/* no new discards are queued once SWP_WRITEOK is clear */
+	flush_work(&p->discard_work);
 
 	destroy_swap_extents(p);
 	if (p->flags & SWP_CONTINUED)
@@ -1582,11 +1801,16 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 	p->max = 0;
 	swap_map = p->swap_map;
 	p->swap_map = NULL;
+	cluster_info = p->cluster_info;
+	p->cluster_info = NULL;
+	if (!(p->flags & SWP_SOLIDSTATE))
+		atomic_dec(&nr_rotate_swap);
 	p->flags = 0;
 	frontswap_invalidate_area(type);
 	spin_unlock(&swap_lock);
 	mutex_unlock(&swapon_mutex);
 	vfree(swap_map);
+	vfree(cluster_info);
 	vfree(frontswap_map_get(p));
 	/* Destroy swap account informatin */
 	swap_cgroup_swapoff(type);
@@ -1788,6 +2012,7 @@ static struct swap_info_struct *alloc_swap_info(void)
 	p->flags = SWP_USED;
 	p->next = -1;
 	spin_unlock(&swap_lock);
+	INIT_WORK(&p->discard_work, swap_discard_work);
 
 	return p;
 }
@@ -1897,15 +2122,22 @@ static unsigned long read_swap_header(struct swap_info_struct *p,
 static int setup_swap_map_and_extents(struct swap_info_struct *p,
 					union swap_header *swap_header,
 					unsigned char *swap_map,
+					struct swap_cluster_info *cluster_info,
 					unsigned long maxpages,
 					sector_t *span)
 {
 	int i;
 	unsigned int nr_good_pages;
 	int nr_extents;
+	unsigned long nr_clusters = DIV_ROUND_UP(maxpages, SWAPFILE_CLUSTER);
+	unsigned long idx, start;
 
 	nr_good_pages = maxpages - 1;	/* omit header page */
 
+	p->cluster_cur = CLUSTER_NULL;
+	p->free_cluster_head = p->free_cluster_tail = CLUSTER_NULL;
+	p->discard_cluster_head = p->discard_cluster_tail = CLUSTER_NULL;
+
 	for (i = 0; i < swap_header->info.nr_badpages; i++) {
 		unsigned int page_nr = swap_header->info.badpages[i];
 		if (page_nr == 0 || page_nr > swap_header->info.last_page)
@@ -1913,9 +2145,18 @@ static int setup_swap_map_and_extents(struct swap_info_struct *p,
 		if (page_nr < maxpages) {
 			swap_map[page_nr] = SWAP_MAP_BAD;
 			nr_good_pages--;
+			if (cluster_info)
+				cluster_info[page_nr / SWAPFILE_CLUSTER].data++;
 		}
 	}
 
+	/* Never free the clusters holding the header or the tail of swap */
+	if (cluster_info) {
+		cluster_info[0].data++;
+		for (idx = maxpages; idx < nr_clusters * SWAPFILE_CLUSTER; idx++)
+			cluster_info[idx / SWAPFILE_CLUSTER].data++;
+	}
+
 	if (nr_good_pages) {
 		swap_map[0] = SWAP_MAP_BAD;
 		p->max = maxpages;
@@ -1930,6 +2171,25 @@ static int setup_swap_map_and_extents(struct swap_info_struct *p,
 		return -EINVAL;
 	}
 
+	if (!cluster_info)
+		return nr_extents;
+
+	/*
+	 * Start handing out clusters from a random point, so that swap is
+	 * written all over the device: if the Flash Translation Layer only
+	 * remaps within limited zones, we don't want to wear out the first
+	 * zone too quickly.
+	 */
+	start = random32() % nr_clusters;
+	for (i = 0; i < nr_clusters; i++) {
+		idx = (start + i) % nr_clusters;
+		if (cluster_info[idx].data)
+			continue;
+		cluster_info[idx].flags = CLUSTER_FLAG_FREE;
+		cluster_list_add_tail(cluster_info, &p->free_cluster_head,
+				      &p->free_cluster_tail, idx);
+	}
+	p->cluster_info = cluster_info;
 	return nr_extents;
 }
 
@@ -1947,6 +2207,7 @@ SYSCALL_DEFINE2(swapon, const char __user *, specialfile, int, swap_flags)
 	sector_t span;
 	unsigned long maxpages;
 	unsigned char *swap_map = NULL;
+	struct swap_cluster_info *cluster_info = NULL;
 	unsigned long *frontswap_map = NULL;
 	struct page *page = NULL;
 	struct inode *inode = NULL;
@@ -2021,12 +2282,29 @@ SYSCALL_DEFINE2(swapon, const char __user *, specialfile, int, swap_flags)
 		goto bad_swap;
 	}
 
+	if (p->bdev && blk_queue_nonrot(bdev_get_queue(p->bdev))) {
+		p->flags |= SWP_SOLIDSTATE;
+		p->cluster_next = 1 + (random32() % p->highest_bit);
+		/*
+		 * Cluster lists link clusters by a 24 bit index: on a
+		 * larger device, fall back to unaligned clusters.
+		 */
+		if (DIV_ROUND_UP(maxpages, SWAPFILE_CLUSTER) < CLUSTER_NULL) {
+			cluster_info = vzalloc(DIV_ROUND_UP(maxpages,
+				SWAPFILE_CLUSTER) * sizeof(*cluster_info));
+			if (!cluster_info) {
+				error = -ENOMEM;
+				goto bad_swap;
+			}
+		}
+	}
+
 	error = swap_cgroup_swapon(p->type, maxpages);
 	if (error)
 		goto bad_swap;
 
 	nr_extents = setup_swap_map_and_extents(p, swap_header, swap_map,
-		maxpages, &span);
+		cluster_info, maxpages, &span);
 	if (unlikely(nr_extents < 0)) {
 		error = nr_extents;
 		goto bad_swap;
@@ -2035,14 +2313,11 @@ SYSCALL_DEFINE2(swapon, const char __user *, specialfile, int, swap_flags)
 	if (frontswap_enabled)
 		frontswap_map = vzalloc(maxpages / sizeof(long));
 
-	if (p->bdev) {
-		if (blk_queue_nonrot(bdev_get_queue(p->bdev))) {
-			p->flags |= SWP_SOLIDSTATE;
-			p->cluster_next = 1 + (random32() % p->highest_bit);
-		}
-		if ((swap_flags & SWAP_FLAG_DISCARD) && discard_swap(p) == 0)
-			p->flags |= SWP_DISCARDABLE;
-	}
+	if (p->bdev && (swap_flags & SWAP_FLAG_DISCARD) &&
+	    discard_swap(p) == 0)
+		p->flags |= SWP_DISCARDABLE;
+	if (!(p->flags & SWP_SOLIDSTATE))
+		atomic_inc(&nr_rotate_swap);
 
 	mutex_lock(&swapon_mutex);
 	prio = -1;
@@ -2077,8 +2352,10 @@ bad_swap:
 	spin_lock(&swap_lock);
 	p->swap_file = NULL;
 	p->flags = 0;
+	p->cluster_info = NULL;
 	spin_unlock(&swap_lock);
 	vfree(swap_map);
+	vfree(cluster_info);
 	if (swap_file) {
 		if (inode && S_ISREG(inode->i_mode)) {
 			mutex_unlock(&inode->i_mutex);
@@ -2148,6 +2425,16 @@ static int __swap_duplicate(swp_entry_t entry, unsigned char usage)
 		goto unlock_out;
 
 	count = p->swap_map[offset];
+
+	/*
+	 * swapin_readahead() doesn't check if a swap entry is valid, so the
+	 * swap entry could be SWAP_MAP_BAD.  Check here with lock held.
+	 */
+	if (unlikely(swap_count(count) == SWAP_MAP_BAD)) {
+		err = -ENOENT;
+		goto unlock_out;
+	}
+
 	has_cache = count & SWAP_HAS_CACHE;
 	count &= ~SWAP_HAS_CACHE;
 	err = 0;
@@ -0,0 +1,168 @@
+/*
+ * mem-thp-fault.c
+ *
+ * thp-fault: Latency of transparent huge page faults, and how much of
+ * the cache the clearing of the huge pages evicts
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE	14
+#endif
+
+#define HPAGE_SIZE	(2UL << 20)
+#define CACHELINE_SIZE	64
+
+static const char	*length_str	= "512MB";
+static const char	*wss_str	= "4MB";
+static int		iterations	= 1;
+
+static const struct option options[] = {
+	OPT_STRING('l', "length", &length_str, "512MB",
+		    "Specify length of memory to fault in. "
+		    "Available units: B, KB, MB, GB and TB (upper and lower)"),
+	OPT_STRING('w', "working-set", &wss_str, "4MB",
+		    "Specify size of the working set to read back "
+		    "after the faults"),
+	OPT_INTEGER('i', "iterations", &iterations,
+		    "repeat the faults this number of times"),
+	OPT_END()
+};
+
+static const char * const bench_mem_thp_fault_usage[] = {
+	"perf bench mem thp-fault <options>",
+	NULL
+};
+
+static double timeval2double(struct timeval *ts)
+{
+	return (double)ts->tv_sec +
+		(double)ts->tv_usec / (double)1000000;
+}
+
+/* Read a cache line at a time through @buf, returns the seconds taken */
+static double read_working_set(volatile char *buf, size_t len)
+{
+	struct timeval tv_start, tv_end, tv_diff;
+	size_t off;
+
+	BUG_ON(gettimeofday(&tv_start, NULL));
+	for (off = 0; off < len; off += CACHELINE_SIZE)
+		(void)buf[off];
+	BUG_ON(gettimeofday(&tv_end, NULL));
+
+	timersub(&tv_end, &tv_start, &tv_diff);
+	return timeval2double(&tv_diff);
+}
+
+/*
+ * Fault in @len bytes of huge pages, one write of a small page in the
+ * middle of each, returns the seconds taken
+ */
+static double fault_huge_pages(size_t len)
+{
+	struct timeval tv_start, tv_end, tv_diff;
+	long page_size = sysconf(_SC_PAGESIZE);
+	char *map, *area;
+	size_t off;
+
+	map = mmap(NULL, len + HPAGE_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		die("mmap failed - maybe length is too large?\n");
+
+	area = (char *)(((unsigned long)map + HPAGE_SIZE - 1) &
+			~(HPAGE_SIZE - 1));
+	if (madvise(area, len, MADV_HUGEPAGE))
+		fprintf(stderr, "madvise(MADV_HUGEPAGE) failed: "
+			"no transparent huge pages?\n");
+
+	BUG_ON(gettimeofday(&tv_start, NULL));
+	for (off = 0; off < len; off += HPAGE_SIZE)
+		memset(area + off + HPAGE_SIZE / 2, off, page_size);
+	BUG_ON(gettimeofday(&tv_end, NULL));
+
+	munmap(map, len + HPAGE_SIZE);
+
+	timersub(&tv_end, &tv_start, &tv_diff);
+	return timeval2double(&tv_diff);
+}
+
+int bench_mem_thp_fault(int argc, const char **argv,
+			const char *prefix __used)
+{
+	size_t len, wss;
+	unsigned long nr_faults, nr_lines;
+	double fault_time = 0.0, before_time = 0.0, after_time = 0.0;
+	char *buf;
+	int i;
+
+	argc = parse_options(argc, argv, options,
+			     bench_mem_thp_fault_usage, 0);
+
+	len = (size_t)perf_atoll((char *)length_str);
+	if ((s64)len < (s64)HPAGE_SIZE) {
+		fprintf(stderr, "Invalid length:%s\n", length_str);
+		return 1;
+	}
+	len &= ~(HPAGE_SIZE - 1);
+
+	wss = (size_t)perf_atoll((char *)wss_str);
+	if ((s64)wss <= 0) {
+		fprintf(stderr, "Invalid working set size:%s\n", wss_str);
+		return 1;
+	}
+
+	buf = zalloc(wss);
+	if (!buf)
+		die("memory allocation failed - maybe working set is too large?\n");
+
+	if (bench_format == BENCH_FORMAT_DEFAULT)
+		printf("# Faulting in %s of huge pages with %s of working set ...\n\n",
+		       length_str, wss_str);
+
+	for (i = 0; i < iterations; i++) {
+		/* Bring the working set into the cache, then time it there */
+		read_working_set(buf, wss);
+		before_time += read_working_set(buf, wss);
+		fault_time += fault_huge_pages(len);
+		after_time += read_working_set(buf, wss);
+	}
+	free(buf);
+
+	nr_faults = len / HPAGE_SIZE * iterations;
+	nr_lines = wss / CACHELINE_SIZE * iterations;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf(" %14lf usecs/fault\n",
+		       fault_time * 1e6 / nr_faults);
+		printf(" %14lf nsecs/line reading the working set before faults\n",
+		       before_time * 1e9 / nr_lines);
+		printf(" %14lf nsecs/line reading the working set after faults\n",
+		       after_time * 1e9 / nr_lines);
+		break;
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lf %lf %lf\n", fault_time * 1e6 / nr_faults,
+		       before_time * 1e9 / nr_lines,
+		       after_time * 1e9 / nr_lines);
+		break;
+	default:
+		/* reaching this means there's some disaster: */
+		die("unknown format: %d\n", bench_format);
+		break;
+	}
+
+	return 0;
+}
@@ -30,13 +30,29 @@
 
 #define LOOPS_DEFAULT 1000000
 static int loops = LOOPS_DEFAULT;
+static int pages;
 
 static const struct option options[] = {
 	OPT_INTEGER('l', "loop", &loops,
 		    "Specify number of loops"),
+	OPT_INTEGER('p', "pages", &pages,
+		    "Specify number of pages each task touches per loop"),
 	OPT_END()
 };
 
+/*
+ * Touch one byte in each page of the working set, so that the TLB
+ * entries a task loses across the switch to the other task show up
+ * in the time per operation.
+ */
+static void touch_pages(char *buf, long page_size)
+{
+	int i;
+
+	for (i = 0; i < pages; i++)
+		buf[i * page_size]++;
+}
+
 static const char * const bench_sched_pipe_usage[] = {
 	"perf bench sched pipe <options>",
 	NULL
@@ -47,6 +63,8 @@ int bench_sched_pipe(int argc, const char **argv,
 {
 	int pipe_1[2], pipe_2[2];
 	int m = 0, i;
+	long page_size = sysconf(_SC_PAGESIZE);
+	char *buf = NULL;
 	struct timeval start, stop, diff;
 	unsigned long long result_usec = 0;
 
@@ -67,17 +85,25 @@ int bench_sched_pipe(int argc, const char **argv,
 	pid = fork();
 	assert(pid >= 0);
 
+	if (pages > 0) {
+		buf = calloc(pages, page_size);
+		assert(buf);
+	} else
+		pages = 0;
+
 	gettimeofday(&start, NULL);
 
 	if (!pid) {
 		for (i = 0; i < loops; i++) {
 			ret = read(pipe_1[0], &m, sizeof(int));
+			touch_pages(buf, page_size);
 			ret = write(pipe_2[1], &m, sizeof(int));
 		}
 	} else {
 		for (i = 0; i < loops; i++) {
 			ret = write(pipe_1[1], &m, sizeof(int));
 			ret = read(pipe_2[0], &m, sizeof(int));
+			touch_pages(buf, page_size);
 		}
 	}
 
@@ -93,8 +119,12 @@ int bench_sched_pipe(int argc, const char **argv,
 
 	switch (bench_format) {
 	case BENCH_FORMAT_DEFAULT:
-		printf("# Executed %d pipe operations between two tasks\n\n",
+		printf("# Executed %d pipe operations between two tasks\n",
 			loops);
+		if (pages)
+			printf("# Each task touched %d pages per operation\n",
+			       pages);
+		printf("\n");
 
 		result_usec = diff.tv_sec * 1000000;
 		result_usec += diff.tv_usec;